@@ -2,14 +2,23 @@
 #include <nlohmann/json.hpp>
 #include "ldlidar_driver/ldlidar_driver_linux.h"
 #include <SLAMHandler.h>
+#include <cctype>
 #include <chrono>
+#include <cmath>
 #include <iostream>
 #include <thread>
 #include <atomic>
+#include <filesystem>
 #include <mutex>
+#include <optional>
 #include <map>
 #include <ArduinoSerial.h>
 #include "RobotHandler.h"
+#include "HeadingHistogram.h"
+#include "MapCheckpoint.h"
+#include "Relocalizer.h"
+#include "ScanOdometry.h"
+#include "SlamJournal.h"
 
 #include "breezySLAM/cpp/algorithms.hpp"
 #include "breezySLAM/cpp/Laser.hpp"
@@ -18,6 +27,41 @@
 
 static const int MAP_SIZE_PIXELS = 800;
 static const double MAP_SIZE_METERS = 15;
+static const double ROBOT_TRACK_WIDTH_MM = 225;
+// LD20 as configured below and in breezySLAM's LD20 (rays per revolution, field of view)
+static const int LIDAR_SCAN_SIZE = 668;
+static const double LIDAR_DETECTION_ANGLE_DEGREES = 360;
+static const int LIDAR_DETECTION_MARGIN = 4;
+static const double LIDAR_OFFSET_MM = 45;
+// Threads integrating each scan into the map (the Pi has 4 cores)
+static const int SLAM_MAP_THREADS = 4;
+// Scans are integrated into the map only after this much motion or time
+static const double KEYFRAME_DISTANCE_MM = 50;
+static const double KEYFRAME_ROTATION_DEGREES = 3;
+static const double KEYFRAME_MAX_INTERVAL_SECONDS = 2;
+// Obstacle points of each scan used for matching (the map gets all of them)
+static const int SLAM_MATCH_POINTS = 200;
+// RMHC candidates are snapped to a lattice of a map pixel by SLAM_SCORE_CACHE_DEGREES and
+// each lattice point is scored once per search; 0 searches continuous poses. Off: the
+// lattice quantizes the poses found, and bench_rmhc_cache has yet to show over more
+// runs that it costs no accuracy.
+static const double SLAM_SCORE_CACHE_DEGREES = 0;
+// Map as submaps of MAP_SIZE_PIXELS that follow the robot, for areas larger than the map.
+// Positions and the map then move when a submap is frozen, which RobotHandler's targets
+// do not follow, so this is for mapping runs.
+static const bool SLAM_SUBMAPS = false;
+// Pose hypotheses tracked by ParticleSLAM, each searched on its own map; 1 for plain RMHC.
+// They are spread over the SLAM_MAP_THREADS threads instead of each map update.
+static const int SLAM_PARTICLES = 1;
+// Maps are saved as MAP_DIRECTORY/<name>.map. MAP_STARTUP_NAME is loaded at startup and
+// saved every MAP_AUTOSAVE_SECONDS while the map changes.
+static const char* MAP_DIRECTORY = "maps";
+static const char* MAP_STARTUP_NAME = "latest";
+static const int MAP_AUTOSAVE_SECONDS = 60;
+// Keyframes are journaled to SLAM_JOURNAL_DIRECTORY and replayed at startup after a crash,
+// in place of MAP_STARTUP_NAME. Not with submaps, whose poses are relative to a submap.
+static const bool SLAM_JOURNAL = !SLAM_SUBMAPS;
+static const char* SLAM_JOURNAL_DIRECTORY = "maps/journal";
 
 using json = nlohmann::json;
 
@@ -31,6 +75,64 @@ int mm2pix(double mm)
     return (int)(mm / (MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS));
 }
 
+// Map names become file names, so only letters, digits, '-' and '_'.
+bool validMapName(const std::string& name)
+{
+    if (name.empty() || name.size() > 64) return false;
+    for (char c : name) {
+        if (!std::isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') return false;
+    }
+    return true;
+}
+
+std::string mapPath(const std::string& name)
+{
+    return std::string(MAP_DIRECTORY) + "/" + name + ".map";
+}
+
+// Loads a saved map, which must have the size and resolution of the SLAM map.
+std::shared_ptr<MapCheckpoint::Map> loadMap(const std::string& name, std::string& error)
+{
+    auto map = std::make_shared<MapCheckpoint::Map>();
+    if (!MapCheckpoint::Load(mapPath(name), *map, error)) return nullptr;
+    if (map->size_pixels != MAP_SIZE_PIXELS ||
+        std::fabs(map->mm_per_pixel - MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS) > 1e-6) {
+        error = "map " + name + " has another size or resolution";
+        return nullptr;
+    }
+    return map;
+}
+
+// One distance per ray, as SLAMHandler hands scans to breezySLAM.
+std::vector<int> scanDistances(const ldlidar::Points2D& points)
+{
+    std::vector<int> distances;
+    for (const auto& point : points) {
+        distances.push_back(static_cast<int>(point.distance));
+    }
+    return distances;
+}
+
+json relocalizationJson(const Relocalizer::Result& result)
+{
+    json response;
+    response["confident"] = result.confident;
+    response["ms"] = result.ms;
+    response["rotations"] = result.rotations;
+    response["candidates"] = json::array();
+    for (const auto& candidate : result.candidates) {
+        response["candidates"].push_back({
+            {"x_pixel", mm2pix(candidate.position.x_mm)},
+            {"y_pixel", mm2pix(candidate.position.y_mm)},
+            {"x_mm", candidate.position.x_mm},
+            {"y_mm", candidate.position.y_mm},
+            {"theta_degrees", candidate.position.theta_degrees},
+            {"score", candidate.score}
+        });
+    }
+    return response;
+}
+
 struct WebSocketThreadInfo {
     std::thread thread;
     std::atomic<bool> running{ true };
@@ -58,22 +160,124 @@ int main() {
         std::cerr << "Failed to start lidar." << std::endl;
         return -1;
     }
-	LD20 ld20_lidar(4,45); 
-    SinglePositionSLAM* slam = (SinglePositionSLAM*)
-        new RMHC_SLAM(ld20_lidar, MAP_SIZE_PIXELS, MAP_SIZE_METERS, 125);
+	LD20 ld20_lidar(LIDAR_DETECTION_MARGIN, LIDAR_OFFSET_MM); 
+    SinglePositionSLAM* slam = SLAM_SUBMAPS
+        ? (SinglePositionSLAM*)new SubmapSLAM(ld20_lidar, MAP_SIZE_PIXELS, MAP_SIZE_METERS, 125)
+        : SLAM_PARTICLES > 1
+        ? (SinglePositionSLAM*)new ParticleSLAM(ld20_lidar, MAP_SIZE_PIXELS, MAP_SIZE_METERS, SLAM_PARTICLES, 125)
+        : (SinglePositionSLAM*)new RMHC_SLAM(ld20_lidar, MAP_SIZE_PIXELS, MAP_SIZE_METERS, 125);
     ((RMHC_SLAM*)slam)->map_quality = 5;
     ((RMHC_SLAM*)slam)->hole_width_mm = 400;
     ((RMHC_SLAM*)slam)->max_search_iter = 2000;
     ((RMHC_SLAM*)slam)->sigma_xy_mm = 250;
     ((RMHC_SLAM*)slam)->sigma_theta_degrees = 60;
-    SLAMHandler lidarHandler(lidar_drv,slam);
+    ((RMHC_SLAM*)slam)->min_sigma_xy_mm = 10;
+    ((RMHC_SLAM*)slam)->min_sigma_theta_degrees = 1;
+    slam->enablelikelihoodfield(300);
+    ((RMHC_SLAM*)slam)->enablescorecache(MAP_SIZE_METERS * 1000 / MAP_SIZE_PIXELS, SLAM_SCORE_CACHE_DEGREES);
+    if (auto particles = dynamic_cast<ParticleSLAM*>(slam)) {
+        particles->setparticlethreads(SLAM_MAP_THREADS);
+    } else {
+        slam->setmapthreads(SLAM_MAP_THREADS);
+    }
+    slam->max_distance_points = SLAM_MATCH_POINTS;
+    slam->keyframe_distance_mm = KEYFRAME_DISTANCE_MM;
+    slam->keyframe_rotation_degrees = KEYFRAME_ROTATION_DEGREES;
+    slam->keyframe_max_interval_seconds = KEYFRAME_MAX_INTERVAL_SECONDS;
+    MotionModel motionModel(ROBOT_TRACK_WIDTH_MM);
+    ScanOdometry scanOdometry(LIDAR_SCAN_SIZE, LIDAR_DETECTION_ANGLE_DEGREES, LIDAR_OFFSET_MM, LIDAR_DETECTION_MARGIN);
+    HeadingHistogram headingHistogram(LIDAR_SCAN_SIZE, LIDAR_DETECTION_ANGLE_DEGREES, LIDAR_DETECTION_MARGIN);
+
+    Relocalizer relocalizer(LIDAR_SCAN_SIZE, LIDAR_DETECTION_ANGLE_DEGREES, LIDAR_OFFSET_MM, LIDAR_DETECTION_MARGIN,
+                            SLAM_MAP_THREADS);
+    std::optional<uint64_t> relocalizerMapVersion;  // of the map snapshot given to relocalizer
+    std::mutex relocalizerMutex;
+
+    std::error_code directoryError;
+    std::filesystem::create_directories(MAP_DIRECTORY, directoryError);
+    std::filesystem::create_directories(SLAM_JOURNAL_DIRECTORY, directoryError);
+
+    // After a crash the journal is newer than MAP_STARTUP_NAME: replay it into slam
+    SlamJournal::ReplayStats replay;
+    bool recovered = SLAM_JOURNAL && std::filesystem::exists(std::string(SLAM_JOURNAL_DIRECTORY) + "/journal.map") &&
+                     SlamJournal::Replay(SLAM_JOURNAL_DIRECTORY, *slam, MAP_SIZE_PIXELS, LIDAR_SCAN_SIZE, replay);
+    if (recovered) {
+        std::cout << "Recovered the map from the journal: " << replay.records << " keyframes after the checkpoint, "
+                  << replay.load_ms + replay.replay_ms << " ms" << std::endl;
+    }
+    std::shared_ptr<MapCheckpoint::Map> map;
+    if (!recovered && std::filesystem::exists(mapPath(MAP_STARTUP_NAME))) {
+        std::string error;
+        map = loadMap(MAP_STARTUP_NAME, error);
+        if (!map) {
+            std::cerr << "Failed to restore map: " << error << std::endl;
+        }
+    }
+    if (recovered || map) {
+        // The robot may have been moved while it was off: find it in the map
+        // before SLAM integrates anything at the saved pose
+        ldlidar::Points2D points;
+        if (lidar_drv->WaitLaserScanData(points, 1500, 2000) == ldlidar::LidarStatus::NORMAL) {
+            std::vector<unsigned char> bytes;
+            if (recovered) {
+                bytes.resize(static_cast<size_t>(MAP_SIZE_PIXELS) * MAP_SIZE_PIXELS);
+                slam->getmap(bytes.data());
+            }
+            relocalizer.SetMap(recovered ? bytes : map->bytes, MAP_SIZE_PIXELS, MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS);
+            Relocalizer::Result result = relocalizer.Localize(scanDistances(points));
+            if (result.confident && recovered) {
+                slam->setpos(result.candidates[0].position);
+            } else if (result.confident) {
+                map->position = result.candidates[0].position;
+            }
+            std::cout << "Relocalization in " << result.ms << " ms: "
+                      << (result.confident ? "found the robot" : "not sure, keeping the saved pose") << std::endl;
+        }
+    }
+
+    std::unique_ptr<SlamJournal> journal;
+    if (SLAM_JOURNAL) {
+        journal = std::make_unique<SlamJournal>(SLAM_JOURNAL_DIRECTORY, LIDAR_SCAN_SIZE,
+                                                MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS, replay.sequence);
+    }
+    SLAMHandler lidarHandler(lidar_drv, slam, MAP_SIZE_PIXELS, &motionModel, &scanOdometry, &headingHistogram,
+                             journal.get());
+    if (map) {
+        lidarHandler.RestoreMap(map);
+        std::cout << "Restored map " << mapPath(MAP_STARTUP_NAME) << std::endl;
+    }
     lidarHandler.Start();
+
+    MapCheckpoint mapCheckpoint;
+    auto saveMap = [&lidarHandler, &mapCheckpoint](const std::string& name) {
+        auto global = lidarHandler.GetGlobalMap();
+        mapCheckpoint.SaveAsync(mapPath(name), lidarHandler.GetMap(), lidarHandler.GetPosition(),
+                                MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS,
+                                global ? global->originX() : 0, global ? global->originY() : 0);
+    };
+    std::atomic<bool> autosaving{ true };
+    std::thread autosave([&lidarHandler, &saveMap, &autosaving]() {
+        uint64_t saved = lidarHandler.GetMap()->version();
+        while (autosaving) {
+            for (int s = 0; s < MAP_AUTOSAVE_SECONDS && autosaving; ++s) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+            }
+            uint64_t version = lidarHandler.GetMap()->version();
+            if (autosaving && version != saved) {
+                saveMap(MAP_STARTUP_NAME);
+                saved = version;
+            }
+        }
+    });
     std::this_thread::sleep_for(std::chrono::seconds(3)); 
 
     ArduinoSerial arduino("/dev/ttyACM0", 9600);
     if (!arduino.connect()) {
         std::cerr << "Failed to connect to Arduino." << std::endl;
     }
+    arduino.setMotionListener([&motionModel](double left_mm_s, double right_mm_s) {
+        motionModel.setWheelSpeeds(left_mm_s, right_mm_s);
+    });
 
     RobotHandler robotHandler(&lidarHandler, &arduino, MAP_SIZE_METERS, MAP_SIZE_PIXELS);
 
@@ -83,10 +287,10 @@ int main() {
     crow::SimpleApp app;
 
     CROW_ROUTE(app, "/lidar/data").methods(crow::HTTPMethod::GET)([&lidarHandler]() {
-        ldlidar::Points2D laser_scan_data = lidarHandler.GetLatestData();
+        auto laser_scan_data = lidarHandler.GetLatestData();
         json response;
         response["points"] = json::array();
-        for (const ldlidar::PointData& point : laser_scan_data) {
+        for (const ldlidar::PointData& point : *laser_scan_data) {
             response["points"].push_back({ {"x", point.x}, {"y", point.y} });
         }
         return crow::response(response.dump());
@@ -101,6 +305,183 @@ int main() {
         return crow::response(response.dump());
     });
 
+    CROW_ROUTE(app, "/slam/stats").methods(crow::HTTPMethod::GET)([&lidarHandler, &journal]() {
+        SLAMPipelineStats stats = lidarHandler.GetPipelineStats();
+        auto stage = [](const SLAMStageStats& s) {
+            return json{
+                {"frames", s.frames},
+                {"dropped", s.dropped},
+                {"last_ms", s.last_ms},
+                {"avg_ms", s.avg_ms},
+                {"max_ms", s.max_ms}
+            };
+        };
+        json response;
+        response["preprocess"] = stage(stats.preprocess);
+        response["slam"] = stage(stats.slam);
+        response["publish"] = stage(stats.publish);
+        response["keyframe"] = stage(stats.keyframe);
+        response["tracking"] = stage(stats.tracking);
+        response["idle_skipped"] = stats.idle_skipped;
+        response["cpu_saved_ms"] = stats.cpu_saved_ms;
+        response["stationary"] = stats.stationary;
+        response["revolution_ms"] = stats.revolution_ms;
+        response["search_budget_ms"] = stats.search_budget_ms;
+        response["last_evaluations"] = stats.last_evaluations;
+        response["cache_hit_rate"] = stats.cache_hit_rate;
+        response["odometry_only"] = stats.odometry_only;
+        response["sigma_xy_mm"] = stats.sigma_xy_mm;
+        response["sigma_theta_degrees"] = stats.sigma_theta_degrees;
+        response["scan_odometry"] = stats.scan_odometry;
+        response["heading_prior"] = stats.heading_prior;
+        if (journal) {
+            SlamJournal::Stats journaled = journal->GetStats();
+            response["journal"] = {
+                {"appended", journaled.appended},
+                {"written", journaled.written},
+                {"dropped", journaled.dropped},
+                {"checkpoints", journaled.checkpoints},
+                {"bytes", journaled.journal_bytes},
+                {"error", journaled.error}
+            };
+        }
+        return crow::response(response.dump());
+    });
+
+    CROW_ROUTE(app, "/slam/globalmap").methods(crow::HTTPMethod::GET)([&lidarHandler]() {
+        auto global = lidarHandler.GetGlobalMap();
+        if (!global) {
+            return crow::response(404, R"({"status":"error","reason":"SLAM is not mapping in submaps"})");
+        }
+        int x0, y0, width, height;
+        global->bounds(x0, y0, width, height);
+        std::vector<unsigned char> bytes = global->composite();
+        Position position = lidarHandler.GetPosition();
+
+        json response;
+        response["x_pixel"] = x0;
+        response["y_pixel"] = y0;
+        response["width"] = width;
+        response["height"] = height;
+        response["submaps"] = global->submapCount();
+        response["encoded_bytes"] = global->encodedBytes();
+        response["map"] = json::array();
+        for (int y = 0; y < height; ++y) {
+            response["map"].push_back(std::vector<int>(bytes.begin() + y * width, bytes.begin() + (y + 1) * width));
+        }
+        response["position"] = {
+            {"x_pixel", mm2pix(position.x_mm) + global->originX() - x0},
+            {"y_pixel", mm2pix(position.y_mm) + global->originY() - y0},
+            {"theta_degrees", position.theta_degrees}
+        };
+        return crow::response(response.dump());
+    });
+
+    CROW_ROUTE(app, "/slam/map/save").methods(crow::HTTPMethod::POST)(
+        [&saveMap](const crow::request& req) {
+            std::string name = MAP_STARTUP_NAME;
+            try {
+                if (!req.body.empty()) {
+                    auto body = json::parse(req.body);
+                    name = body.value("name", name);
+                }
+            }
+            catch (...) {
+                return crow::response(400, R"({"status":"error","reason":"invalid JSON"})");
+            }
+            if (!validMapName(name)) {
+                return crow::response(400, R"({"status":"error","reason":"Invalid map name"})");
+            }
+            saveMap(name);
+            json response;
+            response["status"] = "queued";
+            response["path"] = mapPath(name);
+            return crow::response(202, response.dump());
+        });
+
+    CROW_ROUTE(app, "/slam/map/save").methods(crow::HTTPMethod::GET)([&mapCheckpoint]() {
+        MapCheckpoint::SaveStatus status = mapCheckpoint.LastSave();
+        json response;
+        response["status"] = !status.done ? "none" : status.ok ? "ok" : "error";
+        response["path"] = status.path;
+        response["error"] = status.error;
+        response["file_bytes"] = status.file_bytes;
+        response["map_version"] = status.map_version;
+        response["encode_ms"] = status.encode_ms;
+        response["write_ms"] = status.write_ms;
+        return crow::response(response.dump());
+    });
+
+    CROW_ROUTE(app, "/slam/map/load").methods(crow::HTTPMethod::POST)(
+        [&lidarHandler](const crow::request& req) {
+            std::string name = MAP_STARTUP_NAME;
+            try {
+                if (!req.body.empty()) {
+                    auto body = json::parse(req.body);
+                    name = body.value("name", name);
+                }
+            }
+            catch (...) {
+                return crow::response(400, R"({"status":"error","reason":"invalid JSON"})");
+            }
+            if (!validMapName(name)) {
+                return crow::response(400, R"({"status":"error","reason":"Invalid map name"})");
+            }
+            auto start = std::chrono::steady_clock::now();
+            std::string error;
+            auto map = loadMap(name, error);
+            if (!map) {
+                json response;
+                response["status"] = "error";
+                response["reason"] = error;
+                return crow::response(404, response.dump());
+            }
+            double load_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            lidarHandler.RestoreMap(map);
+
+            json response;
+            response["status"] = "ok";
+            response["path"] = mapPath(name);
+            response["file_bytes"] = map->file_bytes;
+            response["map_version"] = map->map_version;
+            response["load_ms"] = load_ms;
+            return crow::response(response.dump());
+        });
+
+    CROW_ROUTE(app, "/slam/relocalize").methods(crow::HTTPMethod::POST)(
+        [&lidarHandler, &relocalizer, &relocalizerMapVersion, &relocalizerMutex](const crow::request& req) {
+            bool apply = true;
+            try {
+                if (!req.body.empty()) {
+                    apply = json::parse(req.body).value("apply", true);
+                }
+            }
+            catch (...) {
+                return crow::response(400, R"({"status":"error","reason":"invalid JSON"})");
+            }
+            auto points = lidarHandler.GetLatestData();
+            if (points->empty()) {
+                return crow::response(503, R"({"status":"error","reason":"No lidar scan yet"})");
+            }
+
+            std::lock_guard<std::mutex> lock(relocalizerMutex);
+            auto map = lidarHandler.GetMap();
+            if (relocalizerMapVersion != map->version()) {
+                relocalizer.SetMap(map->bytes(), MAP_SIZE_PIXELS, MAP_SIZE_METERS * 1000. / MAP_SIZE_PIXELS);
+                relocalizerMapVersion = map->version();
+            }
+            Relocalizer::Result result = relocalizer.Localize(scanDistances(*points));
+            bool applied = apply && result.confident;
+            if (applied) {
+                lidarHandler.SetPosition(result.candidates[0].position);
+            }
+
+            json response = relocalizationJson(result);
+            response["status"] = "ok";
+            response["applied"] = applied;
+            return crow::response(response.dump());
+        });
+
     CROW_WEBSOCKET_ROUTE(app, "/ws/map")
         .onopen([&](crow::websocket::connection& conn) {
         std::cout << "WebSocket map connection opened" << std::endl;
@@ -108,7 +489,7 @@ int main() {
         thread_info->thread = std::thread([&lidarHandler, &conn, thread_info]() {
             try {
                 while (thread_info->running) {
-                    unsigned char* map_data = lidarHandler.GetMap();
+                    auto map = lidarHandler.GetMap();
                     Position position = lidarHandler.GetPosition();
 
                     int x_pixel = mm2pix(position.x_mm);
@@ -119,7 +500,7 @@ int main() {
                     for (unsigned int y = 0; y < MAP_SIZE_PIXELS; ++y) {
                         json row = json::array();
                         for (unsigned int x = 0; x < MAP_SIZE_PIXELS; ++x) {
-                            row.push_back(map_data[y * MAP_SIZE_PIXELS + x]);
+                            row.push_back(map->at(x, y));
                         }
                         response["map"].push_back(row);
                     }
@@ -227,10 +608,10 @@ int main() {
         thread_info->thread = std::thread([&lidarHandler, &conn, thread_info]() {
             try {
                 while (thread_info->running) {
-                    ldlidar::Points2D data = lidarHandler.GetLatestData();
+                    auto data = lidarHandler.GetLatestData();
                     json response;
                     response["points"] = json::array();
-                    for (const auto& point : data) {
+                    for (const auto& point : *data) {
                         response["points"].push_back({ {"x", point.x}, {"y", point.y} });
                     }
                     if (!thread_info->running) break;
@@ -262,6 +643,9 @@ int main() {
 
     app.port(18080).run();
 
+    autosaving = false;
+    autosave.join();
+
     {
         std::lock_guard<std::mutex> lock(ws_threads_mutex);
         for (auto& pair : ws_threads) {
@@ -0,0 +1,166 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+
+// Shared helpers for the microbenchmarks: synthetic LD20-like scans of a
+// rectangular room and of a corridor, a drive down the corridor with noisy
+// odometry, a shared SLAM configuration, and simple timing/percentile
+// utilities.
+namespace bench {
+
+constexpr int LD20_SCAN_SIZE = 668;
+
+// The map and laser of RESTAPI_EP.cpp, and the seed the benches start from
+constexpr int MAP_SIZE_PIXELS = 800;
+constexpr double MAP_SIZE_METERS = 15;
+constexpr double OFFSET_MM = 45;
+constexpr unsigned SEED = 125;
+
+// Distances (mm) seen from (x_mm, y_mm, theta_deg) inside a room spanning
+// [0, room_mm] on both axes, with a square pillar so the scan is not symmetric.
+inline std::vector<int> roomScan(double x_mm, double y_mm, double theta_deg, double room_mm = 8000.0,
+                                 int scan_size = LD20_SCAN_SIZE) {
+    std::vector<int> out(scan_size);
+    const double pillar_lo = room_mm * 0.6, pillar_hi = room_mm * 0.7;
+    for (int i = 0; i < scan_size; ++i) {
+        double a = (theta_deg - 180.0 + 360.0 * i / (scan_size - 1)) * M_PI / 180.0;
+        double dx = std::cos(a), dy = std::sin(a);
+        double t = 1e9;
+        if (dx > 1e-9) t = std::min(t, (room_mm - x_mm) / dx);
+        if (dx < -1e-9) t = std::min(t, -x_mm / dx);
+        if (dy > 1e-9) t = std::min(t, (room_mm - y_mm) / dy);
+        if (dy < -1e-9) t = std::min(t, -y_mm / dy);
+        // slab test against the pillar
+        double t0 = 0, t1 = 1e9;
+        bool hit = true;
+        for (int axis = 0; axis < 2 && hit; ++axis) {
+            double o = axis ? y_mm : x_mm, d = axis ? dy : dx;
+            if (std::fabs(d) < 1e-9) {
+                hit = o >= pillar_lo && o <= pillar_hi;
+            } else {
+                double ta = (pillar_lo - o) / d, tb = (pillar_hi - o) / d;
+                t0 = std::max(t0, std::min(ta, tb));
+                t1 = std::min(t1, std::max(ta, tb));
+            }
+        }
+        if (hit && t0 <= t1 && t0 > 0) t = std::min(t, t0);
+        out[i] = t > 12000.0 ? 0 : static_cast<int>(t);
+    }
+    return out;
+}
+
+// Distance along (dx, dy) from (x, y) to the box [x0, x1] x [y0, y1], or 1e9.
+inline double hitBox(double x, double y, double dx, double dy, double x0, double y0, double x1, double y1) {
+    double t0 = 0, t1 = 1e9;
+    for (int axis = 0; axis < 2; ++axis) {
+        double o = axis ? y : x, d = axis ? dy : dx, lo = axis ? y0 : x0, hi = axis ? y1 : x1;
+        if (std::fabs(d) < 1e-9) {
+            if (o < lo || o > hi) return 1e9;
+            continue;
+        }
+        double ta = (lo - o) / d, tb = (hi - o) / d;
+        t0 = std::max(t0, std::min(ta, tb));
+        t1 = std::min(t1, std::max(ta, tb));
+    }
+    return t0 <= t1 && t0 > 0 ? t0 : 1e9;
+}
+
+// Distances (mm) seen inside a corridor spanning [0, length_mm] x [0, width_mm],
+// with 400 mm pillars along alternate walls every 2.5 m.
+inline std::vector<int> corridorScan(double x_mm, double y_mm, double theta_deg, double length_mm = 40000.0,
+                                     double width_mm = 4000.0, int scan_size = LD20_SCAN_SIZE) {
+    const double spacing = 2500.0, pillar = 400.0;
+    std::vector<int> out(scan_size);
+    for (int i = 0; i < scan_size; ++i) {
+        double a = (theta_deg - 180.0 + 360.0 * i / (scan_size - 1)) * M_PI / 180.0;
+        double dx = std::cos(a), dy = std::sin(a);
+        double t = 1e9;
+        if (dx > 1e-9) t = std::min(t, (length_mm - x_mm) / dx);
+        if (dx < -1e-9) t = std::min(t, -x_mm / dx);
+        if (dy > 1e-9) t = std::min(t, (width_mm - y_mm) / dy);
+        if (dy < -1e-9) t = std::min(t, -y_mm / dy);
+        for (int k = 1; k * spacing < length_mm; ++k) {
+            double px = k * spacing, py = k % 2 ? 0 : width_mm - pillar;
+            t = std::min(t, hitBox(x_mm, y_mm, dx, dy, px, py, px + pillar, py + pillar));
+        }
+        out[i] = t > 12000.0 ? 0 : static_cast<int>(t);
+    }
+    return out;
+}
+
+// The RMHC search and map settings the benches share. Map quality, hole width, search
+// iterations and the likelihood field (unless likelihood_field is false) are those
+// of RESTAPI_EP.cpp; the search sigmas are narrower (100 mm / 10 degrees against
+// 250 / 60) for the small synthetic steps, and every scan point is matched (no
+// max_distance_points) with no score cache.
+inline void configureSlam(RMHC_SLAM& slam, bool likelihood_field = true) {
+    slam.map_quality = 5;
+    slam.hole_width_mm = 400;
+    slam.max_search_iter = 2000;
+    slam.sigma_xy_mm = 100;
+    slam.sigma_theta_degrees = 10;
+    slam.min_sigma_xy_mm = 10;
+    slam.min_sigma_theta_degrees = 1;
+    if (likelihood_field) slam.enablelikelihoodfield(300);
+}
+
+// One revolution of a drive: the scan, the odometry reported for it and where the
+// robot really was
+struct Frame {
+    std::vector<int> scan;
+    PoseChange odometry;
+    double x, y;
+};
+
+// Down a corridor of length_mm by 4 m from 3.5 m in, step_mm per revolution, and
+// back, the odometry slipping by 20% and drifting by a degree. dt = 0: the synthetic
+// scans need no de-skewing.
+inline std::vector<Frame> driveCorridor(unsigned seed, int frames_each_way = 150, double step_mm = 40,
+                                        double length_mm = 11000) {
+    const double width_mm = 4000;
+    std::mt19937 random(seed);
+    std::normal_distribution<double> slip(1.0, 0.2), drift(0.0, 1.0);
+    std::vector<Frame> frames;
+    double x = 3500, y = width_mm / 2, theta = 0;
+    for (int i = 0; i < 2 * frames_each_way; ++i) {
+        double dxy = i ? step_mm : 0, dtheta = (i == frames_each_way) ? 180 : 0;
+        x += dxy * std::cos(theta * M_PI / 180);
+        y += dxy * std::sin(theta * M_PI / 180);
+        theta += dtheta;
+        Frame frame;
+        frame.scan = corridorScan(x + OFFSET_MM * std::cos(theta * M_PI / 180),
+                                  y + OFFSET_MM * std::sin(theta * M_PI / 180), theta, length_mm, width_mm);
+        frame.odometry = PoseChange(i ? dxy * slip(random) : 0, i ? dtheta + drift(random) : 0, 0);
+        frame.x = x;
+        frame.y = y;
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+using Clock = std::chrono::steady_clock;
+
+inline double elapsedUs(Clock::time_point since) {
+    return std::chrono::duration<double, std::micro>(Clock::now() - since).count();
+}
+
+inline double percentile(std::vector<double> samples, double p) {
+    if (samples.empty()) return 0.0;
+    std::sort(samples.begin(), samples.end());
+    size_t idx = static_cast<size_t>(p / 100.0 * (samples.size() - 1));
+    return samples[idx];
+}
+
+inline void printLatency(const char* label, const std::vector<double>& us) {
+    std::printf("%-28s n=%-8zu p50=%9.2f us  p99=%9.2f us  max=%9.2f us\n", label, us.size(),
+                percentile(us, 50), percentile(us, 99), percentile(us, 100));
+}
+
+} // namespace bench
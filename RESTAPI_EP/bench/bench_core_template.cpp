@@ -0,0 +1,133 @@
+// Compile-time specialized SLAM core (CoreSlamT) against the C core behind RMHC_SLAM.
+// Both run the same synthetic trajectory with the same seed and parameters; the
+// poses must agree exactly. Reports per-frame update time and the cost of the
+// scan construction, scan-to-map distance and map integration kernels.
+#include <cstring>
+#include <memory>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/CoreSlamT.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+
+static const int FRAMES = 300;
+static const int KERNEL_REPEATS = 2000;
+
+static void configure(auto& slam) {
+    slam.map_quality = 5;
+    slam.hole_width_mm = 400;
+    slam.max_search_iter = 2000;
+    slam.sigma_xy_mm = 250;
+    slam.sigma_theta_degrees = 60;
+    slam.min_sigma_xy_mm = 10;
+    slam.min_sigma_theta_degrees = 1;
+}
+
+struct Frame {
+    std::vector<int> scan;
+    PoseChange poseChange;
+};
+
+// Drives along a loop in the room, turning slowly, one frame per lidar revolution
+static std::vector<Frame> trajectory() {
+    std::vector<Frame> frames;
+    double x = 4000, y = 3000, theta = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        double dxy = 40, dtheta = (i / 50) % 2 ? 3 : -1.5;
+        Frame f;
+        f.poseChange = PoseChange(i ? dxy : 0, i ? dtheta : 0, 1.0 / 6);
+        if (i) {
+            x += dxy * std::cos(theta * M_PI / 180);
+            y += dxy * std::sin(theta * M_PI / 180);
+            theta += dtheta;
+        }
+        f.scan = bench::roomScan(x, y, theta);
+        frames.push_back(std::move(f));
+    }
+    return frames;
+}
+
+int main() {
+    std::vector<Frame> frames = trajectory();
+
+    LD20 laser(4, 45);
+    RMHC_SLAM rmhc(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    configure(rmhc);
+    auto core = std::make_unique<LD20CoreSlam>(bench::MAP_SIZE_METERS, bench::SEED);
+    configure(*core);
+
+    std::vector<double> rmhc_us, core_us;
+    int mismatches = 0;
+    for (auto& f : frames) {
+        PoseChange a = f.poseChange, b = f.poseChange;
+        auto t0 = bench::Clock::now();
+        rmhc.update(f.scan.data(), a);
+        rmhc_us.push_back(bench::elapsedUs(t0));
+        t0 = bench::Clock::now();
+        core->update(f.scan.data(), b);
+        core_us.push_back(bench::elapsedUs(t0));
+
+        Position p = rmhc.getpos(), q = core->getpos();
+        if (p.x_mm != q.x_mm || p.y_mm != q.y_mm || p.theta_degrees != q.theta_degrees) ++mismatches;
+    }
+
+    std::vector<unsigned char> map_c(bench::MAP_SIZE_PIXELS * bench::MAP_SIZE_PIXELS), map_tmpl(map_c.size());
+    rmhc.getmap(map_c.data());
+    core->getmap(map_tmpl.data());
+    bool same_map = std::memcmp(map_c.data(), map_tmpl.data(), map_c.size()) == 0;
+
+    std::printf("poses: %d/%d frames differ, maps %s\n", mismatches, FRAMES, same_map ? "identical" : "DIFFER");
+    bench::printLatency("update RMHC_SLAM (C core)", rmhc_us);
+    bench::printLatency("update LD20CoreSlam", core_us);
+
+    // Kernels on the final map, through the C API and the template
+    const Frame& last = frames.back();
+    Position pos = core->getpos();
+    position_t at = {pos.x_mm, pos.y_mm, pos.theta_degrees};
+
+    using Model = LD20Model<4, 45>;
+    scan_t scan_c, scan_c3;
+    scan_init(&scan_c, 1, Model::scan_size, Model::scan_rate_hz, Model::detection_angle_degrees,
+              Model::distance_no_detection_mm, Model::detection_margin, Model::offset_mm);
+    scan_init(&scan_c3, 3, Model::scan_size, Model::scan_rate_hz, Model::detection_angle_degrees,
+              Model::distance_no_detection_mm, Model::detection_margin, Model::offset_mm);
+    map_t cmap;
+    map_init(&cmap, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS);
+    map_set(&cmap, reinterpret_cast<char*>(map_c.data()));
+
+    auto scan_t1 = std::make_unique<LD20CoreSlam::ScanT<1>>();
+    auto scan_t3 = std::make_unique<LD20CoreSlam::ScanT<3>>();
+    PoseChange velocities(40, 3, 1);
+    int* distances = const_cast<int*>(last.scan.data());
+
+    std::vector<double> us;
+    auto time = [&](const char* label, auto fn) {
+        us.clear();
+        for (int i = 0; i < KERNEL_REPEATS; ++i) {
+            auto t0 = bench::Clock::now();
+            fn();
+            us.push_back(bench::elapsedUs(t0));
+        }
+        bench::printLatency(label, us);
+    };
+
+    volatile int sink = 0;
+    time("scan_update_both (C)", [&] {
+        scan_update_both(&scan_c3, &scan_c, distances, 400, velocities.dxy_mm, velocities.dtheta_degrees);
+    });
+    time("buildScan x2 (template)", [&] {
+        core->buildScan(*scan_t3, distances, velocities);
+        core->buildScan(*scan_t1, distances, velocities);
+    });
+    time("distance_scan_to_map (C)", [&] { sink = distance_scan_to_map(&cmap, &scan_c, at); });
+    time("distanceScanToMap (template)", [&] { sink = core->distanceScanToMap(*scan_t1, at); });
+    time("map_update (C)", [&] { map_update(&cmap, &scan_c3, at, 5, 400); });
+    time("updateMap (template)", [&] { core->updateMap(*scan_t3, at, 5, 400); });
+    (void)sink;
+
+    map_free(&cmap);
+    scan_free(&scan_c);
+    scan_free(&scan_c3);
+    return mismatches || !same_map;
+}
@@ -0,0 +1,172 @@
+// Inflated costmap (Costmap) over the snapshots of RMHC_SLAM driving around a room,
+// published as SLAMHandler does, with RobotHandler's robot radius and decay band.
+// Reports the time of an incremental update against costing the whole map again and
+// against updateObstycle, and checks every incremental result against a fresh
+// Costmap. Then plans across the room on updateObstycle's nodes and on the costmap's,
+// and reports how close each path comes to an obstacle.
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "Costmap.h"
+#include "MapSnapshot.h"
+#include "PathFinder.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 600;
+static const double ROOM_MM = 8000;
+static const double ROBOT_RADIUS_MM = 225.0 / 2;
+static const double DECAY_MM = 300;
+static const int CHECK_EVERY = 25;
+
+struct Clearance {
+    size_t vertices = 0;
+    double length_mm = 0, min_mm = 0, mean_mm = 0;
+};
+
+// Along the segments between the path's node centres, pixel by pixel, the distance
+// to the nearest obstacle (as far as the costmap reaches)
+static Clearance measure(const Costmap& costmap, const std::vector<std::pair<int, int>>& path, int node_size_px,
+                         double mm_per_pixel) {
+    Clearance c;
+    c.vertices = path.size();
+    if (path.size() < 2) return c;
+    c.min_mm = 1e9;
+    int samples = 0;
+    for (size_t i = 1; i < path.size(); ++i) {
+        double x0 = (path[i - 1].first + 0.5) * node_size_px, y0 = (path[i - 1].second + 0.5) * node_size_px;
+        double x1 = (path[i].first + 0.5) * node_size_px, y1 = (path[i].second + 0.5) * node_size_px;
+        double length = std::hypot(x1 - x0, y1 - y0);
+        c.length_mm += length * mm_per_pixel;
+        int steps = std::max(1, static_cast<int>(std::ceil(length)));
+        for (int k = 0; k <= steps; ++k) {
+            int x = static_cast<int>(x0 + (x1 - x0) * k / steps), y = static_cast<int>(y0 + (y1 - y0) * k / steps);
+            double d = costmap.DistanceMm(x, y);
+            c.min_mm = std::min(c.min_mm, d);
+            c.mean_mm += d;
+            ++samples;
+        }
+    }
+    c.mean_mm /= samples;
+    return c;
+}
+
+static void printClearance(const char* label, const Clearance& c) {
+    std::printf("%-34s %3zu vertices, %5.0f mm long, clearance min %4.0f mm, mean %4.0f mm\n", label, c.vertices,
+                c.length_mm, c.min_mm, c.mean_mm);
+}
+
+int main() {
+    const double mm_per_pixel = bench::MAP_SIZE_METERS * 1000 / bench::MAP_SIZE_PIXELS;
+    LD20 laser(4, bench::OFFSET_MM);
+    RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    bench::configureSlam(slam);
+
+    Costmap costmap(bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, ROBOT_RADIUS_MM, DECAY_MM);
+    std::shared_ptr<const MapSnapshot> snapshot;
+    std::vector<double> incremental_us, full_us, obstycle_us;
+    long long tiles_before = 0, windows_before = 0;
+    int checks = 0, mismatches = 0;
+    double room_x0 = 0, room_y0 = 0;   // room coordinates to map coordinates
+
+    // A circle of 2.8 m radius around the middle of the room, 60 mm per step, from
+    // heading along x, so the map is the room translated
+    const double radius = 2800, step = 60;
+    for (int i = 0; i < FRAMES; ++i) {
+        double angle = i * step / radius - M_PI / 2;
+        double theta = angle * 180 / M_PI + 90;
+        double x = ROOM_MM / 2 + radius * std::cos(angle), y = ROOM_MM / 2 + radius * std::sin(angle);
+        std::vector<int> scan = bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta, ROOM_MM);
+        PoseChange move(i ? step : 0, i ? step / radius * 180 / M_PI : 0, 1.0 / 6);
+        slam.update(scan.data(), move);
+        if (i == 0) {
+            Position p = slam.getpos();
+            room_x0 = p.x_mm - x;
+            room_y0 = p.y_mm - y;
+        }
+
+        // As SLAMHandler publishes the map
+        int xmin, ymin, xmax, ymax;
+        bool changed = slam.getmapchanges(xmin, ymin, xmax, ymax);
+        if (!snapshot) {
+            snapshot = MapSnapshot::capture(slam, bench::MAP_SIZE_PIXELS);
+        } else if (changed) {
+            snapshot = snapshot->next(slam, xmin, ymin, xmax, ymax);
+        }
+
+        auto t0 = bench::Clock::now();
+        if (!costmap.Update(snapshot)) continue;
+        if (i > 0) {
+            incremental_us.push_back(bench::elapsedUs(t0));
+        } else {
+            tiles_before = costmap.GetStats().tiles_transformed;
+            windows_before = costmap.GetStats().windows_transformed;
+        }
+
+        t0 = bench::Clock::now();
+        Costmap fresh(bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, ROBOT_RADIUS_MM, DECAY_MM);
+        fresh.Update(snapshot);
+        full_us.push_back(bench::elapsedUs(t0));
+
+        t0 = bench::Clock::now();
+        auto bytes = snapshot->bytes();
+        auto grid = PathFinder::updateObstycle(bytes.data(), bench::MAP_SIZE_METERS, bench::MAP_SIZE_PIXELS);
+        obstycle_us.push_back(bench::elapsedUs(t0));
+
+        if (i % CHECK_EVERY == 0 || i + 1 == FRAMES) {
+            ++checks;
+            bool same = fresh.Costs() == costmap.Costs();
+            for (int py = 0; py < bench::MAP_SIZE_PIXELS && same; ++py) {
+                for (int px = 0; px < bench::MAP_SIZE_PIXELS && same; ++px) {
+                    same = fresh.DistanceMm(px, py) == costmap.DistanceMm(px, py);
+                }
+            }
+            mismatches += !same;
+        }
+    }
+
+    bench::printLatency("Costmap::Update, incremental", incremental_us);
+    bench::printLatency("Costmap::Update, whole map", full_us);
+    bench::printLatency("updateObstycle (with copy)", obstycle_us);
+    Costmap::Stats stats = costmap.GetStats();
+    int tiles = snapshot->tilesPerSide() * snapshot->tilesPerSide();
+    size_t incremental = std::max<size_t>(1, incremental_us.size());
+    std::printf("%llu updates, %.1f of %d tiles in %.2f windows transformed per incremental update\n",
+                (unsigned long long)stats.updates, double(stats.tiles_transformed - tiles_before) / incremental, tiles,
+                double(stats.windows_transformed - windows_before) / incremental);
+    std::printf("incremental against fresh costmap: %d of %d checks differ\n", mismatches, checks);
+
+    // Across the room, past the pillar, and along a wall
+    int node_size_px = static_cast<int>(std::round(0.25f * (bench::MAP_SIZE_PIXELS / bench::MAP_SIZE_METERS)));
+    auto toNode = [&](double x_mm, double y_mm) {
+        return std::make_pair(static_cast<int>((x_mm + room_x0) / mm_per_pixel) / node_size_px,
+                              static_cast<int>((y_mm + room_y0) / mm_per_pixel) / node_size_px);
+    };
+    auto bytes = snapshot->bytes();
+    auto plain = PathFinder::updateObstycle(bytes.data(), bench::MAP_SIZE_METERS, bench::MAP_SIZE_PIXELS);
+    auto inflated = costmap.NodeGrid();
+    struct Query {
+        const char* label;
+        double x0, y0, x1, y1;
+    };
+    for (const Query& q : {Query{"corner to corner", 500, 500, 7500, 7500}, Query{"along a wall", 300, 300, 7700, 300}}) {
+        auto start = toNode(q.x0, q.y0), goal = toNode(q.x1, q.y1);
+        std::printf("%s: node (%d,%d) to (%d,%d)\n", q.label, start.first, start.second, goal.first, goal.second);
+
+        auto path = PathFinder::SmoothPath(plain, PathFinder::FindPathJPS(plain, start, goal));
+        printClearance("  JPS, updateObstycle", measure(costmap, path, node_size_px, mm_per_pixel));
+        path = PathFinder::SmoothPath(inflated, PathFinder::FindPathJPS(inflated, start, goal), costmap.Costs().data());
+        printClearance("  JPS, inflated", measure(costmap, path, node_size_px, mm_per_pixel));
+        PathFinder::DStarLite planner(inflated, start, goal, true, costmap.Costs().data());
+        path = PathFinder::SmoothPath(inflated, planner.run(), costmap.Costs().data());
+        printClearance("  D* Lite, inflated with decay", measure(costmap, path, node_size_px, mm_per_pixel));
+    }
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,105 @@
+// Heading from orientation histogram correlation (HeadingHistogram) on consecutive
+// synthetic revolutions with turns of increasing speed: time per estimate and error
+// of the estimated turn. Then the RMHC search on the same trajectory, with no motion
+// prior (full 60 degree window) and with the histogram's turn as the prior (narrow
+// window), comparing scan-to-map evaluations and pose error.
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "HeadingHistogram.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const double PRIOR_SIGMA_SCALE = 2.0;    // as in SLAMHandler
+
+struct Frame {
+    std::vector<int> scan;
+    double dxy, dtheta, theta;
+};
+
+static std::vector<Frame> trajectory(double step_mm, double turn_degrees) {
+    std::vector<Frame> frames;
+    double x = 4000, y = 3000, theta = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        // circles in the middle of the room, reversing every 25 frames
+        double dxy = i ? step_mm : 0, dtheta = i ? ((i / 25) % 2 ? -turn_degrees : turn_degrees) : 0;
+        x += dxy * std::cos(theta * M_PI / 180);
+        y += dxy * std::sin(theta * M_PI / 180);
+        theta += dtheta;
+        frames.push_back({bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                          y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta),
+                          dxy, dtheta, theta});
+    }
+    return frames;
+}
+
+static void heading(const char* label, const std::vector<Frame>& frames) {
+    HeadingHistogram histogram(bench::LD20_SCAN_SIZE, 360, 4);
+    std::vector<double> us;
+    double err = 0, err_max = 0;
+    int valid = 0;
+    for (const Frame& f : frames) {
+        auto t0 = bench::Clock::now();
+        HeadingHistogram::Estimate e = histogram.match(f.scan);
+        us.push_back(bench::elapsedUs(t0));
+        if (!e.valid) continue;
+        ++valid;
+        double d = std::fabs(e.dtheta_degrees - f.dtheta);
+        err += d;
+        err_max = std::max(err_max, d);
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s %d/%d valid, dtheta error mean %.3f max %.3f deg\n", "", valid, FRAMES - 1,
+                err / std::max(valid, 1), err_max);
+}
+
+static void search(const char* label, const std::vector<Frame>& frames, bool prior) {
+    LD20 laser(4, bench::OFFSET_MM);
+    RMHC_SLAM slam(laser, 800, 15, 125);
+    slam.map_quality = 5;
+    slam.hole_width_mm = 400;
+    slam.max_search_iter = 2000;
+    slam.min_sigma_xy_mm = 10;
+    slam.min_sigma_theta_degrees = 1;
+    slam.enablelikelihoodfield(300);
+    HeadingHistogram histogram(bench::LD20_SCAN_SIZE, 360, 4);
+
+    std::vector<double> us;
+    long evaluations = 0;
+    double theta_err = 0;
+    for (const Frame& f : frames) {
+        HeadingHistogram::Estimate e = histogram.match(f.scan);
+        slam.sigma_xy_mm = 250;
+        slam.sigma_theta_degrees = 60;
+        // dt = 0: the synthetic scans are instantaneous and must not be de-skewed
+        PoseChange move;
+        if (prior && e.valid) {
+            move = PoseChange(0, e.dtheta_degrees, 0);
+            slam.sigma_theta_degrees = std::max(slam.min_sigma_theta_degrees, PRIOR_SIGMA_SCALE * e.sigma_degrees);
+        }
+        auto t0 = bench::Clock::now();
+        slam.update(const_cast<int*>(f.scan.data()), move);
+        us.push_back(bench::elapsedUs(t0));
+        evaluations += slam.last_evaluations;
+        theta_err += std::fabs(std::remainder(slam.getpos().theta_degrees - f.theta, 360));
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s %.0f evaluations per frame, heading error mean %.2f deg\n", "",
+                double(evaluations) / FRAMES, theta_err / FRAMES);
+}
+
+int main() {
+    heading("heading, 3 deg per frame", trajectory(40, 3));
+    heading("heading, 15 deg per frame", trajectory(40, 15));
+    heading("heading, 40 deg per frame", trajectory(40, 40));
+
+    std::vector<Frame> fast = trajectory(40, 15);
+    search("RMHC, no prior", fast, false);
+    search("RMHC, histogram prior", fast, true);
+    return 0;
+}
@@ -0,0 +1,149 @@
+// Likelihood field (CoreSLAM::enablelikelihoodfield) kept up to date incrementally by
+// map_update, checked against the field recomputed from scratch over the same map
+// every CHECK_EVERY scans, and once against a brute-force minimum over each cell's
+// window. Reports what the refresh adds to map_update and what a full recompute
+// costs. Then RMHC_SLAM down a corridor and back with noisy, slipping odometry,
+// configured by bench::configureSlam with and without the field, unbounded and
+// capped at CAPPED_EVALUATIONS, for the position error against the truth.
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/c/coreslam.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/CoreSlamT.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const double ROOM_MM = 8000;
+static const double ROOM_ORIGIN_MM = 3500;     // where the room lies in the map
+static const double BASIN_MM = 300;
+static const int CHECK_EVERY = 25;
+static const int CAPPED_EVALUATIONS = 1000;
+static const int RUNS = 3;
+
+// Every cell as the minimum over the pixels q of its window of (map byte at q + the
+// cost of each axis' distance to q), truncated at 255
+static bool matchesBruteForce(const map_t& map) {
+    const likelihood_t& field = *map.likelihood;
+    const int size = map.size_pixels, r = field.radius_pixels;
+    for (int y = 0; y < size; ++y) {
+        for (int x = 0; x < size; ++x) {
+            int best = 255;
+            for (int qy = std::max(y - r, 0); qy <= std::min(y + r, size - 1); ++qy) {
+                for (int qx = std::max(x - r, 0); qx <= std::min(x + r, size - 1); ++qx) {
+                    int value = (map.pixels[qy * size + qx] >> 8) + field.costs[std::abs(qx - x)] +
+                                field.costs[std::abs(qy - y)];
+                    best = std::min(best, value);
+                }
+            }
+            if (field.cells[y * size + x] != best) return false;
+        }
+    }
+    return true;
+}
+
+static bool checkField() {
+    using Model = LD20Model<4, 45>;
+    scan_t scan_map, scan_distance;
+    scan_init(&scan_map, 3, Model::scan_size, Model::scan_rate_hz, Model::detection_angle_degrees,
+              Model::distance_no_detection_mm, Model::detection_margin, Model::offset_mm);
+    scan_init(&scan_distance, 1, Model::scan_size, Model::scan_rate_hz, Model::detection_angle_degrees,
+              Model::distance_no_detection_mm, Model::detection_margin, Model::offset_mm);
+    map_t with_field, without_field;
+    map_init(&with_field, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS);
+    map_init(&without_field, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS);
+    map_enable_likelihood(&with_field, BASIN_MM);
+
+    // A circle of 2.8 m radius around the middle of the room, at the true laser poses
+    const double radius = 2800, step = 60;
+    std::vector<double> plain_us, field_us, full_us;
+    int checks = 0, mismatches = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        double angle = i * step / radius - M_PI / 2;
+        double theta = angle * 180 / M_PI + 90;
+        double x = ROOM_MM / 2 + radius * std::cos(angle) + bench::OFFSET_MM * std::cos(theta * M_PI / 180);
+        double y = ROOM_MM / 2 + radius * std::sin(angle) + bench::OFFSET_MM * std::sin(theta * M_PI / 180);
+        std::vector<int> scan = bench::roomScan(x, y, theta, ROOM_MM);
+        scan_update_both(&scan_map, &scan_distance, scan.data(), 400, 0, 0);
+        position_t at = { x + ROOM_ORIGIN_MM, y + ROOM_ORIGIN_MM, theta };
+
+        auto t0 = bench::Clock::now();
+        map_update(&without_field, &scan_map, at, 5, 400);
+        plain_us.push_back(bench::elapsedUs(t0));
+        t0 = bench::Clock::now();
+        map_update(&with_field, &scan_map, at, 5, 400);
+        field_us.push_back(bench::elapsedUs(t0));
+
+        if (i % CHECK_EVERY == 0 || i + 1 == FRAMES) {
+            map_t full;
+            map_init(&full, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS);
+            std::memcpy(full.pixels, with_field.pixels,
+                        sizeof(pixel_t) * bench::MAP_SIZE_PIXELS * bench::MAP_SIZE_PIXELS);
+            t0 = bench::Clock::now();
+            map_enable_likelihood(&full, BASIN_MM);
+            full_us.push_back(bench::elapsedUs(t0));
+            ++checks;
+            mismatches += std::memcmp(full.likelihood->cells, with_field.likelihood->cells,
+                                      static_cast<size_t>(bench::MAP_SIZE_PIXELS) * bench::MAP_SIZE_PIXELS) != 0;
+            map_free(&full);
+        }
+    }
+    bool brute_force = matchesBruteForce(with_field);
+
+    bench::printLatency("map_update, no field", plain_us);
+    bench::printLatency("map_update + field refresh", field_us);
+    bench::printLatency("field from scratch", full_us);
+    std::printf("incremental field against recomputed: %d of %d checks differ; against brute force: %s\n",
+                mismatches, checks, brute_force ? "identical" : "DIFFERS");
+
+    map_free(&with_field);
+    map_free(&without_field);
+    scan_free(&scan_map);
+    scan_free(&scan_distance);
+    return mismatches == 0 && brute_force;
+}
+
+static void run(const char* label, bool field, int max_evaluations) {
+    LD20 laser(4, bench::OFFSET_MM);
+    std::vector<double> us;
+    double error_sum = 0, error_max = 0, final_sum = 0, evaluations = 0;
+    for (int r = 0; r < RUNS; ++r) {
+        std::vector<bench::Frame> frames = bench::driveCorridor(bench::SEED + r);
+        RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED + r);
+        bench::configureSlam(slam, field);
+        slam.max_evaluations = max_evaluations;
+
+        Position start;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            auto t0 = bench::Clock::now();
+            slam.update(frames[i].scan.data(), frames[i].odometry);
+            us.push_back(bench::elapsedUs(t0));
+            evaluations += slam.last_evaluations;
+
+            Position p = slam.getpos();
+            if (i == 0) start = p;
+            double error = std::hypot((p.x_mm - start.x_mm) - (frames[i].x - frames[0].x),
+                                      (p.y_mm - start.y_mm) - (frames[i].y - frames[0].y));
+            error_sum += error;
+            error_max = std::max(error_max, error);
+            if (i + 1 == frames.size()) final_sum += error;
+        }
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s %.0f kernel calls per search; error mean %.1f mm, max %.1f mm, at the end %.1f mm\n", "",
+                evaluations / us.size(), error_sum / us.size(), error_max, final_sum / RUNS);
+}
+
+int main() {
+    bool field_ok = checkField();
+    run("raw map", false, 0);
+    run("likelihood field", true, 0);
+    run("raw map, capped", false, CAPPED_EVALUATIONS);
+    run("likelihood field, capped", true, CAPPED_EVALUATIONS);
+    return field_ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+// Map checkpoints (MapCheckpoint) of a map built by RMHC_SLAM driving around a room,
+// configured by bench::configureSlam. Reports the file size against the raw map, the
+// time to encode and write it atomically, and the startup path: mapping and decoding
+// the file, then restoring it into a new RMHC_SLAM, which rebuilds the likelihood
+// field. The restored map and pose must be the saved ones.
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <unistd.h>
+
+#include "BenchCommon.h"
+#include "MapCheckpoint.h"
+#include "MapSnapshot.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const double ROOM_MM = 8000;
+static const int RUNS = 20;
+static const char* PATH = "bench_map_checkpoint.map";
+
+int main() {
+    LD20 laser(4, bench::OFFSET_MM);
+    RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    bench::configureSlam(slam);
+
+    // A circle of 2 m radius around the middle of the room, 40 mm per revolution
+    const double radius = 2000, step = 40;
+    for (int i = 0; i < FRAMES; ++i) {
+        double angle = i * step / radius;
+        double theta = angle * 180 / M_PI + 90;
+        double x = ROOM_MM / 2 + radius * std::cos(angle), y = ROOM_MM / 2 + radius * std::sin(angle);
+        std::vector<int> scan = bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta, ROOM_MM);
+        PoseChange move(i ? step : 0, i ? step / radius * 180 / M_PI : 0, 0);
+        slam.update(scan.data(), move);
+    }
+    auto snapshot = MapSnapshot::capture(slam, bench::MAP_SIZE_PIXELS);
+    Position saved = slam.getpos();
+    const double mm_per_pixel = bench::MAP_SIZE_METERS * 1000 / bench::MAP_SIZE_PIXELS;
+
+    std::vector<double> encode_us, write_us, load_us, restore_us;
+    std::vector<unsigned char> data;
+    std::string error;
+    for (int r = 0; r < RUNS; ++r) {
+        auto t0 = bench::Clock::now();
+        data = MapCheckpoint::Encode(*snapshot, saved, mm_per_pixel);
+        encode_us.push_back(bench::elapsedUs(t0));
+        t0 = bench::Clock::now();
+        if (!MapCheckpoint::WriteAtomically(PATH, data, error)) {
+            std::printf("write failed: %s\n", error.c_str());
+            return 1;
+        }
+        write_us.push_back(bench::elapsedUs(t0));
+    }
+
+    bool same = true;
+    for (int r = 0; r < RUNS; ++r) {
+        RMHC_SLAM restored(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+        bench::configureSlam(restored);
+        auto t0 = bench::Clock::now();
+        MapCheckpoint::Map map;
+        if (!MapCheckpoint::Load(PATH, map, error)) {
+            std::printf("load failed: %s\n", error.c_str());
+            return 1;
+        }
+        load_us.push_back(bench::elapsedUs(t0));
+        t0 = bench::Clock::now();
+        restored.restore(map.bytes.data(), map.position);
+        restore_us.push_back(bench::elapsedUs(t0));
+
+        std::vector<unsigned char> bytes(static_cast<size_t>(bench::MAP_SIZE_PIXELS) * bench::MAP_SIZE_PIXELS);
+        restored.getmap(bytes.data());
+        Position p = restored.getpos();
+        same &= bytes == snapshot->bytes() && p.x_mm == saved.x_mm && p.y_mm == saved.y_mm &&
+                p.theta_degrees == saved.theta_degrees;
+    }
+    ::unlink(PATH);
+
+    bench::printLatency("encode", encode_us);
+    bench::printLatency("write (fsync, rename)", write_us);
+    bench::printLatency("mmap and decode", load_us);
+    bench::printLatency("restore into RMHC_SLAM", restore_us);
+    std::printf("%zu bytes on disk, %d bytes raw; restored map and pose %s\n", data.size(),
+                bench::MAP_SIZE_PIXELS * bench::MAP_SIZE_PIXELS, same ? "identical" : "DIFFERENT");
+    return same ? 0 : 1;
+}
@@ -0,0 +1,67 @@
+// Map integration (map_update) with one thread against the tile-partitioned
+// parallel mode of Map::setThreads. Integrates the same scans at the same poses
+// on every map and checks that the maps come out identical. Threads beyond the
+// cores of the host are not used, so on a single core every run is serial.
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 400;
+
+static std::unique_ptr<RMHC_SLAM> makeSlam(LD20& laser, int threads) {
+    auto slam = std::make_unique<RMHC_SLAM>(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, 125);
+    slam->map_quality = 5;
+    slam->hole_width_mm = 400;
+    // Integrate at the odometry poses, so only the map update is timed
+    slam->search_enabled = false;
+    slam->setmapthreads(threads);
+    return slam;
+}
+
+int main() {
+    LD20 laser(4, 45);
+    std::vector<unsigned char> reference(bench::MAP_SIZE_PIXELS * bench::MAP_SIZE_PIXELS), map(reference.size());
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("%u hardware threads\n", cores);
+
+    double serial_p50 = 0;
+    for (int threads : {1, 2, 4}) {
+        auto slam = makeSlam(laser, threads);
+        std::vector<double> us;
+        double x = 4000, y = 3000, theta = 0;
+        for (int i = 0; i < FRAMES; ++i) {
+            double dxy = i ? 30 : 0, dtheta = i ? 2 : 0;
+            x += dxy * std::cos(theta * M_PI / 180);
+            y += dxy * std::sin(theta * M_PI / 180);
+            theta += dtheta;
+            std::vector<int> scan = bench::roomScan(x, y, theta);
+            PoseChange poseChange(dxy, dtheta, 1.0 / 6);
+            auto t0 = bench::Clock::now();
+            slam->update(scan.data(), poseChange);
+            us.push_back(bench::elapsedUs(t0));
+        }
+
+        // setmapthreads() uses no more threads than there are cores
+        char label[64];
+        std::snprintf(label, sizeof(label), "update, %d of %d thread(s)", slam->getmapthreads(), threads);
+        bench::printLatency(label, us);
+
+        slam->getmap(threads == 1 ? reference.data() : map.data());
+        if (threads == 1) {
+            serial_p50 = bench::percentile(us, 50);
+        } else {
+            bool same = std::memcmp(reference.data(), map.data(), map.size()) == 0;
+            std::printf("  speed-up %.2fx, map %s\n", serial_p50 / bench::percentile(us, 50),
+                        same ? "identical" : "DIFFERS");
+            if (!same) return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+// Multi-hypothesis SLAM (ParticleSLAM) against RMHC_SLAM down a corridor and back,
+// with noisy, slipping odometry, configured by bench::configureSlam. Reports the
+// update time (with every particle on one thread and on PARTICLE_THREADS threads,
+// which only differ with as many cores),
+// the position error against the truth, the resamplings and the number of maps
+// the particles held at the end.
+#include <cmath>
+#include <cstdio>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+// 60 revolutions each way (the full 150-revolution drive with particles takes minutes
+// on one core), once per configuration
+static const int FRAMES_EACH_WAY = 60;
+static const int PARTICLE_THREADS = 4;
+static const int RUNS = 2;
+
+static void run(const char* label, int particles, int threads) {
+    LD20 laser(4, bench::OFFSET_MM);
+    std::vector<double> us;
+    double error_sum = 0, error_max = 0, final_sum = 0;
+    int resamples = 0, lineages = 0;
+    for (int r = 0; r < RUNS; ++r) {
+        std::vector<bench::Frame> frames = bench::driveCorridor(bench::SEED + r, FRAMES_EACH_WAY);
+        // CoreSLAM has no virtual destructor, so each kind is owned as itself
+        std::unique_ptr<RMHC_SLAM> rmhc;
+        std::unique_ptr<ParticleSLAM> particle;
+        if (particles > 0) {
+            particle.reset(new ParticleSLAM(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, particles, bench::SEED + r));
+            particle->setparticlethreads(threads);
+        } else {
+            rmhc.reset(new RMHC_SLAM(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED + r));
+        }
+        RMHC_SLAM* slam = particle ? particle.get() : rmhc.get();
+        bench::configureSlam(*slam);
+
+        Position start;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            auto t0 = bench::Clock::now();
+            slam->update(frames[i].scan.data(), frames[i].odometry);
+            us.push_back(bench::elapsedUs(t0));
+
+            Position p = slam->getpos();
+            if (i == 0) start = p;
+            double error = std::hypot((p.x_mm - start.x_mm) - (frames[i].x - frames[0].x),
+                                      (p.y_mm - start.y_mm) - (frames[i].y - frames[0].y));
+            error_sum += error;
+            error_max = std::max(error_max, error);
+            if (i + 1 == frames.size()) final_sum += error;
+        }
+        if (particle) {
+            resamples += particle->resample_count;
+            lineages += particle->getlineagecount();
+        }
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s error mean %.1f mm, max %.1f mm, at the end %.1f mm; %.1f resamplings, %.1f maps\n", "",
+                error_sum / us.size(), error_max, final_sum / RUNS, double(resamples) / RUNS, double(lineages) / RUNS);
+}
+
+int main() {
+    run("RMHC_SLAM", 0, 1);
+    run("ParticleSLAM 4, 1 thread", 4, 1);
+    run("ParticleSLAM 4, 4 threads", 4, PARTICLE_THREADS);
+    std::printf("%u hardware thread(s)\n", std::thread::hardware_concurrency());
+    return 0;
+}
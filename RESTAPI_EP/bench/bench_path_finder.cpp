@@ -0,0 +1,385 @@
+// D* Lite (PathFinder::FindPathDStarLite) on node grids such as updateObstycle makes:
+// 60 x 60 for our 15 m map at 0.25 m per node, and the grids of 30, 60 and 120 m maps.
+// Compares the flat-array planner with the one it replaced (kept below: hash maps for
+// g, rhs and cost, a priority queue with lazy deletion plus a set of open nodes, and a
+// vector of neighbours per expansion) on the same queries, whose path lengths must
+// agree: both are shortest paths. The old planner is left out on the largest grid,
+// where it takes seconds per query.
+//
+// Then replanning while driving: the robot follows its path and an obstacle appears
+// a few nodes ahead of it every few steps, as when detectCollisionByScan fires.
+// Compares a fresh planner per replan with one planner kept for the goal, moved and
+// given the changed nodes; their path lengths must agree.
+//
+// Last, the path shapes on the same queries: 4- and 8-connected D* Lite, the
+// 8-connected path smoothed by line of sight (what RobotHandler tracks), Theta* and
+// lazy Theta*. Reports nodes expanded, vertices, turns of more than 15 degrees (each
+// a stop-turn-stop in trackPath) and the length driven.
+//
+// And one-shot queries, as for a new goal: a fresh 8-connected D* Lite against jump
+// point search, on grids up to a 240 m map, cluttered and nearly clear. Both are
+// optimal, so their path lengths must agree.
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "PathFinder.h"
+
+static const int QUERIES = 20;
+static const int LEGACY_MAX_SIDE = 240;
+
+struct pair_hash {
+    std::size_t operator()(const std::pair<int, int>& p) const {
+        return (std::hash<int>()(p.first) << 1) ^ std::hash<int>()(p.second);
+    }
+};
+
+// PathFinder::DStarLite as it was
+class LegacyDStarLite {
+public:
+    LegacyDStarLite(const std::vector<std::vector<uint8_t>>& grid, std::pair<int, int> start, std::pair<int, int> goal)
+        : grid_(grid), width_(grid[0].size()), height_(grid.size()), start_(start), goal_(goal), km_(0.0f)
+    {
+        for (int y = 0; y < height_; ++y) {
+            for (int x = 0; x < width_; ++x) {
+                g_[{x, y}] = std::numeric_limits<float>::infinity();
+                rhs_[{x, y}] = std::numeric_limits<float>::infinity();
+                cost_[{x, y}] = (grid[y][x] == 1) ? std::numeric_limits<float>::infinity() : 1.0f;
+            }
+        }
+        rhs_[goal_] = 0.0f;
+        insertOpen(goal_);
+    }
+
+    std::vector<std::pair<int, int>> run() {
+        computeShortestPath();
+        std::vector<std::pair<int, int>> path;
+        auto s = start_;
+        if (g_[s] == std::numeric_limits<float>::infinity()) return {};
+        if (s == goal_) return {s};
+        path.push_back(s);
+        while (s != goal_) {
+            auto nbrs = getNeighbors(s);
+            float min_cost = std::numeric_limits<float>::infinity();
+            std::pair<int, int> next = s;
+            for (auto& n : nbrs) {
+                float c = cost_[n] + g_[n];
+                if (c < min_cost) {
+                    min_cost = c;
+                    next = n;
+                }
+            }
+            if (next == s) break;
+            s = next;
+            path.push_back(s);
+        }
+        if (path.size() <= 1) return {};
+        return path;
+    }
+
+private:
+    const std::vector<std::vector<uint8_t>>& grid_;
+    int width_, height_;
+    std::pair<int, int> start_, goal_;
+    float km_;
+
+    std::unordered_map<std::pair<int, int>, float, pair_hash> g_;
+    std::unordered_map<std::pair<int, int>, float, pair_hash> rhs_;
+    std::unordered_map<std::pair<int, int>, float, pair_hash> cost_;
+
+    using QueueElem = std::pair<std::pair<float, float>, std::pair<int, int>>;
+    struct QueueCompare {
+        bool operator()(const QueueElem& a, const QueueElem& b) const {
+            if (a.first.first != b.first.first)
+                return a.first.first > b.first.first;
+            return a.first.second > b.first.second;
+        }
+    };
+    std::priority_queue<QueueElem, std::vector<QueueElem>, QueueCompare> openList_;
+    std::set<std::pair<int, int>, std::less<>> openSet_; // for fast lookup/removal
+
+    float heuristic(const std::pair<int, int>& a, const std::pair<int, int>& b) const {
+        return std::abs(a.first - b.first) + std::abs(a.second - b.second);
+    }
+
+    std::pair<float, float> calculateKey(const std::pair<int, int>& s) const {
+        float g_rhs = std::min(g_.at(s), rhs_.at(s));
+        return {g_rhs + heuristic(start_, s) + km_, g_rhs};
+    }
+
+    std::vector<std::pair<int, int>> getNeighbors(const std::pair<int, int>& s) const {
+        static const int dx[4] = {1, -1, 0, 0};
+        static const int dy[4] = {0, 0, 1, -1};
+        std::vector<std::pair<int, int>> nbrs;
+        for (int i = 0; i < 4; ++i) {
+            int nx = s.first + dx[i];
+            int ny = s.second + dy[i];
+            if (nx >= 0 && nx < width_ && ny >= 0 && ny < height_) {
+                if (cost_.at({nx, ny}) < std::numeric_limits<float>::infinity()) {
+                    nbrs.emplace_back(nx, ny);
+                }
+            }
+        }
+        return nbrs;
+    }
+
+    void removeOpen(const std::pair<int, int>& u) {
+        openSet_.erase(u);
+    }
+
+    void insertOpen(const std::pair<int, int>& u) {
+        openList_.push({calculateKey(u), u});
+        openSet_.insert(u);
+    }
+
+    void updateVertex(const std::pair<int, int>& u) {
+        if (u != goal_) {
+            float min_rhs = std::numeric_limits<float>::infinity();
+            for (auto& s : getNeighbors(u)) {
+                min_rhs = std::min(min_rhs, cost_.at(u) + g_.at(s));
+            }
+            rhs_[u] = min_rhs;
+        }
+        if (openSet_.count(u)) removeOpen(u);
+        if (g_[u] != rhs_[u]) insertOpen(u);
+    }
+
+    void computeShortestPath() {
+        while (!openList_.empty()) {
+            auto [k_old, u] = openList_.top();
+            if (!openSet_.count(u)) { openList_.pop(); continue; }
+            auto k_start = calculateKey(start_);
+            if (!(k_old < k_start) && rhs_[start_] == g_[start_]) break;
+
+            auto k_new = calculateKey(u);
+            if (k_old < k_new) {
+                openList_.pop();
+                insertOpen(u);
+            } else if (g_[u] > rhs_[u]) {
+                g_[u] = rhs_[u];
+                openList_.pop();
+                openSet_.erase(u);
+                for (auto& s : getNeighbors(u)) updateVertex(s);
+            } else {
+                g_[u] = std::numeric_limits<float>::infinity();
+                openList_.pop();
+                openSet_.erase(u);
+                updateVertex(u);
+                for (auto& s : getNeighbors(u)) updateVertex(s);
+            }
+        }
+    }
+};
+
+using Grid = std::vector<std::vector<uint8_t>>;
+
+// Rooms of 5 m (20 nodes) with a door in each wall, clutter in 8% of the nodes (by
+// default) and 10% unknown, which is passable
+static Grid flat(int side, std::mt19937& random, int clutter_percent = 8) {
+    Grid grid(side, std::vector<uint8_t>(side, 0));
+    std::uniform_int_distribution<int> percent(0, 99);
+    for (int y = 0; y < side; ++y) {
+        for (int x = 0; x < side; ++x) {
+            bool wall = (x % 20 == 0 || y % 20 == 0) && !((x % 20 == 10) || (y % 20 == 10));
+            int p = percent(random);
+            grid[y][x] = wall || p < clutter_percent ? 1 : p < clutter_percent + 10 ? 2 : 0;
+        }
+    }
+    return grid;
+}
+
+static std::pair<int, int> freeNode(const Grid& grid, std::mt19937& random) {
+    std::uniform_int_distribution<int> any(0, static_cast<int>(grid.size()) - 1);
+    while (true) {
+        int x = any(random), y = any(random);
+        if (grid[y][x] != 1) return {x, y};
+    }
+}
+
+static void replanWhileDriving(int side) {
+    const int STEP = 3, AHEAD = 4;
+    std::mt19937 random(bench::SEED);
+    Grid grid = flat(side, random);
+    std::vector<double> fresh_us, kept_us;
+    long long fresh_expansions = 0, kept_expansions = 0;
+    int replans = 0, disagree = 0;
+    for (int q = 0; q < QUERIES; ++q) {
+        Grid g = grid;
+        auto start = freeNode(g, random), goal = freeNode(g, random);
+        PathFinder::DStarLite kept(g, start, goal);
+        auto path = kept.run();
+        while (path.size() > STEP + AHEAD + 1) {
+            // Drive STEP nodes, then a 2 x 2 obstacle appears AHEAD nodes further on
+            start = path[STEP];
+            auto blocked = path[STEP + AHEAD];
+            for (int y = blocked.second; y < std::min(blocked.second + 2, side); ++y) {
+                for (int x = blocked.first; x < std::min(blocked.first + 2, side); ++x) {
+                    if (std::make_pair(x, y) != goal) g[y][x] = 1;
+                }
+            }
+
+            auto t0 = bench::Clock::now();
+            PathFinder::DStarLite fresh(g, start, goal);
+            auto expected = fresh.run();
+            fresh_us.push_back(bench::elapsedUs(t0));
+            fresh_expansions += fresh.expansions();
+
+            long long before = kept.expansions();
+            t0 = bench::Clock::now();
+            kept.moveStart(start);
+            kept.updateGrid(g);
+            path = kept.run();
+            kept_us.push_back(bench::elapsedUs(t0));
+            kept_expansions += kept.expansions() - before;
+
+            ++replans;
+            disagree += path.size() != expected.size();
+        }
+    }
+    char label[64];
+    std::snprintf(label, sizeof(label), "%d x %d, fresh planner", side, side);
+    bench::printLatency(label, fresh_us);
+    std::snprintf(label, sizeof(label), "%d x %d, kept planner", side, side);
+    bench::printLatency(label, kept_us);
+    std::printf("%28s %d replans, expansions per replan %.0f from scratch, %.0f repaired; %d lengths differ\n", "",
+                replans, double(fresh_expansions) / replans, double(kept_expansions) / replans, disagree);
+}
+
+struct Shape {
+    double expansions = 0, vertices = 0, turns = 0, length = 0, us = 0;
+    int found = 0;
+};
+
+static void measure(Shape& shape, const std::vector<std::pair<int, int>>& path) {
+    if (path.empty()) return;
+    ++shape.found;
+    shape.vertices += path.size();
+    for (size_t i = 1; i < path.size(); ++i) {
+        double dx = path[i].first - path[i - 1].first, dy = path[i].second - path[i - 1].second;
+        shape.length += std::hypot(dx, dy);
+        if (i + 1 < path.size()) {
+            double ex = path[i + 1].first - path[i].first, ey = path[i + 1].second - path[i].second;
+            double turn = std::fabs(std::remainder(std::atan2(ey, ex) - std::atan2(dy, dx), 2 * M_PI));
+            shape.turns += turn > 15 * M_PI / 180;
+        }
+    }
+}
+
+static void compareShapes(int side) {
+    std::mt19937 random(bench::SEED);
+    Grid grid = flat(side, random);
+    const char* names[] = { "4-connected", "8-connected", "8-connected, smoothed", "Theta*", "lazy Theta*" };
+    Shape shapes[5];
+    for (int q = 0; q < QUERIES; ++q) {
+        auto start = freeNode(grid, random), goal = freeNode(grid, random);
+        for (int mode = 0; mode < 5; ++mode) {
+            long long expansions = 0;
+            std::vector<std::pair<int, int>> path;
+            auto t0 = bench::Clock::now();
+            if (mode < 3) {
+                PathFinder::DStarLite dstar(grid, start, goal, mode > 0);
+                path = dstar.run();
+                if (mode == 2) path = PathFinder::SmoothPath(grid, path);
+                expansions = dstar.expansions();
+            } else {
+                path = PathFinder::FindPathThetaStar(grid, start, goal, mode == 4, &expansions);
+            }
+            shapes[mode].us += bench::elapsedUs(t0);
+            shapes[mode].expansions += expansions;
+            measure(shapes[mode], path);
+        }
+    }
+    std::printf("%d x %d, %d queries%9s ms   expanded   vertices   turns   length\n", side, side, QUERIES, "");
+    for (int mode = 0; mode < 5; ++mode) {
+        const Shape& shape = shapes[mode];
+        int n = std::max(shape.found, 1);
+        std::printf("  %-26s %8.3f %10.0f %10.1f %7.1f %8.1f\n", names[mode], shape.us / 1000 / QUERIES,
+                    shape.expansions / QUERIES, shape.vertices / n, shape.turns / n, shape.length / n);
+    }
+}
+
+static double pathLength(const std::vector<std::pair<int, int>>& path) {
+    double length = 0;
+    for (size_t i = 1; i < path.size(); ++i) {
+        length += std::hypot(path[i].first - path[i - 1].first, path[i].second - path[i - 1].second);
+    }
+    return length;
+}
+
+static void compareOneShot(int side, int clutter_percent) {
+    std::mt19937 random(bench::SEED);
+    Grid grid = flat(side, random, clutter_percent);
+    std::vector<double> dstar_us, jps_us;
+    double dstar_expansions = 0, jps_expansions = 0;
+    int disagree = 0;
+    for (int q = 0; q < QUERIES; ++q) {
+        auto start = freeNode(grid, random), goal = freeNode(grid, random);
+        auto t0 = bench::Clock::now();
+        PathFinder::DStarLite dstar(grid, start, goal, true);
+        auto expected = dstar.run();
+        dstar_us.push_back(bench::elapsedUs(t0));
+        dstar_expansions += dstar.expansions();
+
+        long long expansions = 0;
+        t0 = bench::Clock::now();
+        auto path = PathFinder::FindPathJPS(grid, start, goal, &expansions);
+        jps_us.push_back(bench::elapsedUs(t0));
+        jps_expansions += expansions;
+        disagree += path.empty() != expected.empty() || std::fabs(pathLength(path) - pathLength(expected)) > 1e-3;
+    }
+    char label[64];
+    std::snprintf(label, sizeof(label), "%d x %d, %d%%, D* Lite", side, side, clutter_percent);
+    bench::printLatency(label, dstar_us);
+    std::snprintf(label, sizeof(label), "%d x %d, %d%%, JPS", side, side, clutter_percent);
+    bench::printLatency(label, jps_us);
+    std::printf("%28s expansions per query %.0f D* Lite, %.0f JPS; %d lengths differ\n", "",
+                dstar_expansions / QUERIES, jps_expansions / QUERIES, disagree);
+}
+
+int main() {
+    for (int side : { 60, 120, 240, 480 }) {
+        std::mt19937 random(bench::SEED);
+        Grid grid = flat(side, random);
+        std::vector<double> legacy_us, flat_us;
+        int found = 0, disagree = 0;
+        double length = 0;
+        for (int q = 0; q < QUERIES; ++q) {
+            auto start = freeNode(grid, random), goal = freeNode(grid, random);
+            auto t0 = bench::Clock::now();
+            auto path = PathFinder::FindPathDStarLite(grid, start, goal);
+            flat_us.push_back(bench::elapsedUs(t0));
+
+            if (side <= LEGACY_MAX_SIDE) {
+                t0 = bench::Clock::now();
+                LegacyDStarLite legacy(grid, start, goal);
+                auto expected = legacy.run();
+                legacy_us.push_back(bench::elapsedUs(t0));
+                disagree += path.size() != expected.size();
+            }
+            found += !path.empty();
+            length += path.size();
+        }
+        char label[64];
+        std::snprintf(label, sizeof(label), "%d x %d, before", side, side);
+        if (!legacy_us.empty()) bench::printLatency(label, legacy_us);
+        std::snprintf(label, sizeof(label), "%d x %d, flat arrays", side, side);
+        bench::printLatency(label, flat_us);
+        std::printf("%28s %d/%d paths found, %.0f nodes on average, %d lengths differ\n", "", found, QUERIES,
+                    found ? length / found : 0.0, disagree);
+    }
+    for (int side : { 60, 240 }) replanWhileDriving(side);
+    for (int side : { 60, 240 }) compareShapes(side);
+    for (int clutter : { 8, 1 }) {
+        for (int side : { 60, 240, 960 }) compareOneShot(side, clutter);
+    }
+    return 0;
+}
@@ -0,0 +1,96 @@
+// Gaussian sampling for the RMHC search. Compares the ziggurat on one shared SHR3
+// seed, one variate per call (what random_normal used to be), with random_normal
+// and random_normals on the lanes of xoshiro128++. Checks the moments and tails of
+// the batched variates, and that a jumped copy of a generator is uncorrelated with it.
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "random.h"
+extern "C" {
+#include "ziggurat.h"
+}
+
+static const int SAMPLES = 4000000;
+static const int RUNS = 5;
+// As rmhc_position_search_bounded draws them: three per candidate, 16 candidates
+static const int BATCH = 48;
+
+struct Shr3Ziggurat {
+    uint32_t seed = 125;
+    uint32_t kn[128];
+    float fn[128], wn[128];
+
+    Shr3Ziggurat() { r4_nor_setup(kn, fn, wn); }
+};
+
+// Kept out of line, as random_normal is across the void * handle
+__attribute__((noinline)) static double shr3Normal(Shr3Ziggurat& z, double mu, double sigma) {
+    return mu + sigma * r4_nor(&z.seed, z.kn, z.fn, z.wn);
+}
+
+static double nsPerSample(const std::vector<double>& us) {
+    double best = us[0];
+    for (double u : us) best = std::min(best, u);
+    return best * 1000 / SAMPLES;
+}
+
+int main() {
+    std::vector<double> shr3_us, single_us, batch_us;
+    double sink = 0;
+    for (int run = 0; run < RUNS; ++run) {
+        Shr3Ziggurat z;
+        auto t0 = bench::Clock::now();
+        for (int i = 0; i < SAMPLES; ++i) sink += shr3Normal(z, 0, 1);
+        shr3_us.push_back(bench::elapsedUs(t0));
+
+        void* r = random_new(125);
+        t0 = bench::Clock::now();
+        for (int i = 0; i < SAMPLES; ++i) sink += random_normal(r, 0, 1);
+        single_us.push_back(bench::elapsedUs(t0));
+
+        float normals[BATCH];
+        t0 = bench::Clock::now();
+        for (int i = 0; i < SAMPLES; i += BATCH) {
+            random_normals(r, normals, BATCH);
+            sink += normals[0];
+        }
+        batch_us.push_back(bench::elapsedUs(t0));
+        random_free(r);
+    }
+
+    // Moments and tails of the batched variates
+    void* r = random_new(7);
+    std::vector<float> normals(SAMPLES);
+    random_normals(r, normals.data(), SAMPLES);
+    double m1 = 0, m2 = 0, m3 = 0, m4 = 0;
+    int beyond3 = 0;
+    for (float x : normals) {
+        m1 += x;
+        m2 += x * x;
+        m3 += x * x * x;
+        m4 += double(x) * x * x * x;
+        beyond3 += std::fabs(x) > 3;
+    }
+    m1 /= SAMPLES, m2 /= SAMPLES, m3 /= SAMPLES, m4 /= SAMPLES;
+
+    // A jumped copy against the original, variate by variate
+    void* jumped = random_copy(r);
+    random_jump(jumped);
+    std::vector<float> a(SAMPLES), b(SAMPLES);
+    random_normals(r, a.data(), SAMPLES);
+    random_normals(jumped, b.data(), SAMPLES);
+    double ab = 0;
+    for (int i = 0; i < SAMPLES; ++i) ab += double(a[i]) * b[i];
+    random_free(jumped);
+    random_free(r);
+
+    std::printf("%-34s %6.2f ns/variate\n", "r4_nor on SHR3, one per call", nsPerSample(shr3_us));
+    std::printf("%-34s %6.2f ns/variate\n", "random_normal (xoshiro, buffered)", nsPerSample(single_us));
+    std::printf("%-34s %6.2f ns/variate\n", "random_normals, 48 per call", nsPerSample(batch_us));
+    std::printf("mean %.4f, variance %.4f, skewness %.4f, kurtosis %.4f (0, 1, 0, 3)\n", m1, m2 - m1 * m1, m3, m4);
+    std::printf("|x| > 3: %.5f (0.00270); jumped stream correlation %.5f\n", double(beyond3) / SAMPLES, ab / SAMPLES);
+    return sink == 12345.678 ? 1 : 0;
+}
@@ -0,0 +1,154 @@
+// Global relocalization (Relocalizer) in a map built by RMHC_SLAM driving around a
+// flat, configured by bench::configureSlam. Each trial takes one revolution from a
+// random pose in the flat and searches the whole 15 m map for it with no prior.
+// Reports the time to prepare the map, the search time on one and on
+// RELOCALIZATION_THREADS threads, how often the best candidate is the true pose and
+// how often the result is confident and wrong.
+#include <cmath>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "Relocalizer.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const int DETECTION_MARGIN = 4;
+static const double FLAT_WIDTH_MM = 9000;
+static const double FLAT_DEPTH_MM = 6000;
+static const int TRIALS = 30;
+static const int RELOCALIZATION_THREADS = 4;
+// A best candidate this close to the truth is a success: well inside the RMHC search
+// window, and the truth itself is only as good as the map, which drifts by ~50 mm
+static const double TOLERANCE_MM = 200;
+static const double TOLERANCE_DEGREES = 5;
+
+// A flat of [0, FLAT_WIDTH_MM] x [0, FLAT_DEPTH_MM], split by a wall from the
+// bottom up to y = 3.5 m, with a cupboard: no symmetry to confuse the search.
+static const double BOXES[][4] = { { 4950, 0, 5050, 3500 }, { 1800, 4400, 2600, 5000 } };
+
+static std::vector<int> flatScan(double x_mm, double y_mm, double theta_deg) {
+    std::vector<int> out(bench::LD20_SCAN_SIZE);
+    for (int i = 0; i < bench::LD20_SCAN_SIZE; ++i) {
+        double a = (theta_deg - 180.0 + 360.0 * i / (bench::LD20_SCAN_SIZE - 1)) * M_PI / 180.0;
+        double dx = std::cos(a), dy = std::sin(a);
+        double t = 1e9;
+        if (dx > 1e-9) t = std::min(t, (FLAT_WIDTH_MM - x_mm) / dx);
+        if (dx < -1e-9) t = std::min(t, -x_mm / dx);
+        if (dy > 1e-9) t = std::min(t, (FLAT_DEPTH_MM - y_mm) / dy);
+        if (dy < -1e-9) t = std::min(t, -y_mm / dy);
+        for (const auto& box : BOXES) t = std::min(t, bench::hitBox(x_mm, y_mm, dx, dy, box[0], box[1], box[2], box[3]));
+        out[i] = t > 12000.0 ? 0 : static_cast<int>(t);
+    }
+    return out;
+}
+
+// At least clearance_mm inside the walls and away from the boxes
+static bool open(double x, double y, double clearance_mm) {
+    if (x < clearance_mm || y < clearance_mm || x > FLAT_WIDTH_MM - clearance_mm || y > FLAT_DEPTH_MM - clearance_mm) {
+        return false;
+    }
+    for (const auto& box : BOXES) {
+        if (x > box[0] - clearance_mm && x < box[2] + clearance_mm && y > box[1] - clearance_mm &&
+            y < box[3] + clearance_mm) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main() {
+    LD20 laser(DETECTION_MARGIN, bench::OFFSET_MM);
+    RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    bench::configureSlam(slam);
+
+    // A circle of 1 m radius above the end of the wall, 40 mm per revolution
+    const double radius = 1000, step = 40, cx = 5000, cy = 4800;
+    double x0 = 0, y0 = 0, theta0 = 0;
+    Position start;
+    for (int i = 0; i < FRAMES; ++i) {
+        double angle = i * step / radius;
+        double theta = angle * 180 / M_PI + 90;
+        double x = cx + radius * std::cos(angle), y = cy + radius * std::sin(angle);
+        std::vector<int> scan = flatScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                         y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta);
+        PoseChange move(i ? step : 0, i ? step / radius * 180 / M_PI : 0, 0);
+        slam.update(scan.data(), move);
+        if (i == 0) {
+            x0 = x;
+            y0 = y;
+            theta0 = theta;
+            start = slam.getpos();
+        }
+    }
+    // Flat to map coordinates, from the first pose
+    const double turn = (start.theta_degrees - theta0) * M_PI / 180;
+    auto toMap = [&](double x, double y, double theta) {
+        double dx = x - x0, dy = y - y0;
+        return Position(start.x_mm + dx * std::cos(turn) - dy * std::sin(turn),
+                        start.y_mm + dx * std::sin(turn) + dy * std::cos(turn),
+                        theta + turn * 180 / M_PI);
+    };
+
+    std::vector<unsigned char> map(static_cast<size_t>(bench::MAP_SIZE_PIXELS) * bench::MAP_SIZE_PIXELS);
+    slam.getmap(map.data());
+    const double mm_per_pixel = bench::MAP_SIZE_METERS * 1000 / bench::MAP_SIZE_PIXELS;
+
+    for (int threads : { 1, RELOCALIZATION_THREADS }) {
+        Relocalizer relocalizer(bench::LD20_SCAN_SIZE, 360, bench::OFFSET_MM, DETECTION_MARGIN, threads);
+        auto t0 = bench::Clock::now();
+        relocalizer.SetMap(map, bench::MAP_SIZE_PIXELS, mm_per_pixel);
+        double prepare_us = bench::elapsedUs(t0);
+
+        std::mt19937 random(bench::SEED);
+        std::uniform_real_distribution<double> across(0, FLAT_WIDTH_MM), up(0, FLAT_DEPTH_MM), heading(-180, 180);
+        std::vector<double> us;
+        int found = 0, confident = 0, confident_wrong = 0, rotations = 0;
+        double nodes = 0, error_sum = 0, best_sum = 0, second_sum = 0;
+        for (int trial = 0; trial < TRIALS; ++trial) {
+            double x, y;
+            do {
+                x = across(random);
+                y = up(random);
+            } while (!open(x, y, 500));
+            double theta = heading(random);
+            std::vector<int> scan = flatScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                             y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta);
+            Position truth = toMap(x, y, theta);
+
+            t0 = bench::Clock::now();
+            Relocalizer::Result result = relocalizer.Localize(scan);
+            us.push_back(bench::elapsedUs(t0));
+            rotations = result.rotations;
+            nodes += result.nodes;
+
+            bool right = false;
+            if (!result.candidates.empty()) {
+                const Position& best = result.candidates[0].position;
+                double error = std::hypot(best.x_mm - truth.x_mm, best.y_mm - truth.y_mm);
+                double error_theta = std::fabs(std::remainder(best.theta_degrees - truth.theta_degrees, 360.0));
+                right = error < TOLERANCE_MM && error_theta < TOLERANCE_DEGREES;
+                if (right) error_sum += error;
+                best_sum += result.candidates[0].score;
+                if (result.candidates.size() > 1) second_sum += result.candidates[1].score;
+            }
+            found += right;
+            confident += result.confident;
+            confident_wrong += result.confident && !right;
+        }
+
+        char label[64];
+        std::snprintf(label, sizeof(label), "Localize, %d thread%s", threads, threads > 1 ? "s" : "");
+        bench::printLatency(label, us);
+        std::printf("%28s SetMap %.1f ms, %d rotation bins, %.0f windows scored per search\n", "",
+                    prepare_us / 1000, rotations, nodes / TRIALS);
+        std::printf("%28s best is the truth %d/%d (mean error %.1f mm), confident %d, confident and wrong %d\n", "",
+                    found, TRIALS, found ? error_sum / found : 0.0, confident, confident_wrong);
+        std::printf("%28s mean score best %.2f, second %.2f\n", "", best_sum / TRIALS, second_sum / TRIALS);
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+// RMHC score cache (RMHC_SLAM::enablescorecache) down a corridor and back with
+// noisy, slipping odometry, configured by bench::configureSlam. For no cache and for
+// lattices of a map pixel down to a quarter of one, reports the update time, the
+// kernel calls per search, the share of candidates scored from the cache and the
+// position error against the truth, which the lattice must not make worse.
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int RUNS = 5;
+
+static void run(const char* label, double xy_quantum_mm, double theta_quantum_degrees) {
+    LD20 laser(4, bench::OFFSET_MM);
+    std::vector<double> us;
+    double error_sum = 0, error_max = 0, final_sum = 0, evaluations = 0;
+    long long lookups = 0, hits = 0;
+    for (int r = 0; r < RUNS; ++r) {
+        std::vector<bench::Frame> frames = bench::driveCorridor(bench::SEED + r);
+        RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED + r);
+        bench::configureSlam(slam);
+        slam.enablescorecache(xy_quantum_mm, theta_quantum_degrees);
+
+        Position start;
+        for (size_t i = 0; i < frames.size(); ++i) {
+            auto t0 = bench::Clock::now();
+            slam.update(frames[i].scan.data(), frames[i].odometry);
+            us.push_back(bench::elapsedUs(t0));
+            evaluations += slam.last_evaluations;
+
+            Position p = slam.getpos();
+            if (i == 0) start = p;
+            double error = std::hypot((p.x_mm - start.x_mm) - (frames[i].x - frames[0].x),
+                                      (p.y_mm - start.y_mm) - (frames[i].y - frames[0].y));
+            error_sum += error;
+            error_max = std::max(error_max, error);
+            if (i + 1 == frames.size()) final_sum += error;
+        }
+        long long l = 0, h = 0;
+        slam.getcachestats(l, h);
+        lookups += l;
+        hits += h;
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s %.0f kernel calls per search, %.1f%% of candidates from the cache\n", "",
+                evaluations / us.size(), lookups ? 100.0 * hits / lookups : 0.0);
+    std::printf("%28s error mean %.1f mm, max %.1f mm, at the end %.1f mm\n", "", error_sum / us.size(), error_max,
+                final_sum / RUNS);
+}
+
+int main() {
+    const double pixel_mm = bench::MAP_SIZE_METERS * 1000 / bench::MAP_SIZE_PIXELS;
+    run("no cache", 0, 0);
+    run("1 pixel, 0.5 degree", pixel_mm, 0.5);
+    run("1/2 pixel, 0.25 degree", pixel_mm / 2, 0.25);
+    run("1/4 pixel, 0.125 degree", pixel_mm / 4, 0.125);
+    return 0;
+}
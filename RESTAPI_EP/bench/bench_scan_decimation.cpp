@@ -0,0 +1,94 @@
+// Matching scan decimation (CoreSLAM::max_distance_points). Runs the same synthetic
+// trajectory with the full-density matching scan and with several point budgets,
+// configured as in RESTAPI_EP.cpp, and reports the points kept, the per-frame
+// update time, the time per scan-to-map evaluation and the pose error against the
+// ground truth.
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/c/coreslam.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/CoreSlamT.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const int BUDGETS[] = {0, 300, 200, 120, 60};
+
+using Model = LD20Model<4, 45>;
+
+struct Truth {
+    double x, y, theta;
+};
+
+int main() {
+    // Drives along a loop in the room, turning slowly, one frame per lidar revolution
+    std::vector<Truth> truth;
+    std::vector<std::vector<int>> scans;
+    std::vector<PoseChange> moves;
+    double x = 4000, y = 3000, theta = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        double dxy = i ? 40 : 0, dtheta = i ? ((i / 50) % 2 ? 3 : -1.5) : 0;
+        x += dxy * std::cos(theta * M_PI / 180);
+        y += dxy * std::sin(theta * M_PI / 180);
+        theta += dtheta;
+        truth.push_back({x, y, theta});
+        scans.push_back(bench::roomScan(x, y, theta));
+        moves.push_back(PoseChange(dxy, dtheta, 1.0 / 6));
+    }
+
+    LD20 laser(4, 45);
+    for (int budget : BUDGETS) {
+        RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+        slam.map_quality = 5;
+        slam.hole_width_mm = 400;
+        slam.max_search_iter = 2000;
+        slam.sigma_xy_mm = 250;
+        slam.sigma_theta_degrees = 60;
+        slam.min_sigma_xy_mm = 10;
+        slam.min_sigma_theta_degrees = 1;
+        slam.enablelikelihoodfield(300);
+        slam.max_distance_points = budget;
+
+        std::vector<double> us;
+        double per_eval_us = 0, error_sum = 0, error_max = 0;
+        Position start;
+        for (int i = 0; i < FRAMES; ++i) {
+            auto t0 = bench::Clock::now();
+            slam.update(scans[i].data(), moves[i]);
+            us.push_back(bench::elapsedUs(t0));
+            per_eval_us += us.back() / std::max(slam.last_evaluations, 1);
+
+            // Laser displacement since the first frame, in both frames of reference
+            Position p = slam.getpos();
+            double lx = p.x_mm + Model::offset_mm * std::cos(p.theta_degrees * M_PI / 180);
+            double ly = p.y_mm + Model::offset_mm * std::sin(p.theta_degrees * M_PI / 180);
+            if (i == 0) start = Position(lx, ly, p.theta_degrees);
+            double ex = (lx - start.x_mm) - (truth[i].x - truth[0].x);
+            double ey = (ly - start.y_mm) - (truth[i].y - truth[0].y);
+            double error = std::hypot(ex, ey);
+            error_sum += error;
+            error_max = std::max(error_max, error);
+        }
+
+        // Points the matching scan keeps for a typical frame
+        scan_t scan;
+        scan_init(&scan, 1, Model::scan_size, Model::scan_rate_hz, Model::detection_angle_degrees,
+                  Model::distance_no_detection_mm, Model::detection_margin, Model::offset_mm);
+        scan_update(&scan, NULL, scans[FRAMES / 2].data(), Model::scan_size, 400, 0, 0);
+        int before = scan.obst_npoints;
+        scan_decimate(&scan, budget);
+        int after = scan.obst_npoints;
+        scan_free(&scan);
+
+        char label[64];
+        std::snprintf(label, sizeof label, "budget %d (%d of %d pts)", budget, after, before);
+        bench::printLatency(label, us);
+        std::printf("%28s per evaluation %.2f us, error mean %.1f mm max %.1f mm\n", "",
+                    per_eval_us / FRAMES, error_sum / FRAMES, error_max);
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+// Scans built ahead of matching (buildScanFrame, then update(ScanFrame &)), as
+// SLAMHandler's pipeline does, against update(scan_mm, poseChange), for RMHC_SLAM
+// driving around a room with odometry. Both must de-skew with the same velocities:
+// the pose of every frame and the final map must come out identical. Reports the
+// time scan construction takes off the SLAM thread.
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 300;
+static const double ROOM_MM = 8000;
+
+int main() {
+    LD20 laser(4, bench::OFFSET_MM);
+    RMHC_SLAM direct(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    RMHC_SLAM pipelined(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    bench::configureSlam(direct);
+    bench::configureSlam(pipelined);
+    ScanFrame frame(pipelined);
+
+    // A circle of 2 m radius around the middle of the room, 60 mm and 1.7 degrees
+    // per revolution, so every scan is de-skewed
+    const double radius = 2000, step = 60;
+    std::vector<double> direct_us, build_us, update_us;
+    int pose_mismatches = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        double angle = i * step / radius;
+        double theta = angle * 180 / M_PI + 90;
+        double x = ROOM_MM / 2 + radius * std::cos(angle), y = ROOM_MM / 2 + radius * std::sin(angle);
+        std::vector<int> scan = bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta, ROOM_MM);
+        PoseChange move(i ? step : 0, i ? step / radius * 180 / M_PI : 0, 1.0 / 6);
+
+        auto t0 = bench::Clock::now();
+        direct.update(scan.data(), move);
+        direct_us.push_back(bench::elapsedUs(t0));
+
+        t0 = bench::Clock::now();
+        pipelined.buildScanFrame(frame, scan.data(), move);
+        build_us.push_back(bench::elapsedUs(t0));
+        t0 = bench::Clock::now();
+        pipelined.update(frame);
+        update_us.push_back(bench::elapsedUs(t0));
+
+        Position a = direct.getpos(), b = pipelined.getpos();
+        pose_mismatches += a.x_mm != b.x_mm || a.y_mm != b.y_mm || a.theta_degrees != b.theta_degrees;
+    }
+
+    std::vector<unsigned char> a(static_cast<size_t>(bench::MAP_SIZE_PIXELS) * bench::MAP_SIZE_PIXELS), b(a.size());
+    direct.getmap(a.data());
+    pipelined.getmap(b.data());
+    bool same_map = std::memcmp(a.data(), b.data(), a.size()) == 0;
+
+    bench::printLatency("update(scan, poseChange)", direct_us);
+    bench::printLatency("buildScanFrame (acquisition)", build_us);
+    bench::printLatency("update(frame) (SLAM thread)", update_us);
+    std::printf("%d of %d poses differ; maps %s\n", pose_mismatches, FRAMES, same_map ? "identical" : "differ");
+    return pose_mismatches == 0 && same_map ? 0 : 1;
+}
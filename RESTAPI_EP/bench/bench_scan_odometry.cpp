@@ -0,0 +1,52 @@
+// Scan-to-scan ICP odometry (ScanOdometry) on consecutive synthetic revolutions,
+// started from a zero guess as on a robot without wheel encoders. Reports the time
+// per match and the error of the estimated motion against the true one, for slow
+// and fast driving.
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "ScanOdometry.h"
+
+static const int FRAMES = 300;
+
+static void run(const char* label, double step_mm, double turn_degrees) {
+    ScanOdometry odometry(bench::LD20_SCAN_SIZE, 360, bench::OFFSET_MM, 4);
+    std::vector<double> us;
+    double x = 4000, y = 3000, theta = 0;
+    double dxy_err = 0, dxy_max = 0, dtheta_err = 0, dtheta_max = 0;
+    int valid = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        double dxy = i ? step_mm : 0, dtheta = i ? ((i / 50) % 2 ? turn_degrees : -turn_degrees / 2) : 0;
+        // the robot turns about its centre; the scan is taken bench::OFFSET_MM ahead of it
+        x += dxy * std::cos(theta * M_PI / 180);
+        y += dxy * std::sin(theta * M_PI / 180);
+        theta += dtheta;
+        std::vector<int> scan = bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta);
+
+        auto t0 = bench::Clock::now();
+        ScanOdometry::Estimate e = odometry.match(scan, PoseChange());
+        us.push_back(bench::elapsedUs(t0));
+        if (!e.valid) continue;
+
+        ++valid;
+        double ex = std::fabs(e.poseChange.dxy_mm - dxy), et = std::fabs(e.poseChange.dtheta_degrees - dtheta);
+        dxy_err += ex;
+        dtheta_err += et;
+        dxy_max = std::max(dxy_max, ex);
+        dtheta_max = std::max(dtheta_max, et);
+    }
+    bench::printLatency(label, us);
+    std::printf("%28s %d/%d valid, dxy error mean %.2f max %.2f mm, dtheta error mean %.3f max %.3f deg\n", "",
+                valid, FRAMES - 1, dxy_err / std::max(valid, 1), dxy_max,
+                dtheta_err / std::max(valid, 1), dtheta_max);
+}
+
+int main() {
+    run("40 mm, 3 deg per frame", 40, 3);
+    run("150 mm, 10 deg per frame", 150, 10);
+    run("250 mm, 20 deg per frame", 250, 20);
+    return 0;
+}
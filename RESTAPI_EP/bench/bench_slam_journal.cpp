@@ -0,0 +1,124 @@
+// Write-ahead journal (SlamJournal) of RMHC_SLAM driving around a room, configured
+// by bench::configureSlam, with keyframe thresholds. Reports what journaling costs
+// the SLAM thread per keyframe and on disk, and the recovery after a "crash" at the
+// end: replaying the journal into a new RMHC_SLAM against the time RMHC took for the
+// same keyframes. The replayed pose must be the one SLAM ended with, and the map
+// within one grey level of its map: checkpoints keep only the high byte of each
+// 16-bit pixel, and the rest of it is lost once the journal is replayed over it.
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <filesystem>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "MapSnapshot.h"
+#include "SlamJournal.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 700;
+static const double ROOM_MM = 8000;
+static const char* DIRECTORY = "bench_slam_journal";
+
+static void configure(RMHC_SLAM& slam) {
+    bench::configureSlam(slam);
+    slam.keyframe_distance_mm = 50;
+    slam.keyframe_rotation_degrees = 3;
+    slam.keyframe_max_interval_seconds = 2;
+}
+
+int main() {
+    std::filesystem::remove_all(DIRECTORY);
+    std::filesystem::create_directories(DIRECTORY);
+    const double mm_per_pixel = bench::MAP_SIZE_METERS * 1000 / bench::MAP_SIZE_PIXELS;
+
+    LD20 laser(4, bench::OFFSET_MM);
+    RMHC_SLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    configure(slam);
+
+    // A circle of 2 m radius around the middle of the room, 60 mm per revolution
+    const double radius = 2000, step = 60;
+    std::vector<double> append_us, checkpoint_us;
+    double keyframe_ms = 0;
+    int keyframes = 0;
+    ScanFrame frame(slam);
+    {
+        SlamJournal journal(DIRECTORY, bench::LD20_SCAN_SIZE, mm_per_pixel);
+        for (int i = 0; i < FRAMES; ++i) {
+            double angle = i * step / radius;
+            double theta = angle * 180 / M_PI + 90;
+            double x = ROOM_MM / 2 + radius * std::cos(angle), y = ROOM_MM / 2 + radius * std::sin(angle);
+            std::vector<int> scan = bench::roomScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                    y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta, ROOM_MM);
+            PoseChange move(i ? step : 0, i ? step / radius * 180 / M_PI : 0, 1.0 / 6);
+            // Through a ScanFrame, as SLAMHandler does: its scans are de-skewed with this
+            // frame's pose change, which is the one journaled
+            auto t0 = bench::Clock::now();
+            slam.buildScanFrame(frame, scan.data(), move);
+            slam.update(frame);
+            double update_ms = bench::elapsedUs(t0) / 1000;
+            if (!slam.last_frame_keyframe) continue;
+            keyframe_ms += update_ms;
+            ++keyframes;
+
+            t0 = bench::Clock::now();
+            journal.Append(scan, move, slam.getkeyframepos(), slam.map_quality, slam.hole_width_mm);
+            append_us.push_back(bench::elapsedUs(t0));
+            if (journal.CheckpointDue()) {
+                // As SLAMHandler does, from the snapshot it publishes anyway
+                auto snapshot = MapSnapshot::capture(slam, bench::MAP_SIZE_PIXELS);
+                t0 = bench::Clock::now();
+                journal.Checkpoint(snapshot, slam.getpos());
+                checkpoint_us.push_back(bench::elapsedUs(t0));
+            }
+        }
+        // Leaving the scope waits for the writer, as stopping the server does
+    }
+
+    std::vector<unsigned char> expected(static_cast<size_t>(bench::MAP_SIZE_PIXELS) * bench::MAP_SIZE_PIXELS);
+    slam.getmap(expected.data());
+    Position pose = slam.getpos();
+
+    RMHC_SLAM recovered(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    configure(recovered);
+    SlamJournal::ReplayStats replay;
+    if (!SlamJournal::Replay(DIRECTORY, recovered, bench::MAP_SIZE_PIXELS, bench::LD20_SCAN_SIZE, replay)) {
+        std::printf("replay failed: %s\n", replay.error.c_str());
+        return 1;
+    }
+    std::vector<unsigned char> bytes(expected.size());
+    recovered.getmap(bytes.data());
+    Position p = recovered.getpos();
+    size_t different = 0;
+    int worst = 0;
+    for (size_t k = 0; k < bytes.size(); ++k) {
+        int difference = std::abs(bytes[k] - expected[k]);
+        different += difference > 0;
+        worst = std::max(worst, difference);
+    }
+    double pose_error = std::hypot(p.x_mm - pose.x_mm, p.y_mm - pose.y_mm) +
+                        std::fabs(std::remainder(p.theta_degrees - pose.theta_degrees, 360.0));
+    uintmax_t journal_bytes = std::filesystem::file_size(std::string(DIRECTORY) + "/journal.bin");
+    uintmax_t checkpoint_bytes = std::filesystem::file_size(std::string(DIRECTORY) + "/journal.map");
+    std::filesystem::remove_all(DIRECTORY);
+
+    bench::printLatency("Append (SLAM thread)", append_us);
+    bench::printLatency("Checkpoint (SLAM thread)", checkpoint_us);
+    std::printf("%d keyframes of %d frames, %zu checkpoints; %zu bytes per record\n", keyframes, FRAMES,
+                checkpoint_us.size(), sizeof(uint16_t) * bench::LD20_SCAN_SIZE + 80);
+    std::printf("on disk: journal.map %ju bytes, journal.bin %ju bytes\n", checkpoint_bytes, journal_bytes);
+    std::printf("recovery: checkpoint at %llu, %llu records replayed to %llu\n",
+                (unsigned long long)replay.checkpoint_sequence, (unsigned long long)replay.records,
+                (unsigned long long)replay.sequence);
+    std::printf("          load %.1f ms, replay %.1f ms (%.2f ms per keyframe; RMHC took %.2f ms per keyframe)\n",
+                replay.load_ms, replay.replay_ms, replay.records ? replay.replay_ms / replay.records : 0.0,
+                keyframe_ms / keyframes);
+    std::printf("replayed map: %zu pixels differ, by at most %d; pose off by %.6f\n", different, worst, pose_error);
+    return worst <= 1 && pose_error < 1e-6 && replay.sequence == static_cast<uint64_t>(keyframes) ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+// Reader latency for pose/scan queries while a SLAM thread updates continuously.
+// Compares the old pattern (one mutex held across slam->update) with the
+// seqlock / atomic shared_ptr publication used by SLAMHandler.
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "Seqlock.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+
+static const int RUN_SECONDS = 3;
+static const int READERS = 2;
+
+struct Result {
+    std::vector<double> pose_us;
+    std::vector<double> scan_us;
+    int updates = 0;
+};
+
+static RMHC_SLAM* makeSlam(LD20& laser) {
+    auto* slam = new RMHC_SLAM(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, 125);
+    slam->map_quality = 5;
+    slam->hole_width_mm = 400;
+    slam->max_search_iter = 2000;
+    slam->sigma_xy_mm = 250;
+    slam->sigma_theta_degrees = 60;
+    return slam;
+}
+
+template <typename Writer, typename Reader>
+static Result run(Writer writer, Reader reader) {
+    Result result;
+    std::atomic<bool> running{true};
+    std::vector<std::vector<double>> pose(READERS), scan(READERS);
+
+    std::thread slam_thread([&] {
+        for (int frame = 0; running; ++frame) {
+            writer(frame);
+            ++result.updates;
+        }
+    });
+    std::vector<std::thread> readers;
+    for (int r = 0; r < READERS; ++r) {
+        readers.emplace_back([&, r] {
+            while (running) {
+                reader(pose[r], scan[r]);
+                std::this_thread::sleep_for(std::chrono::microseconds(500));
+            }
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(RUN_SECONDS));
+    running = false;
+    slam_thread.join();
+    for (auto& t : readers) t.join();
+    for (int r = 0; r < READERS; ++r) {
+        result.pose_us.insert(result.pose_us.end(), pose[r].begin(), pose[r].end());
+        result.scan_us.insert(result.scan_us.end(), scan[r].begin(), scan[r].end());
+    }
+    return result;
+}
+
+static std::vector<int> frameScan(int frame) {
+    return bench::roomScan(4000 + 5.0 * (frame % 100), 4000, 0.5 * (frame % 60));
+}
+
+int main() {
+    LD20 laser(4, 45);
+
+    {
+        std::unique_ptr<RMHC_SLAM> slam(makeSlam(laser));
+        std::mutex data_mutex;
+        std::vector<int> latest;
+        auto result = run(
+            [&](int frame) {
+                auto scan = frameScan(frame);
+                std::lock_guard<std::mutex> lock(data_mutex);
+                latest = scan;
+                slam->update(scan.data());
+            },
+            [&](std::vector<double>& pose_us, std::vector<double>& scan_us) {
+                auto t0 = bench::Clock::now();
+                {
+                    std::lock_guard<std::mutex> lock(data_mutex);
+                    Position p = slam->getpos();
+                    (void)p;
+                }
+                pose_us.push_back(bench::elapsedUs(t0));
+                t0 = bench::Clock::now();
+                {
+                    std::lock_guard<std::mutex> lock(data_mutex);
+                    auto copy = latest;
+                    (void)copy;
+                }
+                scan_us.push_back(bench::elapsedUs(t0));
+            });
+        std::printf("mutex held across update (%d SLAM updates)\n", result.updates);
+        bench::printLatency("  GetPosition", result.pose_us);
+        bench::printLatency("  GetLatestData", result.scan_us);
+    }
+
+    {
+        std::unique_ptr<RMHC_SLAM> slam(makeSlam(laser));
+        Seqlock<Position> position(slam->getpos());
+        std::atomic<std::shared_ptr<const std::vector<int>>> latest{std::make_shared<const std::vector<int>>()};
+        auto result = run(
+            [&](int frame) {
+                auto scan = frameScan(frame);
+                latest.store(std::make_shared<const std::vector<int>>(scan));
+                slam->update(scan.data());
+                position.store(slam->getpos());
+            },
+            [&](std::vector<double>& pose_us, std::vector<double>& scan_us) {
+                auto t0 = bench::Clock::now();
+                Position p = position.load();
+                (void)p;
+                pose_us.push_back(bench::elapsedUs(t0));
+                t0 = bench::Clock::now();
+                auto s = latest.load();
+                (void)s;
+                scan_us.push_back(bench::elapsedUs(t0));
+            });
+        std::printf("seqlock pose / atomic scan (%d SLAM updates)\n", result.updates);
+        bench::printLatency("  GetPosition", result.pose_us);
+        bench::printLatency("  GetLatestData", result.scan_us);
+    }
+    return 0;
+}
@@ -0,0 +1,74 @@
+// Submap mode (SubmapSLAM) on a drive down a corridor longer than the submap, with
+// the submap configured as the map in RESTAPI_EP.cpp. Reports the update time early
+// and late in the drive, which should not grow with the explored area, the time of
+// the updates that froze and moved the submap, the size of the frozen submaps, the
+// cost of compositing the global map and the global position error.
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+#include "BenchCommon.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/Laser.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+
+static const int FRAMES = 900;
+
+static const double CORRIDOR_WIDTH_MM = 4000;
+
+int main() {
+    LD20 laser(4, bench::OFFSET_MM);
+    SubmapSLAM slam(laser, bench::MAP_SIZE_PIXELS, bench::MAP_SIZE_METERS, bench::SEED);
+    bench::configureSlam(slam);
+
+    // Down the middle of the corridor, 40 mm per revolution, weaving gently
+    std::vector<double> early, late, moves;
+    double x = 1500, y = CORRIDOR_WIDTH_MM / 2, theta = 0;
+    double error_sum = 0, error_max = 0;
+    Position start;
+    for (int i = 0; i < FRAMES; ++i) {
+        double dxy = i ? 40 : 0, dtheta = i ? (((i + 20) / 40) % 2 ? 0.25 : -0.25) : 0;
+        x += dxy * std::cos(theta * M_PI / 180);
+        y += dxy * std::sin(theta * M_PI / 180);
+        theta += dtheta;
+        std::vector<int> scan = bench::corridorScan(x + bench::OFFSET_MM * std::cos(theta * M_PI / 180),
+                                                    y + bench::OFFSET_MM * std::sin(theta * M_PI / 180), theta);
+
+        int before = slam.getsubmapcount();
+        PoseChange move(dxy, dtheta, 0);    // dt = 0: the synthetic scans need no de-skewing
+        auto t0 = bench::Clock::now();
+        slam.update(scan.data(), move);
+        double us = bench::elapsedUs(t0);
+        if (slam.getsubmapcount() != before) moves.push_back(us);
+        else if (i < FRAMES / 4) early.push_back(us);
+        else if (i >= FRAMES * 3 / 4) late.push_back(us);
+
+        Position p = slam.getglobalpos();
+        if (i == 0) start = p;
+        double error = std::hypot((p.x_mm - start.x_mm) - (x - 1500), (p.y_mm - start.y_mm) - (y - CORRIDOR_WIDTH_MM / 2));
+        error_sum += error;
+        error_max = std::max(error_max, error);
+    }
+
+    bench::printLatency("update, first quarter", early);
+    bench::printLatency("update, last quarter", late);
+    bench::printLatency("update moving the submap", moves);
+
+    size_t encoded = 0;
+    for (int k = 0; k < slam.getsubmapcount(); ++k) encoded += slam.getsubmap(k).encodedsize();
+    int gx, gy, gw, gh;
+    slam.getglobalmapbounds(gx, gy, gw, gh);
+    std::vector<unsigned char> global(static_cast<size_t>(gw) * gh);
+    std::vector<double> us;
+    for (int k = 0; k < 20; ++k) {
+        auto t0 = bench::Clock::now();
+        slam.getglobalmap(global.data());
+        us.push_back(bench::elapsedUs(t0));
+    }
+    bench::printLatency("getglobalmap", us);
+    std::printf("%d frozen submaps, %zu bytes encoded in all (%d bytes per raw submap), global map %d x %d px\n",
+                slam.getsubmapcount(), encoded, bench::MAP_SIZE_PIXELS * bench::MAP_SIZE_PIXELS, gw, gh);
+    std::printf("global position error mean %.1f mm, max %.1f mm\n", error_sum / FRAMES, error_max);
+    return 0;
+}
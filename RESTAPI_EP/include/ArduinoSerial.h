@@ -3,9 +3,15 @@
 #include <iostream>
 #include <string>
 #include <cmath>
+#include <functional>
+#include <sstream>
+#include <vector>
 
 class ArduinoSerial {
 public:
+    // Called with the left/right wheel speeds (mm/s) of every motor command sent.
+    using MotionListener = std::function<void(double left_mm_s, double right_mm_s)>;
+
     ArduinoSerial(const std::string& port, unsigned int baudrate)
         : io_(), serial_(io_), port_name_(port), baudrate_(baudrate),
           wheel_diameter_mm_(60.0), rpm_(100) // default: 65mm wheel, 60 obr/min
@@ -45,6 +51,7 @@ public:
             std::cerr << "[ArduinoSerial] send failed!" << std::endl;
             return false;
         }
+        notifyMotion(data);
         return true;
     }
 
@@ -102,6 +109,12 @@ public:
 
     void setWheelDiameter(double mm) { wheel_diameter_mm_ = mm; }
     void setRPM(double rpm) { rpm_ = rpm; }
+    void setMotionListener(MotionListener listener) { motionListener_ = std::move(listener); }
+
+    // Wheel surface speed for a motor command value; 50 runs the motor at rpm_.
+    double wheelSpeedMmPerSec(double command) const {
+        return command / FULL_SPEED_COMMAND * (rpm_ / 60.0) * M_PI * wheel_diameter_mm_;
+    }
 
     double calculateForwardTime(double distance_mm) const {
 
@@ -117,6 +130,29 @@ public:
     }
 
 private:
+    static constexpr double FULL_SPEED_COMMAND = 50.0;
+
+    // Motor commands are "m0;m1;m2;m3", motors 0 and 2 on the right side, 1 and 3 on the left.
+    void notifyMotion(const std::string& data) {
+        if (!motionListener_) return;
+
+        std::vector<double> motors;
+        std::stringstream ss(data);
+        std::string field;
+        while (std::getline(ss, field, ';')) {
+            try {
+                motors.push_back(std::stod(field));
+            } catch (const std::exception&) {
+                return;
+            }
+        }
+        if (motors.size() != 4) return;
+
+        double right = 0.5 * (motors[0] + motors[2]);
+        double left = 0.5 * (motors[1] + motors[3]);
+        motionListener_(wheelSpeedMmPerSec(left), wheelSpeedMmPerSec(right));
+    }
+
     boost::asio::io_service io_;
     boost::asio::serial_port serial_;
     std::string port_name_;
@@ -124,4 +160,5 @@ private:
 
     double wheel_diameter_mm_;
     double rpm_;
+    MotionListener motionListener_;
 };
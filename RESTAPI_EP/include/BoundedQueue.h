@@ -0,0 +1,73 @@
+#pragma once
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+// Fixed-capacity FIFO between pipeline threads. A push into a full queue evicts
+// the oldest item and hands it back, so producers never block on a slow consumer
+// and stale data is dropped instead of queued.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+    std::optional<T> push(T item) {
+        std::optional<T> evicted;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (items_.size() >= capacity_) {
+                evicted.emplace(std::move(items_.front()));
+                items_.pop_front();
+            }
+            items_.push_back(std::move(item));
+        }
+        cv_.notify_one();
+        return evicted;
+    }
+
+    std::optional<T> pop(std::chrono::milliseconds timeout) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!cv_.wait_for(lock, timeout, [this] { return !items_.empty() || closed_; }) || items_.empty()) {
+            return std::nullopt;
+        }
+        T item = std::move(items_.front());
+        items_.pop_front();
+        return item;
+    }
+
+    std::optional<T> tryPop() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (items_.empty()) return std::nullopt;
+        T item = std::move(items_.front());
+        items_.pop_front();
+        return item;
+    }
+
+    // Wakes up every waiting pop(); later pops still drain the remaining items.
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        cv_.notify_all();
+    }
+
+    void reopen() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        closed_ = false;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return items_.size();
+    }
+
+private:
+    const size_t capacity_;
+    bool closed_;
+    std::deque<T> items_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+};
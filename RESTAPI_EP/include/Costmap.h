@@ -0,0 +1,310 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include "MapSnapshot.h"
+
+// Planning costs of the 0.25 m nodes of PathFinder::updateObstycle, inflated around
+// obstacles for a robot of robot_radius_mm. Obstacle pixels of the map get an exact
+// Euclidean distance transform, and each node is costed by the distance from its
+// centre pixel to the nearest obstacle:
+//   LETHAL          the node is an obstacle (as updateObstycle classifies it)
+//   INSCRIBED       the robot centred on the node would touch an obstacle
+//   1..MAX_DECAY    falling linearly across decay_mm beyond that
+//   0               clear
+// Nodes updateObstycle calls unknown and that are not inscribed are NO_INFORMATION.
+//
+// Updates are incremental: a MapSnapshot shares the tiles that did not change with
+// the previous version, so only the tiles it re-read and those within the inflation
+// radius of them are transformed again, and only the nodes over those are recosted.
+// Each 8-connected region of those tiles is transformed in its own window. A scan
+// re-reads one rectangle of tiles, though, so there is normally one region: the
+// rectangle the scan reaches plus the inflation around it, which can be half the map
+// (bench_costmap reports how much).
+class Costmap {
+public:
+    static constexpr uint8_t NO_INFORMATION = 255;
+    static constexpr uint8_t LETHAL = 254;
+    static constexpr uint8_t INSCRIBED = 253;
+    static constexpr uint8_t MAX_DECAY = 252;
+
+    struct Stats {
+        uint64_t updates = 0;
+        uint64_t tiles_transformed = 0;     // summed over updates
+        uint64_t windows_transformed = 0;   // summed over updates
+        double last_update_ms = 0.0;
+    };
+
+    Costmap(int map_pixels, float map_meters, double robot_radius_mm, double decay_mm)
+        : map_pixels_(map_pixels),
+          mm_per_pixel_(map_meters * 1000.0 / map_pixels),
+          node_size_px_(std::max(1, static_cast<int>(std::round(0.25f * (map_pixels / map_meters))))),
+          nodes_per_side_((map_pixels + node_size_px_ - 1) / node_size_px_),
+          inscribed_px_(robot_radius_mm / mm_per_pixel_),
+          decay_px_(decay_mm / mm_per_pixel_),
+          reach_px_(static_cast<int>(std::ceil(inscribed_px_ + decay_px_))),
+          distance_(static_cast<size_t>(map_pixels) * map_pixels, 0.0f),
+          costs_(static_cast<size_t>(nodes_per_side_) * nodes_per_side_, NO_INFORMATION)
+    {
+    }
+
+    // Brings the costs up to date with map. Returns whether any were recomputed.
+    bool Update(const std::shared_ptr<const MapSnapshot>& map) {
+        auto start = std::chrono::steady_clock::now();
+        if (!map || static_cast<int>(map->size()) != map_pixels_) return false;
+        if (map == map_) return false;
+
+        // Tiles re-read since the map we have, then every tile within reach of one
+        int tiles = map->tilesPerSide();
+        std::vector<uint8_t> changed(tiles * tiles, 0);
+        bool any = false;
+        for (int ty = 0; ty < tiles; ++ty) {
+            for (int tx = 0; tx < tiles; ++tx) {
+                if (!map_ || &map_->tile(tx, ty) != &map->tile(tx, ty)) {
+                    changed[ty * tiles + tx] = 1;
+                    any = true;
+                }
+            }
+        }
+        map_ = map;
+        if (!any) return false;
+
+        int spread = (reach_px_ + MapSnapshot::TILE_SIZE - 1) / MapSnapshot::TILE_SIZE;
+        std::vector<uint8_t> dirty(tiles * tiles, 0);
+        for (int ty = 0; ty < tiles; ++ty) {
+            for (int tx = 0; tx < tiles; ++tx) {
+                if (!changed[ty * tiles + tx]) continue;
+                for (int y = std::max(ty - spread, 0); y <= std::min(ty + spread, tiles - 1); ++y) {
+                    for (int x = std::max(tx - spread, 0); x <= std::min(tx + spread, tiles - 1); ++x) {
+                        dirty[y * tiles + x] = 1;
+                    }
+                }
+            }
+        }
+
+        // A window around each 8-connected region of dirty tiles, merged where windows
+        // overlap so no pixel is transformed twice
+        std::vector<uint8_t> seen(tiles * tiles, 0);
+        std::vector<int> stack;
+        std::vector<std::array<int, 4>> windows;   // tx0, ty0, tx1, ty1
+        for (int i = 0; i < tiles * tiles; ++i) {
+            if (!dirty[i] || seen[i]) continue;
+            std::array<int, 4> box = { tiles, tiles, -1, -1 };
+            seen[i] = 1;
+            stack.push_back(i);
+            while (!stack.empty()) {
+                int t = stack.back();
+                stack.pop_back();
+                int tx = t % tiles, ty = t / tiles;
+                box = { std::min(box[0], tx), std::min(box[1], ty), std::max(box[2], tx), std::max(box[3], ty) };
+                for (int y = std::max(ty - 1, 0); y <= std::min(ty + 1, tiles - 1); ++y) {
+                    for (int x = std::max(tx - 1, 0); x <= std::min(tx + 1, tiles - 1); ++x) {
+                        int n = y * tiles + x;
+                        if (dirty[n] && !seen[n]) {
+                            seen[n] = 1;
+                            stack.push_back(n);
+                        }
+                    }
+                }
+            }
+            windows.push_back(box);
+        }
+        for (bool merged = true; merged;) {
+            merged = false;
+            for (size_t i = 0; i < windows.size() && !merged; ++i) {
+                for (size_t j = i + 1; j < windows.size() && !merged; ++j) {
+                    std::array<int, 4>& a = windows[i];
+                    const std::array<int, 4>& b = windows[j];
+                    if (a[0] > b[2] || b[0] > a[2] || a[1] > b[3] || b[1] > a[3]) continue;
+                    a = { std::min(a[0], b[0]), std::min(a[1], b[1]), std::max(a[2], b[2]), std::max(a[3], b[3]) };
+                    windows.erase(windows.begin() + j);
+                    merged = true;
+                }
+            }
+        }
+        for (const std::array<int, 4>& w : windows) {
+            TransformRegion(*map, w[0] << MapSnapshot::TILE_SHIFT, w[1] << MapSnapshot::TILE_SHIFT,
+                            std::min((w[2] + 1) << MapSnapshot::TILE_SHIFT, map_pixels_),
+                            std::min((w[3] + 1) << MapSnapshot::TILE_SHIFT, map_pixels_));
+            stats_.tiles_transformed += (w[2] - w[0] + 1) * (w[3] - w[1] + 1);
+            ++stats_.windows_transformed;
+        }
+
+        // Nodes over a dirty tile
+        for (int ny = 0; ny < nodes_per_side_; ++ny) {
+            int ty0 = (ny * node_size_px_) >> MapSnapshot::TILE_SHIFT;
+            int ty1 = (std::min((ny + 1) * node_size_px_, map_pixels_) - 1) >> MapSnapshot::TILE_SHIFT;
+            for (int nx = 0; nx < nodes_per_side_; ++nx) {
+                int tx0 = (nx * node_size_px_) >> MapSnapshot::TILE_SHIFT;
+                int tx1 = (std::min((nx + 1) * node_size_px_, map_pixels_) - 1) >> MapSnapshot::TILE_SHIFT;
+                if (dirty[ty0 * tiles + tx0] || dirty[ty0 * tiles + tx1] || dirty[ty1 * tiles + tx0] ||
+                    dirty[ty1 * tiles + tx1]) {
+                    costs_[ny * nodes_per_side_ + nx] = NodeCost(*map, nx, ny);
+                }
+            }
+        }
+
+        ++stats_.updates;
+        stats_.last_update_ms =
+            std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+    int NodesPerSide() const { return nodes_per_side_; }
+
+    // Node costs, row by row: node (x, y) at y * NodesPerSide() + x
+    const std::vector<uint8_t>& Costs() const { return costs_; }
+
+    // As updateObstycle makes it (0 free, 1 occupied, 2 unknown), with the inscribed
+    // nodes occupied too, for the planners' passability
+    std::vector<std::vector<uint8_t>> NodeGrid() const {
+        std::vector<std::vector<uint8_t>> grid(nodes_per_side_, std::vector<uint8_t>(nodes_per_side_, 0));
+        for (int y = 0; y < nodes_per_side_; ++y) {
+            for (int x = 0; x < nodes_per_side_; ++x) {
+                uint8_t cost = costs_[y * nodes_per_side_ + x];
+                grid[y][x] = cost == NO_INFORMATION ? 2 : cost >= INSCRIBED ? 1 : 0;
+            }
+        }
+        return grid;
+    }
+
+    // Distance in millimetres from pixel (x, y) to the nearest obstacle pixel, up to
+    // the reach of the inflation
+    double DistanceMm(int x, int y) const { return distance_[y * map_pixels_ + x] * mm_per_pixel_; }
+
+    Stats GetStats() const { return stats_; }
+
+private:
+    // Pixels darker than this are obstacles; updateObstycle's nodes are occupied below
+    // an average of OCCUPIED_AVERAGE and unknown up to FREE_AVERAGE
+    static constexpr int OBSTACLE_BELOW = 64;
+    static constexpr double OCCUPIED_AVERAGE = 25.0;
+    static constexpr double FREE_AVERAGE = 200.0;
+
+    int map_pixels_;
+    double mm_per_pixel_;
+    int node_size_px_;
+    int nodes_per_side_;
+    double inscribed_px_;
+    double decay_px_;
+    int reach_px_;                      // obstacles further than this cost nothing
+
+    std::shared_ptr<const MapSnapshot> map_;
+    std::vector<float> distance_;       // pixels to the nearest obstacle pixel, at most reach_px_ + 1
+    std::vector<uint8_t> costs_;
+    Stats stats_;
+
+    // Scratch for the distance transform
+    std::vector<float> window_, line_, lineOut_, z_;
+    std::vector<int> v_;
+
+    // Exact distances for the pixels [px0, px1) x [py0, py1): a Euclidean distance
+    // transform of them and the reach_px_ around them, which holds every obstacle that
+    // matters to them. Down the columns, the distance to the nearest obstacle in the
+    // column is counted in two sweeps over the rows; along the rows, the squares of those
+    // are combined exactly as Felzenszwalb and Huttenlocher do.
+    void TransformRegion(const MapSnapshot& map, int px0, int py0, int px1, int py1) {
+        const float CAP = static_cast<float>(reach_px_ + 1);
+        const float FAR = CAP * CAP;
+        int x0 = std::max(px0 - reach_px_, 0), y0 = std::max(py0 - reach_px_, 0);
+        int x1 = std::min(px1 + reach_px_, map_pixels_), y1 = std::min(py1 + reach_px_, map_pixels_);
+        int w = x1 - x0, h = y1 - y0;
+        if (w <= 0 || h <= 0) return;
+
+        window_.resize(static_cast<size_t>(w) * h);
+        for (int y = 0; y < h; ++y) {
+            int py = y0 + y, row = (py & (MapSnapshot::TILE_SIZE - 1)) * MapSnapshot::TILE_SIZE;
+            float* out = &window_[y * w];
+            const float* above = y > 0 ? out - w : nullptr;
+            for (int x = x0; x < x1;) {
+                int tx = x >> MapSnapshot::TILE_SHIFT;
+                int end = std::min((tx + 1) << MapSnapshot::TILE_SHIFT, x1);
+                const unsigned char* pixels = map.tile(tx, py >> MapSnapshot::TILE_SHIFT).data() + row;
+                for (; x < end; ++x) {
+                    float up = above ? std::min(above[x - x0] + 1.0f, CAP) : CAP;
+                    out[x - x0] = pixels[x & (MapSnapshot::TILE_SIZE - 1)] < OBSTACLE_BELOW ? 0.0f : up;
+                }
+            }
+        }
+        for (int y = h - 2; y >= 0; --y) {
+            float* out = &window_[y * w];
+            const float* below = out + w;
+            for (int x = 0; x < w; ++x) out[x] = std::min(out[x], below[x] + 1.0f);
+        }
+
+        line_.resize(w);
+        lineOut_.resize(w);
+        z_.resize(w + 1);
+        v_.resize(w);
+        for (int y = py0 - y0; y < py1 - y0; ++y) {
+            const float* in = &window_[y * w];
+            float* out = &distance_[(y0 + y) * map_pixels_];
+            for (int x = 0; x < w; ++x) line_[x] = in[x] * in[x];
+            if (Transform1D(w, FAR)) {
+                for (int x = px0; x < px1; ++x) out[x] = std::sqrt(lineOut_[x - x0]);
+            } else {
+                std::fill(out + px0, out + px1, CAP);
+            }
+        }
+    }
+
+    // Lower envelope of the parabolas rooted at line_[0..n): lineOut_[q] = min over p
+    // of line_[p] + (q - p)^2, or far where that is far. Parabolas rooted at far never
+    // bring a pixel under far, so they are left out; returns false if all of them are.
+    bool Transform1D(int n, float far) {
+        const float INF = std::numeric_limits<float>::infinity();
+        int k = -1;
+        for (int q = 0; q < n; ++q) {
+            if (line_[q] >= far) continue;
+            if (k < 0) {
+                k = 0;
+                v_[0] = q;
+                z_[0] = -INF;
+                z_[1] = INF;
+                continue;
+            }
+            float s = ((line_[q] + q * q) - (line_[v_[k]] + v_[k] * v_[k])) / (2.0f * (q - v_[k]));
+            while (s <= z_[k]) {
+                --k;
+                s = ((line_[q] + q * q) - (line_[v_[k]] + v_[k] * v_[k])) / (2.0f * (q - v_[k]));
+            }
+            ++k;
+            v_[k] = q;
+            z_[k] = s;
+            z_[k + 1] = INF;
+        }
+        if (k < 0) return false;
+        k = 0;
+        for (int q = 0; q < n; ++q) {
+            while (z_[k + 1] < q) ++k;
+            int p = v_[k];
+            lineOut_[q] = std::min((q - p) * (q - p) + line_[p], far);
+        }
+        return true;
+    }
+
+    uint8_t NodeCost(const MapSnapshot& map, int nx, int ny) const {
+        int x_start = nx * node_size_px_, x_end = std::min((nx + 1) * node_size_px_, map_pixels_);
+        int y_start = ny * node_size_px_, y_end = std::min((ny + 1) * node_size_px_, map_pixels_);
+        int sum = 0, count = 0;
+        for (int y = y_start; y < y_end; ++y) {
+            for (int x = x_start; x < x_end; ++x) {
+                sum += map.at(x, y);
+                ++count;
+            }
+        }
+        double average = count > 0 ? static_cast<double>(sum) / count : 255.0;
+
+        double d = distance_[((y_start + y_end) / 2) * map_pixels_ + (x_start + x_end) / 2];
+        if (average < OCCUPIED_AVERAGE || d == 0.0) return LETHAL;
+        if (d <= inscribed_px_) return INSCRIBED;
+        if (average <= FREE_AVERAGE) return NO_INFORMATION;
+        if (d >= inscribed_px_ + decay_px_) return 0;
+        return static_cast<uint8_t>(std::max(1.0, std::ceil(MAX_DECAY * (1.0 - (d - inscribed_px_) / decay_px_))));
+    }
+};
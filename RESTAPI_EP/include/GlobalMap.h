@@ -0,0 +1,105 @@
+#pragma once
+#include <algorithm>
+#include <memory>
+#include <vector>
+#include "breezySLAM/c/coreslam.h"
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "MapSnapshot.h"
+
+// Immutable view of a SubmapSLAM map: the frozen submaps, shared between versions
+// and only copied out of SLAM when one is added, plus a snapshot of the current
+// submap and where it lies. Coordinates are global pixels, those of the first
+// submap. The global map is composited only when asked for.
+class GlobalMap {
+public:
+    using Frozen = std::vector<std::shared_ptr<const FrozenSubmap>>;
+
+    // View of slam with local as its current submap; shares the frozen submaps of
+    // previous, if given, when slam has not frozen any since.
+    static std::shared_ptr<const GlobalMap> capture(SubmapSLAM& slam, std::shared_ptr<const MapSnapshot> local,
+                                                    const GlobalMap* previous = nullptr) {
+        auto view = std::shared_ptr<GlobalMap>(new GlobalMap());
+        int count = slam.getsubmapcount();
+        if (previous && static_cast<int>(previous->frozen_->size()) == count) {
+            view->frozen_ = previous->frozen_;
+        } else {
+            auto frozen = std::make_shared<Frozen>();
+            if (previous) *frozen = *previous->frozen_;
+            for (int k = static_cast<int>(frozen->size()); k < count; ++k) {
+                frozen->push_back(std::make_shared<const FrozenSubmap>(slam.getsubmap(k)));
+            }
+            view->frozen_ = std::move(frozen);
+        }
+        slam.getsubmaporigin(view->origin_x_, view->origin_y_);
+        view->local_ = std::move(local);
+        return view;
+    }
+
+    int submapCount() const { return static_cast<int>(frozen_->size()); }
+    int originX() const { return origin_x_; }
+    int originY() const { return origin_y_; }
+    const MapSnapshot& local() const { return *local_; }
+
+    size_t encodedBytes() const {
+        size_t bytes = 0;
+        for (const auto& submap : *frozen_) bytes += submap->encodedsize();
+        return bytes;
+    }
+
+    // Rectangle covered by the frozen submaps and the current one.
+    void bounds(int& x, int& y, int& width, int& height) const {
+        int size = static_cast<int>(local_->size());
+        int xmin = origin_x_, ymin = origin_y_, xmax = xmin + size, ymax = ymin + size;
+        for (const auto& submap : *frozen_) {
+            if (submap->width_pixels == 0) continue;
+            int sx = submap->origin_x_pixels + submap->crop_x_pixels;
+            int sy = submap->origin_y_pixels + submap->crop_y_pixels;
+            xmin = std::min(xmin, sx);
+            ymin = std::min(ymin, sy);
+            xmax = std::max(xmax, sx + submap->width_pixels);
+            ymax = std::max(ymax, sy + submap->height_pixels);
+        }
+        x = xmin;
+        y = ymin;
+        width = xmax - xmin;
+        height = ymax - ymin;
+    }
+
+    // Frozen submaps oldest first, then the current one, over bounds(); pixels a
+    // submap has not seen leave the ones below them showing.
+    std::vector<unsigned char> composite() const {
+        int x0, y0, width, height;
+        bounds(x0, y0, width, height);
+        std::vector<unsigned char> out(static_cast<size_t>(width) * height, MAP_UNKNOWN_BYTE);
+        std::vector<unsigned char> block;
+        for (const auto& submap : *frozen_) {
+            block.resize(static_cast<size_t>(submap->width_pixels) * submap->height_pixels);
+            submap->decode(block.data(), submap->width_pixels);
+            Blend(out, width, submap->origin_x_pixels + submap->crop_x_pixels - x0,
+                  submap->origin_y_pixels + submap->crop_y_pixels - y0, block, submap->width_pixels);
+        }
+        int size = static_cast<int>(local_->size());
+        Blend(out, width, origin_x_ - x0, origin_y_ - y0, local_->bytes(), size);
+        return out;
+    }
+
+private:
+    GlobalMap() = default;
+
+    static void Blend(std::vector<unsigned char>& out, int stride, int x, int y,
+                      const std::vector<unsigned char>& block, int width) {
+        int height = width ? static_cast<int>(block.size()) / width : 0;
+        for (int j = 0; j < height; ++j) {
+            const unsigned char* src = block.data() + static_cast<size_t>(j) * width;
+            unsigned char* dst = out.data() + static_cast<size_t>(y + j) * stride + x;
+            for (int i = 0; i < width; ++i) {
+                if (src[i] != MAP_UNKNOWN_BYTE) dst[i] = src[i];
+            }
+        }
+    }
+
+    std::shared_ptr<const Frozen> frozen_;
+    int origin_x_ = 0;
+    int origin_y_ = 0;
+    std::shared_ptr<const MapSnapshot> local_;
+};
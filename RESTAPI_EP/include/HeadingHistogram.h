@@ -0,0 +1,149 @@
+#pragma once
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+// Rotation between consecutive lidar revolutions from their surface orientation
+// histograms: every point votes for the direction of its surface normal, weighted by
+// the length of surface it stands for, into 360 one-degree bins. Turning the robot
+// shifts the histogram, translating it does not, so the shift that best correlates
+// two histograms is the turn. Rays are laid out as in breezySLAM, like ScanOdometry.
+//
+// Rooms repeat every 90 degrees, so only turns up to MAX_TURN_DEGREES are searched;
+// at 6 Hz that is 270 degrees per second.
+class HeadingHistogram {
+public:
+    struct Estimate {
+        bool valid = false;
+        double dtheta_degrees = 0.0;
+        double sigma_degrees = 0.0;
+        double peak_ratio = 0.0;        // best correlation over the best one away from it
+    };
+
+    HeadingHistogram(int scan_size, double detection_angle_degrees, int detection_margin = 0)
+        : first_ray_(detection_margin + 1), end_ray_(scan_size - detection_margin)
+    {
+        for (int i = 0; i < scan_size; ++i) {
+            double angle = (-detection_angle_degrees / 2 + i * detection_angle_degrees / (scan_size - 1)) * M_PI / 180.0;
+            ray_cos_.push_back(std::cos(angle));
+            ray_sin_.push_back(std::sin(angle));
+        }
+    }
+
+    // Turn from the previous call's scan to this one (one distance per ray, 0 = no
+    // return). Invalid on the first call and when no shift clearly wins.
+    Estimate match(const std::vector<int>& distances) {
+        Histogram current = Build(distances);
+        Estimate estimate;
+        if (has_previous_) {
+            estimate = Correlate(current);
+        }
+        // the previous histogram is kept twice over so every shift reads 360 contiguous bins
+        std::copy(current.begin(), current.end(), previous_.begin());
+        std::copy(current.begin(), current.end(), previous_.begin() + BINS);
+        has_previous_ = true;
+        return estimate;
+    }
+
+    void reset() {
+        has_previous_ = false;
+    }
+
+private:
+    static constexpr int BINS = 360;
+    static constexpr int MAX_TURN_DEGREES = 45;
+    // Shifts this close to the best are the same peak
+    static constexpr int PEAK_WIDTH = 5;
+    static constexpr double MIN_PEAK_RATIO = 1.15;
+    static constexpr double MIN_RANGE_MM = 150.0;
+    static constexpr double MAX_RANGE_MM = 10000.0;
+    // Neighbours along the scan farther apart than this are on different surfaces
+    static constexpr double NORMAL_GAP_MM = 200.0;
+    static constexpr double SIGMA_DEGREES = 1.5;
+
+    using Histogram = std::array<float, BINS>;
+
+    Histogram Build(const std::vector<int>& distances) {
+        points_x_.clear();
+        points_y_.clear();
+        int end = std::min<int>(end_ray_, static_cast<int>(distances.size()));
+        for (int i = first_ray_; i < end; ++i) {
+            double d = distances[i];
+            if (d < MIN_RANGE_MM || d > MAX_RANGE_MM) continue;
+            points_x_.push_back(d * ray_cos_[i]);
+            points_y_.push_back(d * ray_sin_[i]);
+        }
+
+        Histogram h{};
+        size_t n = points_x_.size();
+        for (size_t i = 1; i + 1 < n; ++i) {
+            double tx = points_x_[i + 1] - points_x_[i - 1];
+            double ty = points_y_[i + 1] - points_y_[i - 1];
+            double length = std::hypot(tx, ty);
+            if (length == 0.0 || length > 2 * NORMAL_GAP_MM) continue;
+
+            // normal facing the sensor, so opposite sides of a pillar vote apart
+            double nx = -ty, ny = tx;
+            if (nx * points_x_[i] + ny * points_y_[i] > 0) {
+                nx = -nx;
+                ny = -ny;
+            }
+            double angle = std::atan2(ny, nx) * 180.0 / M_PI;
+            if (angle < 0) angle += BINS;
+
+            // split the vote between the two nearest bins
+            int bin = static_cast<int>(angle);
+            double frac = angle - bin;
+            h[bin % BINS] += static_cast<float>(0.5 * length * (1.0 - frac));
+            h[(bin + 1) % BINS] += static_cast<float>(0.5 * length * frac);
+        }
+        return h;
+    }
+
+    Estimate Correlate(const Histogram& current) const {
+        // score[s] = sum_k current[k] * previous[k + s]: surfaces seen at k now were at
+        // k + s before, i.e. the robot turned by s
+        constexpr int SHIFTS = 2 * MAX_TURN_DEGREES + 1;
+        std::array<float, SHIFTS> score;
+        for (int s = -MAX_TURN_DEGREES; s <= MAX_TURN_DEGREES; ++s) {
+            const float* prev = previous_.data() + (s + BINS) % BINS;
+            float sum = 0.0f;
+            for (int k = 0; k < BINS; ++k) {
+                sum += current[k] * prev[k];
+            }
+            score[s + MAX_TURN_DEGREES] = sum;
+        }
+
+        int best = static_cast<int>(std::max_element(score.begin(), score.end()) - score.begin());
+        float runner_up = 0.0f;
+        for (int i = 0; i < SHIFTS; ++i) {
+            if (std::abs(i - best) > PEAK_WIDTH) runner_up = std::max(runner_up, score[i]);
+        }
+
+        Estimate estimate;
+        estimate.peak_ratio = runner_up > 0.0f ? score[best] / runner_up : (score[best] > 0.0f ? INFINITY : 0.0);
+        if (score[best] <= 0.0f || estimate.peak_ratio < MIN_PEAK_RATIO) return estimate;
+
+        // parabola through the peak and its neighbours for the fraction of a degree
+        double offset = 0.0;
+        if (best > 0 && best < SHIFTS - 1) {
+            double a = score[best - 1], b = score[best], c = score[best + 1];
+            double denom = a - 2 * b + c;
+            if (denom < 0.0) offset = 0.5 * (a - c) / denom;
+        }
+        estimate.valid = true;
+        estimate.dtheta_degrees = best - MAX_TURN_DEGREES + offset;
+        estimate.sigma_degrees = SIGMA_DEGREES;
+        return estimate;
+    }
+
+    const int first_ray_;
+    const int end_ray_;
+    std::vector<double> ray_cos_;
+    std::vector<double> ray_sin_;
+    std::vector<double> points_x_;
+    std::vector<double> points_y_;
+    std::array<float, 2 * BINS> previous_{};
+    bool has_previous_ = false;
+};
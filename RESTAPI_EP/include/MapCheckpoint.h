@@ -0,0 +1,401 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "breezySLAM/cpp/Position.hpp"
+#include "BoundedQueue.h"
+#include "MapSnapshot.h"
+
+// Versioned binary map file, so a restart can pick up the map where it was left.
+//
+//   header       fixed 96 bytes, little-endian (Header below)
+//   tile table   tiles + 1 offsets of the tile payloads, u32, relative to its end
+//   tiles        row by row, MapSnapshot::TILE_SIZE square (cut at the map edge),
+//                each one kind byte and then:
+//                  UNIFORM  one value for the whole tile
+//                  RUNS     (count 1..255, value) pairs
+//                  RAW      the bytes row by row
+//
+// Unknown and free areas are mostly uniform tiles, so a 15 m map is a few tens of
+// KB. Saving encodes an immutable MapSnapshot on a writer thread, so SLAM never
+// waits for it, and replaces the file atomically: a crash leaves the previous file.
+class MapCheckpoint {
+public:
+    static constexpr uint32_t VERSION = 1;
+
+    // A loaded map, ready for SinglePositionSLAM::restore.
+    struct Map {
+        unsigned int size_pixels = 0;
+        double mm_per_pixel = 0.0;
+        int origin_x_pixels = 0;        // global position of a SubmapSLAM submap
+        int origin_y_pixels = 0;
+        Position position;
+        uint64_t map_version = 0;
+        uint64_t journal_sequence = 0;  // last SlamJournal record in the map
+        size_t file_bytes = 0;
+        std::vector<unsigned char> bytes;
+    };
+
+    struct SaveStatus {
+        bool done = false;              // false until the first save has finished
+        bool ok = false;
+        std::string path;
+        std::string error;
+        size_t file_bytes = 0;
+        uint64_t map_version = 0;
+        double encode_ms = 0.0;
+        double write_ms = 0.0;
+    };
+
+    MapCheckpoint() : requests_(1), running_(true), writer_(&MapCheckpoint::RunWriter, this) {}
+
+    ~MapCheckpoint() {
+        running_ = false;
+        requests_.close();
+        if (writer_.joinable()) writer_.join();
+    }
+
+    MapCheckpoint(const MapCheckpoint&) = delete;
+    MapCheckpoint& operator=(const MapCheckpoint&) = delete;
+
+    // Queues map to be written to path on the writer thread; a newer request
+    // replaces one that has not started yet.
+    void SaveAsync(const std::string& path, std::shared_ptr<const MapSnapshot> map, const Position& position,
+                   double mm_per_pixel, int origin_x_pixels = 0, int origin_y_pixels = 0) {
+        requests_.push(SaveRequest{ path, std::move(map), position, mm_per_pixel, origin_x_pixels, origin_y_pixels });
+    }
+
+    SaveStatus LastSave() const {
+        std::lock_guard<std::mutex> lock(statusMutex_);
+        return lastSave_;
+    }
+
+    // FNV-1a, which is all a torn or corrupted write needs; pass the hash of the
+    // previous part to continue it.
+    static uint64_t Checksum(const unsigned char* data, size_t length, uint64_t hash = 14695981039346656037ull) {
+        for (size_t i = 0; i < length; ++i) {
+            hash = (hash ^ data[i]) * 1099511628211ull;
+        }
+        return hash;
+    }
+
+    // Encodes map into the file format.
+    static std::vector<unsigned char> Encode(const MapSnapshot& map, const Position& position, double mm_per_pixel,
+                                             int origin_x_pixels = 0, int origin_y_pixels = 0,
+                                             uint64_t journal_sequence = 0) {
+        const int tiles = map.tilesPerSide() * map.tilesPerSide();
+        const size_t table_bytes = (tiles + 1) * sizeof(uint32_t);
+        std::vector<unsigned char> out(sizeof(Header) + table_bytes);
+        std::vector<uint32_t> table(tiles + 1);
+
+        for (int ty = 0, k = 0; ty < map.tilesPerSide(); ++ty) {
+            for (int tx = 0; tx < map.tilesPerSide(); ++tx, ++k) {
+                table[k] = static_cast<uint32_t>(out.size() - sizeof(Header) - table_bytes);
+                EncodeTile(map, tx, ty, out);
+            }
+        }
+        table[tiles] = static_cast<uint32_t>(out.size() - sizeof(Header) - table_bytes);
+        std::memcpy(out.data() + sizeof(Header), table.data(), table_bytes);
+
+        Header header{};
+        std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.header_bytes = sizeof(Header);
+        header.size_pixels = map.size();
+        header.tile_size = MapSnapshot::TILE_SIZE;
+        header.mm_per_pixel = mm_per_pixel;
+        header.origin_x_pixels = origin_x_pixels;
+        header.origin_y_pixels = origin_y_pixels;
+        header.x_mm = position.x_mm;
+        header.y_mm = position.y_mm;
+        header.theta_degrees = position.theta_degrees;
+        header.map_version = map.version();
+        header.journal_sequence = journal_sequence;
+        header.payload_bytes = out.size() - sizeof(Header);
+        header.checksum = Checksum(out.data() + sizeof(Header), header.payload_bytes);
+        std::memcpy(out.data(), &header, sizeof(Header));
+        return out;
+    }
+
+    // Writes data to path through a temporary file renamed over it, so readers
+    // and a crash see either the old file or the whole new one.
+    static bool WriteAtomically(const std::string& path, const std::vector<unsigned char>& data, std::string& error) {
+        const std::string temporary = path + ".tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) return Fail(error, "cannot create " + temporary);
+        size_t written = 0;
+        while (written < data.size()) {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                ::close(fd);
+                ::unlink(temporary.c_str());
+                return Fail(error, "cannot write " + temporary);
+            }
+            written += static_cast<size_t>(n);
+        }
+        if (::fsync(fd) != 0 || ::close(fd) != 0) {
+            ::unlink(temporary.c_str());
+            return Fail(error, "cannot flush " + temporary);
+        }
+        if (::rename(temporary.c_str(), path.c_str()) != 0) {
+            ::unlink(temporary.c_str());
+            return Fail(error, "cannot rename " + temporary);
+        }
+        // Make the rename itself durable
+        size_t slash = path.find_last_of('/');
+        std::string directory = (slash == std::string::npos) ? "." : path.substr(0, slash + 1);
+        int dirfd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (dirfd >= 0) {
+            ::fsync(dirfd);
+            ::close(dirfd);
+        }
+        return true;
+    }
+
+    // Maps the file at path and decodes it into map. Returns false, with the
+    // reason in error, for a missing, truncated, corrupt or foreign file.
+    static bool Load(const std::string& path, Map& map, std::string& error) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return Fail(error, "cannot open " + path);
+        struct stat info;
+        if (::fstat(fd, &info) != 0 || static_cast<size_t>(info.st_size) < sizeof(Header)) {
+            ::close(fd);
+            return Fail(error, "not a map file: " + path);
+        }
+        size_t length = static_cast<size_t>(info.st_size);
+        void* mapped = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (mapped == MAP_FAILED) return Fail(error, "cannot map " + path);
+        ::madvise(mapped, length, MADV_SEQUENTIAL);
+        bool ok = Decode(static_cast<const unsigned char*>(mapped), length, map, error);
+        ::munmap(mapped, length);
+        return ok;
+    }
+
+    // Decodes a whole file already in memory.
+    static bool Decode(const unsigned char* data, size_t length, Map& map, std::string& error) {
+        if (length < sizeof(Header)) return Fail(error, "not a map file");
+        Header header;
+        std::memcpy(&header, data, sizeof(Header));
+        if (std::memcmp(header.magic, MAGIC, sizeof(header.magic)) != 0) return Fail(error, "not a map file");
+        if (header.version != VERSION) return Fail(error, "unsupported map file version " + std::to_string(header.version));
+        if (header.header_bytes != sizeof(Header) || header.tile_size != MapSnapshot::TILE_SIZE ||
+            header.size_pixels == 0 || header.size_pixels > MAX_SIZE_PIXELS ||
+            header.payload_bytes != length - sizeof(Header)) {
+            return Fail(error, "corrupt map file header");
+        }
+        const unsigned char* payload = data + sizeof(Header);
+        if (Checksum(payload, header.payload_bytes) != header.checksum) return Fail(error, "map file checksum mismatch");
+
+        const unsigned int size = header.size_pixels;
+        const int tiles_per_side = (size + MapSnapshot::TILE_SIZE - 1) >> MapSnapshot::TILE_SHIFT;
+        const size_t tiles = static_cast<size_t>(tiles_per_side) * tiles_per_side;
+        const size_t table_bytes = (tiles + 1) * sizeof(uint32_t);
+        if (table_bytes > header.payload_bytes) return Fail(error, "corrupt map file tile table");
+        std::vector<uint32_t> table(tiles + 1);
+        std::memcpy(table.data(), payload, table_bytes);
+        const unsigned char* body = payload + table_bytes;
+        const size_t body_bytes = header.payload_bytes - table_bytes;
+
+        map.size_pixels = size;
+        map.mm_per_pixel = header.mm_per_pixel;
+        map.origin_x_pixels = header.origin_x_pixels;
+        map.origin_y_pixels = header.origin_y_pixels;
+        map.position = Position(header.x_mm, header.y_mm, header.theta_degrees);
+        map.map_version = header.map_version;
+        map.journal_sequence = header.journal_sequence;
+        map.file_bytes = length;
+        map.bytes.resize(static_cast<size_t>(size) * size);
+        for (int ty = 0, k = 0; ty < tiles_per_side; ++ty) {
+            for (int tx = 0; tx < tiles_per_side; ++tx, ++k) {
+                if (table[k] > table[k + 1] || table[k + 1] > body_bytes ||
+                    !DecodeTile(body + table[k], table[k + 1] - table[k], tx, ty, size, map.bytes.data())) {
+                    return Fail(error, "corrupt map tile " + std::to_string(k));
+                }
+            }
+        }
+        return true;
+    }
+
+private:
+    static_assert(std::endian::native == std::endian::little, "map files are little-endian");
+
+    static constexpr char MAGIC[8] = { 'B', 'R', 'Z', 'Y', 'M', 'A', 'P', '\0' };
+    static constexpr unsigned int MAX_SIZE_PIXELS = 1 << 15;
+
+    enum TileKind : unsigned char { UNIFORM = 0, RUNS = 1, RAW = 2 };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t header_bytes;
+        uint32_t size_pixels;
+        uint32_t tile_size;
+        double mm_per_pixel;
+        int32_t origin_x_pixels;
+        int32_t origin_y_pixels;
+        double x_mm;
+        double y_mm;
+        double theta_degrees;
+        uint64_t map_version;
+        uint64_t payload_bytes;         // tile table and tiles
+        uint64_t checksum;              // FNV-1a of the payload
+        uint64_t journal_sequence;
+    };
+    static_assert(sizeof(Header) == 96, "the map file header is 96 bytes");
+
+    struct SaveRequest {
+        std::string path;
+        std::shared_ptr<const MapSnapshot> map;
+        Position position;
+        double mm_per_pixel;
+        int origin_x_pixels;
+        int origin_y_pixels;
+    };
+
+    using Clock = std::chrono::steady_clock;
+
+    static bool Fail(std::string& error, const std::string& reason) {
+        error = reason;
+        return false;
+    }
+
+    static void TileExtent(int tx, int ty, unsigned int size, int& x0, int& y0, int& width, int& height) {
+        x0 = tx << MapSnapshot::TILE_SHIFT;
+        y0 = ty << MapSnapshot::TILE_SHIFT;
+        width = std::min<int>(MapSnapshot::TILE_SIZE, size - x0);
+        height = std::min<int>(MapSnapshot::TILE_SIZE, size - y0);
+    }
+
+    // Appends the smallest of the three encodings of tile (tx, ty).
+    static void EncodeTile(const MapSnapshot& map, int tx, int ty, std::vector<unsigned char>& out) {
+        int x0, y0, width, height;
+        TileExtent(tx, ty, map.size(), x0, y0, width, height);
+        const MapSnapshot::Tile& tile = map.tile(tx, ty);
+
+        size_t start = out.size();
+        out.push_back(RUNS);
+        unsigned char value = tile[0];
+        int count = 0;
+        bool uniform = true;
+        for (int y = 0; y < height; ++y) {
+            const unsigned char* row = tile.data() + y * MapSnapshot::TILE_SIZE;
+            for (int x = 0; x < width; ++x) {
+                if (row[x] == value && count < 255) {
+                    ++count;
+                    continue;
+                }
+                uniform &= row[x] == value;
+                out.push_back(static_cast<unsigned char>(count));
+                out.push_back(value);
+                value = row[x];
+                count = 1;
+            }
+        }
+        out.push_back(static_cast<unsigned char>(count));
+        out.push_back(value);
+
+        const size_t raw_bytes = static_cast<size_t>(width) * height;
+        if (uniform) {
+            out.resize(start);
+            out.push_back(UNIFORM);
+            out.push_back(value);
+        } else if (out.size() - start - 1 >= raw_bytes) {
+            out.resize(start);
+            out.push_back(RAW);
+            for (int y = 0; y < height; ++y) {
+                const unsigned char* row = tile.data() + y * MapSnapshot::TILE_SIZE;
+                out.insert(out.end(), row, row + width);
+            }
+        }
+    }
+
+    static bool DecodeTile(const unsigned char* in, size_t length, int tx, int ty, unsigned int size, unsigned char* map) {
+        int x0, y0, width, height;
+        TileExtent(tx, ty, size, x0, y0, width, height);
+        if (length < 1) return false;
+        unsigned char* origin = map + static_cast<size_t>(y0) * size + x0;
+        switch (in[0]) {
+        case UNIFORM:
+            if (length != 2) return false;
+            for (int y = 0; y < height; ++y) std::memset(origin + static_cast<size_t>(y) * size, in[1], width);
+            return true;
+        case RAW:
+            if (length != 1 + static_cast<size_t>(width) * height) return false;
+            for (int y = 0; y < height; ++y) std::memcpy(origin + static_cast<size_t>(y) * size, in + 1 + y * width, width);
+            return true;
+        case RUNS:
+        {
+            if (length % 2 != 1) return false;
+            int x = 0, y = 0;
+            for (size_t i = 1; i < length; i += 2) {
+                int count = in[i];
+                const unsigned char value = in[i + 1];
+                while (count > 0) {
+                    if (y >= height) return false;
+                    int n = std::min(count, width - x);
+                    std::memset(origin + static_cast<size_t>(y) * size + x, value, n);
+                    count -= n;
+                    x += n;
+                    if (x == width) {
+                        x = 0;
+                        ++y;
+                    }
+                }
+            }
+            return y == height;
+        }
+        default:
+            return false;
+        }
+    }
+
+    void RunWriter() {
+        // A save queued before shutdown is still written
+        for (;;) {
+            auto request = requests_.pop(std::chrono::milliseconds(WRITER_WAIT_MS));
+            if (!request) {
+                if (!running_) break;
+                continue;
+            }
+
+            SaveStatus status;
+            status.done = true;
+            status.path = request->path;
+            status.map_version = request->map->version();
+            auto start = Clock::now();
+            std::vector<unsigned char> data = Encode(*request->map, request->position, request->mm_per_pixel,
+                                                     request->origin_x_pixels, request->origin_y_pixels);
+            auto encoded = Clock::now();
+            status.ok = WriteAtomically(request->path, data, status.error);
+            status.file_bytes = data.size();
+            status.encode_ms = std::chrono::duration<double, std::milli>(encoded - start).count();
+            status.write_ms = std::chrono::duration<double, std::milli>(Clock::now() - encoded).count();
+
+            std::lock_guard<std::mutex> lock(statusMutex_);
+            lastSave_ = status;
+        }
+    }
+
+    static constexpr int WRITER_WAIT_MS = 200;
+
+    BoundedQueue<SaveRequest> requests_;
+    std::atomic<bool> running_;
+    mutable std::mutex statusMutex_;
+    SaveStatus lastSave_;
+    std::thread writer_;
+};
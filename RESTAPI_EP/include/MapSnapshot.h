@@ -0,0 +1,101 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include "breezySLAM/cpp/algorithms.hpp"
+
+// Immutable 8-bit copy of the SLAM map. The map is split into square tiles held
+// by shared_ptr, so a new version only re-reads the tiles touched by the last
+// update and shares the rest with the previous version.
+class MapSnapshot {
+public:
+    static constexpr int TILE_SHIFT = 6;
+    static constexpr int TILE_SIZE = 1 << TILE_SHIFT;
+    using Tile = std::vector<unsigned char>;
+
+    // Reads the whole map of slam into a first snapshot.
+    static std::shared_ptr<const MapSnapshot> capture(CoreSLAM& slam, unsigned int size_pixels) {
+        auto snapshot = std::shared_ptr<MapSnapshot>(new MapSnapshot(size_pixels));
+        for (int ty = 0; ty < snapshot->tiles_per_side_; ++ty) {
+            for (int tx = 0; tx < snapshot->tiles_per_side_; ++tx) {
+                snapshot->loadTile(slam, tx, ty);
+            }
+        }
+        return snapshot;
+    }
+
+    // Builds the next version, re-reading only the tiles that intersect the
+    // changed rectangle (inclusive pixel bounds, as reported by getmapchanges).
+    std::shared_ptr<const MapSnapshot> next(CoreSLAM& slam, int xmin, int ymin, int xmax, int ymax) const {
+        auto snapshot = std::shared_ptr<MapSnapshot>(new MapSnapshot(*this));
+        snapshot->version_ = version_ + 1;
+        int tx_end = std::min(xmax >> TILE_SHIFT, tiles_per_side_ - 1);
+        int ty_end = std::min(ymax >> TILE_SHIFT, tiles_per_side_ - 1);
+        for (int ty = std::max(ymin, 0) >> TILE_SHIFT; ty <= ty_end; ++ty) {
+            for (int tx = std::max(xmin, 0) >> TILE_SHIFT; tx <= tx_end; ++tx) {
+                snapshot->loadTile(slam, tx, ty);
+            }
+        }
+        return snapshot;
+    }
+
+    unsigned int size() const { return size_; }
+    uint64_t version() const { return version_; }
+
+    int tilesPerSide() const { return tiles_per_side_; }
+
+    // Tile (tx, ty), TILE_SIZE rows of TILE_SIZE bytes; the part past the map edge is zero.
+    const Tile& tile(int tx, int ty) const { return *tiles_[ty * tiles_per_side_ + tx]; }
+
+    unsigned char at(unsigned int x, unsigned int y) const {
+        const Tile& tile = *tiles_[(y >> TILE_SHIFT) * tiles_per_side_ + (x >> TILE_SHIFT)];
+        return tile[(y & (TILE_SIZE - 1)) * TILE_SIZE + (x & (TILE_SIZE - 1))];
+    }
+
+    // Copies the map row by row into dst, which must hold size() * size() bytes.
+    void copyTo(unsigned char* dst) const {
+        for (unsigned int y = 0; y < size_; ++y) {
+            const int ty = y >> TILE_SHIFT;
+            const int row = (y & (TILE_SIZE - 1)) * TILE_SIZE;
+            for (int tx = 0; tx < tiles_per_side_; ++tx) {
+                const int x0 = tx << TILE_SHIFT;
+                const int width = std::min<int>(TILE_SIZE, size_ - x0);
+                std::memcpy(dst + y * size_ + x0, tiles_[ty * tiles_per_side_ + tx]->data() + row, width);
+            }
+        }
+    }
+
+    std::vector<unsigned char> bytes() const {
+        std::vector<unsigned char> out(static_cast<size_t>(size_) * size_);
+        copyTo(out.data());
+        return out;
+    }
+
+private:
+    explicit MapSnapshot(unsigned int size_pixels)
+        : size_(size_pixels),
+          tiles_per_side_((size_pixels + TILE_SIZE - 1) >> TILE_SHIFT),
+          version_(0),
+          tiles_(static_cast<size_t>(tiles_per_side_) * tiles_per_side_)
+    {
+    }
+
+    MapSnapshot(const MapSnapshot&) = default;
+
+    void loadTile(CoreSLAM& slam, int tx, int ty) {
+        const int x0 = tx << TILE_SHIFT;
+        const int y0 = ty << TILE_SHIFT;
+        const int width = std::min<int>(TILE_SIZE, size_ - x0);
+        const int height = std::min<int>(TILE_SIZE, size_ - y0);
+        auto tile = std::make_shared<Tile>(TILE_SIZE * TILE_SIZE, 0);
+        slam.getmapregion(tile->data(), x0, y0, width, height, TILE_SIZE);
+        tiles_[ty * tiles_per_side_ + tx] = std::move(tile);
+    }
+
+    unsigned int size_;
+    int tiles_per_side_;
+    uint64_t version_;
+    std::vector<std::shared_ptr<const Tile>> tiles_;
+};
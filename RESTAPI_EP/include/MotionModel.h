@@ -0,0 +1,129 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include "breezySLAM/cpp/PoseChange.hpp"
+
+// Dead-reckoning prior for SLAM. Integrates the wheel speeds implied by the motor
+// commands we send (and wheel odometry, when a robot has it) between two lidar
+// frames into a PoseChange plus a rough 1-sigma uncertainty, so RMHC can start
+// near the right pose and search a window sized to how much we trust it.
+class MotionModel {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Increment {
+        PoseChange poseChange;
+        double sigma_xy_mm;
+        double sigma_theta_degrees;
+    };
+
+    // track_width_mm: distance between left and right wheels (robot_width_mm in RobotHandler)
+    explicit MotionModel(double track_width_mm = 225.0)
+        : track_width_mm_(track_width_mm), last_(Clock::now())
+    {
+        reset();
+    }
+
+    // Commanded wheel surface speeds, effective from now until the next command.
+    void setWheelSpeeds(double left_mm_s, double right_mm_s) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(Clock::now());
+        if (left_mm_s != left_mm_s_ || right_mm_s != right_mm_s_) {
+            // motors take a moment to reach (or leave) the commanded speed
+            sigma_xy_ += TRANSIENT_XY_MM;
+            sigma_theta_ += TRANSIENT_THETA_DEG;
+        }
+        left_mm_s_ = left_mm_s;
+        right_mm_s_ = right_mm_s;
+    }
+
+    // Measured motion (e.g. from WheeledRobot::computePoseChange) replaces the
+    // commanded motion for the current interval and is trusted more.
+    void addOdometry(const PoseChange& measured) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(Clock::now());
+        if (!has_odometry_) {
+            dxy_mm_ = 0.0;
+            dtheta_deg_ = 0.0;
+            sigma_xy_ = 0.0;
+            sigma_theta_ = 0.0;
+            has_odometry_ = true;
+        }
+        dxy_mm_ += measured.dxy_mm;
+        dtheta_deg_ += measured.dtheta_degrees;
+        sigma_xy_ += ODOMETRY_XY_PER_MM * std::fabs(measured.dxy_mm);
+        sigma_theta_ += ODOMETRY_THETA_PER_DEG * std::fabs(measured.dtheta_degrees);
+    }
+
+    // Whether the wheels are commanded to turn or motion is waiting to be taken.
+    bool moving() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return left_mm_s_ != 0.0 || right_mm_s_ != 0.0 || dxy_mm_ != 0.0 || dtheta_deg_ != 0.0;
+    }
+
+    // Motion accumulated since the previous call, ending at `now`.
+    Increment take(Clock::time_point now = Clock::now()) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        advance(now);
+        double dt = std::chrono::duration<double>(now - taken_).count();
+        Increment inc{
+            PoseChange(dxy_mm_, dtheta_deg_, dt),
+            sigma_xy_ + BASE_SIGMA_XY_MM,
+            sigma_theta_ + BASE_SIGMA_THETA_DEG
+        };
+        taken_ = now;
+        reset();
+        return inc;
+    }
+
+private:
+    // Noise model, in sigma per unit of motion, summed linearly since the errors are
+    // mostly systematic (speed calibration, slip). Commanded motion slips and lags a lot
+    // (skid steering, no speed control); measured wheel odometry much less.
+    static constexpr double COMMAND_XY_PER_MM = 0.25;
+    static constexpr double COMMAND_THETA_PER_DEG = 0.3;
+    static constexpr double COMMAND_XY_PER_DEG = 1.0;
+    static constexpr double ODOMETRY_XY_PER_MM = 0.05;
+    static constexpr double ODOMETRY_THETA_PER_DEG = 0.1;
+    static constexpr double TRANSIENT_XY_MM = 20.0;
+    static constexpr double TRANSIENT_THETA_DEG = 3.0;
+    // SLAM pose error that remains even when standing still
+    static constexpr double BASE_SIGMA_XY_MM = 20.0;
+    static constexpr double BASE_SIGMA_THETA_DEG = 2.0;
+
+    void reset() {
+        dxy_mm_ = 0.0;
+        dtheta_deg_ = 0.0;
+        sigma_xy_ = 0.0;
+        sigma_theta_ = 0.0;
+        has_odometry_ = false;
+    }
+
+    // Integrates the current commanded speeds up to `now`.
+    void advance(Clock::time_point now) {
+        double dt = std::chrono::duration<double>(now - last_).count();
+        last_ = std::max(last_, now);
+        if (dt <= 0.0 || has_odometry_) return;
+
+        double ddist = 0.5 * (left_mm_s_ + right_mm_s_) * dt;
+        double dtheta = (right_mm_s_ - left_mm_s_) / track_width_mm_ * dt * 180.0 / M_PI;
+        dxy_mm_ += ddist;
+        dtheta_deg_ += dtheta;
+        sigma_xy_ += COMMAND_XY_PER_MM * std::fabs(ddist) + COMMAND_XY_PER_DEG * std::fabs(dtheta);
+        sigma_theta_ += COMMAND_THETA_PER_DEG * std::fabs(dtheta);
+    }
+
+    const double track_width_mm_;
+    std::mutex mutex_;
+    Clock::time_point last_;
+    Clock::time_point taken_ = Clock::now();
+    double left_mm_s_ = 0.0;
+    double right_mm_s_ = 0.0;
+    double dxy_mm_;
+    double dtheta_deg_;
+    double sigma_xy_;
+    double sigma_theta_;
+    bool has_odometry_;
+};
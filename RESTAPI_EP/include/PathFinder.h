@@ -1,22 +1,17 @@
 #pragma once
 #include <vector>
-#include <queue>
+#include <algorithm>
 #include <limits>
 #include <cmath>
 #include <cstdint>
-#include <unordered_map>
-#include <tuple>
-#include <functional>
-#include <set>
-
-struct pair_hash {
-    std::size_t operator()(const std::pair<int, int>& p) const {
-        return (std::hash<int>()(p.first) << 1) ^ std::hash<int>()(p.second);
-    }
-};
+#include <utility>
 
 class PathFinder {
 public:
+    // Node costs up to this (Costmap::MAX_DECAY) are the decay band around obstacles;
+    // the ones above it mark nodes the grid already classifies
+    static constexpr uint8_t MAX_DECAY_COST = 252;
+
     static std::vector<std::vector<uint8_t>> ConvertMapToGrid(const unsigned char* map_data, int width, int height, uint8_t threshold = 250) {
         std::vector<std::vector<uint8_t>> grid(height, std::vector<uint8_t>(width, 0));
         for (int y = 0; y < height; ++y) {
@@ -80,143 +75,615 @@ public:
         return dstar.run();
     }
 
+    // Whether the straight line between the centres of nodes a and b crosses only
+    // passable nodes. Where it passes exactly through a corner, both nodes beside the
+    // corner must be passable, as for a diagonal step. Given node costs (as
+    // Costmap::Costs() gives them), the nodes between a and b must also cost no more
+    // than max_cost.
+    static bool LineOfSight(const std::vector<std::vector<uint8_t>>& grid, std::pair<int, int> a, std::pair<int, int> b,
+                            const uint8_t* costs = nullptr, int max_cost = 255) {
+        int width = grid[0].size();
+        auto blocked = [&](int x, int y) {
+            if (grid[y][x] == 1) return true;
+            if (!costs || (x == a.first && y == a.second) || (x == b.first && y == b.second)) return false;
+            uint8_t cost = costs[y * width + x];
+            return cost <= MAX_DECAY_COST && cost > max_cost;
+        };
+        int x = a.first, y = a.second;
+        int dx = std::abs(b.first - x), dy = std::abs(b.second - y);
+        int sx = b.first > x ? 1 : -1, sy = b.second > y ? 1 : -1;
+        int error = dx - dy;
+        dx *= 2;
+        dy *= 2;
+        for (int n = dx / 2 + dy / 2; ; --n) {
+            if (blocked(x, y)) return false;
+            if (n <= 0) return true;
+            if (error > 0) {
+                x += sx;
+                error -= dy;
+            } else if (error < 0) {
+                y += sy;
+                error += dx;
+            } else {
+                if (blocked(x + sx, y) || blocked(x, y + sy)) return false;
+                x += sx;
+                y += sy;
+                error += dx - dy;
+                --n;
+            }
+        }
+    }
+
+    // Drops the nodes of path that the robot can drive straight past: each vertex
+    // kept is the furthest node in line of sight of the one before it. Given node
+    // costs, a shortcut may not cross a node costlier than the nodes it drops, so it
+    // keeps the path as far from obstacles as the planner did.
+    static std::vector<std::pair<int, int>> SmoothPath(const std::vector<std::vector<uint8_t>>& grid,
+                                                       const std::vector<std::pair<int, int>>& path,
+                                                       const uint8_t* costs = nullptr) {
+        if (path.size() <= 2) return path;
+        int width = grid[0].size();
+        auto decay = [&](const std::pair<int, int>& n) {
+            uint8_t cost = costs ? costs[n.second * width + n.first] : 0;
+            return cost <= MAX_DECAY_COST ? int(cost) : 0;
+        };
+        std::vector<std::pair<int, int>> vertices = {path[0]};
+        size_t anchor = 0;
+        int dropped = decay(path[1]);
+        for (size_t i = 2; i < path.size(); ++i) {
+            if (!LineOfSight(grid, path[anchor], path[i], costs, dropped)) {
+                anchor = i - 1;
+                vertices.push_back(path[anchor]);
+                dropped = decay(path[i]);
+            } else {
+                dropped = std::max(dropped, decay(path[i]));
+            }
+        }
+        vertices.push_back(path.back());
+        return vertices;
+    }
+
+    // Jump point search: A* on the 8-connected grid (diagonals cutting no corner, as in
+    // DStarLite) that expands only the nodes where an optimal path may turn, jumping
+    // straight and diagonally over the rest. Exact for grids of one cost per step, as
+    // updateObstycle makes, and keeps no state between queries. Returns every node from
+    // start to goal, as FindPathDStarLite does, or nothing.
+    static std::vector<std::pair<int, int>> FindPathJPS(
+        const std::vector<std::vector<uint8_t>>& grid,
+        std::pair<int, int> start,
+        std::pair<int, int> goal,
+        long long* expansions = nullptr
+    ) {
+        if (grid.empty() || grid[0].empty()) return {};
+        int h = grid.size(), w = grid[0].size();
+        if (start.first < 0 || start.second < 0 || start.first >= w || start.second >= h) return {};
+        if (goal.first < 0 || goal.second < 0 || goal.first >= w || goal.second >= h) return {};
+        if (grid[start.second][start.first] == 1 || grid[goal.second][goal.first] == 1) return {};
+
+        const float INF = std::numeric_limits<float>::infinity();
+        const float DIAGONAL = 1.41421356f;
+        auto passable = [&](int x, int y) { return x >= 0 && y >= 0 && x < w && y < h && grid[y][x] != 1; };
+        auto octile = [&](int a, int b) {
+            int dx = std::abs(a % w - b % w), dy = std::abs(a / w - b / w);
+            return std::max(dx, dy) + (DIAGONAL - 1.0f) * std::min(dx, dy);
+        };
+        int s0 = start.second * w + start.first, target = goal.second * w + goal.first;
+
+        // From (x, y) on in direction (dx, dy): the first node where a path may turn
+        // (the goal, a node with a forced neighbour, or a diagonal node from which a
+        // straight jump finds one), or -1 where it runs into an obstacle
+        auto jump = [&](int x, int y, int dx, int dy) {
+            while (true) {
+                if (!passable(x, y)) return -1;
+                int u = y * w + x;
+                if (u == target) return u;
+                if (dx != 0 && dy != 0) {
+                    for (int straight = 0; straight < 2; ++straight) {
+                        int sx = straight ? 0 : dx, sy = straight ? dy : 0;
+                        for (int jx = x + sx, jy = y + sy; passable(jx, jy); jx += sx, jy += sy) {
+                            if (jy * w + jx == target) return u;
+                            if (sx != 0 && ((passable(jx, jy - 1) && !passable(jx - sx, jy - 1)) ||
+                                            (passable(jx, jy + 1) && !passable(jx - sx, jy + 1)))) return u;
+                            if (sy != 0 && ((passable(jx - 1, jy) && !passable(jx - 1, jy - sy)) ||
+                                            (passable(jx + 1, jy) && !passable(jx + 1, jy - sy)))) return u;
+                        }
+                    }
+                    if (!passable(x + dx, y) || !passable(x, y + dy)) return -1;
+                } else if (dx != 0) {
+                    if ((passable(x, y - 1) && !passable(x - dx, y - 1)) ||
+                        (passable(x, y + 1) && !passable(x - dx, y + 1))) return u;
+                } else {
+                    if ((passable(x - 1, y) && !passable(x - 1, y - dy)) ||
+                        (passable(x + 1, y) && !passable(x + 1, y - dy))) return u;
+                }
+                x += dx;
+                y += dy;
+            }
+        };
+
+        std::vector<float> g(w * h, INF);
+        std::vector<int> parent(w * h, -1);
+        std::vector<uint8_t> closed(w * h, 0);
+        IndexedHeap open(w * h);
+        g[s0] = 0.0f;
+        parent[s0] = s0;
+        open.push(s0, {octile(s0, target), 0.0f});
+        long long expanded = 0;
+
+        while (!open.empty()) {
+            int s = open.top();
+            open.remove(s);
+            closed[s] = 1;
+            ++expanded;
+            if (s == target) break;
+
+            // Directions worth jumping in, pruned by the direction we came from
+            int x = s % w, y = s / w;
+            int dirs[8][2];
+            int count = 0;
+            auto add = [&](int dx, int dy) {
+                dirs[count][0] = dx;
+                dirs[count][1] = dy;
+                ++count;
+            };
+            if (parent[s] == s) {
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        if (dx == 0 && dy == 0) continue;
+                        if (dx != 0 && dy != 0 && (!passable(x + dx, y) || !passable(x, y + dy))) continue;
+                        add(dx, dy);
+                    }
+                }
+            } else {
+                int dx = (x > parent[s] % w) - (x < parent[s] % w);
+                int dy = (y > parent[s] / w) - (y < parent[s] / w);
+                if (dx != 0 && dy != 0) {
+                    add(0, dy);
+                    add(dx, 0);
+                    if (passable(x, y + dy) && passable(x + dx, y)) add(dx, dy);
+                } else if (dx != 0) {
+                    if (passable(x + dx, y)) {
+                        add(dx, 0);
+                        if (passable(x, y + 1)) add(dx, 1);
+                        if (passable(x, y - 1)) add(dx, -1);
+                    }
+                    add(0, 1);
+                    add(0, -1);
+                } else {
+                    if (passable(x, y + dy)) {
+                        add(0, dy);
+                        if (passable(x + 1, y)) add(1, dy);
+                        if (passable(x - 1, y)) add(-1, dy);
+                    }
+                    add(1, 0);
+                    add(-1, 0);
+                }
+            }
+
+            for (int i = 0; i < count; ++i) {
+                int n = jump(x + dirs[i][0], y + dirs[i][1], dirs[i][0], dirs[i][1]);
+                if (n < 0 || closed[n]) continue;
+                float through = g[s] + octile(s, n);
+                if (through < g[n]) {
+                    g[n] = through;
+                    parent[n] = s;
+                    open.push(n, {through + octile(n, target), -through});
+                }
+            }
+        }
+        if (expansions) *expansions += expanded;
+        if (!closed[target]) return {};
+
+        // Jump points back to start, filled in with the straight and diagonal runs between them
+        std::vector<std::pair<int, int>> path;
+        for (int u = target; u != s0; u = parent[u]) {
+            int p = parent[u];
+            int dx = (p % w > u % w) - (p % w < u % w), dy = (p / w > u / w) - (p / w < u / w);
+            for (int x = u % w, y = u / w; y * w + x != p; x += dx, y += dy) path.emplace_back(x, y);
+        }
+        path.push_back(start);
+        std::reverse(path.begin(), path.end());
+        return path;
+    }
+
+    // Any-angle A* (Theta*) on the 8-connected grid: a node's parent may be any node
+    // in line of sight, so the path is a list of vertices joined by straight lines.
+    // Lazy Theta* assumes line of sight when a node is reached and checks it only
+    // when the node is expanded, which needs far fewer checks. Returns the vertices
+    // from start to goal, or nothing.
+    static std::vector<std::pair<int, int>> FindPathThetaStar(
+        const std::vector<std::vector<uint8_t>>& grid,
+        std::pair<int, int> start,
+        std::pair<int, int> goal,
+        bool lazy = true,
+        long long* expansions = nullptr
+    ) {
+        if (grid.empty() || grid[0].empty()) return {};
+        int h = grid.size(), w = grid[0].size();
+        if (start.first < 0 || start.second < 0 || start.first >= w || start.second >= h) return {};
+        if (goal.first < 0 || goal.second < 0 || goal.first >= w || goal.second >= h) return {};
+        if (grid[start.second][start.first] == 1 || grid[goal.second][goal.first] == 1) return {};
+
+        const float INF = std::numeric_limits<float>::infinity();
+        auto node = [w](int u) { return std::make_pair(u % w, u / w); };
+        auto distance = [w](int a, int b) {
+            return std::hypot(static_cast<float>(a % w - b % w), static_cast<float>(a / w - b / w));
+        };
+        auto passable = [&](int x, int y) { return x >= 0 && y >= 0 && x < w && y < h && grid[y][x] != 1; };
+
+        int s0 = start.second * w + start.first, target = goal.second * w + goal.first;
+        std::vector<float> g(w * h, INF);
+        std::vector<int> parent(w * h, -1);
+        std::vector<uint8_t> closed(w * h, 0);
+        IndexedHeap open(w * h);
+        g[s0] = 0.0f;
+        parent[s0] = s0;
+        open.push(s0, {distance(s0, target), 0.0f});
+        long long expanded = 0;
+
+        while (!open.empty()) {
+            int s = open.top();
+            open.remove(s);
+            int sx = s % w, sy = s / w;
+            if (lazy && parent[s] != s && !LineOfSight(grid, node(parent[s]), node(s))) {
+                // No line of sight after all: the best expanded neighbour becomes the parent
+                g[s] = INF;
+                for (int dy = -1; dy <= 1; ++dy) {
+                    for (int dx = -1; dx <= 1; ++dx) {
+                        int n = s + dy * w + dx;
+                        if ((dx == 0 && dy == 0) || !passable(sx + dx, sy + dy) || !closed[n]) continue;
+                        if (dx != 0 && dy != 0 && (!passable(sx + dx, sy) || !passable(sx, sy + dy))) continue;
+                        float through = g[n] + distance(n, s);
+                        if (through < g[s]) {
+                            g[s] = through;
+                            parent[s] = n;
+                        }
+                    }
+                }
+            }
+            closed[s] = 1;
+            ++expanded;
+            if (s == target) break;
+
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int n = s + dy * w + dx;
+                    if ((dx == 0 && dy == 0) || !passable(sx + dx, sy + dy) || closed[n]) continue;
+                    if (dx != 0 && dy != 0 && (!passable(sx + dx, sy) || !passable(sx, sy + dy))) continue;
+                    int p = parent[s];
+                    if (!lazy && !LineOfSight(grid, node(p), node(n))) p = s;
+                    float through = g[p] + distance(p, n);
+                    if (through < g[n]) {
+                        g[n] = through;
+                        parent[n] = p;
+                        open.push(n, {through + distance(n, target), -through});
+                    }
+                }
+            }
+        }
+        if (expansions) *expansions += expanded;
+        if (!closed[target]) return {};
+
+        std::vector<std::pair<int, int>> path;
+        for (int u = target; ; u = parent[u]) {
+            path.push_back(node(u));
+            if (u == s0) break;
+        }
+        std::reverse(path.begin(), path.end());
+        return path;
+    }
+
 private:
+    // D* Lite priority: lexicographic (min(g, rhs) + h + km, min(g, rhs))
+    struct Key {
+        float k1, k2;
+        bool operator<(const Key& o) const { return k1 < o.k1 || (k1 == o.k1 && k2 < o.k2); }
+    };
+
+    // 4-ary min-heap of node indices that knows where each node is, so a node's key
+    // can be changed or the node removed in place instead of leaving stale entries
+    class IndexedHeap {
+    public:
+        explicit IndexedHeap(int nodes) : position_(nodes, -1) {}
+
+        bool empty() const { return entries_.empty(); }
+        int top() const { return entries_[0].node; }
+        const Key& topKey() const { return entries_[0].key; }
+        bool contains(int node) const { return position_[node] >= 0; }
+
+        // Inserts node, or moves it to its new key if it is already queued
+        void push(int node, Key key) {
+            int i = position_[node];
+            if (i < 0) {
+                i = static_cast<int>(entries_.size());
+                entries_.push_back({key, node});
+                position_[node] = i;
+                siftUp(i);
+            } else if (key < entries_[i].key) {
+                entries_[i].key = key;
+                siftUp(i);
+            } else {
+                entries_[i].key = key;
+                siftDown(i);
+            }
+        }
+
+        void remove(int node) {
+            int i = position_[node];
+            if (i < 0) return;
+            position_[node] = -1;
+            Entry last = entries_.back();
+            entries_.pop_back();
+            if (i == static_cast<int>(entries_.size())) return;
+            entries_[i] = last;
+            position_[last.node] = i;
+            if (i > 0 && last.key < entries_[(i - 1) / ARITY].key) {
+                siftUp(i);
+            } else {
+                siftDown(i);
+            }
+        }
+
+    private:
+        static constexpr int ARITY = 4;
+        struct Entry {
+            Key key;
+            int node;
+        };
+        std::vector<Entry> entries_;
+        std::vector<int> position_;     // index in entries_ of each node, -1 if not queued
+
+        void siftUp(int i) {
+            Entry e = entries_[i];
+            while (i > 0) {
+                int parent = (i - 1) / ARITY;
+                if (!(e.key < entries_[parent].key)) break;
+                entries_[i] = entries_[parent];
+                position_[entries_[i].node] = i;
+                i = parent;
+            }
+            entries_[i] = e;
+            position_[e.node] = i;
+        }
+
+        void siftDown(int i) {
+            Entry e = entries_[i];
+            int n = static_cast<int>(entries_.size());
+            while (true) {
+                int first = ARITY * i + 1;
+                if (first >= n) break;
+                int best = first;
+                int last = std::min(first + ARITY, n);
+                for (int c = first + 1; c < last; ++c) {
+                    if (entries_[c].key < entries_[best].key) best = c;
+                }
+                if (!(entries_[best].key < e.key)) break;
+                entries_[i] = entries_[best];
+                position_[entries_[i].node] = i;
+                i = best;
+            }
+            entries_[i] = e;
+            position_[e.node] = i;
+        }
+    };
+
+public:
+    // D* Lite planner that can be kept across replans towards one goal. Nodes are
+    // indexed y * width + x, with g, rhs and cost in flat arrays. After the robot moves
+    // (moveStart) and the grid changes (updateGrid), run() repairs the previous search
+    // from the changed cells instead of starting over.
+    //
+    // 4-connected with a Manhattan heuristic, or 8-connected with an octile one: a
+    // diagonal step costs sqrt(2) and may not cut a corner, i.e. both nodes beside it
+    // must be passable too.
+    //
+    // Optional node costs, as Costmap::Costs() gives them, make steps into the decay
+    // band around obstacles dearer, by up to DECAY_WEIGHT times, so paths keep clear of
+    // walls where there is room. Passability still comes from the grid alone.
     class DStarLite {
     public:
-        DStarLite(const std::vector<std::vector<uint8_t>>& grid, std::pair<int, int> start, std::pair<int, int> goal)
-            : grid_(grid), width_(grid[0].size()), height_(grid.size()), start_(start), goal_(goal), km_(0.0f)
+        DStarLite(const std::vector<std::vector<uint8_t>>& grid, std::pair<int, int> start, std::pair<int, int> goal,
+                  bool eight_connected = false, const uint8_t* costs = nullptr)
+            : width_(grid[0].size()), height_(grid.size()), eight_connected_(eight_connected),
+              start_(start.second * width_ + start.first), last_(start_), goal_(goal.second * width_ + goal.first),
+              km_(0.0f), cells_(width_ * height_), decay_(width_ * height_, 0), g_(width_ * height_, INF),
+              rhs_(width_ * height_, INF), cost_(width_ * height_), open_(width_ * height_)
         {
             for (int y = 0; y < height_; ++y) {
                 for (int x = 0; x < width_; ++x) {
-                    g_[{x, y}] = std::numeric_limits<float>::infinity();
-                    rhs_[{x, y}] = std::numeric_limits<float>::infinity();
-                    cost_[{x, y}] = (grid[y][x] == 1) ? std::numeric_limits<float>::infinity() : 1.0f;
+                    int u = y * width_ + x;
+                    cells_[u] = grid[y][x];
+                    if (costs) decay_[u] = decayOf(costs[u]);
+                    cost_[u] = cellCost(cells_[u], decay_[u]);
                 }
             }
             rhs_[goal_] = 0.0f;
-            insertOpen(goal_);
+            open_.push(goal_, calculateKey(goal_));
         }
 
+        int width() const { return width_; }
+        int height() const { return height_; }
+        std::pair<int, int> goal() const { return node(goal_); }
+        // Nodes expanded by plan() so far
+        long long expansions() const { return expansions_; }
+
         std::vector<std::pair<int, int>> run() {
             computeShortestPath();
             std::vector<std::pair<int, int>> path;
-            auto s = start_;
-            if (g_[s] == std::numeric_limits<float>::infinity()) return {};
-            if (s == goal_) return {s};
-            path.push_back(s);
+            int s = start_;
+            if (g_[s] == INF) return {};
+            if (s == goal_) return {node(s)};
+            path.push_back(node(s));
             while (s != goal_) {
-                auto nbrs = getNeighbors(s);
-                float min_cost = std::numeric_limits<float>::infinity();
-                std::pair<int, int> next = s;
-                for (auto& n : nbrs) {
-                    float c = cost_[n] + g_[n];
+                int nbrs[8];
+                float steps[8];
+                int count = neighbors(s, nbrs, steps);
+                float min_cost = INF;
+                int next = s;
+                for (int i = 0; i < count; ++i) {
+                    float c = cost_[s] * steps[i] + g_[nbrs[i]];
                     if (c < min_cost) {
                         min_cost = c;
-                        next = n;
+                        next = nbrs[i];
                     }
                 }
                 if (next == s) break;
                 s = next;
-                path.push_back(s);
+                path.push_back(node(s));
             }
             if (path.size() <= 1) return {};
             return path;
         }
 
-        void updateNodeCost(const std::pair<int, int>& node, float new_cost) {
-            cost_[node] = new_cost;
-            updateVertex(node);
+        // The robot is now at start: keys computed from the old start stay valid
+        // lower bounds once km grows by the distance moved
+        void moveStart(std::pair<int, int> start) {
+            int s = start.second * width_ + start.first;
+            km_ += heuristic(last_, s);
+            last_ = s;
+            start_ = s;
+        }
+
+        // Takes the cells (and, given costs, the node costs) that differ from the ones
+        // seen last. Returns how many nodes changed.
+        int updateGrid(const std::vector<std::vector<uint8_t>>& grid, const uint8_t* costs = nullptr) {
+            int changed = 0;
+            for (int y = 0; y < height_; ++y) {
+                const uint8_t* row = grid[y].data();
+                for (int x = 0; x < width_; ++x) {
+                    int u = y * width_ + x;
+                    uint8_t decay = costs ? decayOf(costs[u]) : decay_[u];
+                    if (row[x] == cells_[u] && decay == decay_[u]) continue;
+                    cells_[u] = row[x];
+                    decay_[u] = decay;
+                    ++changed;
+                    float cost = cellCost(row[x], decay);
+                    if (cost != cost_[u]) updateNodeCost({x, y}, cost);
+                }
+            }
+            return changed;
+        }
+
+        // Whether u is passable changes which nodes are its neighbours' neighbours (and,
+        // 8-connected, which diagonals cut its corners), so their rhs is recomputed too
+        void updateNodeCost(const std::pair<int, int>& n, float new_cost) {
+            int u = n.second * width_ + n.first;
+            cost_[u] = new_cost;
+            updateVertex(u);
+            for (int dy = -1; dy <= 1; ++dy) {
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int x = n.first + dx, y = n.second + dy;
+                    if ((dx == 0 && dy == 0) || x < 0 || y < 0 || x >= width_ || y >= height_) continue;
+                    if (dx != 0 && dy != 0 && !eight_connected_) continue;
+                    updateVertex(y * width_ + x);
+                }
+            }
         }
 
     private:
-        const std::vector<std::vector<uint8_t>>& grid_;
+        static constexpr float INF = std::numeric_limits<float>::infinity();
+        static constexpr float DIAGONAL = 1.41421356f;
+        static constexpr float DECAY_WEIGHT = 2.0f;
+
         int width_, height_;
-        std::pair<int, int> start_, goal_;
+        bool eight_connected_;
+        int start_, last_, goal_;
         float km_;
+        long long expansions_ = 0;
 
-        std::unordered_map<std::pair<int, int>, float, pair_hash> g_;
-        std::unordered_map<std::pair<int, int>, float, pair_hash> rhs_;
-        std::unordered_map<std::pair<int, int>, float, pair_hash> cost_;
+        std::vector<uint8_t> cells_;    // grid as last seen: 0 free, 1 occupied, 2 unknown
+        std::vector<uint8_t> decay_;    // node costs as last seen, 0 outside the decay band
+        std::vector<float> g_;
+        std::vector<float> rhs_;
+        std::vector<float> cost_;
+        IndexedHeap open_;
 
-        using QueueElem = std::pair<std::pair<float, float>, std::pair<int, int>>;
-        struct QueueCompare {
-            bool operator()(const QueueElem& a, const QueueElem& b) const {
-                if (a.first.first != b.first.first)
-                    return a.first.first > b.first.first;
-                return a.first.second > b.first.second;
-            }
-        };
-        std::priority_queue<QueueElem, std::vector<QueueElem>, QueueCompare> openList_;
-        std::set<std::pair<int, int>, std::less<>> openSet_; // for fast lookup/removal
+        static uint8_t decayOf(uint8_t cost) { return cost <= MAX_DECAY_COST ? cost : 0; }
 
-        float heuristic(const std::pair<int, int>& a, const std::pair<int, int>& b) const {
-            return std::abs(a.first - b.first) + std::abs(a.second - b.second);
+        static float cellCost(uint8_t cell, uint8_t decay) {
+            return cell == 1 ? INF : 1.0f + DECAY_WEIGHT * decay / MAX_DECAY_COST;
         }
 
-        std::pair<float, float> calculateKey(const std::pair<int, int>& s) const {
-            float g_rhs = std::min(g_.at(s), rhs_.at(s));
-            return {g_rhs + heuristic(start_, s) + km_, g_rhs};
-        }
+        std::pair<int, int> node(int u) const { return {u % width_, u / width_}; }
 
-        std::vector<std::pair<int, int>> getNeighbors(const std::pair<int, int>& s) const {
-            static const int dx[4] = {1, -1, 0, 0};
-            static const int dy[4] = {0, 0, 1, -1};
-            std::vector<std::pair<int, int>> nbrs;
-            for (int i = 0; i < 4; ++i) {
-                int nx = s.first + dx[i];
-                int ny = s.second + dy[i];
-                if (nx >= 0 && nx < width_ && ny >= 0 && ny < height_) {
-                    if (cost_.at({nx, ny}) < std::numeric_limits<float>::infinity()) {
-                        nbrs.emplace_back(nx, ny);
-                    }
-                }
-            }
-            return nbrs;
+        float heuristic(int a, int b) const {
+            int dx = std::abs(a % width_ - b % width_), dy = std::abs(a / width_ - b / width_);
+            if (!eight_connected_) return dx + dy;
+            return std::max(dx, dy) + (DIAGONAL - 1.0f) * std::min(dx, dy);
         }
 
-        void removeOpen(const std::pair<int, int>& u) {
-            openSet_.erase(u);
+        Key calculateKey(int s) const {
+            float g_rhs = std::min(g_[s], rhs_[s]);
+            return {g_rhs + heuristic(start_, s) + km_, g_rhs};
         }
 
-        void insertOpen(const std::pair<int, int>& u) {
-            openList_.push({calculateKey(u), u});
-            openSet_.insert(u);
+        // Passable neighbours of u and the length of the step to each, in the order
+        // +x, -x, +y, -y, then the diagonals that cut no corner
+        int neighbors(int u, int (&out)[8], float (&steps)[8]) const {
+            int x = u % width_, y = u / width_;
+            bool right = x + 1 < width_ && cost_[u + 1] < INF;
+            bool left = x > 0 && cost_[u - 1] < INF;
+            bool down = y + 1 < height_ && cost_[u + width_] < INF;
+            bool up = y > 0 && cost_[u - width_] < INF;
+            int count = 0;
+            auto add = [&](int v, float step) {
+                out[count] = v;
+                steps[count] = step;
+                ++count;
+            };
+            if (right) add(u + 1, 1.0f);
+            if (left) add(u - 1, 1.0f);
+            if (down) add(u + width_, 1.0f);
+            if (up) add(u - width_, 1.0f);
+            if (eight_connected_) {
+                if (right && down && cost_[u + width_ + 1] < INF) add(u + width_ + 1, DIAGONAL);
+                if (left && down && cost_[u + width_ - 1] < INF) add(u + width_ - 1, DIAGONAL);
+                if (right && up && cost_[u - width_ + 1] < INF) add(u - width_ + 1, DIAGONAL);
+                if (left && up && cost_[u - width_ - 1] < INF) add(u - width_ - 1, DIAGONAL);
+            }
+            return count;
         }
 
-        void updateVertex(const std::pair<int, int>& u) {
+        void updateVertex(int u) {
             if (u != goal_) {
-                float min_rhs = std::numeric_limits<float>::infinity();
-                for (auto& s : getNeighbors(u)) {
-                    min_rhs = std::min(min_rhs, cost_.at(u) + g_.at(s));
+                int nbrs[8];
+                float steps[8];
+                int count = neighbors(u, nbrs, steps);
+                float min_rhs = INF;
+                for (int i = 0; i < count; ++i) {
+                    min_rhs = std::min(min_rhs, cost_[u] * steps[i] + g_[nbrs[i]]);
                 }
                 rhs_[u] = min_rhs;
             }
-            if (openSet_.count(u)) removeOpen(u);
-            if (g_[u] != rhs_[u]) insertOpen(u);
+            if (g_[u] != rhs_[u]) {
+                open_.push(u, calculateKey(u));
+            } else {
+                open_.remove(u);
+            }
         }
 
         void computeShortestPath() {
-            while (!openList_.empty()) {
-                auto [k_old, u] = openList_.top();
-                if (!openSet_.count(u)) { openList_.pop(); continue; }
-                auto k_start = calculateKey(start_);
-                if (!(k_old < k_start) && rhs_[start_] == g_[start_]) break;
+            while (!open_.empty()) {
+                int u = open_.top();
+                Key k_old = open_.topKey();
+                if (!(k_old < calculateKey(start_)) && rhs_[start_] == g_[start_]) break;
 
-                auto k_new = calculateKey(u);
+                ++expansions_;
+                Key k_new = calculateKey(u);
+                int nbrs[8];
+                float steps[8];
                 if (k_old < k_new) {
-                    openList_.pop();
-                    insertOpen(u);
+                    open_.push(u, k_new);
                 } else if (g_[u] > rhs_[u]) {
                     g_[u] = rhs_[u];
-                    openList_.pop();
-                    openSet_.erase(u);
-                    for (auto& s : getNeighbors(u)) updateVertex(s);
+                    open_.remove(u);
+                    int count = neighbors(u, nbrs, steps);
+                    for (int i = 0; i < count; ++i) updateVertex(nbrs[i]);
                 } else {
-                    g_[u] = std::numeric_limits<float>::infinity();
-                    openList_.pop();
-                    openSet_.erase(u);
+                    g_[u] = INF;
                     updateVertex(u);
-                    for (auto& s : getNeighbors(u)) updateVertex(s);
+                    int count = neighbors(u, nbrs, steps);
+                    for (int i = 0; i < count; ++i) updateVertex(nbrs[i]);
                 }
             }
         }
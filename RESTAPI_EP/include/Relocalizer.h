@@ -0,0 +1,449 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+#include "breezySLAM/cpp/Position.hpp"
+
+// Global relocalization: finds where a lidar revolution was taken in a known map,
+// with no prior on the pose, e.g. after restoring a saved map at startup.
+//
+// Correlative matching as a branch and bound over the whole map. Scan points score
+// the likelihood of the map cell they fall in (highest at obstacles, falling off
+// with the distance to them), at a base resolution of BASE_FACTOR map pixels. For
+// each rotation bin, a pyramid of grids holding the maximum of the base grid over
+// windows of 2^h cells bounds the score of every translation in such a window, so
+// whole windows are dropped as soon as their bound falls below the candidates
+// already found, and so are windows with no free space for the robot to stand in.
+// The rotation bins are spread over the threads. The best distinct candidates are
+// then refined on the full resolution map.
+class Relocalizer {
+public:
+    struct Candidate {
+        Position position;              // robot pose, as SinglePositionSLAM::getpos()
+        double score = 0.0;             // mean likelihood of the scan points, 0..1
+    };
+
+    struct Result {
+        std::vector<Candidate> candidates;  // best first, at least MIN_SEPARATION apart
+        bool confident = false;         // the best is good and clearly ahead of the next
+        int points = 0;
+        int rotations = 0;
+        uint64_t nodes = 0;             // search windows scored
+        double ms = 0.0;
+    };
+
+    // offset_mm: forward offset of the lidar from the centre of rotation
+    Relocalizer(int scan_size, double detection_angle_degrees, double offset_mm, int detection_margin = 0,
+                int threads = 1)
+        : offset_mm_(offset_mm), first_ray_(detection_margin + 1), end_ray_(scan_size - detection_margin),
+          threads_(std::max(threads, 1))
+    {
+        for (int i = 0; i < scan_size; ++i) {
+            double angle = (-detection_angle_degrees / 2 + i * detection_angle_degrees / (scan_size - 1)) * M_PI / 180.0;
+            ray_cos_.push_back(std::cos(angle));
+            ray_sin_.push_back(std::sin(angle));
+        }
+    }
+
+    // Builds the search grids for map, size_pixels square, one byte per pixel as
+    // from getmap(). Takes a few tens of ms, so keep the Relocalizer for a map.
+    void SetMap(const std::vector<unsigned char>& map, int size_pixels, double mm_per_pixel) {
+        fine_size_ = size_pixels;
+        fine_mm_ = mm_per_pixel;
+        size_ = (size_pixels + BASE_FACTOR - 1) / BASE_FACTOR;
+        base_mm_ = mm_per_pixel * BASE_FACTOR;
+        stride_ = size_ + PAD;
+
+        // Chamfer distance (3 per step, 4 per diagonal) to the nearest obstacle pixel
+        const int far = 3 * static_cast<int>(std::ceil(3 * SIGMA_MM / mm_per_pixel));
+        std::vector<int> distance(map.size());
+        for (size_t k = 0; k < map.size(); ++k) distance[k] = map[k] < OBSTACLE_BYTE ? 0 : far;
+        const int n = size_pixels;
+        for (int y = 0; y < n; ++y) {
+            for (int x = 0; x < n; ++x) {
+                int& d = distance[y * n + x];
+                if (x > 0) d = std::min(d, distance[y * n + x - 1] + 3);
+                if (y > 0) {
+                    d = std::min(d, distance[(y - 1) * n + x] + 3);
+                    if (x > 0) d = std::min(d, distance[(y - 1) * n + x - 1] + 4);
+                    if (x < n - 1) d = std::min(d, distance[(y - 1) * n + x + 1] + 4);
+                }
+            }
+        }
+        for (int y = n - 1; y >= 0; --y) {
+            for (int x = n - 1; x >= 0; --x) {
+                int& d = distance[y * n + x];
+                if (x < n - 1) d = std::min(d, distance[y * n + x + 1] + 3);
+                if (y < n - 1) {
+                    d = std::min(d, distance[(y + 1) * n + x] + 3);
+                    if (x < n - 1) d = std::min(d, distance[(y + 1) * n + x + 1] + 4);
+                    if (x > 0) d = std::min(d, distance[(y + 1) * n + x - 1] + 4);
+                }
+            }
+        }
+
+        // Likelihood by chamfer distance; the base grid is a little wider, as its
+        // cells are coarser
+        std::vector<uint8_t> fine_table(far + 1), base_table(far + 1);
+        for (int d = 0; d <= far; ++d) {
+            double mm = d / 3.0 * mm_per_pixel;
+            fine_table[d] = static_cast<uint8_t>(std::lround(255 * std::exp(-mm * mm / (2 * SIGMA_MM * SIGMA_MM))));
+            double base_sigma = SIGMA_MM * BASE_FACTOR;
+            base_table[d] = static_cast<uint8_t>(std::lround(255 * std::exp(-mm * mm / (2 * base_sigma * base_sigma))));
+        }
+        fine_.resize(map.size());
+        for (size_t k = 0; k < map.size(); ++k) fine_[k] = fine_table[std::min(distance[k], far)];
+
+        // Base grid: nearest obstacle and any free pixel of each block
+        levels_.assign(TOP_LEVEL + 1, std::vector<uint8_t>(static_cast<size_t>(stride_) * stride_, 0));
+        free_.assign(TOP_LEVEL + 1, std::vector<uint8_t>(static_cast<size_t>(size_) * size_, 0));
+        for (int cy = 0; cy < size_; ++cy) {
+            for (int cx = 0; cx < size_; ++cx) {
+                int d = far;
+                uint8_t free = 0;
+                for (int y = cy * BASE_FACTOR; y < std::min(n, (cy + 1) * BASE_FACTOR); ++y) {
+                    for (int x = cx * BASE_FACTOR; x < std::min(n, (cx + 1) * BASE_FACTOR); ++x) {
+                        d = std::min(d, distance[y * n + x]);
+                        free |= map[y * n + x] > FREE_BYTE;
+                    }
+                }
+                levels_[0][Index(cx, cy)] = base_table[d];
+                free_[0][cy * size_ + cx] = free;
+            }
+        }
+
+        // Level h holds the maximum of level 0 over [x, x + 2^h) x [y, y + 2^h),
+        // from x = -PAD so windows hanging over the top and left edges are bounded too
+        for (int h = 1; h <= TOP_LEVEL; ++h) {
+            const int half = 1 << (h - 1);
+            const std::vector<uint8_t>& below = levels_[h - 1];
+            std::vector<uint8_t> rows(below.size(), 0);
+            for (int y = -PAD; y < size_; ++y) {
+                for (int x = -PAD; x < size_; ++x) {
+                    uint8_t v = below[Index(x, y)];
+                    if (x + half < size_) v = std::max(v, below[Index(x + half, y)]);
+                    rows[Index(x, y)] = v;
+                }
+            }
+            for (int y = -PAD; y < size_; ++y) {
+                for (int x = -PAD; x < size_; ++x) {
+                    uint8_t v = rows[Index(x, y)];
+                    if (y + half < size_) v = std::max(v, rows[Index(x, y + half)]);
+                    levels_[h][Index(x, y)] = v;
+                }
+            }
+            for (int y = 0; y < size_; ++y) {
+                for (int x = 0; x < size_; ++x) {
+                    uint8_t any = free_[h - 1][y * size_ + x];
+                    if (x + half < size_) any |= free_[h - 1][y * size_ + x + half];
+                    if (y + half < size_) any |= free_[h - 1][(y + half) * size_ + x];
+                    if (x + half < size_ && y + half < size_) any |= free_[h - 1][(y + half) * size_ + x + half];
+                    free_[h][y * size_ + x] = any;
+                }
+            }
+        }
+    }
+
+    bool HasMap() const { return size_ > 0; }
+
+    // Candidate poses for the revolution (one distance per ray, 0 = no return) in the
+    // map given to SetMap(), best first.
+    Result Localize(const std::vector<int>& distances, int max_candidates = 5) const {
+        auto start = std::chrono::steady_clock::now();
+        Result result;
+        if (!HasMap()) return result;
+
+        std::vector<Point> points = BuildPoints(distances);
+        result.points = static_cast<int>(points.size());
+        if (points.size() < MIN_POINTS) return result;
+
+        // Rotation bins no wider than moves the farthest points by one base cell
+        std::vector<double> ranges;
+        for (const Point& p : points) ranges.push_back(std::hypot(p.x, p.y));
+        std::nth_element(ranges.begin(), ranges.begin() + ranges.size() * 9 / 10, ranges.end());
+        double reach = ranges[ranges.size() * 9 / 10];
+        double step = std::acos(1 - base_mm_ * base_mm_ / (2 * reach * reach)) * 180 / M_PI;
+        step = std::min(std::max(step, MIN_ROTATION_STEP_DEGREES), MAX_ROTATION_STEP_DEGREES);
+        const int rotations = static_cast<int>(std::ceil(360 / step));
+        step = 360.0 / rotations;
+        result.rotations = rotations;
+
+        const int keep = std::max(max_candidates, 1) * 2;
+        std::vector<Best> found(threads_, Best(keep, MinScore(points.size()), *this, step));
+        std::vector<uint64_t> nodes(threads_, 0);
+        auto work = [&](int t) {
+            std::vector<int> ox(points.size()), oy(points.size());
+            for (int r = t; r < rotations; r += threads_) {
+                double c = std::cos(r * step * M_PI / 180), s = std::sin(r * step * M_PI / 180);
+                for (size_t i = 0; i < points.size(); ++i) {
+                    ox[i] = static_cast<int>(std::lround((c * points[i].x - s * points[i].y) / base_mm_));
+                    oy[i] = static_cast<int>(std::lround((s * points[i].x + c * points[i].y) / base_mm_));
+                }
+                SearchRotation(r, ox, oy, found[t], nodes[t]);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 1; t < threads_; ++t) workers.emplace_back(work, t);
+        work(0);
+        for (auto& worker : workers) worker.join();
+
+        // Distinct candidates of all threads, refined on the full resolution map
+        Best merged(keep, 0, *this, step);
+        for (int t = 0; t < threads_; ++t) {
+            result.nodes += nodes[t];
+            for (const Node& node : found[t].nodes) merged.Insert(node);
+        }
+        std::vector<Candidate> refined;
+        for (const Node& node : merged.nodes) {
+            refined.push_back(Refine(points, CellCentreMm(node.cx), CellCentreMm(node.cy), node.rotation * step, step));
+        }
+        std::sort(refined.begin(), refined.end(),
+                  [](const Candidate& a, const Candidate& b) { return a.score > b.score; });
+        for (const Candidate& candidate : refined) {
+            bool distinct = true;
+            for (const Candidate& kept : result.candidates) distinct &= !Near(candidate.position, kept.position);
+            if (distinct && static_cast<int>(result.candidates.size()) < max_candidates) {
+                result.candidates.push_back(candidate);
+            }
+        }
+
+        if (!result.candidates.empty()) {
+            double best = result.candidates[0].score;
+            double second = result.candidates.size() > 1 ? result.candidates[1].score : 0.0;
+            result.confident = best >= CONFIDENT_SCORE && best - second >= CONFIDENT_MARGIN;
+        }
+        result.ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        return result;
+    }
+
+private:
+    static constexpr int BASE_FACTOR = 2;           // map pixels per base cell
+    static constexpr int TOP_LEVEL = 5;             // search windows of 32 base cells
+    static constexpr int PAD = 1 << TOP_LEVEL;
+    static constexpr unsigned char OBSTACLE_BYTE = 64;
+    static constexpr unsigned char FREE_BYTE = 180;
+    static constexpr double SIGMA_MM = 40.0;
+    static constexpr double MIN_RANGE_MM = 150.0;
+    static constexpr double MAX_RANGE_MM = 10000.0;
+    static constexpr int MAX_POINTS = 120;
+    static constexpr size_t MIN_POINTS = 30;
+    static constexpr double MIN_ROTATION_STEP_DEGREES = 0.5;
+    static constexpr double MAX_ROTATION_STEP_DEGREES = 2.0;
+    // Candidates closer than both of these are the same one
+    static constexpr double MIN_SEPARATION_MM = 500.0;
+    static constexpr double MIN_SEPARATION_DEGREES = 15.0;
+    static constexpr double MIN_SCORE = 0.2;
+    static constexpr double CONFIDENT_SCORE = 0.5;
+    static constexpr double CONFIDENT_MARGIN = 0.1;
+
+    struct Point {
+        double x, y;
+    };
+
+    // Laser pose at the centre of base cell (cx, cy), in rotation bin `rotation`. Map
+    // pixel k covers k +- 0.5 pixels, as in breezySLAM, so base cell c covers pixels
+    // c * BASE_FACTOR and up.
+    struct Node {
+        int score;
+        int rotation;
+        int cx, cy;
+    };
+
+    // The best distinct leaves found so far.
+    struct Best {
+        Best(int keep, int min_score, const Relocalizer& owner, double step)
+            : keep(keep), min_score(min_score), owner(&owner), step(step) {}
+
+        int Threshold() const {
+            if (static_cast<int>(nodes.size()) < keep) return min_score;
+            int lowest = nodes[0].score;
+            for (const Node& node : nodes) lowest = std::min(lowest, node.score);
+            return lowest;
+        }
+
+        void Insert(const Node& node) {
+            if (node.score <= min_score) return;
+            for (size_t k = 0; k < nodes.size(); ++k) {
+                if (!Same(nodes[k], node)) continue;
+                if (nodes[k].score >= node.score) return;
+                nodes.erase(nodes.begin() + k);
+                --k;
+            }
+            if (static_cast<int>(nodes.size()) < keep) {
+                nodes.push_back(node);
+                return;
+            }
+            auto lowest = std::min_element(nodes.begin(), nodes.end(),
+                                           [](const Node& a, const Node& b) { return a.score < b.score; });
+            if (lowest->score < node.score) *lowest = node;
+        }
+
+        bool Same(const Node& a, const Node& b) const {
+            double dx = (a.cx - b.cx) * owner->base_mm_, dy = (a.cy - b.cy) * owner->base_mm_;
+            double dtheta = std::remainder((a.rotation - b.rotation) * step, 360.0);
+            return std::hypot(dx, dy) < MIN_SEPARATION_MM && std::fabs(dtheta) < MIN_SEPARATION_DEGREES;
+        }
+
+        int keep;
+        int min_score;
+        const Relocalizer* owner;
+        double step;
+        std::vector<Node> nodes;
+    };
+
+    size_t Index(int x, int y) const {
+        return static_cast<size_t>(y + PAD) * stride_ + (x + PAD);
+    }
+
+    double CellCentreMm(int c) const {
+        return (c * BASE_FACTOR + (BASE_FACTOR - 1) / 2.0) * fine_mm_;
+    }
+
+    int MinScore(size_t points) const {
+        return static_cast<int>(MIN_SCORE * 255 * points);
+    }
+
+    std::vector<Point> BuildPoints(const std::vector<int>& distances) const {
+        std::vector<Point> points;
+        int end = std::min<int>(end_ray_, static_cast<int>(distances.size()));
+        for (int i = first_ray_; i < end; ++i) {
+            double d = distances[i];
+            if (d < MIN_RANGE_MM || d > MAX_RANGE_MM) continue;
+            points.push_back({ d * ray_cos_[i], d * ray_sin_[i] });
+        }
+        if (points.size() > static_cast<size_t>(MAX_POINTS)) {
+            std::vector<Point> kept;
+            for (int k = 0; k < MAX_POINTS; ++k) kept.push_back(points[k * points.size() / MAX_POINTS]);
+            points.swap(kept);
+        }
+        return points;
+    }
+
+    // Upper bound on the score of every laser position in [cx, cx + 2^h) x [cy, cy + 2^h).
+    int Bound(int h, int cx, int cy, const std::vector<int>& ox, const std::vector<int>& oy) const {
+        const std::vector<uint8_t>& grid = levels_[h];
+        int score = 0;
+        for (size_t i = 0; i < ox.size(); ++i) {
+            int x = cx + ox[i], y = cy + oy[i];
+            if (x >= -PAD && x < size_ && y >= -PAD && y < size_) score += grid[Index(x, y)];
+        }
+        return score;
+    }
+
+    void SearchRotation(int rotation, const std::vector<int>& ox, const std::vector<int>& oy, Best& best,
+                        uint64_t& nodes) const {
+        std::vector<Node> roots;
+        for (int cy = 0; cy < size_; cy += PAD) {
+            for (int cx = 0; cx < size_; cx += PAD) {
+                if (!free_[TOP_LEVEL][cy * size_ + cx]) continue;
+                roots.push_back({ Bound(TOP_LEVEL, cx, cy, ox, oy), rotation, cx, cy });
+                ++nodes;
+            }
+        }
+        std::sort(roots.begin(), roots.end(), [](const Node& a, const Node& b) { return a.score > b.score; });
+        for (const Node& root : roots) {
+            if (root.score <= best.Threshold()) break;
+            Search(TOP_LEVEL, root, ox, oy, best, nodes);
+        }
+    }
+
+    // Depth first, the most promising window first.
+    void Search(int h, const Node& node, const std::vector<int>& ox, const std::vector<int>& oy, Best& best,
+                uint64_t& nodes) const {
+        if (h == 0) {
+            best.Insert(node);
+            return;
+        }
+        const int half = 1 << (h - 1);
+        Node children[4];
+        int count = 0;
+        for (int j = 0; j < 2; ++j) {
+            for (int i = 0; i < 2; ++i) {
+                int cx = node.cx + i * half, cy = node.cy + j * half;
+                if (cx >= size_ || cy >= size_ || !free_[h - 1][cy * size_ + cx]) continue;
+                children[count++] = { Bound(h - 1, cx, cy, ox, oy), node.rotation, cx, cy };
+                ++nodes;
+            }
+        }
+        // At most four: insertion sort, best first
+        for (int k = 1; k < count; ++k) {
+            Node child = children[k];
+            int m = k;
+            for (; m > 0 && children[m - 1].score < child.score; --m) children[m] = children[m - 1];
+            children[m] = child;
+        }
+        for (int k = 0; k < count; ++k) {
+            if (children[k].score <= best.Threshold()) break;
+            Search(h - 1, children[k], ox, oy, best, nodes);
+        }
+    }
+
+    // Mean full resolution likelihood of the points from laser pose (x, y, theta).
+    double FineScore(const std::vector<Point>& points, double x_mm, double y_mm, double theta_degrees) const {
+        double c = std::cos(theta_degrees * M_PI / 180), s = std::sin(theta_degrees * M_PI / 180);
+        int sum = 0;
+        for (const Point& p : points) {
+            int x = static_cast<int>(std::floor((x_mm + c * p.x - s * p.y) / fine_mm_ + 0.5));
+            int y = static_cast<int>(std::floor((y_mm + s * p.x + c * p.y) / fine_mm_ + 0.5));
+            if (x >= 0 && x < fine_size_ && y >= 0 && y < fine_size_) sum += fine_[y * fine_size_ + x];
+        }
+        return sum / (255.0 * points.size());
+    }
+
+    // Hill climbing from a base cell, halving the steps down to a quarter pixel.
+    Candidate Refine(const std::vector<Point>& points, double x_mm, double y_mm, double theta_degrees,
+                     double step_degrees) const {
+        double score = FineScore(points, x_mm, y_mm, theta_degrees);
+        double step_mm = base_mm_ / 2, step_theta = step_degrees / 2;
+        while (step_mm >= fine_mm_ / 4) {
+            bool moved = false;
+            const double moves[6][3] = { { step_mm, 0, 0 }, { -step_mm, 0, 0 }, { 0, step_mm, 0 },
+                                         { 0, -step_mm, 0 }, { 0, 0, step_theta }, { 0, 0, -step_theta } };
+            for (const auto& move : moves) {
+                double moved_score = FineScore(points, x_mm + move[0], y_mm + move[1], theta_degrees + move[2]);
+                if (moved_score > score) {
+                    score = moved_score;
+                    x_mm += move[0];
+                    y_mm += move[1];
+                    theta_degrees += move[2];
+                    moved = true;
+                }
+            }
+            if (!moved) {
+                step_mm /= 2;
+                step_theta /= 2;
+            }
+        }
+        theta_degrees = std::remainder(theta_degrees, 360.0);
+        double theta_radians = theta_degrees * M_PI / 180;
+        Candidate candidate;
+        candidate.position = Position(x_mm - offset_mm_ * std::cos(theta_radians),
+                                      y_mm - offset_mm_ * std::sin(theta_radians), theta_degrees);
+        candidate.score = score;
+        return candidate;
+    }
+
+    static bool Near(const Position& a, const Position& b) {
+        return std::hypot(a.x_mm - b.x_mm, a.y_mm - b.y_mm) < MIN_SEPARATION_MM &&
+               std::fabs(std::remainder(a.theta_degrees - b.theta_degrees, 360.0)) < MIN_SEPARATION_DEGREES;
+    }
+
+    double offset_mm_;
+    int first_ray_;
+    int end_ray_;
+    int threads_;
+    std::vector<double> ray_cos_;
+    std::vector<double> ray_sin_;
+
+    int fine_size_ = 0;
+    double fine_mm_ = 0.0;
+    std::vector<uint8_t> fine_;
+    int size_ = 0;                      // base grid, size_ x size_ cells
+    double base_mm_ = 0.0;
+    int stride_ = 0;
+    std::vector<std::vector<uint8_t>> levels_;
+    std::vector<std::vector<uint8_t>> free_;
+};
@@ -2,6 +2,7 @@
 #include "SLAMHandler.h"
 #include "ArduinoSerial.h"
 #include "PathFinder.h"
+#include "Costmap.h"
 #include <vector>
 #include <utility>
 #include <memory>
@@ -12,15 +13,15 @@
 #include <iostream>
 #include <atomic>
 #include <chrono>
+#include <mutex>
 
 class RobotHandler {
 public:
     RobotHandler(SLAMHandler* slam, ArduinoSerial* arduino, float map_meters, int map_pixels)
-        : slam_(slam), arduino_(arduino), map_meters_(map_meters), map_pixels_(map_pixels), exploring_(false) {}
+        : slam_(slam), arduino_(arduino), map_meters_(map_meters), map_pixels_(map_pixels), exploring_(false),
+          costmap_(map_pixels, map_meters, ROBOT_RADIUS_MM, CLEARANCE_DECAY_MM) {}
     std::vector<std::pair<int, int>> planPathToGoal(const std::pair<int, int>& goal_node) {
-        unsigned char* map_data = slam_->GetMap();
-        auto node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
-        delete[] map_data;
+        auto node_grid = currentNodeGrid();
 
         Position pos = slam_->GetPosition();
         int node_size_px = static_cast<int>(std::round(0.25f * (map_pixels_ / map_meters_)));
@@ -29,7 +30,7 @@ public:
 
         std::pair<int, int> start_node = {x_node, y_node};
         std::cout << "[RobotHandler] planPathToGoal: start_node=(" << start_node.first << "," << start_node.second << ") goal_node=(" << goal_node.first << "," << goal_node.second << ")\n";
-        auto path = PathFinder::FindPathDStarLite(node_grid, start_node, goal_node);
+        auto path = findPath(node_grid, start_node, goal_node, PathQuery::NewGoal);
         std::cout << "[RobotHandler] Path size: " << path.size() << "\n";
         for (const auto& p : path) {
             std::cout << "  (" << p.first << "," << p.second << ")";
@@ -52,14 +53,13 @@ public:
         auto goal_node = path.back();
         int recalc_attempts = 0;
 
-        unsigned char* map_data = nullptr;
         auto node_grid = std::vector<std::vector<uint8_t>>();
 
         auto last_map_update = std::chrono::steady_clock::now();
 
         while (path_idx + 1 < current_path.size()) {
-            const auto& node = current_path[path_idx];
-            const auto& next_node = current_path[path_idx + 1];
+            const auto node = current_path[path_idx];
+            const auto next_node = current_path[path_idx + 1];
             bool reached = false;
             int stuck_counter = 0;
             while (!reached) {
@@ -69,23 +69,18 @@ public:
 
                 auto now = std::chrono::steady_clock::now();
                 if (now - last_map_update > std::chrono::seconds(1)) {
-                    if (map_data) delete[] map_data;
-                    map_data = slam_->GetMap();
-                    node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
+                    node_grid = currentNodeGrid();
                     last_map_update = now;
                 }
 
                 if (detectCollisionByScan()) {
                     std::cout << "[RobotHandler] Collision detected by scan, replanning..." << std::endl;
-                    if (map_data) delete[] map_data;
-                    map_data = slam_->GetMap();
-                    node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
-                    auto new_path = PathFinder::FindPathDStarLite(node_grid, {x_node, y_node}, goal_node);
+                    node_grid = currentNodeGrid();
+                    auto new_path = findPath(node_grid, {x_node, y_node}, goal_node, PathQuery::Replan);
                     recalc_attempts++;
                     if (new_path.empty() || recalc_attempts > 5) {
                         std::cout << "[RobotHandler] Replanning failed or too many attempts, aborting." << std::endl;
                         arduino_->stop();
-                        if (map_data) delete[] map_data;
                         return;
                     }
                     std::cout << "[RobotHandler] New path size: " << new_path.size() << std::endl;
@@ -94,8 +89,10 @@ public:
                     break;
                 }
 
-                double dx = (next_node.first - node.first);
-                double dy = (next_node.second - node.second);
+                // Towards the centre of the next vertex from where we are: after smoothing,
+                // vertices can be many nodes apart, and a miss must not be driven again
+                double dx = (next_node.first + 0.5) - pos.x_mm / node_size_mm;
+                double dy = (next_node.second + 0.5) - pos.y_mm / node_size_mm;
                 double target_angle = std::atan2(dy, dx) * 180.0 / M_PI;
                 double angle_diff = target_angle - pos.theta_degrees;
                 while (angle_diff > 180.0) angle_diff -= 360.0;
@@ -123,9 +120,9 @@ public:
                 std::this_thread::sleep_for(std::chrono::milliseconds(200));
 
                 Position new_pos = slam_->GetPosition();
-                int new_x_node = static_cast<int>(new_pos.x_mm / node_size_mm);
-                int new_y_node = static_cast<int>(new_pos.y_mm / node_size_mm);
-                if (std::abs(new_x_node - next_node.first) <= 0 && std::abs(new_y_node - next_node.second) <= 0) {
+                double miss_x = (next_node.first + 0.5) - new_pos.x_mm / node_size_mm;
+                double miss_y = (next_node.second + 0.5) - new_pos.y_mm / node_size_mm;
+                if (std::sqrt(miss_x * miss_x + miss_y * miss_y) * node_size_mm <= VERTEX_REACHED_MM) {
                     reached = true;
                     std::cout << "[RobotHandler] Node reached: (" << next_node.first << ", " << next_node.second << ")" << std::endl;
                     break;
@@ -134,14 +131,13 @@ public:
                 if (++stuck_counter > 100) {
                     std::cout << "[RobotHandler] Stuck at node (" << node.first << ", " << node.second << "), aborting." << std::endl;
                     arduino_->stop();
-                    if (map_data) delete[] map_data;
                     return;
                 }
             }
-            ++path_idx;
+            // A replan starts the new path from its first vertex
+            if (reached) ++path_idx;
         }
         arduino_->stop();
-        if (map_data) delete[] map_data;
     }
 
     void goToGoal(const std::pair<int, int>& goal_node) {
@@ -173,9 +169,7 @@ public:
         float node_size_mm = 0.25f * 1000.0f; 
 
         while (exploring_) {
-            unsigned char* map_data = slam_->GetMap();
-            auto node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
-            delete[] map_data;
+            auto node_grid = currentNodeGrid();
 
             Position pos = slam_->GetPosition();
             int x_node = static_cast<int>(pos.x_mm / node_size_mm);
@@ -204,7 +198,7 @@ public:
             }
             std::cout << "[RobotHandler] Exploring to unvisited node: (" << best_node.first << "," << best_node.second << ")" << std::endl;
 
-            auto path = PathFinder::FindPathDStarLite(node_grid, {x_node, y_node}, best_node);
+            auto path = findPath(node_grid, {x_node, y_node}, best_node, PathQuery::NewGoal);
             if (path.empty()) {
                 continue;
             }
@@ -217,9 +211,9 @@ public:
         exploring_ = false;
     }
 
-    unsigned char* getMap() { return slam_->GetMap(); }
+    std::shared_ptr<const MapSnapshot> getMap() { return slam_->GetMap(); }
     Position getPosition() { return slam_->GetPosition(); }
-    std::vector<ldlidar::PointData> getLatestScan() { return slam_->GetLatestData(); }
+    std::shared_ptr<const ldlidar::Points2D> getLatestScan() { return slam_->GetLatestData(); }
 
 private:
     SLAMHandler* slam_;
@@ -228,68 +222,144 @@ private:
     int map_pixels_;
     std::set<std::pair<int, int>> visited_nodes{};
     std::atomic<bool> exploring_;
+    // D* Lite search towards the current goal once it has been replanned, kept so that
+    // further replans repair it
+    std::unique_ptr<PathFinder::DStarLite> planner_;
+    std::mutex plannerMutex_;
+
+    // Half the track width of the robot, and how far beyond that paths are pushed away
+    // from walls where there is room
+    static constexpr double ROBOT_RADIUS_MM = 225.0 / 2;
+    static constexpr double CLEARANCE_DECAY_MM = 300.0;
+    // How close to the centre of a path vertex counts as having reached it
+    static constexpr double VERTEX_REACHED_MM = 125.0;
+    // Node costs inflated by the robot, brought up to date with the map by each
+    // currentNodeGrid(), under plannerMutex_
+    Costmap costmap_;
+
+    // The nodes of updateObstycle, with those the robot would touch an obstacle from
+    // occupied too
+    std::vector<std::vector<uint8_t>> currentNodeGrid() {
+        std::lock_guard<std::mutex> lock(plannerMutex_);
+        costmap_.Update(slam_->GetMap());
+        return costmap_.NodeGrid();
+    }
+
+    enum class PathQuery {
+        NewGoal,    // first plan towards a goal: most are never replanned
+        Replan      // towards the same goal, after the grid changed
+    };
+
+    // A new goal is planned by jump point search, which keeps no state and expands
+    // far fewer nodes than a fresh D* Lite. Replans use the D* Lite planner kept for
+    // the goal, made on the first replan: moved to start and given the nodes that
+    // changed since its last plan, it repairs its search instead of starting over.
+    // Both plan 8-connected on the inflated nodes, and the path is returned as the
+    // vertices left after dropping those in line of sight. D* Lite also weighs the
+    // costmap's decay band, which jump point search cannot, and smoothing keeps to the
+    // clearance the planner left.
+    std::vector<std::pair<int, int>> findPath(const std::vector<std::vector<uint8_t>>& node_grid,
+                                              std::pair<int, int> start, std::pair<int, int> goal,
+                                              PathQuery query) {
+        if (node_grid.empty() || node_grid[0].empty()) return {};
+        int h = node_grid.size(), w = node_grid[0].size();
+        if (start.first < 0 || start.second < 0 || start.first >= w || start.second >= h) return {};
+        if (goal.first < 0 || goal.second < 0 || goal.first >= w || goal.second >= h) return {};
+
+        std::lock_guard<std::mutex> lock(plannerMutex_);
+        // A robot that has come too close to a wall must still be able to leave
+        const uint8_t* costs = nullptr;
+        std::vector<std::vector<uint8_t>> grid_copy;
+        const std::vector<std::vector<uint8_t>>* grid = &node_grid;
+        if (costmap_.NodesPerSide() == w && costmap_.NodesPerSide() == h) {
+            costs = costmap_.Costs().data();
+            if (costs[start.second * w + start.first] == Costmap::INSCRIBED) {
+                grid_copy = node_grid;
+                grid_copy[start.second][start.first] = 0;
+                grid = &grid_copy;
+            }
+        }
+
+        if (query == PathQuery::NewGoal) {
+            planner_.reset();
+            long long expanded = 0;
+            auto path = PathFinder::FindPathJPS(*grid, start, goal, &expanded);
+            std::cout << "[RobotHandler] Planned by jump point search with " << expanded << " expansions" << std::endl;
+            return PathFinder::SmoothPath(*grid, path, costs);
+        }
+        if (!planner_ || planner_->goal() != goal || planner_->width() != w || planner_->height() != h) {
+            planner_ = std::make_unique<PathFinder::DStarLite>(*grid, start, goal, true, costs);
+        } else {
+            planner_->moveStart(start);
+            int changed = planner_->updateGrid(*grid, costs);
+            std::cout << "[RobotHandler] Repairing the plan for " << changed << " changed nodes" << std::endl;
+        }
+        long long expanded = planner_->expansions();
+        auto path = planner_->run();
+        std::cout << "[RobotHandler] Planned with " << planner_->expansions() - expanded << " expansions" << std::endl;
+        return PathFinder::SmoothPath(*grid, path, costs);
+    }
 
     void trackPathWithExplorationCheck(const std::vector<std::pair<int, int>>& path) {
         if (path.empty()) return;
-        float pixels_per_meter = static_cast<float>(map_pixels_) / map_meters_;
-        int node_size_px = static_cast<int>(std::round(0.25f * pixels_per_meter));
-        float node_size_mm = 0.25f * 1000.0f; 
+        float node_size_mm = 0.25f * 1000.0f;
 
         std::vector<std::pair<int, int>> current_path = path;
         size_t path_idx = 0;
         auto goal_node = path.back();
         int recalc_attempts = 0;
 
-        unsigned char* map_data = nullptr;
         auto node_grid = std::vector<std::vector<uint8_t>>();
 
         auto last_map_update = std::chrono::steady_clock::now();
 
+        // From where the robot is, towards the same goal; false once it should give up
+        auto replan = [&](const Position& pos) {
+            node_grid = currentNodeGrid();
+            auto new_path = findPath(node_grid, {static_cast<int>(pos.x_mm / node_size_mm),
+                                                 static_cast<int>(pos.y_mm / node_size_mm)},
+                                     goal_node, PathQuery::Replan);
+            recalc_attempts++;
+            if (new_path.empty() || recalc_attempts > 5) {
+                std::cout << "[RobotHandler] Replanning failed or too many attempts, aborting." << std::endl;
+                return false;
+            }
+            std::cout << "[RobotHandler] New path size: " << new_path.size() << std::endl;
+            current_path = new_path;
+            path_idx = 0;
+            return true;
+        };
+
         while (path_idx < current_path.size() && exploring_) {
-            const auto& node = current_path[path_idx];
+            const auto node = current_path[path_idx];
             bool reached = false;
             int stuck_counter = 0;
             while (!reached && exploring_) {
                 Position pos = slam_->GetPosition();
-                int x_node = static_cast<int>(pos.x_mm / node_size_mm);
-                int y_node = static_cast<int>(pos.y_mm / node_size_mm);
 
                 auto now = std::chrono::steady_clock::now();
                 if (now - last_map_update > std::chrono::seconds(1)) {
-                    if (map_data) delete[] map_data;
-                    map_data = slam_->GetMap();
-                    node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
+                    node_grid = currentNodeGrid();
                     last_map_update = now;
                 }
 
                 if (detectCollisionByScan()) {
                     std::cout << "[RobotHandler] Collision detected by scan, replanning..." << std::endl;
-                    if (map_data) delete[] map_data;
-                    map_data = slam_->GetMap();
-                    node_grid = PathFinder::updateObstycle(map_data, map_meters_, map_pixels_);
-                    auto new_path = PathFinder::FindPathDStarLite(node_grid, {x_node, y_node}, goal_node);
-                    recalc_attempts++;
-                    if (new_path.empty() || recalc_attempts > 5) {
-                        std::cout << "[RobotHandler] Replanning failed or too many attempts, aborting." << std::endl;
-                        arduino_->stop();
-                        if (map_data) delete[] map_data;
-                        return;
-                    }
-                    std::cout << "[RobotHandler] New path size: " << new_path.size() << std::endl;
-                    current_path = new_path;
-                    path_idx = 0;
-                    continue;
+                    arduino_->stop();
+                    if (!replan(pos)) return;
+                    break;
                 }
 
-                if (std::abs(x_node - node.first) <= 0 && std::abs(y_node - node.second) <= 0) {
+                // Towards the centre of the vertex from where we are: after smoothing,
+                // vertices can be many nodes apart
+                double dx = (node.first + 0.5) - pos.x_mm / node_size_mm;
+                double dy = (node.second + 0.5) - pos.y_mm / node_size_mm;
+                if (std::sqrt(dx * dx + dy * dy) * node_size_mm <= VERTEX_REACHED_MM) {
                     reached = true;
                     arduino_->stop();
                     break;
                 }
 
-                int dx = node.first - x_node;
-                int dy = node.second - y_node;
-
                 double angle_to_target = std::atan2(dy, dx) * 180.0 / M_PI;
                 double angle_diff = angle_to_target - pos.theta_degrees;
                 while (angle_diff > 180.0) angle_diff -= 360.0;
@@ -305,17 +375,18 @@ private:
 
                 std::this_thread::sleep_for(std::chrono::milliseconds(100));
                 if (++stuck_counter > 100) {
+                    std::cout << "[RobotHandler] Stuck before node (" << node.first << ", " << node.second << "), replanning..." << std::endl;
                     arduino_->stop();
-                    if (map_data) delete[] map_data;
+                    if (!replan(slam_->GetPosition())) return;
                     break;
                 }
             }
             if (!exploring_) {
                 arduino_->stop();
-                if (map_data) delete[] map_data;
                 break;
             }
-            ++path_idx;
+            // A replan starts the new path from its first vertex
+            if (reached) ++path_idx;
         }
         arduino_->stop();
     }
@@ -329,7 +400,7 @@ private:
     bool detectCollisionByScan() {
         Position pos = slam_->GetPosition();
         auto scan = slam_->GetLatestData();
-        for (const auto& pt : scan) {
+        for (const auto& pt : *scan) {
             double dx = pt.x - pos.x_mm;
             double dy = pt.y - pos.y_mm;
             double dist = std::sqrt(dx * dx + dy * dy);
@@ -1,16 +1,123 @@
 #pragma once
 #include "ldlidar_driver/ldlidar_driver_linux.h"
+#include <algorithm>
 #include <atomic>
-#include <mutex>
+#include <chrono>
+#include <cmath>
 #include <thread>
 #include <vector>
+#include <memory>
 #include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "BoundedQueue.h"
+#include "GlobalMap.h"
+#include "MapSnapshot.h"
+#include "MotionModel.h"
+#include "HeadingHistogram.h"
+#include "MapCheckpoint.h"
+#include "ScanOdometry.h"
+#include "Seqlock.h"
+#include "SlamJournal.h"
 
+struct SLAMStageStats {
+    uint64_t frames = 0;
+    uint64_t dropped = 0;
+    double last_ms = 0.0;
+    double avg_ms = 0.0;
+    double max_ms = 0.0;
+
+    void record(double ms) {
+        ++frames;
+        last_ms = ms;
+        avg_ms = (frames == 1) ? ms : 0.9 * avg_ms + 0.1 * ms;
+        max_ms = std::max(max_ms, ms);
+    }
+};
+
+// preprocess: scan filtering and scan construction (acquisition thread)
+// slam:       RMHC matching and map integration (SLAM thread)
+// publish:    pose and map snapshot publication (SLAM thread)
+// keyframe:   slam time of frames integrated into the map
+// tracking:   slam time of frames only matched against the map
+struct SLAMPipelineStats {
+    SLAMStageStats preprocess;
+    SLAMStageStats slam;
+    SLAMStageStats publish;
+    SLAMStageStats keyframe;
+    SLAMStageStats tracking;
+    uint64_t idle_skipped = 0;      // frames not processed at all while standing still
+    double cpu_saved_ms = 0.0;      // estimated time saved by tracking-only and skipped frames
+    bool stationary = false;
+    double revolution_ms = 0.0;     // measured lidar revolution period
+    double search_budget_ms = 0.0;  // matching budget given to the last frame
+    int last_evaluations = 0;       // scan-to-map evaluations used by the last search
+    double cache_hit_rate = 0.0;    // share of search candidates scored from the score cache
+    uint64_t odometry_only = 0;     // frames integrated without a search because we were behind
+    double sigma_xy_mm = 0.0;       // RMHC search window used for the last frame
+    double sigma_theta_degrees = 0.0;
+    uint64_t scan_odometry = 0;     // frames whose prior came from scan-to-scan matching
+    uint64_t heading_prior = 0;     // frames whose turn came from histogram correlation
+};
+
+// Runs SLAM as two pipelined stages: the acquisition thread filters each lidar
+// revolution and builds its scans while the SLAM thread matches and integrates
+// the previous one. Matching and integration stay on one thread so every match
+// sees the map integrated from the frame before it. Only the newest frame is
+// kept waiting; older ones are dropped.
+//
+// Both threads are woken by frames rather than timers. Each frame gets a search
+// budget of SEARCH_CPU_FRACTION of the measured revolution period, minus the time
+// it already waited, converted into an RMHC evaluation cap at the time the
+// searches took per evaluation. A frame that arrives
+// with no budget left, or with a newer frame already queued, is integrated at the
+// odometry pose without searching.
+//
+// With a MotionModel, the motion since the previous frame is the starting guess
+// for the search and its uncertainty sets the RMHC sigmas, capped at the sigmas
+// configured on the RMHC_SLAM object. Without one, the robot is assumed to stand
+// still and the configured sigmas are used as they are. A HeadingHistogram
+// replaces the guessed turn and its sigma with the one measured from the scans.
+// With a ScanOdometry, each scan is matched against the previous one starting
+// from that guess, and a converged match replaces it with its own, tighter, prior.
+//
+// Frames below the keyframe thresholds configured on the SLAM object are only
+// tracked. Once the pose stops changing and no motion is commanded, only one
+// frame per IDLE_FRAME_PERIOD_MS is processed until something moves again.
+//
+// With a SubmapSLAM, the map and position are those of the current submap, and a
+// GlobalMap view is published with every map snapshot. A ParticleSLAM searches its
+// particles side by side, so the evaluation cap applies to each of them.
+//
+// A map restored from a MapCheckpoint, or a pose found by relocalization, replaces
+// the map and pose on the SLAM thread, between two frames.
+//
+// With a SlamJournal, every keyframe is journaled as it is integrated, and the
+// map is checkpointed whenever the journal asks for it, and after every restore.
 class SLAMHandler {
 public:
-    SLAMHandler(ldlidar::LDLidarDriverLinuxInterface* lidarDriver, SinglePositionSLAM* slam, unsigned int map_size = 1000)
-        : lidarDriver_(lidarDriver), isRunning_(false), slam_(slam), map_size_(map_size)
+    SLAMHandler(ldlidar::LDLidarDriverLinuxInterface* lidarDriver, SinglePositionSLAM* slam, unsigned int map_size = 1000,
+                MotionModel* motionModel = nullptr, ScanOdometry* scanOdometry = nullptr,
+                HeadingHistogram* headingHistogram = nullptr, SlamJournal* journal = nullptr)
+        : lidarDriver_(lidarDriver), isRunning_(false), slam_(slam), map_size_(map_size),
+          rmhc_(dynamic_cast<RMHC_SLAM*>(slam)), submaps_(dynamic_cast<SubmapSLAM*>(slam)), motionModel_(motionModel), scanOdometry_(scanOdometry),
+          headingHistogram_(headingHistogram), journal_(journal),
+          max_sigma_xy_mm_(rmhc_ ? rmhc_->sigma_xy_mm : 0.0),
+          max_sigma_theta_degrees_(rmhc_ ? rmhc_->sigma_theta_degrees : 0.0),
+          pendingFrames_(PIPELINE_DEPTH), framePool_(PIPELINE_DEPTH + 2),
+          revolutionMs_(NOMINAL_REVOLUTION_MS), msPerEvaluation_(0.0)
     {
+        // The first snapshot reads the whole map, so drop the initial "all changed" box.
+        int xmin, ymin, xmax, ymax;
+        slam_->getmapchanges(xmin, ymin, xmax, ymax);
+        mapSnapshot_.store(MapSnapshot::capture(*slam_, map_size_));
+        if (submaps_) {
+            globalMap_.store(GlobalMap::capture(*submaps_, mapSnapshot_.load()));
+        }
+        position_.store(slam_->getpos());
+        latestScan_.store(std::make_shared<const ldlidar::Points2D>());
+        for (int i = 0; i < PIPELINE_DEPTH + 2; ++i) {
+            framePool_.push(std::make_unique<ScanFrame>(*slam_));
+        }
     }
 
     ~SLAMHandler() {
@@ -21,6 +128,8 @@ public:
         if (isRunning_) return;
 
         isRunning_ = true;
+        pendingFrames_.reopen();
+        slamThread_ = std::thread(&SLAMHandler::RunSlam, this);
         lidarThread_ = std::thread(&SLAMHandler::Run, this);
     }
 
@@ -28,67 +137,340 @@ public:
         if (!isRunning_) return;
 
         isRunning_ = false;
+        pendingFrames_.close();
         if (lidarThread_.joinable()) {
             lidarThread_.join();
         }
+        if (slamThread_.joinable()) {
+            slamThread_.join();
+        }
+    }
+
+    // Latest filtered scan; the returned points are never modified.
+    std::shared_ptr<const ldlidar::Points2D> GetLatestData() const {
+        return latestScan_.load();
+    }
+
+    // Latest published map; never blocks on the SLAM thread.
+    std::shared_ptr<const MapSnapshot> GetMap() const {
+        return mapSnapshot_.load();
+    }
+
+    // Latest published submaps and current submap; null unless SLAM is a SubmapSLAM.
+    std::shared_ptr<const GlobalMap> GetGlobalMap() const {
+        return globalMap_.load();
     }
 
-    std::vector<ldlidar::PointData> GetLatestData() {
-        std::lock_guard<std::mutex> lock(dataMutex_);
-        return laserScanPoints_;
+    Position GetPosition() const {
+        return position_.load();
     }
 
-    unsigned char* GetMap() {
-        std::lock_guard<std::mutex> lock(dataMutex_);
-        unsigned char* mapbytes = new unsigned char[map_size_ * map_size_];
-        slam_->getmap(mapbytes);
-        return mapbytes;
+    // Replaces the map and pose with map, which must be as large as the SLAM map,
+    // before the next frame; a newer map replaces one not yet applied.
+    void RestoreMap(std::shared_ptr<MapCheckpoint::Map> map) {
+        pendingRestore_.store(std::move(map));
     }
 
-    Position GetPosition() {
-        std::lock_guard<std::mutex> lock(dataMutex_);
-        return slam_->getpos();
+    // Moves the pose, e.g. to one found by a Relocalizer, before the next frame.
+    void SetPosition(const Position& position) {
+        pendingPose_.store(std::make_shared<const Position>(position));
+    }
+
+    SLAMPipelineStats GetPipelineStats() const {
+        SLAMPipelineStats stats = slamStats_.load();
+        stats.preprocess = preprocessStats_.load();
+        stats.idle_skipped = idleSkipped_.load();
+        stats.cpu_saved_ms += stats.idle_skipped * (stats.preprocess.avg_ms + stats.tracking.avg_ms);
+        return stats;
     }
 
 private:
+    static constexpr int PIPELINE_DEPTH = 1;
+    static constexpr int FRAME_WAIT_MS = 100;
+    static constexpr int IDLE_RETRY_MS = 100;
+    static constexpr double NOMINAL_REVOLUTION_MS = 1000.0 / 6.0;
+    static constexpr double SEARCH_CPU_FRACTION = 0.6;
+    static constexpr int MIN_EVALUATIONS = 50;
+    // RMHC sigmas as a multiple of the motion prior's 1-sigma uncertainty
+    static constexpr double PRIOR_SIGMA_SCALE = 2.0;
+    // Pose change between two frames below which the robot counts as standing still
+    static constexpr double STATIONARY_XY_MM = 10.0;
+    static constexpr double STATIONARY_THETA_DEGREES = 1.0;
+    static constexpr double IDLE_FRAME_PERIOD_MS = 1000.0;
+
+    using FramePtr = std::unique_ptr<ScanFrame>;
+    using Clock = std::chrono::steady_clock;
+
+    struct PendingFrame {
+        FramePtr frame;
+        Clock::time_point captured;
+        double revolution_ms;
+        double prior_sigma_xy_mm;       // <= 0 without a prior on the translation
+        double prior_sigma_theta_degrees;   // <= 0 without a prior on the turn
+        bool scan_odometry;             // prior from scan-to-scan matching
+        bool heading_prior;             // turn from histogram correlation
+        PoseChange poseChange;          // the scans were built with, for the journal
+        std::vector<int> distances;     // the raw scan, only kept for the journal
+    };
+
+    static double MillisecondsSince(Clock::time_point start) {
+        return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+    }
+
+    // Acquisition and preprocessing stage.
     void Run() {
         ldlidar::Points2D laserScanPoints;
+        std::vector<int> distances;
+        SLAMStageStats stats;
+        Clock::time_point lastFrame;
+        Clock::time_point lastSent = Clock::now();
         while (isRunning_ && ldlidar::LDLidarDriverLinuxInterface::Ok()) {
-            switch (lidarDriver_->GetLaserScanData(laserScanPoints, 2000)) {
+            switch (lidarDriver_->WaitLaserScanData(laserScanPoints, FRAME_WAIT_MS, 2000)) {
             case ldlidar::LidarStatus::NORMAL:
             {
-                std::lock_guard<std::mutex> lock(dataMutex_);
-                laserScanPoints_ = laserScanPoints;
+                auto start = Clock::now();
+                if (stats.frames > 0) {
+                    double period = std::chrono::duration<double, std::milli>(start - lastFrame).count();
+                    if (period < 4 * revolutionMs_) {
+                        revolutionMs_ = 0.8 * revolutionMs_ + 0.2 * period;
+                    }
+                }
+                lastFrame = start;
+                latestScan_.store(std::make_shared<const ldlidar::Points2D>(laserScanPoints));
 
-                std::vector<int> distances;
-                distances.reserve(laserScanPoints.size());
+                bool commanded = motionModel_ && motionModel_->moving();
+                if (stationary_ && !commanded && MillisecondsSince(lastSent) < IDLE_FRAME_PERIOD_MS) {
+                    ++idleSkipped_;
+                    break;
+                }
+
+                distances.clear();
                 for (const auto& point : laserScanPoints) {
                     distances.push_back(static_cast<int>(point.distance));
                 }
 
-                slam_->update(distances.data());
+                auto recycled = framePool_.tryPop();
+                FramePtr frame = recycled ? std::move(*recycled) : std::make_unique<ScanFrame>(*slam_);
+                PoseChange poseChange;
+                double sigma_xy_mm = 0.0, sigma_theta_degrees = 0.0;
+                if (motionModel_) {
+                    MotionModel::Increment motion = motionModel_->take(start);
+                    poseChange = motion.poseChange;
+                    sigma_xy_mm = motion.sigma_xy_mm;
+                    sigma_theta_degrees = motion.sigma_theta_degrees;
+                } else {
+                    // no motion, but the elapsed time still counts towards the keyframe interval
+                    poseChange = PoseChange(0.0, 0.0, std::chrono::duration<double>(start - lastSent).count());
+                }
+                lastSent = start;
+                bool turned = false;
+                if (headingHistogram_) {
+                    HeadingHistogram::Estimate turn = headingHistogram_->match(distances);
+                    if (turn.valid) {
+                        poseChange = PoseChange(poseChange.dxy_mm, turn.dtheta_degrees, poseChange.dt_seconds);
+                        sigma_theta_degrees = turn.sigma_degrees;
+                        turned = true;
+                    }
+                }
+                bool matched = false;
+                if (scanOdometry_) {
+                    ScanOdometry::Estimate scanMotion = scanOdometry_->match(distances, poseChange);
+                    if (scanMotion.valid) {
+                        poseChange = scanMotion.poseChange;
+                        sigma_xy_mm = scanMotion.sigma_xy_mm;
+                        sigma_theta_degrees = scanMotion.sigma_theta_degrees;
+                        matched = true;
+                    }
+                }
+                slam_->buildScanFrame(*frame, distances.data(), poseChange);
+
+                PendingFrame pending{ std::move(frame), start, revolutionMs_, sigma_xy_mm, sigma_theta_degrees, matched, turned,
+                                      poseChange, journal_ ? distances : std::vector<int>() };
+                if (auto stale = pendingFrames_.push(std::move(pending))) {
+                    ++stats.dropped;
+                    framePool_.push(std::move(stale->frame));
+                }
+                stats.record(MillisecondsSince(start));
+                preprocessStats_.store(stats);
                 break;
             }
             case ldlidar::LidarStatus::DATA_TIME_OUT:
             {
                 LOG_ERROR_LITE("Point cloud data timeout. Check your lidar device.", "");
                 lidarDriver_->Stop();
+                std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_RETRY_MS));
                 break;
             }
             case ldlidar::LidarStatus::DATA_WAIT:
                 break;
             default:
+                std::this_thread::sleep_for(std::chrono::milliseconds(IDLE_RETRY_MS));
                 break;
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(166)); // 6Hz
+        }
+    }
+
+    // Matching, integration and publication stage.
+    void RunSlam() {
+        SLAMPipelineStats stats;
+        Position previous = slam_->getpos();
+        while (isRunning_) {
+            if (auto restore = pendingRestore_.exchange(nullptr)) {
+                ApplyRestore(*restore);
+                previous = slam_->getpos();
+            }
+            if (auto pose = pendingPose_.exchange(nullptr)) {
+                Position moved = *pose;
+                slam_->setpos(moved);
+                position_.store(slam_->getpos());
+                previous = slam_->getpos();
+            }
+
+            auto pending = pendingFrames_.pop(std::chrono::milliseconds(FRAME_WAIT_MS));
+            if (!pending) continue;
+
+            bool searched = PlanSearch(*pending, stats);
+            stats.scan_odometry += pending->scan_odometry;
+            stats.heading_prior += pending->heading_prior;
+
+            auto start = Clock::now();
+            slam_->update(*pending->frame);
+            double slam_ms = MillisecondsSince(start);
+            stats.slam.record(slam_ms);
+            if (slam_->last_frame_keyframe) {
+                stats.keyframe.record(slam_ms);
+            } else {
+                stats.tracking.record(slam_ms);
+                stats.cpu_saved_ms += std::max(stats.keyframe.avg_ms - slam_ms, 0.0);
+            }
+
+            Position current = slam_->getpos();
+            double dx = current.x_mm - previous.x_mm, dy = current.y_mm - previous.y_mm;
+            double dtheta = std::remainder(current.theta_degrees - previous.theta_degrees, 360.0);
+            stats.stationary = std::hypot(dx, dy) < STATIONARY_XY_MM && std::fabs(dtheta) < STATIONARY_THETA_DEGREES;
+            stationary_ = stats.stationary;
+            previous = current;
+
+            if (searched) {
+                stats.last_evaluations = rmhc_->last_evaluations;
+                long long lookups = 0, hits = 0;
+                rmhc_->getcachestats(lookups, hits);
+                stats.cache_hit_rate = lookups ? static_cast<double>(hits) / lookups : 0.0;
+                // The search alone: a keyframe's map integration and likelihood field
+                // refresh would shrink the cap of the frames after it. Cache hits count
+                // neither here nor against the cap, so their time is spread over the rest
+                double per_evaluation = slam_->last_search_seconds * 1000 / std::max(rmhc_->last_evaluations, 1);
+                msPerEvaluation_ = (msPerEvaluation_ > 0.0) ? 0.8 * msPerEvaluation_ + 0.2 * per_evaluation
+                                                            : per_evaluation;
+            }
+
+            if (journal_ && slam_->last_frame_keyframe) {
+                journal_->Append(pending->distances, pending->poseChange, slam_->getkeyframepos(),
+                                 slam_->map_quality, slam_->hole_width_mm);
+            }
+
+            start = Clock::now();
+            position_.store(current);
+            PublishMap();
+            if (journal_ && journal_->CheckpointDue()) {
+                journal_->Checkpoint(mapSnapshot_.load(), current);
+            }
+            stats.publish.record(MillisecondsSince(start));
+
+            framePool_.push(std::move(pending->frame));
+            slamStats_.store(stats);
+        }
+    }
+
+    // Sets the RMHC evaluation cap for this frame, or disables the search when
+    // there is no time left. Returns whether a search will run.
+    bool PlanSearch(const PendingFrame& pending, SLAMPipelineStats& stats) {
+        if (!rmhc_) return false;
+
+        double budget_ms = pending.revolution_ms * SEARCH_CPU_FRACTION - MillisecondsSince(pending.captured);
+        stats.revolution_ms = pending.revolution_ms;
+        stats.search_budget_ms = std::max(budget_ms, 0.0);
+
+        if (budget_ms <= 0.0 || pendingFrames_.size() > 0) {
+            rmhc_->search_enabled = false;
+            ++stats.odometry_only;
+            stats.last_evaluations = 0;
+            return false;
+        }
+
+        rmhc_->search_enabled = true;
+        rmhc_->sigma_xy_mm = (pending.prior_sigma_xy_mm > 0.0)
+            ? std::max(rmhc_->min_sigma_xy_mm,
+                       std::min(PRIOR_SIGMA_SCALE * pending.prior_sigma_xy_mm, max_sigma_xy_mm_))
+            : max_sigma_xy_mm_;
+        rmhc_->sigma_theta_degrees = (pending.prior_sigma_theta_degrees > 0.0)
+            ? std::max(rmhc_->min_sigma_theta_degrees,
+                       std::min(PRIOR_SIGMA_SCALE * pending.prior_sigma_theta_degrees, max_sigma_theta_degrees_))
+            : max_sigma_theta_degrees_;
+        stats.sigma_xy_mm = rmhc_->sigma_xy_mm;
+        stats.sigma_theta_degrees = rmhc_->sigma_theta_degrees;
+        rmhc_->max_evaluations = (msPerEvaluation_ > 0.0)
+            ? std::max(MIN_EVALUATIONS, static_cast<int>(budget_ms / msPerEvaluation_))
+            : 0;
+        return true;
+    }
+
+    // Only called from the SLAM thread, which is the only writer of the map.
+    void PublishMap() {
+        int xmin, ymin, xmax, ymax;
+        if (slam_->getmapchanges(xmin, ymin, xmax, ymax)) {
+            mapSnapshot_.store(mapSnapshot_.load()->next(*slam_, xmin, ymin, xmax, ymax));
+            if (submaps_) {
+                globalMap_.store(GlobalMap::capture(*submaps_, mapSnapshot_.load(), globalMap_.load().get()));
+            }
+        }
+    }
+
+    // Only called from the SLAM thread. Publishes the whole restored map; with
+    // submaps, the view starts again from the restored one alone.
+    void ApplyRestore(MapCheckpoint::Map& map) {
+        slam_->restore(map.bytes.data(), map.position);
+        if (submaps_) {
+            submaps_->setsubmaporigin(map.origin_x_pixels, map.origin_y_pixels);
+        }
+        int xmin, ymin, xmax, ymax;
+        slam_->getmapchanges(xmin, ymin, xmax, ymax);
+        mapSnapshot_.store(mapSnapshot_.load()->next(*slam_, 0, 0, map_size_ - 1, map_size_ - 1));
+        if (submaps_) {
+            globalMap_.store(GlobalMap::capture(*submaps_, mapSnapshot_.load()));
+        }
+        position_.store(slam_->getpos());
+        if (journal_) {
+            journal_->Checkpoint(mapSnapshot_.load(), slam_->getpos());
         }
     }
 
     ldlidar::LDLidarDriverLinuxInterface* lidarDriver_;
     std::atomic<bool> isRunning_;
     std::thread lidarThread_;
-    std::mutex dataMutex_;
-    std::vector<ldlidar::PointData> laserScanPoints_;
+    std::thread slamThread_;
     SinglePositionSLAM* slam_;
     unsigned int map_size_;
+    RMHC_SLAM* rmhc_;
+    SubmapSLAM* submaps_;
+    MotionModel* motionModel_;
+    ScanOdometry* scanOdometry_;
+    HeadingHistogram* headingHistogram_;
+    SlamJournal* journal_;
+    const double max_sigma_xy_mm_;
+    const double max_sigma_theta_degrees_;
+    BoundedQueue<PendingFrame> pendingFrames_;
+    BoundedQueue<FramePtr> framePool_;
+    std::atomic<std::shared_ptr<const MapSnapshot>> mapSnapshot_;
+    std::atomic<std::shared_ptr<const GlobalMap>> globalMap_;
+    std::atomic<std::shared_ptr<MapCheckpoint::Map>> pendingRestore_;
+    std::atomic<std::shared_ptr<const Position>> pendingPose_;
+    Seqlock<Position> position_;
+    std::atomic<std::shared_ptr<const ldlidar::Points2D>> latestScan_;
+    Seqlock<SLAMStageStats> preprocessStats_;
+    Seqlock<SLAMPipelineStats> slamStats_;
+    std::atomic<double> revolutionMs_;
+    std::atomic<bool> stationary_{false};
+    std::atomic<uint64_t> idleSkipped_{0};
+    double msPerEvaluation_;
 };
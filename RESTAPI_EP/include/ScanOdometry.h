@@ -0,0 +1,253 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "breezySLAM/cpp/PoseChange.hpp"
+
+// Scan-to-scan odometry for robots without wheel encoders: point-to-line ICP of each
+// lidar revolution against the previous one. Rays are laid out the way breezySLAM lays
+// out a scan (ray i at -detection/2 + i * detection / (size - 1) degrees), so the
+// estimate is in the frame SLAM works in. The previous scan's points are bucketed in
+// a grid hash for the nearest-neighbour queries and carry a surface normal taken
+// from their neighbours along the scan.
+class ScanOdometry {
+public:
+    struct Estimate {
+        bool valid = false;
+        PoseChange poseChange;          // forward along the old heading, then the turn
+        double sigma_xy_mm = 0.0;
+        double sigma_theta_degrees = 0.0;
+        int matches = 0;
+        int iterations = 0;
+        double rms_mm = 0.0;
+    };
+
+    // offset_mm: forward offset of the lidar from the centre of rotation
+    ScanOdometry(int scan_size, double detection_angle_degrees, double offset_mm, int detection_margin = 0)
+        : offset_mm_(offset_mm), first_ray_(detection_margin + 1), end_ray_(scan_size - detection_margin)
+    {
+        for (int i = 0; i < scan_size; ++i) {
+            double angle = (-detection_angle_degrees / 2 + i * detection_angle_degrees / (scan_size - 1)) * M_PI / 180.0;
+            ray_cos_.push_back(std::cos(angle));
+            ray_sin_.push_back(std::sin(angle));
+        }
+    }
+
+    // Motion from the previous call's scan to this one (one distance per ray, 0 = no
+    // return), searched from `guess`. Invalid on the first call and when ICP does not
+    // converge; the scan becomes the reference for the next call either way.
+    Estimate match(const std::vector<int>& distances, const PoseChange& guess) {
+        BuildPoints(distances, current_);
+        Estimate estimate;
+        if (previous_.size() >= MIN_MATCHES && current_.size() >= MIN_MATCHES) {
+            estimate = Align(guess);
+        }
+        std::swap(previous_, current_);
+        BuildReference();
+        return estimate;
+    }
+
+    void reset() {
+        previous_.clear();
+    }
+
+private:
+    static constexpr size_t MIN_MATCHES = 40;
+    static constexpr int MAX_POINTS = 300;          // current-scan points used per iteration
+    static constexpr int MAX_ITERATIONS = 20;
+    static constexpr double MIN_RANGE_MM = 150.0;
+    static constexpr double MAX_RANGE_MM = 10000.0;
+    // Correspondences farther than this are dropped; the gate shrinks every iteration
+    static constexpr double MATCH_START_MM = 400.0;
+    static constexpr double MATCH_FINAL_MM = 100.0;
+    static constexpr double MATCH_SHRINK = 0.7;
+    static constexpr double CONVERGED_MM = 0.5;
+    static constexpr double CONVERGED_RAD = 0.001;
+    // Neighbours along the scan farther apart than this are on different surfaces
+    static constexpr double NORMAL_GAP_MM = 200.0;
+    static constexpr double CELL_MM = 200.0;
+    // Keeps steps small along directions the scene does not constrain (corridors)
+    static constexpr double DAMPING = 1e-3;
+    // The rotation is solved in mm of arc at this radius, to weigh like the translation
+    static constexpr double ANGLE_SCALE_MM = 1000.0;
+    // 1-sigma error of a converged match, on top of its rms residual
+    static constexpr double SIGMA_XY_MM = 15.0;
+    static constexpr double SIGMA_THETA_DEGREES = 1.5;
+
+    struct Point {
+        double x, y;
+        double nx = 0.0, ny = 0.0;      // unit normal, zero when unknown
+    };
+
+    void BuildPoints(const std::vector<int>& distances, std::vector<Point>& points) const {
+        points.clear();
+        int end = std::min<int>(end_ray_, static_cast<int>(distances.size()));
+        for (int i = first_ray_; i < end; ++i) {
+            double d = distances[i];
+            if (d < MIN_RANGE_MM || d > MAX_RANGE_MM) continue;
+            points.push_back({ d * ray_cos_[i], d * ray_sin_[i] });
+        }
+    }
+
+    // Normals and grid hash of previous_.
+    void BuildReference() {
+        size_t n = previous_.size();
+        for (size_t i = 0; i < n; ++i) {
+            const Point& prev = previous_[(i + n - 1) % n];
+            const Point& next = previous_[(i + 1) % n];
+            Point& p = previous_[i];
+            bool has_prev = std::hypot(p.x - prev.x, p.y - prev.y) < NORMAL_GAP_MM;
+            bool has_next = std::hypot(p.x - next.x, p.y - next.y) < NORMAL_GAP_MM;
+            double tx = (has_next ? next.x : p.x) - (has_prev ? prev.x : p.x);
+            double ty = (has_next ? next.y : p.y) - (has_prev ? prev.y : p.y);
+            double len = std::hypot(tx, ty);
+            p.nx = len > 0.0 ? -ty / len : 0.0;
+            p.ny = len > 0.0 ? tx / len : 0.0;
+        }
+
+        if (n == 0) return;
+        double xmin = previous_[0].x, xmax = xmin, ymin = previous_[0].y, ymax = ymin;
+        for (const Point& p : previous_) {
+            xmin = std::min(xmin, p.x);
+            xmax = std::max(xmax, p.x);
+            ymin = std::min(ymin, p.y);
+            ymax = std::max(ymax, p.y);
+        }
+        gridX_ = xmin;
+        gridY_ = ymin;
+        gridW_ = static_cast<int>((xmax - xmin) / CELL_MM) + 1;
+        gridH_ = static_cast<int>((ymax - ymin) / CELL_MM) + 1;
+
+        // counting sort of the points by cell
+        cellStart_.assign(gridW_ * gridH_ + 1, 0);
+        for (const Point& p : previous_) {
+            ++cellStart_[Cell(p.x, p.y) + 1];
+        }
+        for (size_t c = 1; c < cellStart_.size(); ++c) {
+            cellStart_[c] += cellStart_[c - 1];
+        }
+        cellPoints_.resize(n);
+        std::vector<int> fill(cellStart_.begin(), cellStart_.end() - 1);
+        for (size_t i = 0; i < n; ++i) {
+            cellPoints_[fill[Cell(previous_[i].x, previous_[i].y)]++] = static_cast<int>(i);
+        }
+    }
+
+    int Cell(double x, double y) const {
+        int cx = static_cast<int>((x - gridX_) / CELL_MM);
+        int cy = static_cast<int>((y - gridY_) / CELL_MM);
+        return cy * gridW_ + cx;
+    }
+
+    // Nearest previous point with a normal within max_mm of (x, y), or -1.
+    int Nearest(double x, double y, double max_mm) const {
+        int cx0 = std::max(0, static_cast<int>(std::floor((x - max_mm - gridX_) / CELL_MM)));
+        int cy0 = std::max(0, static_cast<int>(std::floor((y - max_mm - gridY_) / CELL_MM)));
+        int cx1 = std::min(gridW_ - 1, static_cast<int>(std::floor((x + max_mm - gridX_) / CELL_MM)));
+        int cy1 = std::min(gridH_ - 1, static_cast<int>(std::floor((y + max_mm - gridY_) / CELL_MM)));
+        int best = -1;
+        double best_d2 = max_mm * max_mm;
+        for (int cy = cy0; cy <= cy1; ++cy) {
+            for (int cx = cx0; cx <= cx1; ++cx) {
+                int c = cy * gridW_ + cx;
+                for (int k = cellStart_[c]; k < cellStart_[c + 1]; ++k) {
+                    const Point& q = previous_[cellPoints_[k]];
+                    double d2 = (q.x - x) * (q.x - x) + (q.y - y) * (q.y - y);
+                    if (d2 < best_d2 && (q.nx != 0.0 || q.ny != 0.0)) {
+                        best_d2 = d2;
+                        best = cellPoints_[k];
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+    Estimate Align(const PoseChange& guess) {
+        // Robot motion (forward dxy, turn dtheta) as a motion of the lidar, which sits
+        // offset_mm ahead of the centre of rotation: L = O^-1 * R * O
+        double th = guess.dtheta_degrees * M_PI / 180.0;
+        double tx = guess.dxy_mm + offset_mm_ * (std::cos(th) - 1.0);
+        double ty = offset_mm_ * std::sin(th);
+
+        int stride = std::max<int>(1, static_cast<int>(current_.size()) / MAX_POINTS);
+        double gate = MATCH_START_MM;
+        Estimate estimate;
+        bool converged = false;
+        double sse = 0.0;
+        for (int iter = 0; iter < MAX_ITERATIONS && !converged; ++iter) {
+            double c = std::cos(th), s = std::sin(th);
+            double H[3][3] = {}, g[3] = {};
+            int matches = 0;
+            sse = 0.0;
+            for (size_t i = 0; i < current_.size(); i += stride) {
+                double rx = c * current_[i].x - s * current_[i].y;
+                double ry = s * current_[i].x + c * current_[i].y;
+                double px = rx + tx, py = ry + ty;
+                int j = Nearest(px, py, gate);
+                if (j < 0) continue;
+                const Point& q = previous_[j];
+                double r = q.nx * (px - q.x) + q.ny * (py - q.y);
+                double J[3] = { q.nx, q.ny, (q.ny * rx - q.nx * ry) / ANGLE_SCALE_MM };
+                for (int a = 0; a < 3; ++a) {
+                    for (int b = 0; b < 3; ++b) H[a][b] += J[a] * J[b];
+                    g[a] += J[a] * r;
+                }
+                sse += r * r;
+                ++matches;
+            }
+            estimate.iterations = iter + 1;
+            estimate.matches = matches;
+            if (matches < static_cast<int>(MIN_MATCHES)) return estimate;
+
+            double trace = H[0][0] + H[1][1] + H[2][2];
+            for (int a = 0; a < 3; ++a) H[a][a] += DAMPING * trace;
+            double delta[3];
+            if (!Solve3(H, g, delta)) return estimate;
+            tx -= delta[0];
+            ty -= delta[1];
+            th -= delta[2] / ANGLE_SCALE_MM;
+            converged = std::hypot(delta[0], delta[1]) < CONVERGED_MM
+                        && std::fabs(delta[2] / ANGLE_SCALE_MM) < CONVERGED_RAD
+                        && gate <= MATCH_FINAL_MM;
+            gate = std::max(MATCH_FINAL_MM, gate * MATCH_SHRINK);
+        }
+        if (!converged) return estimate;
+
+        // Back to robot motion: R = O * L * O^-1
+        double dxy = offset_mm_ + tx - offset_mm_ * std::cos(th);
+        estimate.valid = true;
+        estimate.rms_mm = std::sqrt(sse / estimate.matches);
+        estimate.poseChange = PoseChange(dxy, th * 180.0 / M_PI, guess.dt_seconds);
+        estimate.sigma_xy_mm = SIGMA_XY_MM + estimate.rms_mm;
+        estimate.sigma_theta_degrees = SIGMA_THETA_DEGREES;
+        return estimate;
+    }
+
+    // Solves H x = g by Cramer's rule; false if H is singular.
+    static bool Solve3(const double H[3][3], const double g[3], double x[3]) {
+        auto det = [](double a, double b, double c, double d, double e, double f, double g, double h, double i) {
+            return a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+        };
+        double D = det(H[0][0], H[0][1], H[0][2], H[1][0], H[1][1], H[1][2], H[2][0], H[2][1], H[2][2]);
+        if (std::fabs(D) < 1e-12) return false;
+        x[0] = det(g[0], H[0][1], H[0][2], g[1], H[1][1], H[1][2], g[2], H[2][1], H[2][2]) / D;
+        x[1] = det(H[0][0], g[0], H[0][2], H[1][0], g[1], H[1][2], H[2][0], g[2], H[2][2]) / D;
+        x[2] = det(H[0][0], H[0][1], g[0], H[1][0], H[1][1], g[1], H[2][0], H[2][1], g[2]) / D;
+        return true;
+    }
+
+    const double offset_mm_;
+    const int first_ray_;
+    const int end_ray_;
+    std::vector<double> ray_cos_;
+    std::vector<double> ray_sin_;
+    std::vector<Point> previous_;
+    std::vector<Point> current_;
+    std::vector<int> cellStart_;
+    std::vector<int> cellPoints_;
+    double gridX_ = 0.0;
+    double gridY_ = 0.0;
+    int gridW_ = 0;
+    int gridH_ = 0;
+};
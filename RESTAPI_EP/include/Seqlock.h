@@ -0,0 +1,57 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// Single-writer sequence lock for small trivially copyable values (poses, stats).
+// The writer never waits; readers retry only if they overlap a store, which is a
+// handful of word writes. The payload is kept in relaxed atomics so concurrent
+// reads are well defined.
+template <typename T>
+class Seqlock {
+    static_assert(std::is_trivially_copyable_v<T>, "Seqlock needs a trivially copyable type");
+    static constexpr size_t WORDS = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+public:
+    Seqlock() : seq_(0) {
+        for (auto& w : words_) w.store(0, std::memory_order_relaxed);
+    }
+
+    explicit Seqlock(const T& value) : Seqlock() { store(value); }
+
+    // Must only be called from one thread at a time.
+    void store(const T& value) {
+        uint64_t buf[WORDS] = {};
+        std::memcpy(buf, &value, sizeof(T));
+
+        const uint32_t seq = seq_.load(std::memory_order_relaxed);
+        seq_.store(seq + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        for (size_t i = 0; i < WORDS; ++i) {
+            words_[i].store(buf[i], std::memory_order_relaxed);
+        }
+        seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    T load() const {
+        uint64_t buf[WORDS];
+        uint32_t before, after;
+        do {
+            before = seq_.load(std::memory_order_acquire);
+            for (size_t i = 0; i < WORDS; ++i) {
+                buf[i] = words_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            after = seq_.load(std::memory_order_relaxed);
+        } while ((before & 1) || before != after);
+
+        T value;
+        std::memcpy(&value, buf, sizeof(T));
+        return value;
+    }
+
+private:
+    std::atomic<uint32_t> seq_;
+    std::atomic<uint64_t> words_[WORDS];
+};
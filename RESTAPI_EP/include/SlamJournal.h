@@ -0,0 +1,365 @@
+#pragma once
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+#include "breezySLAM/cpp/algorithms.hpp"
+#include "breezySLAM/cpp/PoseChange.hpp"
+#include "breezySLAM/cpp/Position.hpp"
+#include "BoundedQueue.h"
+#include "MapCheckpoint.h"
+#include "MapSnapshot.h"
+
+// Write-ahead journal of the keyframes SLAM integrates into its map, so a crash
+// loses at most the last few instead of the whole map.
+//
+// Every keyframe is journaled as its scan (one u16 distance per ray), the pose
+// change it was de-skewed with, the laser pose it was integrated at and the map
+// settings.
+// Every CHECKPOINT_RECORDS keyframes the map is checkpointed to journal.map with
+// the sequence number of its last record, and journal.bin is started again after
+// it. After a crash, Replay() restores the checkpoint and integrates the records
+// that follow it without matching them again.
+//
+// The SLAM thread only queues records; the files are written on a writer thread.
+// The queue is bounded: when the writer falls behind, the oldest records are
+// dropped, the journal stops at the gap and the next keyframe checkpoints again.
+class SlamJournal {
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr int CHECKPOINT_RECORDS = 200;
+    static constexpr size_t QUEUE_CAPACITY = 256;
+
+    struct Stats {
+        uint64_t appended = 0;
+        uint64_t written = 0;
+        uint64_t dropped = 0;           // queued records lost to a full queue
+        uint64_t checkpoints = 0;
+        uint64_t journal_bytes = 0;
+        std::string error;              // last write error, empty when none
+    };
+
+    struct ReplayStats {
+        uint64_t checkpoint_sequence = 0;
+        uint64_t records = 0;
+        uint64_t sequence = 0;          // last record in the map
+        double load_ms = 0.0;
+        double replay_ms = 0.0;
+        std::string error;
+    };
+
+    // last_sequence: the sequence Replay() ended at, so numbering carries on
+    SlamJournal(const std::string& directory, int scan_size, double mm_per_pixel, uint64_t last_sequence = 0)
+        : mapPath_(directory + "/journal.map"), journalPath_(directory + "/journal.bin"), scanSize_(scan_size),
+          mmPerPixel_(mm_per_pixel), nextSequence_(last_sequence + 1), sinceCheckpoint_(0), queue_(QUEUE_CAPACITY),
+          gap_(true), running_(true), writer_(&SlamJournal::RunWriter, this) {}
+
+    ~SlamJournal() {
+        running_ = false;
+        queue_.close();
+        if (writer_.joinable()) writer_.join();
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    SlamJournal(const SlamJournal&) = delete;
+    SlamJournal& operator=(const SlamJournal&) = delete;
+
+    // SLAM thread: journals a keyframe integrated at position (as from getkeyframepos()).
+    void Append(const std::vector<int>& distances, const PoseChange& poseChange, const Position& position,
+                int map_quality, double hole_width_mm) {
+        Record record;
+        record.header.sequence = nextSequence_++;
+        record.header.x_mm = position.x_mm;
+        record.header.y_mm = position.y_mm;
+        record.header.theta_degrees = position.theta_degrees;
+        record.header.dxy_mm = poseChange.dxy_mm;
+        record.header.dtheta_degrees = poseChange.dtheta_degrees;
+        record.header.dt_seconds = poseChange.dt_seconds;
+        record.header.hole_width_mm = hole_width_mm;
+        record.header.map_quality = map_quality;
+        record.header.count = static_cast<uint32_t>(scanSize_);
+        record.distances.resize(scanSize_, 0);
+        for (int i = 0; i < scanSize_ && i < static_cast<int>(distances.size()); ++i) {
+            record.distances[i] = static_cast<uint16_t>(std::clamp(distances[i], 0, 65535));
+        }
+        ++sinceCheckpoint_;
+        ++appended_;
+        Push(std::move(record));
+    }
+
+    // SLAM thread: whether Checkpoint() should be called now.
+    bool CheckpointDue() const {
+        return gap_ || sinceCheckpoint_ >= CHECKPOINT_RECORDS;
+    }
+
+    // SLAM thread: checkpoints map, which must hold every record appended so far
+    // and nothing else, e.g. right after it was published or restored.
+    void Checkpoint(std::shared_ptr<const MapSnapshot> map, const Position& position) {
+        gap_ = false;
+        sinceCheckpoint_ = 0;
+        Push(CheckpointRequest{ std::move(map), position, nextSequence_ - 1 });
+    }
+
+    Stats GetStats() const {
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        Stats stats = stats_;
+        stats.appended = appended_;
+        stats.dropped = dropped_;
+        return stats;
+    }
+
+    // Before SLAM starts: restores the last checkpoint in directory into slam, which
+    // must have a map of size_pixels, and integrates the journal that follows it.
+    // Returns false, with the reason in stats.error, when there is nothing to replay.
+    static bool Replay(const std::string& directory, SinglePositionSLAM& slam, unsigned int size_pixels,
+                       int scan_size, ReplayStats& stats) {
+        using Clock = std::chrono::steady_clock;
+        auto start = Clock::now();
+        MapCheckpoint::Map map;
+        if (!MapCheckpoint::Load(directory + "/journal.map", map, stats.error)) return false;
+        if (map.size_pixels != size_pixels) {
+            stats.error = "the journal checkpoint has another map size";
+            return false;
+        }
+        slam.restore(map.bytes.data(), map.position);
+        stats.checkpoint_sequence = map.journal_sequence;
+        stats.sequence = map.journal_sequence;
+        stats.load_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        start = Clock::now();
+        std::string path = directory + "/journal.bin";
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return true;
+        struct stat info;
+        size_t length = (::fstat(fd, &info) == 0) ? static_cast<size_t>(info.st_size) : 0;
+        void* mapped = length >= sizeof(FileHeader) ? ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        ::close(fd);
+        if (mapped == MAP_FAILED) return true;
+
+        const unsigned char* data = static_cast<const unsigned char*>(mapped);
+        FileHeader file;
+        std::memcpy(&file, data, sizeof(FileHeader));
+        if (std::memcmp(file.magic, MAGIC, sizeof(file.magic)) == 0 && file.version == VERSION &&
+            static_cast<int>(file.scan_size) == scan_size) {
+            const int quality = slam.map_quality;
+            const double hole_width_mm = slam.hole_width_mm;
+            std::vector<int> distances(scan_size);
+            size_t offset = sizeof(FileHeader);
+            const size_t record_bytes = sizeof(RecordHeader) + scan_size * sizeof(uint16_t);
+            // Records up to the checkpoint are in its map already; stop at a torn
+            // record or a gap
+            for (; offset + record_bytes <= length; offset += record_bytes) {
+                RecordHeader header;
+                std::memcpy(&header, data + offset, sizeof(RecordHeader));
+                if (header.count != file.scan_size || RecordChecksum(header, data + offset + sizeof(RecordHeader)) != header.checksum) {
+                    break;
+                }
+                if (header.sequence <= stats.sequence) continue;
+                if (header.sequence != stats.sequence + 1) break;
+
+                const unsigned char* values = data + offset + sizeof(RecordHeader);
+                for (int i = 0; i < scan_size; ++i) {
+                    uint16_t value;
+                    std::memcpy(&value, values + i * sizeof(uint16_t), sizeof(uint16_t));
+                    distances[i] = value;
+                }
+                PoseChange poseChange(header.dxy_mm, header.dtheta_degrees, header.dt_seconds);
+                Position position(header.x_mm, header.y_mm, header.theta_degrees);
+                slam.map_quality = header.map_quality;
+                slam.hole_width_mm = header.hole_width_mm;
+                slam.integrate(distances.data(), poseChange, position);
+                stats.sequence = header.sequence;
+                ++stats.records;
+            }
+            slam.map_quality = quality;
+            slam.hole_width_mm = hole_width_mm;
+        }
+        ::munmap(mapped, length);
+        stats.replay_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        return true;
+    }
+
+private:
+    static constexpr char MAGIC[8] = { 'B', 'R', 'Z', 'Y', 'J', 'R', 'N', 'L' };
+    static constexpr int WRITER_WAIT_MS = 200;
+
+    struct FileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t scan_size;
+        uint64_t base_sequence;         // of the checkpoint the records follow
+        uint64_t reserved;
+    };
+    static_assert(sizeof(FileHeader) == 32, "the journal header is 32 bytes");
+
+    // Followed by count u16 distances.
+    struct RecordHeader {
+        uint64_t sequence;
+        double x_mm;
+        double y_mm;
+        double theta_degrees;
+        double dxy_mm;
+        double dtheta_degrees;
+        double dt_seconds;
+        double hole_width_mm;
+        int32_t map_quality;
+        uint32_t count;
+        uint64_t checksum;              // FNV-1a of the rest of the header and the distances
+    };
+    static_assert(sizeof(RecordHeader) == 80, "journal records start with 80 bytes");
+
+    struct Record {
+        RecordHeader header{};
+        std::vector<uint16_t> distances;
+    };
+
+    struct CheckpointRequest {
+        std::shared_ptr<const MapSnapshot> map;
+        Position position;
+        uint64_t sequence;
+    };
+
+    using Item = std::variant<Record, CheckpointRequest>;
+
+    static uint64_t RecordChecksum(const RecordHeader& header, const unsigned char* distances) {
+        uint64_t hash = MapCheckpoint::Checksum(reinterpret_cast<const unsigned char*>(&header),
+                                                offsetof(RecordHeader, checksum));
+        return MapCheckpoint::Checksum(distances, header.count * sizeof(uint16_t), hash);
+    }
+
+    void Push(Item item) {
+        if (auto evicted = queue_.push(std::move(item))) {
+            ++dropped_;
+            gap_ = true;
+        }
+    }
+
+    void RunWriter() {
+        // Whatever was queued before shutdown is still written
+        for (;;) {
+            auto item = queue_.pop(std::chrono::milliseconds(WRITER_WAIT_MS));
+            if (!item) {
+                if (!running_) break;
+                continue;
+            }
+            if (auto* record = std::get_if<Record>(&*item)) {
+                WriteRecord(*record);
+            } else {
+                WriteCheckpoint(std::get<CheckpointRequest>(*item));
+            }
+            if (queue_.size() == 0 && fd_ >= 0 && dirty_) {
+                ::fdatasync(fd_);
+                dirty_ = false;
+            }
+        }
+    }
+
+    void WriteRecord(Record& record) {
+        // Before the first checkpoint, or after a gap, records have nothing to follow
+        if (fd_ < 0 || record.header.sequence != lastWritten_ + 1) return;
+        record.header.checksum = RecordChecksum(record.header, reinterpret_cast<const unsigned char*>(record.distances.data()));
+        std::vector<unsigned char> bytes(sizeof(RecordHeader) + record.distances.size() * sizeof(uint16_t));
+        std::memcpy(bytes.data(), &record.header, sizeof(RecordHeader));
+        std::memcpy(bytes.data() + sizeof(RecordHeader), record.distances.data(), record.distances.size() * sizeof(uint16_t));
+        if (!WriteAll(fd_, bytes)) {
+            Failed("cannot append to " + journalPath_);
+            return;
+        }
+        lastWritten_ = record.header.sequence;
+        dirty_ = true;
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        ++stats_.written;
+        stats_.journal_bytes += bytes.size();
+    }
+
+    // The checkpoint first, then the journal after it: a crash in between leaves a
+    // journal whose records the checkpoint already holds, which Replay() skips.
+    void WriteCheckpoint(const CheckpointRequest& request) {
+        std::string error;
+        std::vector<unsigned char> data = MapCheckpoint::Encode(*request.map, request.position, mmPerPixel_, 0, 0,
+                                                                request.sequence);
+        if (!MapCheckpoint::WriteAtomically(mapPath_, data, error)) {
+            Failed(error);
+            return;
+        }
+
+        FileHeader header{};
+        std::memcpy(header.magic, MAGIC, sizeof(header.magic));
+        header.version = VERSION;
+        header.scan_size = static_cast<uint32_t>(scanSize_);
+        header.base_sequence = request.sequence;
+        std::vector<unsigned char> bytes(sizeof(FileHeader));
+        std::memcpy(bytes.data(), &header, sizeof(FileHeader));
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        if (!MapCheckpoint::WriteAtomically(journalPath_, bytes, error)) {
+            Failed(error);
+            return;
+        }
+        fd_ = ::open(journalPath_.c_str(), O_WRONLY | O_APPEND);
+        if (fd_ < 0) {
+            Failed("cannot open " + journalPath_);
+            return;
+        }
+        lastWritten_ = request.sequence;
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        ++stats_.checkpoints;
+        stats_.journal_bytes = bytes.size();
+        stats_.error.clear();
+    }
+
+    // Stops journaling until the next checkpoint.
+    void Failed(const std::string& error) {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+        gap_ = true;
+        std::lock_guard<std::mutex> lock(statsMutex_);
+        stats_.error = error;
+    }
+
+    static bool WriteAll(int fd, const std::vector<unsigned char>& bytes) {
+        size_t written = 0;
+        while (written < bytes.size()) {
+            ssize_t n = ::write(fd, bytes.data() + written, bytes.size() - written);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return false;
+            written += static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    const std::string mapPath_;
+    const std::string journalPath_;
+    const int scanSize_;
+    const double mmPerPixel_;
+
+    // SLAM thread
+    uint64_t nextSequence_;
+    int sinceCheckpoint_;
+
+    BoundedQueue<Item> queue_;
+    std::atomic<bool> gap_;
+    std::atomic<uint64_t> appended_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> running_;
+
+    // Writer thread
+    int fd_ = -1;
+    uint64_t lastWritten_ = 0;
+    bool dirty_ = false;
+
+    mutable std::mutex statsMutex_;
+    Stats stats_;
+    std::thread writer_;
+};
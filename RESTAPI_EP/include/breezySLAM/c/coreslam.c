@@ -35,6 +35,7 @@
 #include <time.h>
 #include <string.h>
 #include <math.h>
+#include <limits.h>
 
 #include "coreslam.h"
 #include "coreslam_internals.h"
@@ -137,6 +138,34 @@ static void * safe_malloc(size_t size)
     return v;
 }
 
+/* Makes room for at least needed elements in a growable array */
+static void * grow(void * array, int * capacity, int needed, size_t element_size)
+{
+    int c = *capacity ? *capacity : 64;
+    void * v = NULL;
+    
+    if (needed <= *capacity)
+    {
+        return array;
+    }
+    
+    while (c < needed)
+    {
+        c *= 2;
+    }
+    
+    v = realloc(array, c * element_size);
+    
+    if (!v)
+    {
+        fprintf(stderr, "Unable to allocate %lu bytes\n", (unsigned long)(c * element_size));
+        exit(1);
+    }
+    
+    *capacity = c;
+    return v;
+}
+
 static double * double_alloc(int size)
 {
     return (double *)safe_malloc(size * sizeof(double));
@@ -193,9 +222,223 @@ static int
 }
 
 
+static int
+        clamp(int value, int bound)
+{
+    return value < 0 ? 0 : (value >= bound ? bound - 1 : value);
+}
+
+
 static void
-        map_laser_ray(
-        pixel_t * map_pixels,
+        likelihood_mark_changed(
+        likelihood_t * field,
+        int xmin,
+        int ymin,
+        int xmax,
+        int ymax)
+{
+    if (xmin < field->changed_xmin) field->changed_xmin = xmin;
+    if (ymin < field->changed_ymin) field->changed_ymin = ymin;
+    if (xmax > field->changed_xmax) field->changed_xmax = xmax;
+    if (ymax > field->changed_ymax) field->changed_ymax = ymax;
+}
+
+
+static void
+        map_mark_changed(
+        map_t * map,
+        int xa,
+        int ya,
+        int xb,
+        int yb)
+{
+    int xmin = clamp(xa < xb ? xa : xb, map->size_pixels);
+    int xmax = clamp(xa < xb ? xb : xa, map->size_pixels);
+    int ymin = clamp(ya < yb ? ya : yb, map->size_pixels);
+    int ymax = clamp(ya < yb ? yb : ya, map->size_pixels);
+    
+    if (xmin < map->changed_xmin) map->changed_xmin = xmin;
+    if (ymin < map->changed_ymin) map->changed_ymin = ymin;
+    if (xmax > map->changed_xmax) map->changed_xmax = xmax;
+    if (ymax > map->changed_ymax) map->changed_ymax = ymax;
+    
+    if (map->likelihood)
+    {
+        likelihood_mark_changed(map->likelihood, xmin, ymin, xmax, ymax);
+    }
+}
+
+
+static void
+        map_mark_all_changed(
+        map_t * map)
+{
+    map->changed_xmin = 0;
+    map->changed_ymin = 0;
+    map->changed_xmax = map->size_pixels - 1;
+    map->changed_ymax = map->size_pixels - 1;
+    
+    if (map->likelihood)
+    {
+        likelihood_mark_changed(map->likelihood, 0, 0, map->size_pixels - 1, map->size_pixels - 1);
+    }
+}
+
+
+/* out[x] = min(out[x], row[x] + cost, 255) for n rounded up to a multiple of 16. 
+   Clamping row[x] to 255 - cost first keeps the sum within a byte, and the fixed 
+   inner loops let compilers turn this into byte-wide vector code. */
+static void
+        min_with_row(
+        unsigned char * out,
+        const unsigned char * row,
+        unsigned char cost,
+        int n)
+{
+    unsigned char limit = 255 - cost;
+    int x, k;
+    for (x=0; x<n; x+=16)
+    {
+        unsigned char value[16];
+        for (k=0; k<16; ++k)
+        {
+            value[k] = (row[x+k] < limit ? row[x+k] : limit) + cost;
+        }
+        for (k=0; k<16; ++k)
+        {
+            out[x+k] = value[k] < out[x+k] ? value[k] : out[x+k];
+        }
+    }
+}
+
+
+/* Recomputes the likelihood cells that can depend on the pixels changed since the
+   last refresh: those within radius_pixels of the changed box.  The squared distance
+   separates into a pass along rows and one along columns, and as nothing further 
+   than radius_pixels away can lower a cell, each pass is a minimum over a window of
+   2 * radius_pixels + 1 shifted copies of whole rows. */
+static void
+        likelihood_refresh(
+        map_t * map)
+{
+    likelihood_t * field = map->likelihood;
+    int size = map->size_pixels;
+    int r = field->radius_pixels;
+    
+    int wx0, wy0, wx1, wy1;     /* cells written */
+    int ry0, ry1;               /* rows read */
+    int width, stride, x, y, d;
+    
+    if (field->changed_xmin > field->changed_xmax || field->changed_ymin > field->changed_ymax)
+    {
+        return;
+    }
+    
+    wx0 = clamp(field->changed_xmin - r, size);
+    wy0 = clamp(field->changed_ymin - r, size);
+    wx1 = clamp(field->changed_xmax + r, size);
+    wy1 = clamp(field->changed_ymax + r, size);
+    
+    ry0 = clamp(wy0 - r, size);
+    ry1 = clamp(wy1 + r, size);
+    
+    width = wx1 - wx0 + 1;
+    stride = (width + 15) & ~15;
+    
+    /* Along rows: line holds the pixels from wx0 - r to wx1 + r, 255 off the map */
+    for (y=ry0; y<=ry1; ++y)
+    {
+        pixel_t * src = map->pixels + y * size;
+        unsigned char * line = field->line;
+        unsigned char * out = field->rows + (y - ry0) * stride;
+        
+        for (x=wx0-r; x<=wx1+r; ++x)
+        {
+            line[x - wx0 + r] = (x < 0 || x >= size) ? 255 : src[x] >> 8;
+        }
+        
+        memcpy(out, line + r, width);
+        
+        for (d=1; d<=r; ++d)
+        {
+            min_with_row(out, line + r - d, field->costs[d], width);
+            min_with_row(out, line + r + d, field->costs[d], width);
+        }
+    }
+    
+    /* Along columns, a whole row at a time */
+    for (y=wy0; y<=wy1; ++y)
+    {
+        unsigned char * out = field->line;
+        
+        memcpy(out, field->rows + (y - ry0) * stride, width);
+        
+        for (d=1; d<=r; ++d)
+        {
+            if (y - d >= ry0)
+            {
+                min_with_row(out, field->rows + (y - d - ry0) * stride, field->costs[d], width);
+            }
+            if (y + d <= ry1)
+            {
+                min_with_row(out, field->rows + (y + d - ry0) * stride, field->costs[d], width);
+            }
+        }
+        
+        memcpy(field->cells + y * size + wx0, out, width);
+    }
+    
+    /* empty box: min past max */
+    field->changed_xmin = size;
+    field->changed_ymin = size;
+    field->changed_xmax = -1;
+    field->changed_ymax = -1;
+}
+
+
+/* rows are padded to a multiple of 16 for min_with_row; line holds a row with 
+   radius_pixels on either side */
+static void
+        likelihood_alloc_scratch(
+        likelihood_t * field,
+        int size)
+{
+    field->rows = (unsigned char *)safe_malloc(size * (size + 16));
+    field->line = (unsigned char *)safe_malloc(size + 2 * field->radius_pixels + 16);
+    memset(field->rows, 0, size * (size + 16));
+    memset(field->line, 0, size + 2 * field->radius_pixels + 16);
+}
+
+
+static void
+        likelihood_free(
+        likelihood_t * field)
+{
+    free(field->cells);
+    free(field->costs);
+    free(field->rows);
+    free(field->line);
+    free(field);
+}
+
+
+/* Scores with the likelihood field when the map has one */
+static int
+        scan_distance(
+        map_t * map,
+        scan_t * scan,
+        position_t position)
+{
+    return map->likelihood ? 
+        distance_scan_to_likelihood(map, scan, position) : 
+        distance_scan_to_map(map, scan, position);
+}
+
+
+/* Returns 0 if nothing of the ray is on the map */
+static int
+        laser_ray_init(
+        laser_ray_t * ray,
         int map_size,
         int x1,
         int y1,
@@ -203,260 +446,1207 @@ static void
         int y2,
         int xp,
         int yp,
-        int value,
-        int alpha)
+        int value)
 {
-    
     int x2c = x2;
     int y2c = y2;
+    int dx, dy, dxc, dyc;
     
     if (out_of_bounds(x1, map_size) || out_of_bounds(y1, map_size))
     {
-        return;
+        return 0;
     }
     
-    if (!(clip(&x2c, &y2c, x1, y1, map_size) || clip(&y2c, &x2c, y1, x1, map_size)))
+    if (clip(&x2c, &y2c, x1, y1, map_size) || clip(&y2c, &x2c, y1, x1, map_size))
     {
-        int dx = abs(x2 - x1);
-        int dy = abs(y2 - y1);
-        int dxc = abs(x2c - x1);
-        int dyc = abs(y2c - y1);
-        int incptrx = (x2 > x1) ? 1 : -1;
-        int incptry = (y2 > y1) ? map_size : -map_size;
-        int sincv = (value > NO_OBSTACLE) ? 1 : -1;
-        
-        int derrorv = 0;
-        
-        if (dx > dy)
-        {
-            derrorv = abs(xp - x2);
-        }
-        else
+        return 0;
+    }
+    
+    dx = abs(x2 - x1);
+    dy = abs(y2 - y1);
+    dxc = abs(x2c - x1);
+    dyc = abs(y2c - y1);
+    
+    ray->x = x1;
+    ray->y = y1;
+    ray->sincv = (value > NO_OBSTACLE) ? 1 : -1;
+    
+    if (dx > dy)
+    {
+        ray->major_x = (x2 > x1) ? 1 : -1;
+        ray->major_y = 0;
+        ray->minor_x = 0;
+        ray->minor_y = (y2 > y1) ? 1 : -1;
+        ray->derrorv = abs(xp - x2);
+    }
+    else
+    {
+        swap(&dx, &dy);
+        swap(&dxc, &dyc);
+        ray->major_x = 0;
+        ray->major_y = (y2 > y1) ? 1 : -1;
+        ray->minor_x = (x2 > x1) ? 1 : -1;
+        ray->minor_y = 0;
+        ray->derrorv = abs(yp - y2);
+    }
+    
+    if (!ray->derrorv)
+    {   /* XXX should probably throw an exception */
+        fprintf(stderr, "map_update: No error gradient: try increasing hole width\n");
+        exit(1);
+    }
+    
+    ray->length = dxc + 1;
+    ray->dx = dx;
+    ray->error = 2 * dyc - dxc;
+    ray->horiz = 2 * dyc;
+    ray->diago = 2 * (dyc - dxc);
+    
+    ray->errorv = ray->derrorv / 2;
+    ray->incv = (value - NO_OBSTACLE) / ray->derrorv;
+    ray->incerrorv = value - NO_OBSTACLE - ray->derrorv * ray->incv;
+    ray->pixval = NO_OBSTACLE;
+    
+    return 1;
+}
+
+
+/* Value of the ray at its x'th pixel; call for x = 0, 1, ... in turn */
+static int
+        laser_ray_value(
+        laser_ray_t * ray,
+        int x)
+{
+    if (x > ray->dx - 2 * ray->derrorv)
+    {
+        if (x <= ray->dx - ray->derrorv)
         {
-            swap(&dx, &dy);
-            swap(&dxc, &dyc);
-            swap(&incptrx, &incptry);
-            derrorv = abs(yp - y2);
-        }
-        
-        if (!derrorv)
-        {   /* XXX should probably throw an exception */
-            fprintf(stderr, "map_update: No error gradient: try increasing hole width\n");
-            exit(1);
+            ray->pixval += ray->incv;
+            ray->errorv += ray->incerrorv;
+            if (ray->errorv > ray->derrorv)
+            {
+                ray->pixval += ray->sincv;
+                ray->errorv -= ray->derrorv;
+            }
         }
-        
         else
         {
-            int error = 2 * dyc - dxc;
-            int horiz = 2 * dyc;
-            int diago = 2 * (dyc - dxc);
-            int errorv = derrorv / 2;
-            
-            int incv = (value - NO_OBSTACLE) / derrorv;
-            
-            int incerrorv = value - NO_OBSTACLE - derrorv * incv;
-            
-            pixel_t * ptr = map_pixels + y1 * map_size + x1;
-            int pixval = NO_OBSTACLE;
-            
-            int x = 0;
-            for (x = 0; x <= dxc; x++, ptr += incptrx)
+            ray->pixval -= ray->incv;
+            ray->errorv -= ray->incerrorv;
+            if (ray->errorv < 0)
             {
-                if (x > dx - 2 * derrorv)
-                {
-                    if (x <= dx - derrorv)
-                    {
-                        pixval += incv;
-                        errorv += incerrorv;
-                        if (errorv > derrorv)
-                        {
-                            pixval += sincv;
-                            errorv -= derrorv;
-                        }
-                    }
-                    else
-                    {
-                        pixval -= incv;
-                        errorv -= incerrorv;
-                        if (errorv < 0)
-                        {
-                            pixval -= sincv;
-                            errorv += derrorv;
-                        }
-                    }
-                }
-                
-                /* Integration into the map */
-                *ptr = ((256 - alpha) * (*ptr) + alpha * pixval) >> 8;
-                
-                if (error > 0)
-                {
-                    ptr += incptry;
-                    error += diago;
-                } else
-                {
-                    error += horiz;
-                }
+                ray->pixval -= ray->sincv;
+                ray->errorv += ray->derrorv;
             }
         }
     }
+    
+    return ray->pixval;
+}
+
+
+/* Advances the error term; returns 1 if the next pixel also takes a minor step.
+   Branch-free, since the outcome follows no pattern a predictor could learn. */
+static int
+        laser_ray_step(
+        laser_ray_t * ray)
+{
+    int overflow = ray->error > 0;
+    
+    ray->error += overflow ? ray->diago : ray->horiz;
+    
+    return overflow;
+}
+
+
+/* Floor and ceiling of a / b for b > 0 */
+static int
+        floor_div(int a, int b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static int
+        ceil_div(int a, int b)
+{
+    return -floor_div(-a, b);
+}
+
+
+/* Steps from pos to the first pixel past its tile, going in direction dir */
+static int
+        pixels_to_tile_edge(
+        int pos,
+        int dir)
+{
+    int tile_start = (pos >> MAP_TILE_SHIFT) << MAP_TILE_SHIFT;
+    
+    return dir > 0 ? tile_start + (1 << MAP_TILE_SHIFT) - pos : pos - tile_start + 1;
+}
+
+
+/* The Bresenham error before step n is error0 + n * horiz - m * (horiz - diago), 
+   where m is the number of minor steps taken so far, and always stays within 
+   (diago, horiz].  So the minor offset and error at any step follow directly. */
+static int
+        laser_ray_minor(
+        laser_ray_t * ray,
+        int step)
+{
+    return step ? ceil_div(ray->error + (step - 1) * ray->horiz, ray->horiz - ray->diago) : 0;
+}
+
+static int
+        laser_ray_error(
+        laser_ray_t * ray,
+        int step,
+        int minor)
+{
+    return ray->error + step * ray->horiz - minor * (ray->horiz - ray->diago);
+}
+
+/* First step at which the minor offset reaches minor, or INT_MAX if it never does */
+static int
+        laser_ray_steps_to_minor(
+        laser_ray_t * ray,
+        int minor)
+{
+    if (ray->horiz == 0)
+    {
+        return INT_MAX;
+    }
+    
+    return floor_div((minor - 1) * (ray->horiz - ray->diago) - ray->error, ray->horiz) + 2;
 }
 
+/* Steps before this one leave the ray at its initial value */
+static int
+        laser_ray_hole_start(
+        laser_ray_t * ray)
+{
+    int start = ray->dx - 2 * ray->derrorv + 1;
+    
+    return start > 0 ? start : 0;
+}
 
+
+/* Integrates steps first up to last (exclusive) of the ray into the map, starting 
+   at ptr; the ray must be in its state for step first */
 static void
-        scan_update_xy(
-        scan_t * scan,
-        int offset,
-        int distance,
-        int scanval,
-        double horz_mm,
-        double rotation)
+        laser_ray_draw(
+        laser_ray_t * ray,
+        pixel_t * ptr,
+        int map_size,
+        int first,
+        int last,
+        int alpha)
 {
-    int j;
-    for (j=0; j<scan->span; ++j)
+    int major = ray->major_y * map_size + ray->major_x;
+    int minor = ray->minor_y * map_size + ray->minor_x;
+    int hole = laser_ray_hole_start(ray);
+    int flat = hole < last ? hole : last;
+    
+    int x = first;
+    
+    /* Up to the hole the value stays NO_OBSTACLE */
+    if (x < flat)
     {
-        double k = (double)(offset*scan->span+j) * scan->detection_angle_degrees / (scan->size * scan->span - 1);
-        double angle = radians(-scan->detection_angle_degrees/2 + k * rotation);
-        double x = distance * cos(angle) - k * horz_mm;
-        double y = distance * sin(angle);
+        int error = ray->error;
+        int flat_value = alpha * ray->pixval;
         
-        scan->value[scan->npoints] = scanval;
+        for (; x < flat; x++)
+        {
+            int overflow = error > 0;
+            
+            /* Integration into the map */
+            *ptr = ((256 - alpha) * (*ptr) + flat_value) >> 8;
+            
+            error += overflow ? ray->diago : ray->horiz;
+            ptr += major + (overflow ? minor : 0);
+        }
         
-        scan->x_mm[scan->npoints] = x;
-        scan->y_mm[scan->npoints] = y;
-        scan->npoints++;
+        ray->error = error;
+    }
+    
+    for (; x < last; x++)
+    {
+        int pixval = laser_ray_value(ray, x);
+        
+        /* The profile can overshoot OBSTACLE or NO_OBSTACLE by a little, which would
+           wrap a pixel at either end around to the other */
+        if (pixval < OBSTACLE)
+        {
+            pixval = OBSTACLE;
+        }
+        else if (pixval > NO_OBSTACLE)
+        {
+            pixval = NO_OBSTACLE;
+        }
+        
+        *ptr = ((256 - alpha) * (*ptr) + alpha * pixval) >> 8;
+        
+        ptr += major + (laser_ray_step(ray) ? minor : 0);
     }
 }
 
 
-/* Exported functions --------------------------------------------------------*/
+static void
+        map_laser_ray(
+        pixel_t * map_pixels,
+        int map_size,
+        int x1,
+        int y1,
+        int x2,
+        int y2,
+        int xp,
+        int yp,
+        int value,
+        int alpha)
+{
+    laser_ray_t ray;
+    
+    if (laser_ray_init(&ray, map_size, x1, y1, x2, y2, xp, yp, value))
+    {
+        laser_ray_draw(&ray, map_pixels + ray.y * map_size + ray.x, map_size, 0, ray.length, alpha);
+    }
+}
 
-int *
-        int_alloc(
-        int size)
+/* End points and value of the ray that map_update draws for scan point i */
+static void
+        map_ray_compute(
+        map_ray_t * ray,
+        map_t * map,
+        scan_t * scan,
+        int i,
+        position_t position,
+        double costheta,
+        double sintheta,
+        int map_quality,
+        double hole_width_mm)
 {
-    return (int *)safe_malloc(size * sizeof(int));
+    double x2p = costheta * scan->x_mm[i] - sintheta * scan->y_mm[i];
+    double y2p = sintheta * scan->x_mm[i] + costheta * scan->y_mm[i];
+    
+    double dist = sqrt(x2p * x2p + y2p * y2p);
+    double add = hole_width_mm / 2 / dist;
+    
+    ray->x1 = roundup(position.x_mm * map->scale_pixels_per_mm);
+    ray->y1 = roundup(position.y_mm * map->scale_pixels_per_mm);
+    
+    ray->xp = roundup((position.x_mm + x2p) * map->scale_pixels_per_mm);
+    ray->yp = roundup((position.y_mm + y2p) * map->scale_pixels_per_mm);
+    
+    x2p *= map->scale_pixels_per_mm * (1 + add);
+    y2p *= map->scale_pixels_per_mm * (1 + add);
+    
+    ray->x2 = roundup(position.x_mm * map->scale_pixels_per_mm + x2p);
+    ray->y2 = roundup(position.y_mm * map->scale_pixels_per_mm + y2p);
+    
+    ray->value = OBSTACLE;
+    ray->alpha = map_quality;
+    
+    if (scan->value[i] == NO_OBSTACLE)
+    {
+        ray->alpha = map_quality / 4;
+        ray->value = NO_OBSTACLE;
+    }
+}
+
+
+/* Velocity compensation for one scan.  Sub-ray n is at k = n * k_step degrees into
+   the scan; while the robot moves, its direction turns by k * (rotation - 1) and 
+   its origin shifts back by k * horz_mm.  The turn is applied as a rotation that is
+   advanced from sub-ray to sub-ray, so no trigonometry is needed per point. */
+typedef struct compensation_t
+{
+    double k_step;
+    double horz_mm;
+    int rotating;
+    
+    double cos;                 /* turn of the current sub-ray */
+    double sin;
+    double step_cos;            /* turn between consecutive sub-rays */
+    double step_sin;
+
+} compensation_t;
+
+
+static void
+        compensation_init(
+        compensation_t * comp,
+        scan_t * scan,
+        int first_offset,
+        double horz_mm,
+        double rotation)
+{
+    double turn_per_step = 0;
+    
+    comp->k_step = scan->detection_angle_degrees / (scan->size * scan->span - 1);
+    comp->horz_mm = horz_mm;
+    comp->rotating = rotation != 1;
+    
+    turn_per_step = radians(comp->k_step * (rotation - 1));
+    comp->cos = cos(first_offset * scan->span * turn_per_step);
+    comp->sin = sin(first_offset * scan->span * turn_per_step);
+    comp->step_cos = cos(turn_per_step);
+    comp->step_sin = sin(turn_per_step);
+}
+
+
+static void
+        compensation_advance(
+        compensation_t * comp)
+{
+    double c = comp->cos;
+    comp->cos = c * comp->step_cos - comp->sin * comp->step_sin;
+    comp->sin = comp->sin * comp->step_cos + c * comp->step_sin;
+}
+
+
+/* Adds the span sub-rays of ray offset, advancing comp past them */
+static void
+        scan_update_xy(
+        scan_t * scan,
+        compensation_t * comp,
+        int offset,
+        int distance,
+        int scanval)
+{
+    int j;
+    for (j=0; j<scan->span; ++j)
+    {
+        int n = offset * scan->span + j;
+        double k = n * comp->k_step;
+        double ux = scan->ray_cos[n];
+        double uy = scan->ray_sin[n];
+        double x, y;
+        
+        if (comp->rotating)
+        {
+            double u = ux * comp->cos - uy * comp->sin;
+            uy = uy * comp->cos + ux * comp->sin;
+            ux = u;
+            compensation_advance(comp);
+        }
+        
+        x = distance * ux - k * comp->horz_mm;
+        y = distance * uy;
+        
+        scan->value[scan->npoints] = scanval;
+        scan->x_mm[scan->npoints] = x;
+        scan->y_mm[scan->npoints] = y;
+        scan->npoints++;
+        
+        /* Store obstacles separately for SSE */
+        if (scanval == OBSTACLE)
+        {
+            scan->obst_x_mm[scan->obst_npoints] = (float)x;
+            scan->obst_y_mm[scan->obst_npoints] = (float)y;
+            scan->obst_npoints++;
+        }
+    }
+}
+
+
+/* Adds ray offset to the scan, or skips it (advancing comp) if it is too short */
+static void
+        scan_update_ray(
+        scan_t * scan,
+        compensation_t * comp,
+        int offset,
+        int lidar_value_mm,
+        double hole_width_mm)
+{
+    int j;
+    
+    /* No obstacle */
+    if (lidar_value_mm == 0)
+    {
+        scan_update_xy(scan, comp, offset, (int)scan->distance_no_detection_mm, NO_OBSTACLE);
+    }
+    
+    /* Obstacle */
+    else if (lidar_value_mm > hole_width_mm / 2)
+    {
+        scan_update_xy(scan, comp, offset, lidar_value_mm, OBSTACLE);
+    }
+    
+    else if (comp->rotating)
+    {
+        for (j=0; j<scan->span; ++j)
+        {
+            compensation_advance(comp);
+        }
+    }
+}
+
+
+static void
+        scan_begin(
+        scan_t * scan,
+        compensation_t * comp,
+        double velocities_dxy_mm,
+        double velocities_dtheta_degrees)
+{
+    /* Take velocity into account */
+    int degrees_per_second = (int)(scan->rate_hz * 360);
+    double horz_mm = velocities_dxy_mm / degrees_per_second;
+    double rotation = 1 + velocities_dtheta_degrees / degrees_per_second;
+    
+    compensation_init(comp, scan, scan->detection_margin + 1, horz_mm, rotation);
+    
+    scan->npoints = 0;
+    scan->obst_npoints = 0;
+}
+
+
+/* Scan decimation: every obstacle point gets a class, the bin of its surface 
+   orientation or DECIMATE_EDGE at a range discontinuity, plus DECIMATE_KEEP once 
+   it is selected */
+#define DECIMATE_BINS   16
+#define DECIMATE_EDGE   DECIMATE_BINS
+#define DECIMATE_KEEP   0x80
+
+/* Neighbouring points farther apart than both of these are on different surfaces */
+static const double DECIMATE_GAP_MM   = 100;
+static const double DECIMATE_GAP_RAYS = 4;
+
+static double
+        obstacle_gap(
+        scan_t * scan,
+        int i,
+        int j)
+{
+    double dx = scan->obst_x_mm[i] - scan->obst_x_mm[j];
+    double dy = scan->obst_y_mm[i] - scan->obst_y_mm[j];
+    return sqrt(dx*dx + dy*dy);
+}
+
+static int
+        obstacle_breaks(
+        scan_t * scan,
+        int i,
+        int j,
+        double ray_step_radians)
+{
+    double range = sqrt(scan->obst_x_mm[i] * scan->obst_x_mm[i] + scan->obst_y_mm[i] * scan->obst_y_mm[i]);
+    double gap = obstacle_gap(scan, i, j);
+    
+    return gap > DECIMATE_GAP_MM && gap > DECIMATE_GAP_RAYS * ray_step_radians * range;
+}
+
+/* Edge points, or the surface orientation (mod 180 degrees) from both neighbours */
+static void
+        obstacle_classify(
+        scan_t * scan,
+        int * counts)
+{
+    int n = scan->obst_npoints;
+    double ray_step = radians(scan->detection_angle_degrees / (scan->size * scan->span - 1));
+    int i;
+    
+    for (i=0; i<=DECIMATE_BINS; ++i)
+    {
+        counts[i] = 0;
+    }
+    
+    for (i=0; i<n; ++i)
+    {
+        int prev = (i + n - 1) % n;
+        int next = (i + 1) % n;
+        int c = DECIMATE_EDGE;
+        
+        if (!obstacle_breaks(scan, i, prev, ray_step) && !obstacle_breaks(scan, i, next, ray_step))
+        {
+            double angle = atan2(scan->obst_y_mm[next] - scan->obst_y_mm[prev], 
+                                 scan->obst_x_mm[next] - scan->obst_x_mm[prev]);
+            if (angle < 0)
+            {
+                angle += M_PI;
+            }
+            c = (int)(angle / M_PI * DECIMATE_BINS);
+            if (c >= DECIMATE_BINS)
+            {
+                c = DECIMATE_BINS - 1;
+            }
+        }
+        
+        scan->point_class[i] = (unsigned char)c;
+        counts[c]++;
+    }
+}
+
+/* Splits max_points over the bins so that no bin gets more than it has and the 
+   remaining points are shared equally by the others */
+static void
+        decimate_quotas(
+        int * counts,
+        int * quotas,
+        int nbins,
+        int max_points)
+{
+    int left = max_points;
+    int open = 0;
+    int changed = 1;
+    int b;
+    
+    for (b=0; b<nbins; ++b)
+    {
+        quotas[b] = counts[b] ? -1 : 0;
+        open += counts[b] != 0;
+    }
+    
+    while (changed && open)
+    {
+        int share = left / open;
+        changed = 0;
+        for (b=0; b<nbins; ++b)
+        {
+            if (quotas[b] < 0 && counts[b] <= share)
+            {
+                quotas[b] = counts[b];
+                left -= counts[b];
+                open--;
+                changed = 1;
+            }
+        }
+    }
+    
+    for (b=0; b<nbins; ++b)
+    {
+        if (quotas[b] < 0)
+        {
+            quotas[b] = left / open + (left % open > 0);
+            left -= quotas[b];
+            open--;
+        }
+    }
+}
+
+
+/* Exported functions --------------------------------------------------------*/
+
+int *
+        int_alloc(
+        int size)
+{
+    return (int *)safe_malloc(size * sizeof(int));
+}
+
+float *
+        float_alloc(
+        int size)
+{
+    return (float *)safe_malloc(size * sizeof(float));
+}
+
+void
+        map_init(
+        map_t * map,
+        int size_pixels,
+        double size_meters)
+{
+    int npix = size_pixels * size_pixels;
+
+    int k = 0;
+    
+    map->pixels = (pixel_t *)safe_malloc(npix * sizeof(pixel_t));
+    
+    for (k=0; k<npix; ++k)
+    {
+        map->pixels[k] = (OBSTACLE + NO_OBSTACLE) / 2;
+    }
+    
+    map->size_pixels = size_pixels;
+    map->size_meters = size_meters;
+    
+    /* precompute scale for efficiency */
+    map->scale_pixels_per_mm =  size_pixels / (size_meters * 1000);
+    
+    map->likelihood = NULL;
+    
+    /* a fresh map has not been read by anyone yet */
+    map_mark_all_changed(map);
+}
+
+void
+        map_copy(
+        map_t * map,
+        map_t * src)
+{
+    int size = src->size_pixels;
+    
+    *map = *src;
+    map->pixels = (pixel_t *)safe_malloc(size * size * sizeof(pixel_t));
+    memcpy(map->pixels, src->pixels, size * size * sizeof(pixel_t));
+    
+    if (src->likelihood)
+    {
+        likelihood_t * field = (likelihood_t *)safe_malloc(sizeof(likelihood_t));
+        
+        *field = *src->likelihood;
+        field->cells = (unsigned char *)safe_malloc(size * size);
+        memcpy(field->cells, src->likelihood->cells, size * size);
+        field->costs = (unsigned char *)safe_malloc(field->radius_pixels + 1);
+        memcpy(field->costs, src->likelihood->costs, field->radius_pixels + 1);
+        likelihood_alloc_scratch(field, size);
+        
+        map->likelihood = field;
+    }
+}
+
+void
+        map_free(
+        map_t * map)
+{
+    free(map->pixels);
+    
+    if (map->likelihood)
+    {
+        likelihood_free(map->likelihood);
+        map->likelihood = NULL;
+    }
+}
+
+void map_string(
+        map_t map,
+        char * str)
+{
+    sprintf(str, "size = %d x %d pixels | = %f meters",
+            map.size_pixels, map.size_pixels, map.size_meters);
+}
+
+void
+        map_update(
+        map_t * map,
+        scan_t * scan,
+        position_t position,
+        int map_quality,
+        double hole_width_mm)
+{
+    double position_theta_radians = radians(position.theta_degrees);
+    double costheta = cos(position_theta_radians);
+    double sintheta = sin(position_theta_radians);
+    
+    map_ray_t ray;
+    
+    int i = 0;
+    for (i = 0; i != scan->npoints; i++)
+    {        
+        map_ray_compute(&ray, map, scan, i, position, costheta, sintheta, map_quality, hole_width_mm);
+        
+        map_laser_ray(map->pixels, map->size_pixels, 
+                      ray.x1, ray.y1, ray.x2, ray.y2, ray.xp, ray.yp, ray.value, ray.alpha);
+        
+        if (!out_of_bounds(ray.x1, map->size_pixels) && !out_of_bounds(ray.y1, map->size_pixels))
+        {
+            map_mark_changed(map, ray.x1, ray.y1, ray.x2, ray.y2);
+        }
+    }
+    
+    if (map->likelihood)
+    {
+        likelihood_refresh(map);
+    }
+}
+
+void
+        map_batch_init(
+        map_batch_t * batch,
+        int nparts)
+{
+    int k = 0;
+    
+    batch->nparts = nparts < 1 ? 1 : nparts;
+    batch->parts = (map_batch_part_t *)safe_malloc(batch->nparts * sizeof(map_batch_part_t));
+    
+    for (k=0; k<batch->nparts; ++k)
+    {
+        map_batch_part_t * part = &batch->parts[k];
+        part->runs = NULL;
+        part->nruns = 0;
+        part->runs_capacity = 0;
+    }
+    
+    batch->rays = NULL;
+    batch->walks = NULL;
+    batch->nrays = 0;
+    batch->rays_capacity = 0;
+    batch->walks_capacity = 0;
+    
+    batch->tiles_per_row = 0;
+    batch->ntiles = 0;
+    batch->tile_first = NULL;
+    
+    batch->binned = NULL;
+    batch->binned_capacity = 0;
+}
+
+void
+        map_batch_free(
+        map_batch_t * batch)
+{
+    int k = 0;
+    
+    for (k=0; k<batch->nparts; ++k)
+    {
+        free(batch->parts[k].runs);
+    }
+    
+    free(batch->parts);
+    free(batch->rays);
+    free(batch->walks);
+    free(batch->tile_first);
+    free(batch->binned);
+}
+
+void
+        map_update_begin(
+        map_t * map,
+        map_batch_t * batch,
+        scan_t * scan,
+        position_t position,
+        int map_quality,
+        double hole_width_mm)
+{
+    double position_theta_radians = radians(position.theta_degrees);
+    double costheta = cos(position_theta_radians);
+    double sintheta = sin(position_theta_radians);
+    
+    int tiles_per_row = ((map->size_pixels - 1) >> MAP_TILE_SHIFT) + 1;
+    int k = 0;
+    
+    if (tiles_per_row != batch->tiles_per_row)
+    {
+        batch->tiles_per_row = tiles_per_row;
+        batch->ntiles = tiles_per_row * tiles_per_row;
+        free(batch->tile_first);
+        batch->tile_first = int_alloc(batch->ntiles + 1);
+    }
+    
+    batch->rays = (map_ray_t *)grow(batch->rays, &batch->rays_capacity, scan->npoints, sizeof(map_ray_t));
+    batch->walks = (laser_ray_t *)grow(batch->walks, &batch->walks_capacity, scan->npoints, sizeof(laser_ray_t));
+    batch->nrays = scan->npoints;
+    
+    for (k=0; k<scan->npoints; ++k)
+    {
+        map_ray_compute(&batch->rays[k], map, scan, k, position, costheta, sintheta, map_quality, hole_width_mm);
+    }
+    
+    for (k=0; k<batch->nparts; ++k)
+    {
+        batch->parts[k].nruns = 0;
+    }
+}
+
+void
+        map_update_trace(
+        map_t * map,
+        map_batch_t * batch,
+        int part_index)
+{
+    map_batch_part_t * part = &batch->parts[part_index];
+    
+    /* Each part takes a contiguous share of the rays, so its runs are in ray order */
+    int first = (int)((long)batch->nrays * part_index / batch->nparts);
+    int last = (int)((long)batch->nrays * (part_index + 1) / batch->nparts);
+    
+    int i = 0;
+    for (i=first; i<last; ++i)
+    {
+        map_ray_t * r = &batch->rays[i];
+        laser_ray_t * ray = &batch->walks[i];
+        
+        int major_dir = 0;
+        int minor_dir = 0;
+        int step = 0;
+        
+        if (!laser_ray_init(ray, map->size_pixels, r->x1, r->y1, r->x2, r->y2, r->xp, r->yp, r->value))
+        {
+            continue;
+        }
+        
+        major_dir = ray->major_x + ray->major_y;
+        minor_dir = ray->minor_x + ray->minor_y;
+        
+        /* A line crosses at most one tile edge per axis every tile width */
+        part->runs = (map_run_t *)grow(part->runs, &part->runs_capacity, 
+                                       part->nruns + 2 * (ray->length >> MAP_TILE_SHIFT) + 3, sizeof(map_run_t));
+        
+        /* Cut the ray where it leaves each tile, jumping there directly */
+        while (step < ray->length)
+        {
+            int minor = laser_ray_minor(ray, step);
+            int x = ray->x + step * ray->major_x + minor * ray->minor_x;
+            int y = ray->y + step * ray->major_y + minor * ray->minor_y;
+            
+            int major_pos = ray->major_x ? x : y;
+            int minor_pos = ray->major_x ? y : x;
+            
+            int end = step + pixels_to_tile_edge(major_pos, major_dir);
+            int next = laser_ray_steps_to_minor(ray, minor + pixels_to_tile_edge(minor_pos, minor_dir));
+            
+            map_run_t * run = &part->runs[part->nruns++];
+            
+            if (next < end)
+            {
+                end = next;
+            }
+            if (end > ray->length)
+            {
+                end = ray->length;
+            }
+            
+            run->tile = (y >> MAP_TILE_SHIFT) * batch->tiles_per_row + (x >> MAP_TILE_SHIFT);
+            run->ray = i;
+            run->first = step;
+            run->count = end - step;
+            run->x = x;
+            run->y = y;
+            run->error = laser_ray_error(ray, step, minor);
+            
+            step = end;
+        }
+    }
+}
+
+void
+        map_update_bin(
+        map_t * map,
+        map_batch_t * batch)
+{
+    int nruns = 0;
+    int * first = batch->tile_first;
+    int k = 0;
+    int j = 0;
+    
+    for (k=0; k<=batch->ntiles; ++k)
+    {
+        first[k] = 0;
+    }
+    
+    for (k=0; k<batch->nparts; ++k)
+    {
+        map_batch_part_t * part = &batch->parts[k];
+        for (j=0; j<part->nruns; ++j)
+        {
+            first[part->runs[j].tile + 1]++;
+        }
+        nruns += part->nruns;
+    }
+    
+    for (k=0; k<batch->ntiles; ++k)
+    {
+        first[k+1] += first[k];
+    }
+    
+    batch->binned = (map_run_t *)grow(batch->binned, &batch->binned_capacity, nruns, sizeof(map_run_t));
+    
+    /* Stable counting sort: within a tile, runs keep the order of their rays */
+    for (k=0; k<batch->nparts; ++k)
+    {
+        map_batch_part_t * part = &batch->parts[k];
+        for (j=0; j<part->nruns; ++j)
+        {
+            map_run_t * run = &part->runs[j];
+            batch->binned[first[run->tile]++] = *run;
+        }
+    }
+    
+    /* Counting advanced each start to the next tile's; shift them back */
+    for (k=batch->ntiles; k>0; --k)
+    {
+        first[k] = first[k-1];
+    }
+    first[0] = 0;
+    
+    (void)map;
+}
+
+void
+        map_update_apply(
+        map_t * map,
+        map_batch_t * batch,
+        int part_index)
+{
+    int size = map->size_pixels;
+    
+    /* Tiles are dealt out in turn, so the busy tiles around the robot, which most 
+       rays cross, end up on different parts */
+    int tile = 0;
+    for (tile=part_index; tile<batch->ntiles; tile+=batch->nparts)
+    {
+        int k = 0;
+        for (k=batch->tile_first[tile]; k<batch->tile_first[tile+1]; ++k)
+        {
+            map_run_t * run = &batch->binned[k];
+            laser_ray_t ray = batch->walks[run->ray];
+            
+            /* The value only starts changing at the hole; catch up to the run */
+            int x = 0;
+            for (x = laser_ray_hole_start(&ray); x < run->first; x++)
+            {
+                laser_ray_value(&ray, x);
+            }
+            
+            ray.error = run->error;
+            
+            laser_ray_draw(&ray, map->pixels + run->y * size + run->x, size, 
+                           run->first, run->first + run->count, batch->rays[run->ray].alpha);
+        }
+    }
+}
+
+void
+        map_update_end(
+        map_t * map,
+        map_batch_t * batch)
+{
+    int k = 0;
+    for (k=0; k<batch->nrays; ++k)
+    {
+        map_ray_t * ray = &batch->rays[k];
+        
+        if (!out_of_bounds(ray->x1, map->size_pixels) && !out_of_bounds(ray->y1, map->size_pixels))
+        {
+            map_mark_changed(map, ray->x1, ray->y1, ray->x2, ray->y2);
+        }
+    }
+    
+    if (map->likelihood)
+    {
+        likelihood_refresh(map);
+    }
+}
+
+void
+        map_get(
+        map_t * map,
+        char * bytes)
+{
+    int k;
+    for (k=0; k<map->size_pixels*map->size_pixels; ++k)
+    {
+        bytes[k] = map->pixels[k] >> 8;
+    }
 }
 
-float *
-        float_alloc(
-        int size)
+
+void
+        map_report_all_changed(
+        map_t * map)
 {
-    return (float *)safe_malloc(size * sizeof(float));
+    map->changed_xmin = 0;
+    map->changed_ymin = 0;
+    map->changed_xmax = map->size_pixels - 1;
+    map->changed_ymax = map->size_pixels - 1;
 }
 
 void
-        map_init(
+        map_shift(
         map_t * map,
-        int size_pixels,
-        double size_meters)
+        int dx_pixels,
+        int dy_pixels)
 {
-    int npix = size_pixels * size_pixels;
-
-    int k = 0;
+    pixel_t unknown = (OBSTACLE + NO_OBSTACLE) / 2;
+    int size = map->size_pixels;
+    int x0 = dx_pixels < 0 ? -dx_pixels : 0;            /* destination columns x0 up to x1 */
+    int x1 = dx_pixels > 0 ? size - dx_pixels : size;   /* have a source on the map */
+    int j, x;
     
-    map->pixels = (pixel_t *)safe_malloc(npix * sizeof(pixel_t));
+    if (x1 < x0)
+    {
+        x1 = x0;
+    }
     
-    for (k=0; k<npix; ++k)
+    /* Rows are visited so that every source row is read before it is overwritten */
+    for (j=0; j<size; ++j)
     {
-        map->pixels[k] = (OBSTACLE + NO_OBSTACLE) / 2;
+        int y = dy_pixels >= 0 ? j : size - 1 - j;
+        int sy = y + dy_pixels;
+        pixel_t * row = map->pixels + y * size;
+        int copy_from = x0;
+        int copy_to = x1;
+        
+        if (sy < 0 || sy >= size)
+        {
+            copy_from = copy_to = size;
+        }
+        else if (copy_to > copy_from)
+        {
+            memmove(row + copy_from, map->pixels + sy * size + copy_from + dx_pixels, 
+                    (copy_to - copy_from) * sizeof(pixel_t));
+        }
+        
+        for (x=0; x<copy_from; ++x)
+        {
+            row[x] = unknown;
+        }
+        for (x=copy_to; x<size; ++x)
+        {
+            row[x] = unknown;
+        }
     }
     
-    map->size_pixels = size_pixels;
-    map->size_meters = size_meters;
+    map_mark_all_changed(map);
     
-    /* precompute scale for efficiency */
-    map->scale_pixels_per_mm =  size_pixels / (size_meters * 1000);
+    if (map->likelihood)
+    {
+        likelihood_refresh(map);
+    }
 }
 
 void
-        map_free(
-        map_t * map)
+        map_set(
+        map_t * map,
+        char * bytes)
 {
-    free(map->pixels);
+    int k;
+    for (k=0; k<map->size_pixels*map->size_pixels; ++k)
+    {
+        map->pixels[k] = bytes[k];
+        map->pixels[k] <<= 8;
+    }
+    
+    map_mark_all_changed(map);
+    
+    if (map->likelihood)
+    {
+        likelihood_refresh(map);
+    }
 }
 
-void map_string(
-        map_t map,
-        char * str)
+void
+        map_enable_likelihood(
+        map_t * map,
+        double basin_mm)
 {
-    sprintf(str, "size = %d x %d pixels | = %f meters",
-            map.size_pixels, map.size_pixels, map.size_meters);
+    int size = map->size_pixels;
+    double radius = basin_mm * map->scale_pixels_per_mm;
+    likelihood_t * field = NULL;
+    int k = 0;
+    
+    if (radius < 1)
+    {
+        radius = 1;
+    }
+    
+    if (map->likelihood)
+    {
+        likelihood_free(map->likelihood);
+    }
+    
+    field = (likelihood_t *)safe_malloc(sizeof(likelihood_t));
+    field->cells = (unsigned char *)safe_malloc(size * size);
+    field->radius_pixels = (int)ceil(radius);
+    
+    /* 255 at radius and beyond */
+    field->costs = (unsigned char *)safe_malloc(field->radius_pixels + 1);
+    for (k=0; k<=field->radius_pixels; ++k)
+    {
+        double cost = 255 * (k / radius) * (k / radius);
+        field->costs[k] = cost < 255 ? (unsigned char)floor(cost + 0.5) : 255;
+    }
+    
+    likelihood_alloc_scratch(field, size);
+    
+    map->likelihood = field;
+    
+    likelihood_mark_changed(field, 0, 0, size - 1, size - 1);
+    likelihood_refresh(map);
 }
 
-void
-        map_update(
-        map_t * map,
+int
+        distance_scan_to_likelihood(
+        map_t *  map,
         scan_t * scan,
-        position_t position,
-        int map_quality,
-        double hole_width_mm)
+        position_t position)
 {
+    likelihood_t * field = map->likelihood;
+    int size = map->size_pixels;
     
+    /* Pre-compute sine and cosine of angle for rotation */
     double position_theta_radians = radians(position.theta_degrees);
-    double costheta = cos(position_theta_radians);
-    double sintheta = sin(position_theta_radians);
+    double costheta = cos(position_theta_radians) * map->scale_pixels_per_mm;
+    double sintheta = sin(position_theta_radians) * map->scale_pixels_per_mm;
     
-    int x1 = roundup(position.x_mm * map->scale_pixels_per_mm);
-    int y1 = roundup(position.y_mm * map->scale_pixels_per_mm);
+    /* Pre-compute pixel offset for translation */
+    double pos_x_pix = position.x_mm * map->scale_pixels_per_mm;
+    double pos_y_pix = position.y_mm * map->scale_pixels_per_mm;
     
+    int64_t sum = 0;
+    int npoints = 0;
     int i = 0;
-    for (i = 0; i != scan->npoints; i++)
-    {        
-        double x2p = costheta * scan->x_mm[i] - sintheta * scan->y_mm[i];
-        double y2p = sintheta * scan->x_mm[i] + costheta * scan->y_mm[i];
-        
-        int xp = roundup((position.x_mm + x2p) * map->scale_pixels_per_mm);
-        int yp = roundup((position.y_mm + y2p) * map->scale_pixels_per_mm);
-        
-        double dist = sqrt(x2p * x2p + y2p * y2p);
-        double add = hole_width_mm / 2 / dist;
-        
-        x2p *= map->scale_pixels_per_mm * (1 + add);
-        y2p *= map->scale_pixels_per_mm * (1 + add);
+    
+    if (!field)
+    {
+        return -1;
+    }
+    
+    /* The obstacle points are kept apart from the free ones in obst_x_mm, obst_y_mm */
+    for (i=0; i<scan->obst_npoints; i++)
+    {
+        int x = (int)floor(pos_x_pix + costheta * scan->obst_x_mm[i] - sintheta * scan->obst_y_mm[i] + 0.5);
+        int y = (int)floor(pos_y_pix + sintheta * scan->obst_x_mm[i] + costheta * scan->obst_y_mm[i] + 0.5);
         
-        {  
-            int x2 = roundup(position.x_mm * map->scale_pixels_per_mm + x2p);
-            int y2 = roundup(position.y_mm * map->scale_pixels_per_mm + y2p);
-            
-            int value = OBSTACLE;
-            int q = map_quality;
-            
-            if (scan->value[i] == NO_OBSTACLE)
-            {
-                q = map_quality / 4;
-                value = NO_OBSTACLE;
-            }
-            
-            map_laser_ray(map->pixels, map->size_pixels, x1, y1, x2, y2, xp, yp, value, q);
+        if (x >= 0 && x < size && y >= 0 && y < size)
+        {
+            sum += field->cells[y * size + x];
+            npoints++;
         }
     }
+    
+    return npoints ? (int)(sum * 1024 / npoints) : -1;
 }
 
 void
-        map_get(
+        map_get_region(
         map_t * map,
-        char * bytes)
+        unsigned char * bytes,
+        int x,
+        int y,
+        int width,
+        int height,
+        int stride)
 {
-    int k;
-    for (k=0; k<map->size_pixels*map->size_pixels; ++k)
+    int j;
+    for (j=0; j<height; ++j)
     {
-        bytes[k] = map->pixels[k] >> 8;
+        pixel_t * src = map->pixels + (y + j) * map->size_pixels + x;
+        unsigned char * dst = bytes + j * stride;
+        int k;
+        for (k=0; k<width; ++k)
+        {
+            dst[k] = src[k] >> 8;
+        }
     }
 }
 
-
-void
-        map_set(
+int
+        map_take_changes(
         map_t * map,
-        char * bytes)
+        int * xmin,
+        int * ymin,
+        int * xmax,
+        int * ymax)
 {
-    int k;
-    for (k=0; k<map->size_pixels*map->size_pixels; ++k)
+    if (map->changed_xmin > map->changed_xmax || map->changed_ymin > map->changed_ymax)
     {
-        map->pixels[k] = bytes[k];
-        map->pixels[k] <<= 8;
+        return 0;
     }
+    
+    *xmin = map->changed_xmin;
+    *ymin = map->changed_ymin;
+    *xmax = map->changed_xmax;
+    *ymax = map->changed_ymax;
+    
+    /* empty box: min past max */
+    map->changed_xmin = map->size_pixels;
+    map->changed_ymin = map->size_pixels;
+    map->changed_xmax = -1;
+    map->changed_ymax = -1;
+    
+    return 1;
 }
 
 void scan_init(
@@ -469,6 +1659,8 @@ void scan_init(
     int detection_margin,               
     double offset_mm)                  
 {
+    int n = 0;
+    
     scan->x_mm = double_alloc(size*span);
     scan->y_mm = double_alloc(size*span);
     scan->value = int_alloc(size*span);
@@ -494,6 +1686,18 @@ void scan_init(
     /* assure size multiple of 4 for SSE */
     scan->obst_x_mm = float_alloc(size*span+4);
     scan->obst_y_mm = float_alloc(size*span+4);
+    
+    /* Directions of all sub-rays, fixed for the laser */
+    scan->ray_cos = double_alloc(size*span);
+    scan->ray_sin = double_alloc(size*span);
+    scan->point_class = (unsigned char *)safe_malloc(size*span+4);
+    for (n=0; n<size*span; ++n)
+    {
+        double k = (double)n * detection_angle_degrees / (size * span - 1);
+        double angle = radians(-detection_angle_degrees/2 + k);
+        scan->ray_cos[n] = cos(angle);
+        scan->ray_sin[n] = sin(angle);
+    }
 }
 
 
@@ -507,6 +1711,10 @@ void
     
     free(scan->obst_x_mm);
     free(scan->obst_y_mm);
+    
+    free(scan->ray_cos);
+    free(scan->ray_sin);
+    free(scan->point_class);
 
     interpolation_t * interp = (interpolation_t *)scan->interpolation;
     free(interp->angles);
@@ -538,48 +1746,254 @@ scan_update(
         interpolate_scan(scan, lidar_angles_deg, lidar_distances_mm, scan_size);
     }
 
-    /* Take velocity into account */
-    int degrees_per_second = (int)(scan->rate_hz * 360);
-    double horz_mm = velocities_dxy_mm / degrees_per_second;
-    double rotation = 1 + velocities_dtheta_degrees / degrees_per_second;
+    compensation_t comp;
+    int i = 0;
+    
+    scan_begin(scan, &comp, velocities_dxy_mm, velocities_dtheta_degrees);
     
     /* Span the laser scans to better cover the space */
+    for (i=scan->detection_margin+1; i<scan->size-scan->detection_margin; ++i)
+    {
+        scan_update_ray(scan, &comp, i, lidar_distances_mm[i], hole_width_mm);
+    }
+}
+
+void
+scan_update_both(
+        scan_t * scan1,
+        scan_t * scan2,
+        int *   lidar_distances_mm,
+        double  hole_width_mm,
+        double  velocities_dxy_mm,
+        double  velocities_dtheta_degrees)
+{
+    compensation_t comp1, comp2;
     int i = 0;
     
-    scan->npoints = 0;
-    scan->obst_npoints = 0;
+    /* Both scans have to walk the same rays */
+    if (scan1->size != scan2->size || scan1->detection_margin != scan2->detection_margin)
+    {
+        scan_update(scan1, NULL, lidar_distances_mm, scan1->size, hole_width_mm, 
+                    velocities_dxy_mm, velocities_dtheta_degrees);
+        scan_update(scan2, NULL, lidar_distances_mm, scan2->size, hole_width_mm, 
+                    velocities_dxy_mm, velocities_dtheta_degrees);
+        return;
+    }
     
-    for (i=scan->detection_margin+1; i<scan->size-scan->detection_margin; ++i)
+    scan_begin(scan1, &comp1, velocities_dxy_mm, velocities_dtheta_degrees);
+    scan_begin(scan2, &comp2, velocities_dxy_mm, velocities_dtheta_degrees);
+    
+    for (i=scan1->detection_margin+1; i<scan1->size-scan1->detection_margin; ++i)
     {
-        int lidar_value_mm = lidar_distances_mm[i];
-        
-        /* No obstacle */
-        if (lidar_value_mm == 0)
+        scan_update_ray(scan1, &comp1, i, lidar_distances_mm[i], hole_width_mm);
+        scan_update_ray(scan2, &comp2, i, lidar_distances_mm[i], hole_width_mm);
+    }
+}
+
+void
+        scan_decimate(
+        scan_t * scan,
+        int max_points)
+{
+    int counts[DECIMATE_BINS+1];
+    int quotas[DECIMATE_BINS+1];
+    double spacing[DECIMATE_BINS];
+    double along[DECIMATE_BINS];
+    int n = scan->obst_npoints;
+    int nedges = 0;
+    int edge_quota = 0;
+    int b, i, j, k;
+    
+    if (max_points <= 0 || n <= max_points)
+    {
+        return;
+    }
+    
+    obstacle_classify(scan, counts);
+    
+    /* Ends of surfaces pin down the pose along them, so they go first, evenly 
+       subsampled if there are too many */
+    edge_quota = counts[DECIMATE_EDGE] < max_points / 4 ? counts[DECIMATE_EDGE] : max_points / 4;
+    decimate_quotas(counts, quotas, DECIMATE_BINS, max_points - edge_quota);
+    
+    /* Points are taken evenly along the surfaces of each orientation, so that
+       dense walls close by count no more than distant ones */
+    for (b=0; b<DECIMATE_BINS; ++b)
+    {
+        spacing[b] = 0;
+        along[b] = 0;
+    }
+    for (i=0; i<n; ++i)
+    {
+        b = scan->point_class[i];
+        if (b < DECIMATE_BINS && quotas[b] < counts[b])
         {
-            scan_update_xy(scan, i, (int)scan->distance_no_detection_mm, NO_OBSTACLE, horz_mm, rotation);
+            spacing[b] += obstacle_gap(scan, i, (i + n - 1) % n);
         }
-        
-        /* Obstacle */
-        else if (lidar_value_mm > hole_width_mm / 2)
+    }
+    for (b=0; b<DECIMATE_BINS; ++b)
+    {
+        if (quotas[b] > 0 && quotas[b] < counts[b])
         {
-            int oldstart = scan->npoints;
-         
-            int j = 0;
-            
-            scan_update_xy(scan, i, lidar_value_mm, OBSTACLE, horz_mm, rotation);
-            
-            /* Store obstacles separately for SSE */
-            for (j=oldstart; j<scan->npoints; ++j)
+            spacing[b] /= quotas[b];
+            along[b] = spacing[b];
+        }
+    }
+    
+    for (i=0; i<n; ++i)
+    {
+        b = scan->point_class[i];
+        if (b == DECIMATE_EDGE)
+        {
+            /* keep edge number k when k * quota / count steps up */
+            int keep = (nedges + 1) * edge_quota / counts[b] > nedges * edge_quota / counts[b];
+            nedges++;
+            if (keep)
+            {
+                scan->point_class[i] |= DECIMATE_KEEP;
+            }
+        }
+        else if (quotas[b] >= counts[b])
+        {
+            scan->point_class[i] |= DECIMATE_KEEP;
+        }
+        else if (quotas[b] > 0)
+        {
+            along[b] += obstacle_gap(scan, i, (i + n - 1) % n);
+            if (along[b] >= spacing[b])
             {
-                if (scan->value[j] == OBSTACLE)
-                {
-                    scan->obst_x_mm[scan->obst_npoints] = (float)scan->x_mm[j];
-                    scan->obst_y_mm[scan->obst_npoints] = (float)scan->y_mm[j];
-                    scan->obst_npoints++;
-                }
+                scan->point_class[i] |= DECIMATE_KEEP;
+                along[b] = along[b] >= 2 * spacing[b] ? 0 : along[b] - spacing[b];
+                quotas[b]--;
             }
         }
     }
+    
+    /* Compact both point lists to the kept obstacles, in scan order */
+    for (i=0, j=0, k=0; i<scan->npoints; ++i)
+    {
+        if (scan->value[i] != OBSTACLE)
+        {
+            continue;
+        }
+        if (scan->point_class[j] & DECIMATE_KEEP)
+        {
+            scan->x_mm[k] = scan->x_mm[i];
+            scan->y_mm[k] = scan->y_mm[i];
+            scan->value[k] = OBSTACLE;
+            scan->obst_x_mm[k] = scan->obst_x_mm[j];
+            scan->obst_y_mm[k] = scan->obst_y_mm[j];
+            k++;
+        }
+        j++;
+    }
+    
+    scan->npoints = k;
+    scan->obst_npoints = k;
+}
+
+#define RMHC_BATCH 16
+
+void
+        rmhc_cache_init(
+        rmhc_cache_t * cache,
+        int size_log2,
+        double xy_quantum_mm,
+        double theta_quantum_degrees)
+{
+    int size = 1 << size_log2;
+    
+    cache->keys = (unsigned long long *)safe_malloc(size * sizeof(unsigned long long));
+    cache->distances = int_alloc(size);
+    cache->stamps = (unsigned int *)safe_malloc(size * sizeof(unsigned int));
+    memset(cache->stamps, 0, size * sizeof(unsigned int));
+    cache->size_log2 = size_log2;
+    cache->count = 0;
+    cache->stamp = 0;
+    
+    cache->xy_quantum_mm = xy_quantum_mm;
+    cache->theta_quantum_degrees = theta_quantum_degrees;
+    
+    cache->lookups = 0;
+    cache->hits = 0;
+}
+
+void
+        rmhc_cache_free(
+        rmhc_cache_t * cache)
+{
+    free(cache->keys);
+    free(cache->distances);
+    free(cache->stamps);
+}
+
+static void
+        rmhc_cache_begin(
+        rmhc_cache_t * cache)
+{
+    cache->count = 0;
+    
+    /* Stamp 0 marks a free slot; on wrapping around, free them all */
+    if (++cache->stamp == 0)
+    {
+        memset(cache->stamps, 0, (1 << cache->size_log2) * sizeof(unsigned int));
+        cache->stamp = 1;
+    }
+}
+
+/* Snaps position to the lattice and scores it, from the cache if it has been 
+   scored already in this search.  Returns nonzero if the kernel was run. */
+static int
+        rmhc_cache_distance(
+        rmhc_cache_t * cache,
+        map_t * map,
+        scan_t * scan,
+        position_t * position,
+        int * distance)
+{
+    double qx = floor(position->x_mm / cache->xy_quantum_mm + 0.5);
+    double qy = floor(position->y_mm / cache->xy_quantum_mm + 0.5);
+    double qt = floor(position->theta_degrees / cache->theta_quantum_degrees + 0.5);
+    
+    /* 20 bits of each coordinate and 24 of the heading: candidates of one 
+       search are far closer together than that wraps around */
+    unsigned long long key = 
+        ((unsigned long long)((long long)qx & 0xFFFFF) << 44) |
+        ((unsigned long long)((long long)qy & 0xFFFFF) << 24) |
+        ((unsigned long long)((long long)qt & 0xFFFFFF));
+    
+    unsigned int mask = (1u << cache->size_log2) - 1;
+    unsigned int slot = (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> (64 - cache->size_log2));
+    
+    position->x_mm = qx * cache->xy_quantum_mm;
+    position->y_mm = qy * cache->xy_quantum_mm;
+    position->theta_degrees = qt * cache->theta_quantum_degrees;
+    
+    cache->lookups++;
+    
+    while (cache->stamps[slot] == cache->stamp)
+    {
+        if (cache->keys[slot] == key)
+        {
+            cache->hits++;
+            *distance = cache->distances[slot];
+            return 0;
+        }
+        slot = (slot + 1) & mask;
+    }
+    
+    *distance = scan_distance(map, scan, *position);
+    
+    /* Past half full, probes get long: score the rest without keeping them */
+    if (2 * cache->count < (1 << cache->size_log2))
+    {
+        cache->keys[slot] = key;
+        cache->distances[slot] = *distance;
+        cache->stamps[slot] = cache->stamp;
+        cache->count++;
+    }
+    
+    return 1;
 }
 
 position_t
@@ -591,27 +2005,81 @@ position_t
         double sigma_theta_degrees,
         int max_search_iter,
         void * randomizer)
+{
+    return rmhc_position_search_bounded(start_pos, map, scan, sigma_xy_mm, sigma_theta_degrees, 
+                                        max_search_iter, 0, 0, 0, randomizer, NULL, NULL);
+}
+
+position_t
+        rmhc_position_search_bounded(
+        position_t start_pos,
+        map_t * map,
+        scan_t * scan,
+        double sigma_xy_mm,
+        double sigma_theta_degrees,
+        int max_search_iter,
+        double min_sigma_xy_mm,
+        double min_sigma_theta_degrees,
+        int max_evaluations,
+        void * randomizer,
+        rmhc_cache_t * cache,
+        int * evaluations)
 {
     position_t currentpos = start_pos;
     position_t bestpos = start_pos;
     position_t lastbestpos = start_pos;
     
-    int current_distance = distance_scan_to_map(map, scan, currentpos);
+    int current_distance = scan_distance(map, scan, currentpos);
     
     int lowest_distance =  current_distance;
     int last_lowest_distance = current_distance;
     
     int counter = 0;
+    int nevals = 1;
+    
+    /* Three normals per candidate, drawn RMHC_BATCH candidates at a time */
+    float normals[3*RMHC_BATCH];
+    int next = 3*RMHC_BATCH;
+    
+    if (cache)
+    {
+        rmhc_cache_begin(cache);
+    }
     
     while (counter < max_search_iter)
     {
+        /* Converged to the requested resolution, or out of budget */
+        if (sigma_xy_mm < min_sigma_xy_mm && sigma_theta_degrees < min_sigma_theta_degrees)
+        {
+            break;
+        }
+        if (max_evaluations > 0 && nevals >= max_evaluations)
+        {
+            break;
+        }
+        
+        if (next == 3*RMHC_BATCH)
+        {
+            random_normals(randomizer, normals, 3*RMHC_BATCH);
+            next = 0;
+        }
+        
         currentpos = lastbestpos;
         
-        currentpos.x_mm = random_normal(randomizer, currentpos.x_mm, sigma_xy_mm);
-        currentpos.y_mm = random_normal(randomizer, currentpos.y_mm, sigma_xy_mm);
-        currentpos.theta_degrees = random_normal(randomizer, currentpos.theta_degrees, sigma_theta_degrees);
+        currentpos.x_mm += sigma_xy_mm * normals[next];
+        currentpos.y_mm += sigma_xy_mm * normals[next+1];
+        currentpos.theta_degrees += sigma_theta_degrees * normals[next+2];
+        next += 3;
         
-        current_distance = distance_scan_to_map(map, scan, currentpos);
+        if (cache)
+        {
+            nevals += rmhc_cache_distance(cache, map, scan, &currentpos, &current_distance);
+        }
+        else
+        {
+            current_distance = scan_distance(map, scan, currentpos);
+            nevals++;
+        }
         
         /* -1 indicates infinity */
         if ((current_distance > -1) && (current_distance < lowest_distance))
@@ -638,5 +2106,10 @@ position_t
         
     }
     
+    if (evaluations)
+    {
+        *evaluations = nevals;
+    }
+    
     return bestpos;
 }
@@ -30,6 +30,9 @@ static const double DEFAULT_SIGMA_THETA_DEGREES = 20;
 
 static const double DEFAULT_MAX_SEARCH_ITER     = 1000;
 
+/* Byte value (as from map_get) of a pixel nothing has been seen in */
+static const unsigned char MAP_UNKNOWN_BYTE     = 127;
+
 
 /* Core types --------------------------------------------------------------- */
 
@@ -43,6 +46,30 @@ typedef struct position_t
 
 typedef unsigned short pixel_t;
 
+/* Likelihood field for scan matching: a smoothed byte copy of the map in which
+   each cell holds the minimum over nearby pixels q of (map value at q + a cost 
+   growing with the squared distance to q, reaching 255 at radius_pixels), 
+   truncated at 255.  On a map of clear obstacles and free space this is a 
+   truncated squared Euclidean distance transform of the obstacles, so the matching
+   score falls off smoothly around every wall instead of in steps. */
+typedef struct likelihood_t {
+
+    unsigned char * cells;
+    int radius_pixels;         /* distance beyond which an obstacle has no effect */
+    unsigned char * costs;     /* cost by distance in pixels, 0 through radius_pixels */
+
+    /* bounding box of map pixels changed since the field was last brought up to date */
+    int changed_xmin;
+    int changed_ymin;
+    int changed_xmax;
+    int changed_ymax;
+
+    /* scratch for the distance transform */
+    unsigned char * rows;
+    unsigned char * line;
+
+} likelihood_t;
+
 typedef struct map_t {
     
     pixel_t * pixels;
@@ -50,6 +77,15 @@ typedef struct map_t {
     double size_meters;
     
     double scale_pixels_per_mm;
+
+    /* bounding box of pixels changed since last map_take_changes() */
+    int changed_xmin;
+    int changed_ymin;
+    int changed_xmax;
+    int changed_ymax;
+
+    /* NULL unless map_enable_likelihood() has been called */
+    likelihood_t * likelihood;
     
 } map_t;
 
@@ -76,9 +112,129 @@ typedef struct scan_t
     float * obst_x_mm;
     float * obst_y_mm;
     int obst_npoints;
+    
+    /* unit vector of every sub-ray, before velocity compensation */
+    double * ray_cos;
+    double * ray_sin;
+    
+    /* scratch for scan_decimate */
+    unsigned char * point_class;
         
 } scan_t;
 
+/* One laser ray as drawn by map_laser_ray: a Bresenham line from (x1,y1), clipped
+   to the map, whose value dips from NO_OBSTACLE to the scan value and back over 
+   the hole around the end point. */
+typedef struct laser_ray_t
+{
+    int x;                      /* first pixel */
+    int y;
+    int length;                 /* number of pixels to draw */
+    int major_x;                /* step along the line every pixel */
+    int major_y;
+    int minor_x;                /* extra step whenever the error term overflows */
+    int minor_y;
+    
+    int dx;                     /* length along the major axis before clipping */
+    int error;
+    int horiz;
+    int diago;
+    
+    int derrorv;                /* value profile around the hole */
+    int errorv;
+    int incv;
+    int incerrorv;
+    int sincv;
+    int pixval;
+    
+} laser_ray_t;
+
+/* A map_update split into phases, so that rays can be traced and integrated on 
+   several threads: each part walks a share of the rays and cuts them into runs, 
+   one per map tile crossed, which are binned by tile; each part then integrates 
+   the runs of its own tiles.  No pixel is written by two parts, and each pixel 
+   sees the rays in scan order, so the map ends up exactly as after map_update. */
+static const int MAP_TILE_SHIFT = 5;   /* 32 x 32 pixel tiles */
+
+typedef struct map_ray_t
+{
+    int x1;                     /* start, at the robot */
+    int y1;
+    int x2;                     /* end, past the obstacle by half a hole */
+    int y2;
+    int xp;                     /* obstacle */
+    int yp;
+    int value;
+    int alpha;
+
+} map_ray_t;
+
+/* Consecutive pixels of one ray within one tile */
+typedef struct map_run_t
+{
+    int tile;
+    int ray;
+    int first;                  /* step along the ray */
+    int count;
+    int x;                      /* pixel and Bresenham error at that step */
+    int y;
+    int error;
+
+} map_run_t;
+
+typedef struct map_batch_part_t
+{
+    map_run_t * runs;           /* in ray order */
+    int nruns;
+    int runs_capacity;
+
+} map_batch_part_t;
+
+typedef struct map_batch_t
+{
+    int nparts;
+    map_batch_part_t * parts;
+
+    map_ray_t * rays;
+    laser_ray_t * walks;        /* initial walk state of each ray */
+    int nrays;
+    int rays_capacity;
+    int walks_capacity;
+
+    int tiles_per_row;
+    int ntiles;
+    int * tile_first;           /* runs of tile t are binned[tile_first[t]] up to binned[tile_first[t+1]] */
+    map_run_t * binned;
+    int binned_capacity;
+
+} map_batch_t;
+
+/* Scores of the poses visited by one RMHC search.  Candidates are snapped to a 
+   lattice of xy_quantum_mm by theta_quantum_degrees before they are scored, so 
+   that a candidate landing on a lattice point scored earlier in the same search 
+   (frequent once the sigmas have been halved to a few pixels) reuses its score 
+   instead of running the kernel again, and every score is that of the pose 
+   searched from.  Open addressing with linear probing; slots are stamped with 
+   the search that filled them, so nothing is cleared between searches and a 
+   new search (a new scan, or the map as since updated) never sees old scores. */
+typedef struct rmhc_cache_t
+{
+    unsigned long long * keys;
+    int * distances;
+    unsigned int * stamps;
+    int size_log2;
+    int count;                  /* slots filled by the current search */
+    unsigned int stamp;         /* of the current search */
+
+    double xy_quantum_mm;
+    double theta_quantum_degrees;
+
+    /* since rmhc_cache_init */
+    long long lookups;
+    long long hits;
+
+} rmhc_cache_t;
+
 /* Exported functions ------------------------------------------------------- */
 
 #ifdef __cplusplus 
@@ -100,6 +256,12 @@ map_init(
     int size_pixels, 
     double size_meters);
 
+/* Initializes map as a copy of src, likelihood field included */
+void
+map_copy(
+    map_t * map,
+    map_t * src);
+
 void
 map_free(
     map_t * map);
@@ -116,6 +278,49 @@ map_update(
     int map_quality, 
     double hole_width_mm);
 
+/* Phased map_update for nparts threads.  Call map_update_begin, then 
+   map_update_trace for every part (concurrently), map_update_bin, 
+   map_update_apply for every part (concurrently) and map_update_end. */
+void
+map_batch_init(
+    map_batch_t * batch,
+    int nparts);
+
+void
+map_batch_free(
+    map_batch_t * batch);
+
+void
+map_update_begin(
+    map_t * map,
+    map_batch_t * batch,
+    scan_t * scan,
+    position_t position,
+    int map_quality,
+    double hole_width_mm);
+
+void
+map_update_trace(
+    map_t * map,
+    map_batch_t * batch,
+    int part);
+
+void
+map_update_bin(
+    map_t * map,
+    map_batch_t * batch);
+
+void
+map_update_apply(
+    map_t * map,
+    map_batch_t * batch,
+    int part);
+
+void
+map_update_end(
+    map_t * map,
+    map_batch_t * batch);
+
 void scan_init(
     scan_t * scan, 
     int span,
@@ -144,6 +349,36 @@ scan_update(
     double velocities_dxy_mm,
     double velocities_dtheta_degrees);
 
+/* Same as scan_update on each scan without interpolation, but walks the rays once 
+   for both, e.g. the map-building and distance scans of one revolution */
+void 
+scan_update_both(
+    scan_t * scan1, 
+    scan_t * scan2, 
+    int   * lidar_distances_mm, 
+    double hole_width_mm,
+    double velocities_dxy_mm,
+    double velocities_dtheta_degrees);
+
+/* Moves the map content by (-dx_pixels, -dy_pixels): the pixel at (x, y) takes the
+   value of the one at (x + dx_pixels, y + dy_pixels).  Pixels moved in from off the
+   map are unknown; the whole map counts as changed. */
+void
+map_shift(
+    map_t * map,
+    int dx_pixels,
+    int dy_pixels);
+
+/* Reduces the obstacle points of a scan to at most max_points for matching: points 
+   at range discontinuities (ends of surfaces) first, then the rest spread evenly over
+   surface orientations and, within one orientation, evenly along the surface. Free
+   points are dropped, so the result is only fit for scan-to-map distances. Does 
+   nothing if the scan already has max_points obstacle points or fewer. */
+void
+scan_decimate(
+    scan_t * scan,
+    int max_points);
+
 void
 map_get(
     map_t * map, 
@@ -153,6 +388,33 @@ void
 map_set(
     map_t * map, 
     char * bytes);
+
+/* Copies a width x height rectangle of the map as bytes, rows stride bytes apart */
+void
+map_get_region(
+    map_t * map,
+    unsigned char * bytes,
+    int x,
+    int y,
+    int width,
+    int height,
+    int stride);
+
+/* Returns 1 and the changed rectangle (inclusive) if the map changed since 
+   the last call, 0 otherwise */
+int
+map_take_changes(
+    map_t * map,
+    int * xmin,
+    int * ymin,
+    int * xmax,
+    int * ymax);
+
+/* Makes the next map_take_changes() report the whole map, e.g. when the map stands in
+   for another one a reader had copied; the likelihood field is left as it is */
+void
+map_report_all_changed(
+    map_t * map);
     
 /* Returns -1 for infinity */
 int 
@@ -161,6 +423,24 @@ distance_scan_to_map(
     scan_t * scan,
     position_t position);
 
+/* Builds a likelihood field over the map that follows every later map_update and 
+   map_set, updating only around the changed pixels.  Obstacles affect the field 
+   up to basin_mm away.  Once enabled, the RMHC searches score poses with 
+   distance_scan_to_likelihood instead of distance_scan_to_map. */
+void
+map_enable_likelihood(
+    map_t * map,
+    double basin_mm);
+
+/* Like distance_scan_to_map, but reads the likelihood field; scores range over 
+   0 (every point on an obstacle) to 255 * 1024.  Returns -1 for infinity or if 
+   the map has no likelihood field. */
+int 
+distance_scan_to_likelihood(
+    map_t *  map,
+    scan_t * scan,
+    position_t position);
+
 
 /* Random-Mutation Hill-Climbing search */
 position_t 
@@ -173,6 +453,40 @@ rmhc_position_search(
 	int max_search_iter,
 	void * randomizer);
 
+/* RMHC search that can stop early: once both sigmas have been halved below 
+   min_sigma_xy_mm and min_sigma_theta_degrees (the score has converged to map 
+   resolution), or after max_evaluations calls to distance_scan_to_map (0 for no
+   limit).  With both minimums and max_evaluations at zero and no cache this is 
+   identical to rmhc_position_search.  The number of evaluations used goes to 
+   *evaluations if not NULL; scores found in cache (if not NULL) are not counted. */
+position_t 
+rmhc_position_search_bounded(
+    position_t start_pos,
+    map_t * map,
+    scan_t * scan,
+    double sigma_xy_mm,
+    double sigma_theta_degrees,
+    int max_search_iter,
+    double min_sigma_xy_mm,
+    double min_sigma_theta_degrees,
+    int max_evaluations,
+    void * randomizer,
+    rmhc_cache_t * cache,
+    int * evaluations);
+
+/* Cache of 2^size_log2 slots, which holds the scores of up to half as many 
+   candidates per search */
+void
+rmhc_cache_init(
+    rmhc_cache_t * cache,
+    int size_log2,
+    double xy_quantum_mm,
+    double theta_quantum_degrees);
+
+void
+rmhc_cache_free(
+    rmhc_cache_t * cache);
+
 #ifdef __cplusplus 
 }
 #endif
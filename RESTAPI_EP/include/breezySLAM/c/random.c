@@ -23,16 +23,152 @@ along with this code.  If not, see <http:#www.gnu.org/licenses/>.
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+
+/* The generator is xoshiro128++ (Blackman and Vigna), run as RANDOM_LANES 
+   independent streams side by side so that a batch steps all of them at once in 
+   vector registers.  The lanes start 2^64 steps apart, and random_jump moves all 
+   of them 2^96 steps on.  Normals come from Marsaglia and Tsang's ziggurat, with 
+   the tables of ziggurat.c: a batch takes the fast path for every lane without 
+   branching and fixes up the rare rejections one at a time. */
+
+#define RANDOM_LANES 8
+#define RANDOM_BUFFER 64
 
 typedef struct random_t 
 {
+    uint32_t s0[RANDOM_LANES];
+    uint32_t s1[RANDOM_LANES];
+    uint32_t s2[RANDOM_LANES];
+    uint32_t s3[RANDOM_LANES];
+
     float    fn[128];
     uint32_t kn[128];
     float    wn[128];  
-    uint32_t seed;
+
+    /* variates of the last batch random_normal has not returned yet */
+    float    buffer[RANDOM_BUFFER];
+    int      buffered;
         
 } random_t;
 
+static const uint32_t JUMP[4] = { 0x8764000b, 0xf542d2d3, 0x6fa035c3, 0x77f2db5b };
+static const uint32_t LONG_JUMP[4] = { 0xb523952e, 0x0b6f099f, 0xccf5a0ef, 0x1c580662 };
+
+static inline uint32_t rotl(uint32_t x, int k)
+{
+    return (x << k) | (x >> (32 - k));
+}
+
+/* Steps lane l alone, for the ziggurat's rejections */
+static inline uint32_t next_lane(random_t * r, int l)
+{
+    uint32_t result = rotl(r->s0[l] + r->s3[l], 7) + r->s0[l];
+    uint32_t t = r->s1[l] << 9;
+
+    r->s2[l] ^= r->s0[l];
+    r->s3[l] ^= r->s1[l];
+    r->s1[l] ^= r->s2[l];
+    r->s0[l] ^= r->s3[l];
+    r->s2[l] ^= t;
+    r->s3[l] = rotl(r->s3[l], 11);
+
+    return result;
+}
+
+/* |hz| of the draw u as a signed integer, without branching */
+static inline uint32_t magnitude(uint32_t u)
+{
+    uint32_t sign = (uint32_t)((int32_t)u >> 31);
+    
+    return (u ^ sign) - sign;
+}
+
+/* Uniform in (0, 1), never 0, so that its log is finite */
+static inline float uniform_lane(random_t * r, int l)
+{
+    return ((next_lane(r, l) >> 8) + 0.5f) * (1.0f / 16777216.0f);
+}
+
+/* Moves lane l as many steps on as the polynomial says */
+static void jump_lane(random_t * r, int l, const uint32_t polynomial[4])
+{
+    uint32_t s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    int i = 0, b = 0;
+
+    for (i=0; i<4; ++i)
+    {
+        for (b=0; b<32; ++b)
+        {
+            if (polynomial[i] & (1u << b))
+            {
+                s0 ^= r->s0[l];
+                s1 ^= r->s1[l];
+                s2 ^= r->s2[l];
+                s3 ^= r->s3[l];
+            }
+            next_lane(r, l);
+        }
+    }
+
+    r->s0[l] = s0;
+    r->s1[l] = s1;
+    r->s2[l] = s2;
+    r->s3[l] = s3;
+}
+
+static uint64_t splitmix64(uint64_t * x)
+{
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ull);
+
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+
+    return z ^ (z >> 31);
+}
+
+/* The ziggurat's slow path for the 32-bit draw hz of lane l, which missed the 
+   fast path: the same as r4_nor's after its first draw */
+static float normal_slow(random_t * r, int l, int32_t hz)
+{
+    const float tail = 3.442620f;
+    uint32_t iz = hz & 127;
+    
+    for ( ; ; )
+    {
+        float x = 0;
+
+        if (iz == 0)
+        {
+            float y = 0;
+            
+            do
+            {
+                x = -0.2904764f * logf(uniform_lane(r, l));
+                y = -logf(uniform_lane(r, l));
+            } 
+            while (x * x > y + y);
+
+            return hz > 0 ? tail + x : -tail - x;
+        }
+        
+        x = (float)hz * r->wn[iz];
+        
+        if (r->fn[iz] + uniform_lane(r, l) * (r->fn[iz-1] - r->fn[iz]) < expf(-0.5f * x * x))
+        {
+            return x;
+        }
+        
+        hz = (int32_t)next_lane(r, l);
+        iz = hz & 127;
+        
+        if (magnitude((uint32_t)hz) < r->kn[iz])
+        {
+            return (float)hz * r->wn[iz];
+        }
+    }
+}
+
 size_t random_size(void)
 {
     return sizeof(random_t);
@@ -53,18 +189,134 @@ void * random_new(int seed)
 void random_init(void * v, int seed)
 {
     random_t * r = (random_t *)v;
+    uint64_t x = (uint64_t)(uint32_t)seed;
+    uint64_t a = splitmix64(&x);
+    uint64_t b = splitmix64(&x);
+    int l = 0;
+    
+    r->s0[0] = (uint32_t)a;
+    r->s1[0] = (uint32_t)(a >> 32);
+    r->s2[0] = (uint32_t)b;
+    r->s3[0] = (uint32_t)(b >> 32);
     
-    r->seed = seed;
+    /* All zero is the one state xoshiro never leaves */
+    if (!(r->s0[0] | r->s1[0] | r->s2[0] | r->s3[0]))
+    {
+        r->s0[0] = 1;
+    }
+    
+    for (l=1; l<RANDOM_LANES; ++l)
+    {
+        r->s0[l] = r->s0[l-1];
+        r->s1[l] = r->s1[l-1];
+        r->s2[l] = r->s2[l-1];
+        r->s3[l] = r->s3[l-1];
+        jump_lane(r, l, JUMP);
+    }
+
+    r->buffered = 0;
         
     r4_nor_setup (r->kn, r->fn, r->wn );    
 }
 
 
+void random_normals(void * v, float * normals, int count)
+{
+    random_t * r = (random_t *)v;
+    uint32_t s0[RANDOM_LANES], s1[RANDOM_LANES], s2[RANDOM_LANES], s3[RANDOM_LANES];
+    uint32_t raw[RANDOM_LANES];
+    float values[RANDOM_LANES];
+    uint32_t rejected = 0;
+    int k = 0, l = 0;
+    
+    /* The lanes step in locals, which the compiler keeps in vector registers */
+    memcpy(s0, r->s0, sizeof(s0));
+    memcpy(s1, r->s1, sizeof(s1));
+    memcpy(s2, r->s2, sizeof(s2));
+    memcpy(s3, r->s3, sizeof(s3));
+    
+    for (k=0; k<count; k+=RANDOM_LANES)
+    {
+        for (l=0; l<RANDOM_LANES; ++l)
+        {
+            uint32_t t = s1[l] << 9;
+
+            raw[l] = rotl(s0[l] + s3[l], 7) + s0[l];
+
+            s2[l] ^= s0[l];
+            s3[l] ^= s1[l];
+            s1[l] ^= s2[l];
+            s0[l] ^= s3[l];
+            s2[l] ^= t;
+            s3[l] = rotl(s3[l], 11);
+        }
+
+        /* The fast path for every lane, which ~97% of draws pass */
+        rejected = 0;
+        for (l=0; l<RANDOM_LANES; ++l)
+        {
+            uint32_t iz = raw[l] & 127;
+            
+            values[l] = (float)(int32_t)raw[l] * r->wn[iz];
+            rejected |= (uint32_t)(magnitude(raw[l]) >= r->kn[iz]) << l;
+        }
+
+        if (rejected)
+        {
+            memcpy(r->s0, s0, sizeof(s0));
+            memcpy(r->s1, s1, sizeof(s1));
+            memcpy(r->s2, s2, sizeof(s2));
+            memcpy(r->s3, s3, sizeof(s3));
+            
+            for (l=0; l<RANDOM_LANES; ++l)
+            {
+                if (rejected & (1u << l))
+                {
+                    values[l] = normal_slow(r, l, (int32_t)raw[l]);
+                }
+            }
+            
+            memcpy(s0, r->s0, sizeof(s0));
+            memcpy(s1, r->s1, sizeof(s1));
+            memcpy(s2, r->s2, sizeof(s2));
+            memcpy(s3, r->s3, sizeof(s3));
+        }
+        
+        memcpy(normals + k, values, (count - k < RANDOM_LANES ? count - k : RANDOM_LANES) * sizeof(float));
+    }
+    
+    memcpy(r->s0, s0, sizeof(s0));
+    memcpy(r->s1, s1, sizeof(s1));
+    memcpy(r->s2, s2, sizeof(s2));
+    memcpy(r->s3, s3, sizeof(s3));
+}
+
+
 double random_normal(void * v, double mu, double sigma)
 {
     random_t * r = (random_t *)v;
     
-    return mu + sigma * r4_nor ( &r->seed, r->kn, r->fn, r->wn );
+    if (r->buffered == 0)
+    {
+        random_normals(r, r->buffer, RANDOM_BUFFER);
+        r->buffered = RANDOM_BUFFER;
+    }
+    
+    return mu + sigma * r->buffer[RANDOM_BUFFER - r->buffered--];
+}
+
+
+void random_jump(void * v)
+{
+    random_t * r = (random_t *)v;
+    int l = 0;
+
+    for (l=0; l<RANDOM_LANES; ++l)
+    {
+        jump_lane(r, l, LONG_JUMP);
+    }
+
+    r->buffered = 0;
 }
 
 void random_free(void * v)
@@ -80,4 +332,3 @@ void * random_copy(void * v)
 
     return r;    
 }
-
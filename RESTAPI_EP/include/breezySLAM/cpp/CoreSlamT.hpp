@@ -0,0 +1,677 @@
+/**
+*
+* CoreSlamT.hpp - compile-time specialized RMHC SLAM core
+*
+* A header-only counterpart of RMHC_SLAM for deployments where the Lidar and map
+* size are known when compiling.  The map size and laser descriptor are template
+* parameters, so scan and map loops get constant trip counts and bounds, and map
+* rows are padded to a power-of-two stride so that row addressing is a shift.
+* It follows the arithmetic of the C core (coreslam.c, coreslam_sisd.c) step by
+* step, so given the same seed it produces the same positions and map as
+* RMHC_SLAM without a likelihood field.
+*
+* This code is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as
+* published by the Free Software Foundation, either version 3 of the
+* License, or (at your option) any later version.
+*
+* This code is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU Lesser General Public License
+* along with this code.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#include <stdio.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <array>
+#include <vector>
+
+#include "coreslam.h"
+#include "coreslam_internals.h"
+#include "random.h"
+#include "PoseChange.hpp"
+#include "Position.hpp"
+
+/**
+* Compile-time descriptor of the LD20 Lidar, matching the LD20 Laser class.
+* @param DetectionMargin number of rays at edges of scan to ignore
+* @param OffsetMm forward/backward offset of laser motor from robot center
+*/
+template <int DetectionMargin = 15, int OffsetMm = 50>
+struct LD20Model
+{
+    static constexpr int scan_size = 668;
+    static constexpr double scan_rate_hz = 6;
+    static constexpr double detection_angle_degrees = 360;
+    static constexpr double distance_no_detection_mm = 2000;
+    static constexpr int detection_margin = DetectionMargin;
+    static constexpr double offset_mm = OffsetMm;
+};
+
+/**
+* RMHC SLAM with the map size and Lidar fixed at compile time.
+* @param MapSizePixels the size of the map in pixels (map is square)
+* @param LaserModel a descriptor like LD20Model
+*/
+template <int MapSizePixels, class LaserModel>
+class CoreSlamT
+{
+    static constexpr int ceil_log2(int n)
+    {
+        int shift = 0;
+        while ((1 << shift) < n) ++shift;
+        return shift;
+    }
+
+public:
+
+    static constexpr int MAP_SIZE = MapSizePixels;
+    static constexpr int STRIDE_SHIFT = ceil_log2(MapSizePixels);
+    static constexpr int STRIDE = 1 << STRIDE_SHIFT;
+
+    static constexpr int SCAN_SIZE = LaserModel::scan_size;
+    static constexpr int FIRST_RAY = LaserModel::detection_margin + 1;
+    static constexpr int END_RAY = LaserModel::scan_size - LaserModel::detection_margin;
+    static constexpr int DEGREES_PER_SECOND = (int)(LaserModel::scan_rate_hz * 360);
+    // RMHC candidates whose normals are drawn in one batch
+    static constexpr int RMHC_BATCH = 16;
+
+    static_assert(MapSizePixels > 0 && STRIDE_SHIFT < 16, "unsupported map size");
+    static_assert(FIRST_RAY < END_RAY, "detection margin leaves no rays");
+
+    /**
+    * A scan of this Lidar with Span sub-rays per ray; obstacle points are kept
+    * apart for scan matching.
+    */
+    template <int Span>
+    struct ScanT
+    {
+        static constexpr int CAPACITY = SCAN_SIZE * Span;
+
+        std::array<double, CAPACITY> x_mm;
+        std::array<double, CAPACITY> y_mm;
+        std::array<int, CAPACITY> value;
+        int npoints = 0;
+
+        std::array<double, CAPACITY> obst_x_mm;
+        std::array<double, CAPACITY> obst_y_mm;
+        int obst_npoints = 0;
+    };
+
+    /**
+    * Creates a CoreSlamT object.
+    * @param map_size_meters the size of the area to be mapped, in meters
+    * @param random_seed seed for psuedorandom number generator
+    */
+    CoreSlamT(double map_size_meters, unsigned random_seed)
+        : pixels((size_t)MAP_SIZE * STRIDE, (OBSTACLE + NO_OBSTACLE) / 2)
+    {
+        this->map_quality = DEFAULT_MAP_QUALITY;
+        this->hole_width_mm = DEFAULT_HOLE_WIDTH_MM;
+        this->sigma_xy_mm = DEFAULT_SIGMA_XY_MM;
+        this->sigma_theta_degrees = DEFAULT_SIGMA_THETA_DEGREES;
+        this->max_search_iter = DEFAULT_MAX_SEARCH_ITER;
+        this->min_sigma_xy_mm = 0;
+        this->min_sigma_theta_degrees = 0;
+        this->max_evaluations = 0;
+        this->last_evaluations = 0;
+
+        this->size_meters = map_size_meters;
+        this->scale_pixels_per_mm = MAP_SIZE / (map_size_meters * 1000);
+
+        this->position.x_mm = 500 * map_size_meters;
+        this->position.y_mm = 500 * map_size_meters;
+        this->position.theta_degrees = 0;
+
+        this->randomizer = random_new(random_seed);
+    }
+
+    ~CoreSlamT(void)
+    {
+        free(this->randomizer);
+    }
+
+    CoreSlamT(const CoreSlamT &) = delete;
+    CoreSlamT & operator=(const CoreSlamT &) = delete;
+
+    /**
+    * Updates the scans, searches for the new position and integrates the scan into the
+    * map, like CoreSLAM::update() on an RMHC_SLAM object.
+    * @param scan_mm Lidar scan values, SCAN_SIZE of them
+    * @param poseChange poseChange for odometry
+    */
+    void update(const int * scan_mm, PoseChange & poseChange)
+    {
+        // Velocities first: scans are de-skewed with this revolution's, as in CoreSLAM::update()
+        this->velocities.update(poseChange.dxy_mm, poseChange.dtheta_degrees, poseChange.dt_seconds);
+
+        this->buildScans(scan_mm, this->velocities);
+
+        this->updateMapAndPointcloud(poseChange);
+    }
+
+    /**
+    * Updates with zero poseChange.
+    * @param scan_mm Lidar scan values, SCAN_SIZE of them
+    */
+    void update(const int * scan_mm)
+    {
+        PoseChange zero_poseChange;
+        this->update(scan_mm, zero_poseChange);
+    }
+
+    /**
+    * Returns the current position.
+    */
+    Position getpos(void) const
+    {
+        return Position(this->position.x_mm, this->position.y_mm, this->position.theta_degrees);
+    }
+
+    /**
+    * Retrieves the current map.
+    * @param mapbytes a byte array of MAP_SIZE * MAP_SIZE bytes
+    */
+    void getmap(unsigned char * mapbytes) const
+    {
+        for (int y = 0; y < MAP_SIZE; ++y)
+        {
+            const pixel_t * row = &this->pixels[(size_t)y << STRIDE_SHIFT];
+            for (int x = 0; x < MAP_SIZE; ++x)
+            {
+                mapbytes[y * MAP_SIZE + x] = row[x] >> 8;
+            }
+        }
+    }
+
+    /**
+    * Builds a scan from Lidar values, as scan_update does.
+    * @param scan the scan to fill
+    * @param scan_mm Lidar scan values, SCAN_SIZE of them
+    * @param velocities forward and angular velocity of the robot at scan time
+    */
+    template <int Span>
+    void buildScan(ScanT<Span> & scan, const int * scan_mm, const PoseChange & velocities) const
+    {
+        const RayTable<Span> & rays = rayTable<Span>();
+
+        double horz_mm = velocities.dxy_mm / DEGREES_PER_SECOND;
+        double rotation = 1 + velocities.dtheta_degrees / DEGREES_PER_SECOND;
+        bool rotating = rotation != 1;
+
+        // Velocity compensation turns sub-ray n by n * K_STEP * (rotation - 1)
+        double turn_per_step = radians(RayTable<Span>::K_STEP * (rotation - 1));
+        double turn_cos = cos(FIRST_RAY * Span * turn_per_step);
+        double turn_sin = sin(FIRST_RAY * Span * turn_per_step);
+        double step_cos = cos(turn_per_step);
+        double step_sin = sin(turn_per_step);
+
+        scan.npoints = 0;
+        scan.obst_npoints = 0;
+
+        for (int i = FIRST_RAY; i < END_RAY; ++i)
+        {
+            int lidar_value_mm = scan_mm[i];
+            int distance = 0;
+            int scanval = OBSTACLE;
+
+            if (lidar_value_mm == 0)
+            {
+                distance = (int)LaserModel::distance_no_detection_mm;
+                scanval = NO_OBSTACLE;
+            }
+            else if (lidar_value_mm > this->hole_width_mm / 2)
+            {
+                distance = lidar_value_mm;
+            }
+            else
+            {
+                if (rotating)
+                {
+                    for (int j = 0; j < Span; ++j)
+                    {
+                        advance(turn_cos, turn_sin, step_cos, step_sin);
+                    }
+                }
+                continue;
+            }
+
+            for (int j = 0; j < Span; ++j)
+            {
+                int n = i * Span + j;
+                double k = n * RayTable<Span>::K_STEP;
+                double ux = rays.cos[n];
+                double uy = rays.sin[n];
+
+                if (rotating)
+                {
+                    double u = ux * turn_cos - uy * turn_sin;
+                    uy = uy * turn_cos + ux * turn_sin;
+                    ux = u;
+                    advance(turn_cos, turn_sin, step_cos, step_sin);
+                }
+
+                double x = distance * ux - k * horz_mm;
+                double y = distance * uy;
+
+                scan.value[scan.npoints] = scanval;
+                scan.x_mm[scan.npoints] = x;
+                scan.y_mm[scan.npoints] = y;
+                scan.npoints++;
+
+                if (scanval == OBSTACLE)
+                {
+                    scan.obst_x_mm[scan.obst_npoints] = x;
+                    scan.obst_y_mm[scan.obst_npoints] = y;
+                    scan.obst_npoints++;
+                }
+            }
+        }
+    }
+
+    /**
+    * Computes the distance between a scan and the map at a position, as
+    * distance_scan_to_map does.
+    * @return scaled mean map value under the obstacle points, or -1 for infinity
+    */
+    template <int Span>
+    int distanceScanToMap(const ScanT<Span> & scan, const position_t & position) const
+    {
+        double position_theta_radians = radians(position.theta_degrees);
+        double costheta = cos(position_theta_radians) * this->scale_pixels_per_mm;
+        double sintheta = sin(position_theta_radians) * this->scale_pixels_per_mm;
+
+        double pos_x_pix = position.x_mm * this->scale_pixels_per_mm;
+        double pos_y_pix = position.y_mm * this->scale_pixels_per_mm;
+
+        const pixel_t * map_pixels = this->pixels.data();
+        int64_t sum = 0;
+        int npoints = 0;
+
+        for (int i = 0; i < scan.obst_npoints; i++)
+        {
+            int x = (int)floor(pos_x_pix + costheta * scan.obst_x_mm[i] - sintheta * scan.obst_y_mm[i] + 0.5);
+            int y = (int)floor(pos_y_pix + sintheta * scan.obst_x_mm[i] + costheta * scan.obst_y_mm[i] + 0.5);
+
+            if ((unsigned)x < (unsigned)MAP_SIZE && (unsigned)y < (unsigned)MAP_SIZE)
+            {
+                sum += map_pixels[((size_t)y << STRIDE_SHIFT) + x];
+                npoints++;
+            }
+        }
+
+        return npoints ? (int)(sum * 1024 / npoints) : -1;
+    }
+
+    /**
+    * Integrates a scan into the map at a position, as map_update does.
+    */
+    template <int Span>
+    void updateMap(const ScanT<Span> & scan, const position_t & position, int quality, double hole_width)
+    {
+        double position_theta_radians = radians(position.theta_degrees);
+        double costheta = cos(position_theta_radians);
+        double sintheta = sin(position_theta_radians);
+
+        int x1 = roundup(position.x_mm * this->scale_pixels_per_mm);
+        int y1 = roundup(position.y_mm * this->scale_pixels_per_mm);
+
+        for (int i = 0; i != scan.npoints; i++)
+        {
+            double x2p = costheta * scan.x_mm[i] - sintheta * scan.y_mm[i];
+            double y2p = sintheta * scan.x_mm[i] + costheta * scan.y_mm[i];
+
+            int xp = roundup((position.x_mm + x2p) * this->scale_pixels_per_mm);
+            int yp = roundup((position.y_mm + y2p) * this->scale_pixels_per_mm);
+
+            double dist = sqrt(x2p * x2p + y2p * y2p);
+            double add = hole_width / 2 / dist;
+
+            x2p *= this->scale_pixels_per_mm * (1 + add);
+            y2p *= this->scale_pixels_per_mm * (1 + add);
+
+            int x2 = roundup(position.x_mm * this->scale_pixels_per_mm + x2p);
+            int y2 = roundup(position.y_mm * this->scale_pixels_per_mm + y2p);
+
+            int value = OBSTACLE;
+            int q = quality;
+
+            if (scan.value[i] == NO_OBSTACLE)
+            {
+                q = quality / 4;
+                value = NO_OBSTACLE;
+            }
+
+            this->laserRay(x1, y1, x2, y2, xp, yp, value, q);
+        }
+    }
+
+    /**
+    * The quality of the map (0 through 255); default = 50
+    */
+    int map_quality;
+
+    /**
+    * The width in millimeters of each "hole" in the map (essentially, wall width); default = 600
+    */
+    double hole_width_mm;
+
+    /**
+    * RMHC search parameters, as in RMHC_SLAM
+    */
+    double sigma_xy_mm;
+    double sigma_theta_degrees;
+    int max_search_iter;
+    double min_sigma_xy_mm;
+    double min_sigma_theta_degrees;
+    int max_evaluations;
+
+    /**
+    * Number of scan-to-map distance evaluations used by the most recent search
+    */
+    int last_evaluations;
+
+private:
+
+    // Unit vectors of every sub-ray, shared by all instances for this laser and span
+    template <int Span>
+    struct RayTable
+    {
+        static constexpr int COUNT = SCAN_SIZE * Span;
+        static constexpr double K_STEP = LaserModel::detection_angle_degrees / (COUNT - 1);
+
+        std::array<double, COUNT> cos;
+        std::array<double, COUNT> sin;
+
+        RayTable(void)
+        {
+            for (int n = 0; n < COUNT; ++n)
+            {
+                double k = (double)n * LaserModel::detection_angle_degrees / (COUNT - 1);
+                double angle = radians(-LaserModel::detection_angle_degrees / 2 + k);
+                this->cos[n] = ::cos(angle);
+                this->sin[n] = ::sin(angle);
+            }
+        }
+    };
+
+    template <int Span>
+    static const RayTable<Span> & rayTable(void)
+    {
+        static const RayTable<Span> table;
+        return table;
+    }
+
+    static void advance(double & c, double & s, double step_cos, double step_sin)
+    {
+        double cc = c;
+        c = cc * step_cos - s * step_sin;
+        s = s * step_cos + cc * step_sin;
+    }
+
+    static int roundup(double x)
+    {
+        return (int)floor(x + 0.5);
+    }
+
+    static bool out_of_bounds(int value)
+    {
+        return (unsigned)value >= (unsigned)MAP_SIZE;
+    }
+
+    static bool clip(int * xyc, int * yxc, int xy, int yx)
+    {
+        if (*xyc < 0)
+        {
+            if (*xyc == xy)
+            {
+                return true;
+            }
+            *yxc += (*yxc - yx) * (- *xyc) / (*xyc - xy);
+            *xyc = 0;
+        }
+
+        if (*xyc >= MAP_SIZE)
+        {
+            if (*xyc == xy)
+            {
+                return true;
+            }
+            *yxc += (*yxc - yx) * (MAP_SIZE - 1 - *xyc) / (*xyc - xy);
+            *xyc = MAP_SIZE - 1;
+        }
+
+        return false;
+    }
+
+    // Same Bresenham walk with a hole profile as map_laser_ray, over STRIDE-wide rows
+    void laserRay(int x1, int y1, int x2, int y2, int xp, int yp, int value, int alpha)
+    {
+        int x2c = x2;
+        int y2c = y2;
+
+        if (out_of_bounds(x1) || out_of_bounds(y1))
+        {
+            return;
+        }
+
+        if (clip(&x2c, &y2c, x1, y1) || clip(&y2c, &x2c, y1, x1))
+        {
+            return;
+        }
+
+        int dx = abs(x2 - x1);
+        int dy = abs(y2 - y1);
+        int dxc = abs(x2c - x1);
+        int dyc = abs(y2c - y1);
+        int incptrx = (x2 > x1) ? 1 : -1;
+        int incptry = (y2 > y1) ? STRIDE : -STRIDE;
+        int sincv = (value > NO_OBSTACLE) ? 1 : -1;
+
+        int derrorv = 0;
+
+        if (dx > dy)
+        {
+            derrorv = abs(xp - x2);
+        }
+        else
+        {
+            int tmp = dx; dx = dy; dy = tmp;
+            tmp = dxc; dxc = dyc; dyc = tmp;
+            tmp = incptrx; incptrx = incptry; incptry = tmp;
+            derrorv = abs(yp - y2);
+        }
+
+        if (!derrorv)
+        {
+            fprintf(stderr, "map_update: No error gradient: try increasing hole width\n");
+            exit(1);
+        }
+
+        int error = 2 * dyc - dxc;
+        int horiz = 2 * dyc;
+        int diago = 2 * (dyc - dxc);
+        int errorv = derrorv / 2;
+
+        int incv = (value - NO_OBSTACLE) / derrorv;
+
+        int incerrorv = value - NO_OBSTACLE - derrorv * incv;
+
+        pixel_t * ptr = &this->pixels[((size_t)y1 << STRIDE_SHIFT) + x1];
+        int pixval = NO_OBSTACLE;
+
+        for (int x = 0; x <= dxc; x++, ptr += incptrx)
+        {
+            if (x > dx - 2 * derrorv)
+            {
+                if (x <= dx - derrorv)
+                {
+                    pixval += incv;
+                    errorv += incerrorv;
+                    if (errorv > derrorv)
+                    {
+                        pixval += sincv;
+                        errorv -= derrorv;
+                    }
+                }
+                else
+                {
+                    pixval -= incv;
+                    errorv -= incerrorv;
+                    if (errorv < 0)
+                    {
+                        pixval -= sincv;
+                        errorv += derrorv;
+                    }
+                }
+            }
+
+            /* Integration into the map; past OBSTACLE or NO_OBSTACLE, a pixel at either end
+               would wrap around to the other */
+            int value = pixval < OBSTACLE ? OBSTACLE : pixval > NO_OBSTACLE ? NO_OBSTACLE : pixval;
+            *ptr = ((256 - alpha) * (*ptr) + alpha * value) >> 8;
+
+            if (error > 0)
+            {
+                ptr += incptry;
+                error += diago;
+            }
+            else
+            {
+                error += horiz;
+            }
+        }
+    }
+
+    void buildScans(const int * scan_mm, const PoseChange & velocities)
+    {
+        this->buildScan(this->scan_for_mapbuild, scan_mm, velocities);
+        this->buildScan(this->scan_for_distance, scan_mm, velocities);
+    }
+
+    // Same search as rmhc_position_search_bounded
+    position_t search(position_t start_pos)
+    {
+        double sigma_xy = this->sigma_xy_mm;
+        double sigma_theta = this->sigma_theta_degrees;
+
+        position_t currentpos = start_pos;
+        position_t bestpos = start_pos;
+        position_t lastbestpos = start_pos;
+
+        int current_distance = this->distanceScanToMap(this->scan_for_distance, currentpos);
+
+        int lowest_distance = current_distance;
+        int last_lowest_distance = current_distance;
+
+        int counter = 0;
+        int nevals = 1;
+
+        float normals[3 * RMHC_BATCH];
+        int next = 3 * RMHC_BATCH;
+
+        while (counter < this->max_search_iter)
+        {
+            if (sigma_xy < this->min_sigma_xy_mm && sigma_theta < this->min_sigma_theta_degrees)
+            {
+                break;
+            }
+            if (this->max_evaluations > 0 && nevals >= this->max_evaluations)
+            {
+                break;
+            }
+
+            if (next == 3 * RMHC_BATCH)
+            {
+                random_normals(this->randomizer, normals, 3 * RMHC_BATCH);
+                next = 0;
+            }
+
+            currentpos = lastbestpos;
+
+            currentpos.x_mm += sigma_xy * normals[next];
+            currentpos.y_mm += sigma_xy * normals[next + 1];
+            currentpos.theta_degrees += sigma_theta * normals[next + 2];
+            next += 3;
+
+            current_distance = this->distanceScanToMap(this->scan_for_distance, currentpos);
+            nevals++;
+
+            if ((current_distance > -1) && (current_distance < lowest_distance))
+            {
+                lowest_distance = current_distance;
+                bestpos = currentpos;
+            }
+            else
+            {
+                counter++;
+            }
+
+            if (counter > this->max_search_iter / 3)
+            {
+                if (lowest_distance < last_lowest_distance)
+                {
+                    lastbestpos = bestpos;
+                    last_lowest_distance = lowest_distance;
+                    counter = 0;
+                    sigma_xy *= 0.5;
+                    sigma_theta *= 0.5;
+                }
+            }
+        }
+
+        this->last_evaluations = nevals;
+
+        return bestpos;
+    }
+
+    // Same steps as SinglePositionSLAM::updateMapAndPointcloud
+    void updateMapAndPointcloud(PoseChange & poseChange)
+    {
+        double costheta = cos(M_PI * this->position.theta_degrees / 180);
+        double sintheta = sin(M_PI * this->position.theta_degrees / 180);
+
+        position_t start_pos = this->position;
+
+        start_pos.x_mm += poseChange.dxy_mm * costheta;
+        start_pos.y_mm += poseChange.dxy_mm * sintheta;
+        start_pos.theta_degrees += poseChange.dtheta_degrees;
+
+        start_pos.x_mm += LaserModel::offset_mm * costheta;
+        start_pos.y_mm += LaserModel::offset_mm * sintheta;
+
+        position_t new_position = this->search(start_pos);
+
+        this->updateMap(this->scan_for_mapbuild, new_position, this->map_quality, this->hole_width_mm);
+
+        this->position = new_position;
+        costheta = cos(M_PI * this->position.theta_degrees / 180);
+        sintheta = sin(M_PI * this->position.theta_degrees / 180);
+        this->position.x_mm -= LaserModel::offset_mm * costheta;
+        this->position.y_mm -= LaserModel::offset_mm * sintheta;
+    }
+
+    std::vector<pixel_t> pixels;
+    double size_meters;
+    double scale_pixels_per_mm;
+
+    ScanT<3> scan_for_mapbuild;
+    ScanT<1> scan_for_distance;
+    PoseChange velocities;
+
+    position_t position;
+    void * randomizer;
+};
+
+/**
+* The core instantiated for our deployment: LD20 with LD20(4, 45) and an 800 pixel map.
+*/
+typedef CoreSlamT<800, LD20Model<4, 45> > LD20CoreSlam;
@@ -35,6 +35,7 @@ class Laser
     friend class CoreSLAM;
     friend class SinglePositionSLAM;
     friend class RMHC_SLAM;
+    friend class ParticleSLAM;
     friend class Scan;
 
 protected:
@@ -24,7 +24,10 @@
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
 #include <iostream>
+#include <thread>
+#include <vector>
 using namespace std; 
 
 #include "coreslam.h"
@@ -32,19 +35,62 @@ using namespace std;
 #include "Scan.hpp"
 #include "Position.hpp"
 #include "Map.hpp"
+#include "MapWorkers.hpp"
 
 Map::Map(int size_pixels, double size_meters)
 {
     this->map = new map_t;
     map_init(this->map, size_pixels, size_meters);
+
+    this->batch = NULL;
+    this->workers = NULL;
+}
+
+Map::Map(const Map & other)
+{
+    this->map = new map_t;
+    map_copy(this->map, other.map);
+
+    this->batch = NULL;
+    this->workers = NULL;
 }
 
 Map::~Map(void)
 {
+    this->setThreads(1);
+
     map_free(this->map);
     delete this->map;
 }
 
+void Map::setThreads(int threads)
+{
+    delete this->workers;
+    this->workers = NULL;
+
+    if (this->batch)
+    {
+        map_batch_free(this->batch);
+        delete this->batch;
+        this->batch = NULL;
+    }
+
+    // hardware_concurrency() is 0 when unknown, which counts as one core
+    threads = min(threads, max(1, (int)thread::hardware_concurrency()));
+
+    if (threads > 1)
+    {
+        this->batch = new map_batch_t;
+        map_batch_init(this->batch, threads);
+        this->workers = new MapWorkers(threads);
+    }
+}
+
+int Map::getThreads(void)
+{
+    return this->batch ? this->batch->nparts : 1;
+}
+
 void Map::update(
     Scan & scan, 
     Position & position, 
@@ -56,7 +102,17 @@ void Map::update(
     cpos.y_mm = position.y_mm;
     cpos.theta_degrees = position.theta_degrees;
     
-    map_update(this->map, scan.scan, cpos, quality, hole_width_mm);
+    if (!this->workers)
+    {
+        map_update(this->map, scan.scan, cpos, quality, hole_width_mm);
+        return;
+    }
+
+    map_update_begin(this->map, this->batch, scan.scan, cpos, quality, hole_width_mm);
+    this->workers->run([this](int part) { map_update_trace(this->map, this->batch, part); });
+    map_update_bin(this->map, this->batch);
+    this->workers->run([this](int part) { map_update_apply(this->map, this->batch, part); });
+    map_update_end(this->map, this->batch);
 }
 
 void Map::get(char * bytes)
@@ -64,6 +120,36 @@ void Map::get(char * bytes)
     map_get(this->map, bytes);
 }
 
+void Map::set(char * bytes)
+{
+    map_set(this->map, bytes);
+}
+
+void Map::getRegion(unsigned char * bytes, int x, int y, int width, int height, int stride)
+{
+    map_get_region(this->map, bytes, x, y, width, height, stride);
+}
+
+void Map::shift(int dx_pixels, int dy_pixels)
+{
+    map_shift(this->map, dx_pixels, dy_pixels);
+}
+
+bool Map::takeChanges(int & xmin, int & ymin, int & xmax, int & ymax)
+{
+    return map_take_changes(this->map, &xmin, &ymin, &xmax, &ymax) != 0;
+}
+
+void Map::reportAllChanged(void)
+{
+    map_report_all_changed(this->map);
+}
+
+void Map::enableLikelihood(double basin_mm)
+{
+    map_enable_likelihood(this->map, basin_mm);
+}
+
 
 ostream& operator<< (ostream & out, Map & map)
 {
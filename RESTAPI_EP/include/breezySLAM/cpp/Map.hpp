@@ -31,6 +31,7 @@ typedef unsigned short pixel_t;
 
 class Scan;
 class Position;
+class MapWorkers;
 
 /**
 * A class for maps used in SLAM.
@@ -40,6 +41,8 @@ class Map
     friend class CoreSLAM;
     friend class SinglePositionSLAM;
     friend class RMHC_SLAM;
+    friend class SubmapSLAM;
+    friend class ParticleSLAM;
         
 public:
     
@@ -51,6 +54,13 @@ public:
 */
 Map(int size_pixels, double size_meters);
 
+/**
+* Builds a copy of another map, likelihood field included; integration is serial 
+* until setThreads() is called on the copy.
+* @param other the map to copy
+*/
+Map(const Map & other);
+
 
 /**
 * Deallocates this Map object.
@@ -65,6 +75,70 @@ Map(int size_pixels, double size_meters);
 */
 void get(char * bytes);
 
+/**
+* Replaces the map with bytearray, one byte per pixel as from get(), and brings the
+* likelihood field up to date.
+*/
+void set(char * bytes);
+
+/**
+* Puts a rectangle of current map values into bytearray, one byte per pixel.
+* @param bytes destination, at least stride * height bytes
+* @param x left edge of the rectangle in pixels
+* @param y top edge of the rectangle in pixels
+* @param width width of the rectangle in pixels
+* @param height height of the rectangle in pixels
+* @param stride distance in bytes between rows of the destination
+*/
+void getRegion(unsigned char * bytes, int x, int y, int width, int height, int stride);
+
+/**
+* Returns the rectangle of pixels changed since the previous call, and forgets it.
+* @param xmin gets left edge (inclusive)
+* @param ymin gets top edge (inclusive)
+* @param xmax gets right edge (inclusive)
+* @param ymax gets bottom edge (inclusive)
+* @return false if nothing has changed
+*/
+bool takeChanges(int & xmin, int & ymin, int & xmax, int & ymax);
+
+/**
+* Makes the next takeChanges() report the whole map, e.g. when this map replaces another
+* one whose content a reader had copied.
+*/
+void reportAllChanged(void);
+
+/**
+* Keeps a likelihood field (smoothed byte copy) of this map up to date from now on;
+* scan matching then scores poses against the field.
+* @param basin_mm distance in millimeters over which an obstacle lowers the score
+*/
+void enableLikelihood(double basin_mm);
+
+/**
+* Integrates scans on several threads from now on: rays are traced in parallel and
+* binned by map tile, and each thread writes its own tiles.  The map is the same
+* as with serial integration.  No more threads are used than the hardware runs at
+* once: on a single core the hand-offs cost more than they save, so integration
+* stays serial there.
+* @param threads number of threads, including the caller; 1 goes back to serial
+*/
+void setThreads(int threads);
+
+/**
+* Returns the number of threads scans are integrated on, after setThreads() has
+* limited it to the hardware; 1 when serial.
+*/
+int getThreads(void);
+
+/**
+* Moves the map content so that the pixel at (x, y) takes the value of the one at
+* (x + dx_pixels, y + dy_pixels); pixels moved in from off the map are unknown.
+* @param dx_pixels horizontal shift in pixels
+* @param dy_pixels vertical shift in pixels
+*/
+void shift(int dx_pixels, int dy_pixels);
+
 /**
 * Updates this map object based on new data.
 * @param scan a new scan
@@ -85,5 +159,9 @@ friend ostream& operator<< (ostream & out, Map & map);
 private:
     
     struct map_t * map;
+
+    // Set by setThreads() for parallel integration
+    struct map_batch_t * batch;
+    MapWorkers * workers;
 };
 
@@ -0,0 +1,111 @@
+/**
+* MapWorkers.hpp - thread pool for parallel map integration and particle updates
+*
+* This code is free software: you can redistribute it and/or modify
+* it under the terms of the GNU Lesser General Public License as 
+* published by the Free Software Foundation, either version 3 of the 
+* License, or (at your option) any later version.
+* 
+* This code is distributed in the hope that it will be useful,     
+* but WITHOUT ANY WARRANTY without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+* 
+* You should have received a copy of the GNU Lesser General Public License 
+* along with this code.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using namespace std; 
+
+/**
+* Helper threads that run one job per part, with the caller running part 0.
+*/
+class MapWorkers
+{
+public:
+
+    MapWorkers(int nparts)
+    {
+        for (int part = 1; part < nparts; ++part)
+        {
+            this->threads.emplace_back(&MapWorkers::loop, this, part);
+        }
+    }
+
+    ~MapWorkers(void)
+    {
+        {
+            lock_guard<mutex> lock(this->mtx);
+            this->stopping = true;
+        }
+        this->wake.notify_all();
+        for (auto & t : this->threads)
+        {
+            t.join();
+        }
+    }
+
+    /**
+    * Runs job(part) for every part and returns when all are done.
+    */
+    void run(const function<void(int)> & job)
+    {
+        {
+            lock_guard<mutex> lock(this->mtx);
+            this->job = &job;
+            this->pending = (int)this->threads.size();
+            this->generation++;
+        }
+        this->wake.notify_all();
+
+        job(0);
+
+        unique_lock<mutex> lock(this->mtx);
+        this->done.wait(lock, [this] { return this->pending == 0; });
+        this->job = nullptr;
+    }
+
+private:
+
+    void loop(int part)
+    {
+        unsigned seen = 0;
+        while (true)
+        {
+            const function<void(int)> * job = nullptr;
+            {
+                unique_lock<mutex> lock(this->mtx);
+                this->wake.wait(lock, [&] { return this->stopping || this->generation != seen; });
+                if (this->stopping)
+                {
+                    return;
+                }
+                seen = this->generation;
+                job = this->job;
+            }
+
+            (*job)(part);
+
+            lock_guard<mutex> lock(this->mtx);
+            if (--this->pending == 0)
+            {
+                this->done.notify_one();
+            }
+        }
+    }
+
+    vector<thread> threads;
+    mutex mtx;
+    condition_variable wake;
+    condition_variable done;
+    const function<void(int)> * job = nullptr;
+    unsigned generation = 0;
+    int pending = 0;
+    bool stopping = false;
+};
@@ -96,6 +96,30 @@ Scan::update(
     this->update(scanvals_mm, hole_width_millimeters, zeroPoseChange);
 }
 
+void 
+Scan::updateBoth(
+    Scan & scan1,
+    Scan & scan2,
+    int * scanvals_mm, 
+    double hole_width_millimeters,
+    PoseChange & poseChange)
+{
+    scan_update_both(
+        scan1.scan,
+        scan2.scan,
+        scanvals_mm,
+        hole_width_millimeters,
+        poseChange.dxy_mm,
+        poseChange.dtheta_degrees);
+}
+
+void
+Scan::decimate(
+    int max_points)
+{
+    scan_decimate(this->scan, max_points);
+}
+
 ostream& operator<< (ostream & out, Scan & scan)
 {
     char str[512];
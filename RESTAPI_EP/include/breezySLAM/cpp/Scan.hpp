@@ -40,6 +40,7 @@ class Scan
     friend class Map;
     friend class CoreSLAM;
     friend class RMHC_SLAM;
+    friend class ParticleSLAM;
         
 public:
     
@@ -91,6 +92,34 @@ update(
     double hole_width_millimeters,
     PoseChange & poseChange);
 
+/**
+* Updates two Scan objects of the same Lidar (e.g. with different spans) from one scan,
+* walking the rays once for both.
+* @param scan1 first Scan to update
+* @param scan2 second Scan to update
+* @param scanvals_mm scanned Lidar distance values in millimeters
+* @param hole_width_millimeters hole width in millimeters
+* @param poseChange forward velocity and angular velocity of robot at scan time
+* 
+*/
+static void 
+updateBoth(
+    Scan & scan1,
+    Scan & scan2,
+    int * scanvals_mm, 
+    double hole_width_millimeters,
+    PoseChange & poseChange);
+
+/**
+* Keeps at most max_points obstacle points for matching, preferring the ends of surfaces
+* and spreading the rest over surface orientations; free points are dropped.
+* @param max_points point budget; 0 keeps every point
+* 
+*/
+void
+decimate(
+    int max_points);
+
 friend ostream& operator<< (ostream & out, Scan & scan);
 
 private:
@@ -17,6 +17,9 @@ You should have received a copy of the GNU Lesser General Public License
 along with this code.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <chrono>
+
 #include "coreslam.h"
 #include "random.h"
 
@@ -26,11 +29,15 @@ along with this code.  If not, see <http://www.gnu.org/licenses/>.
 #include "Scan.hpp"
 #include "PoseChange.hpp"
 #include "WheeledRobot.hpp"
+#include "MapWorkers.hpp"
 
 #include "algorithms.hpp"
 
 // Local helpers -------------------------------------------------------------------------------------------------------
 
+// Score cache slots per search: room for 4096 lattice points, more than a search scores
+static const int RMHC_CACHE_SIZE_LOG2 = 13;
+
 static void Position2position_t(Position & cpp_pos, struct position_t * c_pos)
 {
     c_pos->x_mm = cpp_pos.x_mm;
@@ -60,6 +67,7 @@ CoreSLAM::CoreSLAM(
     // Set default params
     this->map_quality = DEFAULT_MAP_QUALITY;
     this->hole_width_mm = DEFAULT_HOLE_WIDTH_MM;   
+    this->max_distance_points = 0;
     
     // Store laser for later
     this->laser = new Laser(laser);
@@ -86,15 +94,17 @@ CoreSLAM::~CoreSLAM(void)
 
 void CoreSLAM::update(int * scan_mm, PoseChange & poseChange)
 {             
-    // Build a scan for computing distance to map, and one for updating map
-    this->scan_update(this->scan_for_mapbuild, scan_mm);
-    this->scan_update(this->scan_for_distance, scan_mm);
-    
-    // Update poseChange
+    // Update poseChange first: scans are de-skewed with this revolution's velocities,
+    // as buildScanFrame() builds them
     this->poseChange->update(poseChange.dxy_mm, 
                              poseChange.dtheta_degrees,  
                              poseChange.dt_seconds);
                              
+    // Build a scan for computing distance to map, and one for updating map
+    Scan::updateBoth(*this->scan_for_mapbuild, *this->scan_for_distance, scan_mm, 
+                     this->hole_width_mm, *this->poseChange);
+    this->scan_for_distance->decimate(this->max_distance_points);
+    
     // Implementing class updates map and pointcloud
     this->updateMapAndPointcloud(poseChange);
 }   
@@ -106,31 +116,109 @@ void CoreSLAM::update(int * scan_mm)
     this->update(scan_mm, zero_poseChange);
 }
 
+void CoreSLAM::buildScanFrame(ScanFrame & frame, int * scan_mm, PoseChange & poseChange)
+{
+    // Scans take velocities, computed from this revolution's own poseChange
+    PoseChange velocities;
+    velocities.update(poseChange.dxy_mm, poseChange.dtheta_degrees, poseChange.dt_seconds);
+    
+    Scan::updateBoth(*frame.scan_for_mapbuild, *frame.scan_for_distance, scan_mm, 
+                     this->hole_width_mm, velocities);
+    frame.scan_for_distance->decimate(this->max_distance_points);
+    
+    *frame.poseChange = poseChange;
+}
+
+void CoreSLAM::update(ScanFrame & frame)
+{
+    // Take the prebuilt scans, handing our previous ones back to the frame for reuse
+    Scan * tmp = this->scan_for_mapbuild;
+    this->scan_for_mapbuild = frame.scan_for_mapbuild;
+    frame.scan_for_mapbuild = tmp;
+    
+    tmp = this->scan_for_distance;
+    this->scan_for_distance = frame.scan_for_distance;
+    frame.scan_for_distance = tmp;
+    
+    PoseChange & poseChange = *frame.poseChange;
+    
+    this->poseChange->update(poseChange.dxy_mm, 
+                             poseChange.dtheta_degrees,  
+                             poseChange.dt_seconds);
+    
+    this->updateMapAndPointcloud(poseChange);
+}
+
 
 void CoreSLAM::getmap(unsigned char * mapbytes)
 {
     this->map->get((char *)mapbytes);
 }
 
-Scan * CoreSLAM::scan_create(int span)
+void CoreSLAM::getmapregion(unsigned char * mapbytes, int x_pixels, int y_pixels, 
+                            int width_pixels, int height_pixels, int stride)
 {
-    return new Scan(this->laser, span);
+    this->map->getRegion(mapbytes, x_pixels, y_pixels, width_pixels, height_pixels, stride);
 }
 
+bool CoreSLAM::getmapchanges(int & xmin_pixels, int & ymin_pixels, int & xmax_pixels, int & ymax_pixels)
+{
+    return this->map->takeChanges(xmin_pixels, ymin_pixels, xmax_pixels, ymax_pixels);
+}
 
-void 
-CoreSLAM::scan_update(Scan * scan, int * scan_mm)
+void CoreSLAM::enablelikelihoodfield(double basin_mm)
 {
-    scan->update(scan_mm, this->hole_width_mm, *this->poseChange);
+    this->map->enableLikelihood(basin_mm);
 }
 
+void CoreSLAM::setmapthreads(int threads)
+{
+    this->map->setThreads(threads);
+}
+
+int CoreSLAM::getmapthreads(void)
+{
+    return this->map->getThreads();
+}
+
+Scan * CoreSLAM::scan_create(int span)
+{
+    return new Scan(this->laser, span);
+}
+
+
 SinglePositionSLAM::SinglePositionSLAM(Laser & laser, int map_size_pixels, double map_size_meters) :
 CoreSLAM(laser, map_size_pixels, map_size_meters)
 {
     this->position = Position(this->init_coord_mm(), this->init_coord_mm(), 0);
+
+    this->keyframe_distance_mm = 0;
+    this->keyframe_rotation_degrees = 0;
+    this->keyframe_max_interval_seconds = 0;
+    this->frame_count = 0;
+    this->keyframe_count = 0;
+    this->last_frame_keyframe = false;
+    this->last_search_seconds = 0;
+    this->keyframe_elapsed_seconds = 0;
 }
 
     
+// ScanFrame class ----------------------------------------------------------------------------------------------------
+
+ScanFrame::ScanFrame(CoreSLAM & slam)
+{
+    this->scan_for_mapbuild = new Scan(slam.laser, 3);
+    this->scan_for_distance = new Scan(slam.laser, 1);
+    this->poseChange = new PoseChange();
+}
+
+ScanFrame::~ScanFrame(void)
+{
+    delete this->scan_for_mapbuild;
+    delete this->scan_for_distance;
+    delete this->poseChange;
+}
+
 // SinglePositionSLAM class -------------------------------------------------------------------------------------------
 
 void SinglePositionSLAM::updateMapAndPointcloud(PoseChange & poseChange)
@@ -148,10 +236,22 @@ void SinglePositionSLAM::updateMapAndPointcloud(PoseChange & poseChange)
     start_pos.y_mm += this->laser->offset_mm * this->sintheta();
     
     // Get new position from implementing class
+    auto search_start = std::chrono::steady_clock::now();
     Position new_position = this->getNewPosition(start_pos);
+    this->last_search_seconds = 
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - search_start).count();
          
-    // Update the map with this new position
-    this->map->update(*this->scan_for_mapbuild, new_position, this->map_quality, this->hole_width_mm);
+    // Update the map with this new position, if it is far enough from the last keyframe
+    this->keyframe_elapsed_seconds += poseChange.dt_seconds;
+    this->last_frame_keyframe = this->is_keyframe(new_position);
+    this->frame_count++;
+    if (this->last_frame_keyframe)
+    {
+        this->updateMap(new_position);
+        this->keyframe_position = new_position;
+        this->keyframe_elapsed_seconds = 0;
+        this->keyframe_count++;
+    }
    
     // Update the current position with this new position, adjusted by laser offset
     this->position = Position(new_position);
@@ -164,6 +264,83 @@ Position & SinglePositionSLAM::getpos(void)
     return this->position;
 }
 
+Position & SinglePositionSLAM::getkeyframepos(void)
+{
+    return this->keyframe_position;
+}
+
+void SinglePositionSLAM::restore(unsigned char * mapbytes, Position & position)
+{
+    this->map->set((char *)mapbytes);
+    this->setpos(position);
+}
+
+void SinglePositionSLAM::integrate(int * scan_mm, PoseChange & poseChange, Position & keyframe_position)
+{
+    PoseChange velocities;
+    velocities.update(poseChange.dxy_mm, poseChange.dtheta_degrees, poseChange.dt_seconds);
+    this->scan_for_mapbuild->update(scan_mm, this->hole_width_mm, velocities);
+    
+    // The position as updateMapAndPointcloud() derives it, to the last bit; adding the
+    // offset back would not give the keyframe pose to the last bit
+    this->position = keyframe_position;
+    Position position = keyframe_position;
+    position.x_mm -= this->laser->offset_mm * this->costheta();
+    position.y_mm -= this->laser->offset_mm * this->sintheta();
+    this->setpos(position);
+    this->keyframe_position = keyframe_position;
+    
+    // Into the one map every particle shares after setpos(), not each particle's own
+    SinglePositionSLAM::updateMap(this->keyframe_position);
+    this->frame_count++;
+    this->keyframe_count++;
+    this->last_frame_keyframe = true;
+}
+
+void SinglePositionSLAM::setpos(Position & position)
+{
+    this->position = position;
+    
+    // Keyframes are measured from the new laser pose
+    this->keyframe_position = Position(position.x_mm + this->laser->offset_mm * this->costheta(),
+                                       position.y_mm + this->laser->offset_mm * this->sintheta(),
+                                       position.theta_degrees);
+    this->keyframe_elapsed_seconds = 0;
+}
+
+void SinglePositionSLAM::updateMap(Position & new_position)
+{
+    this->map->update(*this->scan_for_mapbuild, new_position, this->map_quality, this->hole_width_mm);
+}
+
+void SinglePositionSLAM::shiftpos(double dx_mm, double dy_mm)
+{
+    this->position.x_mm += dx_mm;
+    this->position.y_mm += dy_mm;
+    this->keyframe_position.x_mm += dx_mm;
+    this->keyframe_position.y_mm += dy_mm;
+}
+
+bool SinglePositionSLAM::is_keyframe(Position & new_position)
+{
+    // A threshold of 0 is disabled; with all of them disabled every scan is a keyframe
+    bool by_distance = this->keyframe_distance_mm > 0;
+    bool by_rotation = this->keyframe_rotation_degrees > 0;
+    bool by_interval = this->keyframe_max_interval_seconds > 0;
+    if (this->keyframe_count == 0 || !(by_distance || by_rotation || by_interval))
+    {
+        return true;
+    }
+    
+    double dx = new_position.x_mm - this->keyframe_position.x_mm;
+    double dy = new_position.y_mm - this->keyframe_position.y_mm;
+    double dtheta = remainder(new_position.theta_degrees - this->keyframe_position.theta_degrees, 360);
+    
+    return (by_distance && sqrt(dx*dx + dy*dy) >= this->keyframe_distance_mm) ||
+           (by_rotation && fabs(dtheta) >= this->keyframe_rotation_degrees) ||
+           (by_interval && this->keyframe_elapsed_seconds >= this->keyframe_max_interval_seconds);
+}
+
 double SinglePositionSLAM::init_coord_mm(void)
 {
     // Center of map
@@ -197,32 +374,79 @@ SinglePositionSLAM(laser, map_size_pixels, map_size_meters)
     
     this->max_search_iter = DEFAULT_MAX_SEARCH_ITER;
     
+    this->min_sigma_xy_mm = 0;
+    this->min_sigma_theta_degrees = 0;
+    this->max_evaluations = 0;
+    this->search_enabled = true;
+    this->last_evaluations = 0;
+    
     this->randomizer = random_new(random_seed);
+    
+    this->search_slots = 1;
 }
 
 RMHC_SLAM::~RMHC_SLAM(void)
 {
     free(this->randomizer);
+    
+    this->enablescorecache(0, 0);
+}
+
+void RMHC_SLAM::enablescorecache(double xy_quantum_mm, double theta_quantum_degrees)
+{
+    for (rmhc_cache_t * cache : this->caches)
+    {
+        rmhc_cache_free(cache);
+        delete cache;
+    }
+    this->caches.clear();
+    
+    if (xy_quantum_mm > 0 && theta_quantum_degrees > 0)
+    {
+        for (int k=0; k<this->search_slots; ++k)
+        {
+            rmhc_cache_t * cache = new rmhc_cache_t;
+            rmhc_cache_init(cache, RMHC_CACHE_SIZE_LOG2, xy_quantum_mm, theta_quantum_degrees);
+            this->caches.push_back(cache);
+        }
+    }
+}
+
+void RMHC_SLAM::getcachestats(long long & lookups, long long & hits)
+{
+    lookups = 0;
+    hits = 0;
+    for (rmhc_cache_t * cache : this->caches)
+    {
+        lookups += cache->lookups;
+        hits += cache->hits;
+    }
 }
 
 Position RMHC_SLAM::getNewPosition(Position & start_pos)
 {
     // Search for a new position if indicated
     Position likeliest_position = start_pos;
-    if (this->randomizer)
+    this->last_evaluations = 0;
+    if (this->randomizer && this->search_enabled)
     {
         // Use C to find likeliest position
         position_t start_pos_c;
         Position2position_t(start_pos, &start_pos_c);
         position_t c_likeliest_position = 
-        rmhc_position_search(
+        rmhc_position_search_bounded(
             start_pos_c,
             this->map->map,
             this->scan_for_distance->scan,
             this->sigma_xy_mm,
             this->sigma_theta_degrees,
             this->max_search_iter,
-            this->randomizer);    
+            this->min_sigma_xy_mm,
+            this->min_sigma_theta_degrees,
+            this->max_evaluations,
+            this->randomizer,
+            this->caches.empty() ? NULL : this->caches[0],
+            &this->last_evaluations);    
         
         // Convert back to C++ object
         likeliest_position = 
@@ -235,6 +459,559 @@ Position RMHC_SLAM::getNewPosition(Position & start_pos)
     return likeliest_position;
 }
 
+// FrozenSubmap class -------------------------------------------------------------------------------------------------
+
+void FrozenSubmap::decode(unsigned char * bytes, int stride) const
+{
+    int k = 0;
+    
+    for (size_t r=0; r<this->runs.size(); r+=2)
+    {
+        for (int n=0; n<this->runs[r]; ++n, ++k)
+        {
+            bytes[(k / this->width_pixels) * stride + k % this->width_pixels] = this->runs[r+1];
+        }
+    }
+}
+
+size_t FrozenSubmap::encodedsize(void) const
+{
+    return this->runs.size();
+}
+
+// SubmapSLAM class ---------------------------------------------------------------------------------------------------
+
+SubmapSLAM::SubmapSLAM(Laser & laser, int map_size_pixels, double map_size_meters, unsigned random_seed) :
+RMHC_SLAM(laser, map_size_pixels, map_size_meters, random_seed)
+{
+    this->submap_recentre_mm = 250 * map_size_meters;
+    this->submap_levels = 16;
+    this->origin_x_pixels = 0;
+    this->origin_y_pixels = 0;
+}
+
+void SubmapSLAM::updateMapAndPointcloud(PoseChange & poseChange)
+{
+    SinglePositionSLAM::updateMapAndPointcloud(poseChange);
+    
+    double mm_per_pixel = 1 / this->map->map->scale_pixels_per_mm;
+    double centre_mm = 500 * this->map->map->size_meters;
+    Position & position = this->getpos();
+    double dx_mm = position.x_mm - centre_mm;
+    double dy_mm = position.y_mm - centre_mm;
+    
+    if (sqrt(dx_mm*dx_mm + dy_mm*dy_mm) < this->submap_recentre_mm)
+    {
+        return;
+    }
+    
+    // Move by whole pixels, so the map content need not be resampled
+    int dx_pixels = (int)floor(dx_mm / mm_per_pixel + 0.5);
+    int dy_pixels = (int)floor(dy_mm / mm_per_pixel + 0.5);
+    
+    this->freeze();
+    this->map->shift(dx_pixels, dy_pixels);
+    this->shiftpos(-dx_pixels * mm_per_pixel, -dy_pixels * mm_per_pixel);
+    this->origin_x_pixels += dx_pixels;
+    this->origin_y_pixels += dy_pixels;
+}
+
+void SubmapSLAM::freeze(void)
+{
+    int size = this->map->map->size_pixels;
+    vector<unsigned char> bytes(size * size);
+    this->getmap(bytes.data());
+    
+    FrozenSubmap submap;
+    submap.origin_x_pixels = this->origin_x_pixels;
+    submap.origin_y_pixels = this->origin_y_pixels;
+    submap.dx_pixels = this->submaps.empty() ? 0 : this->origin_x_pixels - this->submaps.back().origin_x_pixels;
+    submap.dy_pixels = this->submaps.empty() ? 0 : this->origin_y_pixels - this->submaps.back().origin_y_pixels;
+    
+    // Crop to the pixels that have been seen
+    int xmin = size, ymin = size, xmax = -1, ymax = -1;
+    for (int y=0; y<size; ++y)
+    {
+        for (int x=0; x<size; ++x)
+        {
+            if (bytes[y * size + x] != MAP_UNKNOWN_BYTE)
+            {
+                xmin = min(xmin, x);
+                xmax = max(xmax, x);
+                ymin = min(ymin, y);
+                ymax = max(ymax, y);
+            }
+        }
+    }
+    submap.crop_x_pixels = xmax < 0 ? 0 : xmin;
+    submap.crop_y_pixels = xmax < 0 ? 0 : ymin;
+    submap.width_pixels = xmax < 0 ? 0 : xmax - xmin + 1;
+    submap.height_pixels = xmax < 0 ? 0 : ymax - ymin + 1;
+    
+    // Grey levels, leaving unknown pixels unknown
+    unsigned char levels[256];
+    int steps = max(1, min(255, this->submap_levels - 1));
+    for (int k=0; k<256; ++k)
+    {
+        levels[k] = k == MAP_UNKNOWN_BYTE ? k : (unsigned char)((k * steps + 127) / 255 * 255 / steps);
+    }
+    
+    // Runs of up to 255 equal bytes, continuing from one row to the next
+    int run = 0;
+    unsigned char value = 0;
+    for (int y=submap.crop_y_pixels; y<submap.crop_y_pixels+submap.height_pixels; ++y)
+    {
+        for (int x=submap.crop_x_pixels; x<submap.crop_x_pixels+submap.width_pixels; ++x)
+        {
+            unsigned char b = levels[bytes[y * size + x]];
+            if (run > 0 && (b != value || run == 255))
+            {
+                submap.runs.push_back((unsigned char)run);
+                submap.runs.push_back(value);
+                run = 0;
+            }
+            value = b;
+            run++;
+        }
+    }
+    if (run > 0)
+    {
+        submap.runs.push_back((unsigned char)run);
+        submap.runs.push_back(value);
+    }
+    
+    this->submaps.push_back(submap);
+}
+
+int SubmapSLAM::getsubmapcount(void)
+{
+    return (int)this->submaps.size();
+}
+
+const FrozenSubmap & SubmapSLAM::getsubmap(int index)
+{
+    return this->submaps[index];
+}
+
+void SubmapSLAM::getsubmaporigin(int & x_pixels, int & y_pixels)
+{
+    x_pixels = this->origin_x_pixels;
+    y_pixels = this->origin_y_pixels;
+}
+
+void SubmapSLAM::restore(unsigned char * mapbytes, Position & position)
+{
+    SinglePositionSLAM::restore(mapbytes, position);
+    this->submaps.clear();
+}
+
+void SubmapSLAM::setsubmaporigin(int x_pixels, int y_pixels)
+{
+    this->origin_x_pixels = x_pixels;
+    this->origin_y_pixels = y_pixels;
+}
+
+Position SubmapSLAM::getglobalpos(void)
+{
+    double mm_per_pixel = 1 / this->map->map->scale_pixels_per_mm;
+    Position position = this->getpos();
+    position.x_mm += this->origin_x_pixels * mm_per_pixel;
+    position.y_mm += this->origin_y_pixels * mm_per_pixel;
+    return position;
+}
+
+void SubmapSLAM::getglobalmapbounds(int & x_pixels, int & y_pixels, int & width_pixels, int & height_pixels)
+{
+    int size = this->map->map->size_pixels;
+    int xmin = this->origin_x_pixels, ymin = this->origin_y_pixels;
+    int xmax = xmin + size, ymax = ymin + size;
+    
+    for (size_t k=0; k<this->submaps.size(); ++k)
+    {
+        const FrozenSubmap & submap = this->submaps[k];
+        int x = submap.origin_x_pixels + submap.crop_x_pixels;
+        int y = submap.origin_y_pixels + submap.crop_y_pixels;
+        if (submap.width_pixels == 0)
+        {
+            continue;
+        }
+        xmin = min(xmin, x);
+        ymin = min(ymin, y);
+        xmax = max(xmax, x + submap.width_pixels);
+        ymax = max(ymax, y + submap.height_pixels);
+    }
+    
+    x_pixels = xmin;
+    y_pixels = ymin;
+    width_pixels = xmax - xmin;
+    height_pixels = ymax - ymin;
+}
+
+// Copies the seen pixels of a width x height block into bytes at (x, y)
+static void composite_block(unsigned char * bytes, int stride, int x, int y, 
+                            const unsigned char * block, int width, int height)
+{
+    for (int j=0; j<height; ++j)
+    {
+        for (int i=0; i<width; ++i)
+        {
+            unsigned char b = block[j * width + i];
+            if (b != MAP_UNKNOWN_BYTE)
+            {
+                bytes[(y + j) * stride + x + i] = b;
+            }
+        }
+    }
+}
+
+void SubmapSLAM::getglobalmap(unsigned char * bytes)
+{
+    int x0, y0, width, height;
+    this->getglobalmapbounds(x0, y0, width, height);
+    
+    for (int k=0; k<width*height; ++k)
+    {
+        bytes[k] = MAP_UNKNOWN_BYTE;
+    }
+    
+    vector<unsigned char> block;
+    for (size_t k=0; k<this->submaps.size(); ++k)
+    {
+        const FrozenSubmap & submap = this->submaps[k];
+        block.resize(submap.width_pixels * submap.height_pixels);
+        submap.decode(block.data(), submap.width_pixels);
+        composite_block(bytes, width, 
+                        submap.origin_x_pixels + submap.crop_x_pixels - x0, 
+                        submap.origin_y_pixels + submap.crop_y_pixels - y0,
+                        block.data(), submap.width_pixels, submap.height_pixels);
+    }
+    
+    int size = this->map->map->size_pixels;
+    block.resize(size * size);
+    this->getmap(block.data());
+    composite_block(bytes, width, this->origin_x_pixels - x0, this->origin_y_pixels - y0, block.data(), size, size);
+}
+
+// ParticleSLAM class -------------------------------------------------------------------------------------------------
+
+ParticleSLAM::ParticleSLAM(Laser & laser, int map_size_pixels, double map_size_meters, int particle_count, 
+                           unsigned random_seed) :
+RMHC_SLAM(laser, map_size_pixels, map_size_meters, random_seed),
+resampler(random_seed)
+{
+    this->motion_noise_xy = 0.1;
+    this->motion_noise_theta = 0.1;
+    this->weight_scale = 2000;
+    this->resample_threshold = 0.5;
+    this->resample_count = 0;
+    
+    this->odometry_dxy_mm = 0;
+    this->odometry_dtheta_degrees = 0;
+    this->workers = NULL;
+    this->threads = 1;
+    
+    // Every particle starts where SinglePositionSLAM does, on CoreSLAM's map
+    this->first_map = this->map;
+    shared_ptr<Map> first_map(this->map, [](Map *) {});
+    
+    // Each particle's randomizer is the previous one's stream, jumped: they never overlap
+    int count = particle_count > 0 ? particle_count : 1;
+    this->search_slots = count;
+    for (int k=0; k<count; ++k)
+    {
+        Particle particle;
+        particle.position = this->getpos();
+        particle.laser_position = particle.position;
+        particle.weight = 1.0 / count;
+        particle.distance = -1;
+        particle.map = first_map;
+        this->particles.push_back(particle);
+        void * randomizer = k ? random_copy(this->randomizers[k-1]) : random_new(random_seed + 1);
+        if (k)
+        {
+            random_jump(randomizer);
+        }
+        this->randomizers.push_back(randomizer);
+    }
+    this->best = 0;
+}
+
+ParticleSLAM::~ParticleSLAM(void)
+{
+    delete this->workers;
+    
+    for (size_t k=0; k<this->randomizers.size(); ++k)
+    {
+        random_free(this->randomizers[k]);
+    }
+    
+    // CoreSLAM deletes its own map; the particles' copies go with them
+    this->map = this->first_map;
+}
+
+void ParticleSLAM::setparticlethreads(int threads)
+{
+    delete this->workers;
+    this->workers = threads > 1 ? new MapWorkers(threads) : NULL;
+    this->threads = threads > 1 ? threads : 1;
+}
+
+void ParticleSLAM::setpos(Position & position)
+{
+    SinglePositionSLAM::setpos(position);
+    
+    shared_ptr<Map> map = this->particles[this->best].map;
+    int count = (int)this->particles.size();
+    for (int k=0; k<count; ++k)
+    {
+        Particle & particle = this->particles[k];
+        particle.position = position;
+        particle.laser_position = position;
+        particle.weight = 1.0 / count;
+        particle.distance = -1;
+        particle.map = map;
+    }
+}
+
+int ParticleSLAM::getparticlecount(void)
+{
+    return (int)this->particles.size();
+}
+
+Position ParticleSLAM::getparticle(int index)
+{
+    return this->particles[index].position;
+}
+
+double ParticleSLAM::getweight(int index)
+{
+    return this->particles[index].weight;
+}
+
+int ParticleSLAM::getlineagecount(void)
+{
+    vector<Map *> maps;
+    for (size_t k=0; k<this->particles.size(); ++k)
+    {
+        Map * map = this->particles[k].map.get();
+        if (find(maps.begin(), maps.end(), map) == maps.end())
+        {
+            maps.push_back(map);
+        }
+    }
+    return (int)maps.size();
+}
+
+void ParticleSLAM::updateMapAndPointcloud(PoseChange & poseChange)
+{
+    this->odometry_dxy_mm = poseChange.dxy_mm;
+    this->odometry_dtheta_degrees = poseChange.dtheta_degrees;
+    
+    SinglePositionSLAM::updateMapAndPointcloud(poseChange);
+}
+
+Position ParticleSLAM::getNewPosition(Position &)
+{
+    int count = (int)this->particles.size();
+    double offset_mm = this->laser->offset_mm;
+    double sigma_xy_mm = count > 1 ? this->motion_noise_xy * fabs(this->odometry_dxy_mm) : 0;
+    double sigma_theta_degrees = count > 1 ? this->motion_noise_theta * fabs(this->odometry_dtheta_degrees) : 0;
+    vector<int> evaluations(count, 0);
+    
+    this->for_each_particle([&](int k) 
+    {
+        Particle & particle = this->particles[k];
+        void * randomizer = this->randomizers[k];
+        
+        // Odometry plus noise, moved to the laser as SinglePositionSLAM does
+        double theta_radians = particle.position.theta_degrees * M_PI / 180;
+        double dxy_mm = this->odometry_dxy_mm + offset_mm;
+        position_t start_pos;
+        start_pos.x_mm = random_normal(randomizer, particle.position.x_mm + dxy_mm * cos(theta_radians), sigma_xy_mm);
+        start_pos.y_mm = random_normal(randomizer, particle.position.y_mm + dxy_mm * sin(theta_radians), sigma_xy_mm);
+        start_pos.theta_degrees = random_normal(randomizer, 
+                                                particle.position.theta_degrees + this->odometry_dtheta_degrees,
+                                                sigma_theta_degrees);
+        
+        position_t found = start_pos;
+        if (this->search_enabled)
+        {
+            found = rmhc_position_search_bounded(
+                start_pos,
+                particle.map->map,
+                this->scan_for_distance->scan,
+                this->sigma_xy_mm,
+                this->sigma_theta_degrees,
+                this->max_search_iter,
+                this->min_sigma_xy_mm,
+                this->min_sigma_theta_degrees,
+                this->max_evaluations,
+                randomizer,
+                this->caches.empty() ? NULL : this->caches[k],
+                &evaluations[k]);
+        }
+        
+        particle.laser_position = Position(found.x_mm, found.y_mm, found.theta_degrees);
+        // Scored as the search scored it, on the likelihood field where the map has one
+        particle.distance = particle.map->map->likelihood
+            ? distance_scan_to_likelihood(particle.map->map, this->scan_for_distance->scan, found)
+            : distance_scan_to_map(particle.map->map, this->scan_for_distance->scan, found);
+        
+        double found_radians = found.theta_degrees * M_PI / 180;
+        particle.position = Position(found.x_mm - offset_mm * cos(found_radians), 
+                                     found.y_mm - offset_mm * sin(found_radians), 
+                                     found.theta_degrees);
+    });
+    
+    // Evaluations run side by side, so the slowest particle sets the time taken
+    this->last_evaluations = *max_element(evaluations.begin(), evaluations.end());
+    
+    // Weights fall off with the distance above the best one; no distance counts as the worst.
+    // Likelihood-field scores (0 through 255) are scaled to map values (0 through 65535).
+    double units = this->particles[0].map->map->likelihood ? 65535. / 255 : 1;
+    double lowest = -1;
+    for (int k=0; k<count; ++k)
+    {
+        int distance = this->particles[k].distance;
+        if (distance >= 0 && (lowest < 0 || distance < lowest))
+        {
+            lowest = distance;
+        }
+    }
+    double total = 0;
+    for (int k=0; k<count; ++k)
+    {
+        Particle & particle = this->particles[k];
+        double worse = particle.distance >= 0 ? (particle.distance - lowest) * units / 1024. : 65535;
+        particle.weight *= exp(-worse / this->weight_scale);
+        total += particle.weight;
+    }
+    
+    double sum_squares = 0;
+    this->best = 0;
+    for (int k=0; k<count; ++k)
+    {
+        Particle & particle = this->particles[k];
+        particle.weight = total > 0 ? particle.weight / total : 1.0 / count;
+        sum_squares += particle.weight * particle.weight;
+        if (particle.weight > this->particles[this->best].weight)
+        {
+            this->best = k;
+        }
+    }
+    
+    if (1 / sum_squares < this->resample_threshold * count)
+    {
+        this->resample();
+    }
+    
+    this->follow_best();
+    
+    return this->particles[this->best].laser_position;
+}
+
+void ParticleSLAM::updateMap(Position &)
+{
+    int count = (int)this->particles.size();
+    
+    // Copy on write: of the particles sharing a map, the first keeps it and the others copy it
+    vector<Map *> copy_from(count, NULL);
+    vector<Map *> kept;
+    for (int k=0; k<count; ++k)
+    {
+        Map * map = this->particles[k].map.get();
+        if (find(kept.begin(), kept.end(), map) == kept.end())
+        {
+            kept.push_back(map);
+        }
+        else
+        {
+            copy_from[k] = map;
+        }
+    }
+    
+    // All copies are made before any map changes
+    this->for_each_particle([&](int k) 
+    {
+        if (copy_from[k])
+        {
+            this->particles[k].map = make_shared<Map>(*copy_from[k]);
+        }
+    });
+    
+    this->for_each_particle([&](int k) 
+    {
+        Particle & particle = this->particles[k];
+        particle.map->update(*this->scan_for_mapbuild, particle.laser_position, this->map_quality, this->hole_width_mm);
+    });
+    
+    this->follow_best();
+}
+
+void ParticleSLAM::for_each_particle(const function<void(int)> & job)
+{
+    int count = (int)this->particles.size();
+    
+    if (!this->workers)
+    {
+        for (int k=0; k<count; ++k)
+        {
+            job(k);
+        }
+        return;
+    }
+    
+    this->workers->run([&](int part) 
+    {
+        for (int k=part; k<count; k+=this->threads)
+        {
+            job(k);
+        }
+    });
+}
+
+void ParticleSLAM::resample(void)
+{
+    // Systematic resampling: count evenly spaced pointers into the cumulative weights
+    int count = (int)this->particles.size();
+    vector<Particle> drawn;
+    double step = 1.0 / count;
+    double pointer = uniform_real_distribution<double>(0, step)(this->resampler);
+    double cumulative = this->particles[0].weight;
+    int best = -1;
+    
+    for (int k=0, j=0; k<count; ++k, pointer+=step)
+    {
+        while (pointer > cumulative && j < count - 1)
+        {
+            cumulative += this->particles[++j].weight;
+        }
+        if (j == this->best && best < 0)
+        {
+            best = k;
+        }
+        drawn.push_back(this->particles[j]);
+        drawn.back().weight = step;
+    }
+    
+    // The best particle, whose weight is at least 1 / count, is always drawn
+    this->particles.swap(drawn);
+    this->best = best >= 0 ? best : 0;
+    this->resample_count++;
+}
+
+void ParticleSLAM::follow_best(void)
+{
+    Map * map = this->particles[this->best].map.get();
+    
+    // Readers of getmapchanges() had the previous particle's map
+    if (map != this->map)
+    {
+        this->map = map;
+        this->map->reportAllChanged();
+    }
+}
+
 // DeterministicSLAM class ---------------------------------------------------------------------------------------------
 
 Deterministic_SLAM::Deterministic_SLAM(Laser & laser, int map_size_pixels, double map_size_meters) :
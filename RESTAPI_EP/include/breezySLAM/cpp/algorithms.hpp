@@ -23,6 +23,9 @@
 #include <math.h>
 
 #include <iostream>
+#include <functional>
+#include <memory>
+#include <random>
 #include <vector>
 using namespace std; 
 #include "Position.hpp" // Add this include at the top of the file to resolve the incomplete type error for Position.
@@ -32,6 +35,9 @@ class Map;
 class Scan;
 class Laser;
 class PoseChange;
+class ScanFrame;
+class MapWorkers;
+struct rmhc_cache_t;
 /**
 *    CoreSLAM is an abstract class that uses the classes Position, Map, Scan, and Laser
 *    to run variants of the simple CoreSLAM (tinySLAM) algorithm described in 
@@ -56,6 +62,7 @@ class PoseChange;
 */
 class CoreSLAM 
 {
+    friend class ScanFrame;
 
 public:
     
@@ -73,10 +80,51 @@ public:
     * @param mapbytes a byte array big enough to hold the map (map_size_pixels * map_size_pixels)
     */
     void getmap(unsigned char * mapbytes);
+
+    /**
+    * Retrieves a rectangle of the current map, one byte per pixel.
+    * @param mapbytes destination, at least stride * height_pixels bytes
+    * @param x_pixels left edge of the rectangle
+    * @param y_pixels top edge of the rectangle
+    * @param width_pixels width of the rectangle
+    * @param height_pixels height of the rectangle
+    * @param stride distance in bytes between rows of mapbytes
+    */
+    void getmapregion(unsigned char * mapbytes, int x_pixels, int y_pixels, 
+                      int width_pixels, int height_pixels, int stride);
+
+    /**
+    * Retrieves the rectangle of the map changed since the previous call (inclusive bounds).
+    * A new map reports itself as entirely changed.
+    * @return false if the map has not changed
+    */
+    bool getmapchanges(int & xmin_pixels, int & ymin_pixels, int & xmax_pixels, int & ymax_pixels);
+    
+    /**
+    * Matches scans against a likelihood field of the map instead of the raw map: every
+    * obstacle lowers the score smoothly out to basin_mm, which gives the search a wide,
+    * smooth basin to converge in.  The field is updated along with the map.
+    * @param basin_mm distance in millimeters over which an obstacle lowers the score
+    */
+    void enablelikelihoodfield(double basin_mm);
+    
+    /**
+    * Integrates scans into the map on several threads; the map comes out the same as
+    * with one thread.  Never more threads than the hardware runs at once, so a single
+    * core stays serial.
+    * @param threads number of threads, including the one calling update; 1 for serial
+    */
+    void setmapthreads(int threads);
+
+    /**
+    * Returns the number of threads scans are integrated into the map on; 1 when serial.
+    */
+    int getmapthreads(void);
     
    /**
     * Updates the scan and odometry, and calls the the implementing class's updateMapAndPointcloud method with
-    * the specified poseChange.
+    * the specified poseChange.  The scan is de-skewed with the velocities of this revolution's poseChange,
+    * as buildScanFrame() and integrate() de-skew theirs.
     * 
     * @param scan_mm Lidar scan values, whose count is specified in the <tt>scan_size</tt> 
     * attribute of the Laser object passed to the CoreSlam constructor
@@ -92,6 +140,24 @@ public:
     * attribute of the Laser object passed to the CoreSlam constructor
     */
     void update(int * scan_mm);
+
+    /**
+    * Builds the map-building and distance scans for one Lidar revolution into a ScanFrame,
+    * without touching the map or position.  Safe to call from another thread while
+    * update(ScanFrame &) runs, so scan construction can be pipelined with matching.
+    * @param frame receives the scans; must have been created for this CoreSLAM object
+    * @param scan_mm Lidar scan values, as for update()
+    * @param poseChange poseChange for odometry over this revolution
+    */
+    void buildScanFrame(ScanFrame & frame, int * scan_mm, PoseChange & poseChange);
+
+    /**
+    * Same as update(scan_mm, poseChange), with scans built beforehand by buildScanFrame(); the map and
+    * position come out identical, with or without odometry.
+    * The frame gets back the previous scans and can be reused for a later revolution.
+    * @param frame scans and odometry for this revolution
+    */
+    void update(ScanFrame & frame);
     
     /**
     * The quality of the map (0 through 255); default = 50
@@ -104,6 +170,13 @@ public:
     */
     double hole_width_mm;
 
+    /**
+    * The most obstacle points the scan used for matching keeps, chosen by Scan::decimate();
+    * the map is still built from every point. Matching cost grows with this rather than
+    * with the scan density; default = 0 (all points)
+    */
+    int max_distance_points;
+
 protected:
 
     /**
@@ -154,12 +227,44 @@ protected:
 private:
             
     Scan * scan_create(int span);
-    
-    void scan_update(Scan * scan, int * scan_mm);
    
 }; // CoreSLAM
 
 
+/**
+*    ScanFrame holds the two scans CoreSLAM builds from one Lidar revolution, so they can
+*    be prepared ahead of CoreSLAM::update(ScanFrame &) on another thread.
+*/
+class ScanFrame
+{
+    friend class CoreSLAM;
+
+public:
+
+    /**
+    * Creates an empty ScanFrame sized for the laser of the given CoreSLAM object.
+    * @param slam the CoreSLAM object the frame will be used with
+    */
+    ScanFrame(CoreSLAM & slam);
+
+    /**
+    * Deallocates this ScanFrame object.
+    */
+    ~ScanFrame(void);
+
+private:
+
+    Scan * scan_for_mapbuild;
+
+    Scan * scan_for_distance;
+
+    PoseChange * poseChange;
+
+    ScanFrame(const ScanFrame &);
+    ScanFrame & operator=(const ScanFrame &);
+};
+
+
 /**
 *    SinglePositionSLAM is an abstract class that implements CoreSLAM using a point-cloud
 *    with a single point (particle, position). Implementing classes should provide the method
@@ -179,6 +284,65 @@ public:
     */
     Position & getpos(void);
 
+    /**
+    * Moves the current position, e.g. to one found by relocalization; the next scan is
+    * searched from it.
+    * @param position the new position, as from getpos()
+    */
+    virtual void setpos(Position & position);
+
+    /**
+    * Replaces the map and the current position, e.g. with a map saved earlier, as
+    * setpos() does.
+    * @param mapbytes the map, one byte per pixel as from getmap()
+    * @param position the new position, as from getpos()
+    */
+    virtual void restore(unsigned char * mapbytes, Position & position);
+
+    /**
+    * Integrates a scan into the map at a known position, without matching, as a keyframe
+    * of update() at that position would; e.g. to replay a journal of keyframes.
+    * @param scan_mm Lidar scan values, whose count is specified in the <tt>scan_size</tt> 
+    * attribute of the Laser object passed to the CoreSlam constructor
+    * @param poseChange the pose change passed to update() with the scan, for its de-skewing
+    * @param keyframe_position the laser pose the scan was integrated at, as from getkeyframepos()
+    */
+    void integrate(int * scan_mm, PoseChange & poseChange, Position & keyframe_position);
+
+    /**
+    * Returns the laser pose the last keyframe was integrated into the map at.
+    * @return the pose as a Position object; the current position is this pose less the laser offset
+    */
+    Position & getkeyframepos(void);
+
+    /**
+    * A scan is integrated into the map only at keyframes: when the pose has moved at least
+    * keyframe_distance_mm or turned at least keyframe_rotation_degrees since the last keyframe,
+    * or keyframe_max_interval_seconds (summed from the PoseChange dt_seconds) have passed.
+    * Other scans are only matched against the map. A threshold of 0 is disabled, so one
+    * can be set without the others; defaults = 0 (all disabled: every scan is a keyframe)
+    */
+    double keyframe_distance_mm;
+    double keyframe_rotation_degrees;
+    double keyframe_max_interval_seconds;
+
+    /**
+    * Number of scans processed and number of them integrated into the map
+    */
+    int frame_count;
+    int keyframe_count;
+
+    /**
+    * Whether the most recent scan was integrated into the map
+    */
+    bool last_frame_keyframe;
+
+    /**
+    * Time in seconds the most recent scan took to find its position, without integrating
+    * it into the map
+    */
+    double last_search_seconds;
+
 protected:
 
     /**
@@ -204,10 +368,31 @@ protected:
     */
     virtual Position getNewPosition(Position & start_pos) = 0;    
     
+    /**
+    * Integrates the map-building scan into the map at a keyframe. Called automatically by
+    * SinglePositionSLAM::updateMapAndPointcloud()
+    * @param new_position the laser position returned by getNewPosition()
+    */
+    virtual void updateMap(Position & new_position);
+    
+    /**
+    * Moves the current position and the last keyframe by the given offset, e.g. after 
+    * the map content has been moved by the same amount
+    * @param dx_mm offset along X in millimeters
+    * @param dy_mm offset along Y in millimeters
+    */
+    void shiftpos(double dx_mm, double dy_mm);
+    
     
 private:    
     
     Position position;
+
+    // Laser pose of the last keyframe and time since it
+    Position keyframe_position;
+    double keyframe_elapsed_seconds;
+
+    bool is_keyframe(Position & new_position);
        
     double init_coord_mm(void);
     
@@ -260,8 +445,53 @@ public:
     */
     int max_search_iter;   
 
+    /**
+    * The search stops early once sigma_xy_mm and sigma_theta_degrees have both been
+    * halved below these values, i.e. the match has converged; default = 0 (never)
+    */
+    double min_sigma_xy_mm;
+    double min_sigma_theta_degrees;
+
+    /**
+    * Upper bound on scan-to-map distance evaluations per search, so that a search
+    * fits a time budget; default = 0 (unlimited)
+    */
+    int max_evaluations;
+
+    /**
+    * When false, the search is skipped and the odometry-predicted position is used as
+    * in Deterministic_SLAM; default = true
+    */
+    bool search_enabled;
+
+    /**
+    * Number of scan-to-map distance evaluations used by the most recent search
+    */
+    int last_evaluations;
+
+    /**
+    * Snaps search candidates to a lattice of xy_quantum_mm by theta_quantum_degrees and
+    * keeps each lattice point's score for the rest of the search, so that the candidates
+    * of its late, narrow stages that land on the same point are not scored again.  Poses
+    * found are then on the lattice; off by default.
+    * @param xy_quantum_mm lattice spacing in millimeters, 0 to turn the cache off
+    * @param theta_quantum_degrees lattice spacing in degrees
+    */
+    void enablescorecache(double xy_quantum_mm, double theta_quantum_degrees);
+
+    /**
+    * Candidates looked up in the score cache, and those scored from it, since it was enabled
+    */
+    void getcachestats(long long & lookups, long long & hits);
+
 protected:
 
+    // Number of searches that run side by side, each with its own score cache
+    int search_slots;
+
+    // Score cache of each search slot, empty while off
+    vector<rmhc_cache_t *> caches;
+
     /**
     * Returns a new position based on RMHC search from a starting position. Called automatically by
     * SinglePositionSLAM::updateMapAndPointcloud()
@@ -276,6 +506,324 @@ private:
    
 }; // RMHC_SLAM
 
+/**
+*    FrozenSubmap is a submap that SubmapSLAM has finished with: the explored part of its map,
+*    run-length encoded, and where it lies in the global frame.  It never changes once made.
+*/
+class FrozenSubmap
+{
+    friend class SubmapSLAM;
+
+public:
+
+    /**
+    * Global position in pixels of the submap's top-left corner
+    */
+    int origin_x_pixels;
+    int origin_y_pixels;
+
+    /**
+    * Offset in pixels of this submap from the previous frozen one (zero for the first)
+    */
+    int dx_pixels;
+    int dy_pixels;
+
+    /**
+    * The explored part of the submap, in submap pixels
+    */
+    int crop_x_pixels;
+    int crop_y_pixels;
+    int width_pixels;
+    int height_pixels;
+
+    /**
+    * Writes the explored part into bytes, one byte per pixel as from CoreSLAM::getmap() but 
+    * rounded to SubmapSLAM::submap_levels grey levels.
+    * @param bytes destination, at least stride * height_pixels bytes
+    * @param stride distance in bytes between rows of the destination
+    */
+    void decode(unsigned char * bytes, int stride) const;
+
+    /**
+    * Returns the size of the encoded pixels in bytes.
+    */
+    size_t encodedsize(void) const;
+
+private:
+
+    // (count, value) pairs, row after row
+    vector<unsigned char> runs;
+};
+
+/**
+*    SubmapSLAM is an RMHC_SLAM whose map is a fixed-size submap that follows the robot. Once
+*    the robot is submap_recentre_mm from the centre of the submap, the submap is frozen into a 
+*    FrozenSubmap and its content moved by whole pixels to centre the robot again, so the cost
+*    of a scan depends on the submap size only, however much area has been explored.
+*
+*    getpos() and getmap() are in submap coordinates; getsubmaporigin() tells where the submap
+*    lies in the global frame (that of the first submap), and getglobalmap() composites the 
+*    frozen submaps and the current one.  Areas driven through again are mapped afresh in the 
+*    current submap.
+*/
+class SubmapSLAM : public RMHC_SLAM
+{
+
+public:
+
+    /**
+    * Creates a SubmapSLAM object.
+    * @param laser a Laser object containing parameters for your Lidar equipment
+    * @param map_size_pixels the size of the submap (submap is square)
+    * @param map_size_meters the size of the area covered by the submap, in meters
+    * @param random_seed seed for psuedorandom number generator in particle filter
+    * @return a new SubmapSLAM object
+    */
+    SubmapSLAM(Laser & laser, 
+        int map_size_pixels,
+        double map_size_meters, 
+        unsigned random_seed);
+
+    /**
+    * Distance in millimeters from the centre of the submap at which it is frozen and moved;
+    * default = a quarter of the submap size
+    */
+    double submap_recentre_mm;
+
+    /**
+    * Number of grey levels kept in frozen submaps, so that free space encodes into long runs; 
+    * 256 keeps them exact; default = 16
+    */
+    int submap_levels;
+
+    /**
+    * Returns the number of frozen submaps.
+    */
+    int getsubmapcount(void);
+
+    /**
+    * Returns a frozen submap.
+    * @param index 0 for the oldest
+    */
+    const FrozenSubmap & getsubmap(int index);
+
+    /**
+    * Gets the global position in pixels of the current submap's top-left corner.
+    * @param x_pixels gets the horizontal position
+    * @param y_pixels gets the vertical position
+    */
+    void getsubmaporigin(int & x_pixels, int & y_pixels);
+
+    /**
+    * Replaces the current submap and position as SinglePositionSLAM does and drops the
+    * frozen submaps; the restored submap keeps the current global origin until
+    * setsubmaporigin() is called.
+    * @param mapbytes the submap, one byte per pixel as from getmap()
+    * @param position the new position in submap coordinates
+    */
+    void restore(unsigned char * mapbytes, Position & position);
+
+    /**
+    * Sets the global position in pixels of the current submap's top-left corner.
+    * @param x_pixels horizontal position
+    * @param y_pixels vertical position
+    */
+    void setsubmaporigin(int x_pixels, int y_pixels);
+
+    /**
+    * Returns the current position in the global frame.
+    */
+    Position getglobalpos(void);
+
+    /**
+    * Gets the rectangle, in global pixels, covered by the frozen submaps and the current one.
+    * @param x_pixels gets the left edge
+    * @param y_pixels gets the top edge
+    * @param width_pixels gets the width
+    * @param height_pixels gets the height
+    */
+    void getglobalmapbounds(int & x_pixels, int & y_pixels, int & width_pixels, int & height_pixels);
+
+    /**
+    * Composites the frozen submaps, oldest first, and the current submap into bytes, one 
+    * byte per pixel over the rectangle from getglobalmapbounds().
+    * @param bytes destination, at least width_pixels * height_pixels bytes
+    */
+    void getglobalmap(unsigned char * bytes);
+
+protected:
+
+    /**
+    * Updates the map and position as SinglePositionSLAM does, then moves the submap if needed.
+    * @param poseChange poseChange for odometry
+    */
+    void updateMapAndPointcloud(PoseChange & poseChange);
+
+private:
+
+    vector<FrozenSubmap> submaps;
+
+    int origin_x_pixels;
+    int origin_y_pixels;
+
+    void freeze(void);
+
+}; // SubmapSLAM
+
+/**
+*    ParticleSLAM is an RMHC_SLAM that keeps several position hypotheses (particles), each with
+*    its own map, so that a bad match in one of them does not decide the map for good.  For 
+*    every scan each particle moves by the odometry plus Gaussian noise and runs the RMHC search
+*    on its own map, with the sigmas, iteration and evaluation limits set on this object; its
+*    weight then falls off with its distanceScanToMap() score.  Once the weights grow too uneven,
+*    the particles are resampled in proportion to them.
+*
+*    A resampled particle shares the map of the one it was drawn from until the next keyframe,
+*    when every particle but one of those sharing a map integrates its scan into a copy of it 
+*    (copy on write), so a lineage of particles costs one map.  getpos(), getmap() and the 
+*    keyframe decisions follow the particle with the highest weight.
+*/
+class ParticleSLAM : public RMHC_SLAM
+{
+
+public:
+
+    /**
+    * Creates a ParticleSLAM object.
+    * @param laser a Laser object containing parameters for your Lidar equipment
+    * @param map_size_pixels the size of the desired map (map is square)
+    * @param map_size_meters the size of the area to be mapped, in meters
+    * @param particle_count number of particles
+    * @param random_seed seed for psuedorandom number generator in particle filter
+    * @return a new ParticleSLAM object
+    */
+    ParticleSLAM(Laser & laser, 
+        int map_size_pixels,
+        double map_size_meters, 
+        int particle_count,
+        unsigned random_seed);
+
+    ~ParticleSLAM(void);
+
+    /**
+    * Standard deviation of the noise added to each particle's odometry, as a fraction of the
+    * distance driven and of the angle turned; defaults = 0.1
+    */
+    double motion_noise_xy;
+    double motion_noise_theta;
+
+    /**
+    * A particle whose scan-to-map distance is this much worse than the best particle's, in
+    * map values (0 through 65535) averaged over the scan, has its weight divided by e for 
+    * that scan.  Distances are scored as the RMHC search scores them, so with the likelihood
+    * field once it is enabled, its costs (0 through 255) counting as map values scaled up
+    * to 65535; default = 2000
+    */
+    double weight_scale;
+
+    /**
+    * Particles are resampled once the effective number of particles (1 / sum of squared 
+    * weights) falls below this fraction of them; default = 0.5
+    */
+    double resample_threshold;
+
+    /**
+    * Number of resamplings so far
+    */
+    int resample_count;
+
+    /**
+    * Searches and integrates the particles on several threads.
+    * @param threads number of threads, including the one calling update; 1 for serial
+    */
+    void setparticlethreads(int threads);
+
+    /**
+    * Moves every particle to the position: they start again from it with equal weights,
+    * sharing the map of the best one.
+    * @param position the new position, as from getpos()
+    */
+    void setpos(Position & position);
+
+    /**
+    * Returns the number of particles.
+    */
+    int getparticlecount(void);
+
+    /**
+    * Returns a particle's position, as getpos() does for the best one.
+    * @param index particle index
+    */
+    Position getparticle(int index);
+
+    /**
+    * Returns a particle's normalized weight.
+    * @param index particle index
+    */
+    double getweight(int index);
+
+    /**
+    * Returns the number of distinct maps held by the particles.
+    */
+    int getlineagecount(void);
+
+protected:
+
+    /**
+    * Keeps the odometry for the particles, then updates as SinglePositionSLAM does.
+    * @param poseChange poseChange for odometry
+    */
+    void updateMapAndPointcloud(PoseChange & poseChange);
+
+    /**
+    * Moves, searches and weighs every particle, resampling if needed, and returns the laser
+    * position of the best one.
+    * @param start_position the starting position of the best particle (unused)
+    */
+    Position getNewPosition(Position & start_position);
+
+    /**
+    * Integrates the scan into the map of every particle at its own position.
+    * @param new_position the laser position of the best particle (unused)
+    */
+    void updateMap(Position & new_position);
+
+private:
+
+    struct Particle
+    {
+        Position position;          // as getpos()
+        Position laser_position;    // as found by the search
+        double weight;
+        int distance;
+        shared_ptr<Map> map;
+    };
+
+    vector<Particle> particles;
+    int best;
+
+    // One generator per particle slot, so copies of a particle draw different noise
+    vector<void *> randomizers;
+    mt19937 resampler;
+
+    // Odometry of the scan being processed
+    double odometry_dxy_mm;
+    double odometry_dtheta_degrees;
+
+    // The map CoreSLAM made, which it deletes
+    Map * first_map;
+
+    MapWorkers * workers;
+    int threads;
+
+    void for_each_particle(const function<void(int)> & job);
+
+    void resample(void);
+
+    void follow_best(void);
+
+}; // ParticleSLAM
+
 /**
 *    Deterministic_SLAM implements SinglePositionSLAM using by returning the starting position instead of searching
 *    on it; i.e., using odometry alone.
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include <chrono>
+#include <condition_variable>
 #include <mutex>
 #include <functional>
 
@@ -54,6 +55,11 @@ public:
   */
   bool GetLaserScanData(Points2D& out); 
 
+  /**
+   * @brief wait up to wait_ms milliseconds for the next lidar scan frame
+  */
+  bool WaitLaserScanData(Points2D& out, int64_t wait_ms);
+
   /**
    * @brief get Lidar spin speed (Hz)
   */
@@ -92,6 +98,7 @@ private:
   Points2D lidar_scan_data_vec_;
   Points2D tmp_lidar_scan_data_vec_;
   std::mutex mutex_lock1_;
+  std::condition_variable frame_ready_cv_;
   std::mutex mutex_lock2_;
 
   void SetLidarStatus(LidarStatus status);
@@ -96,6 +96,15 @@ public:
   LidarStatus GetLaserScanData(Points2D& dst, int64_t timeout = 1000) override;
 
   LidarStatus GetLaserScanData(LaserScan& dst, int64_t timeout = 1000) override;
+
+  /**
+   * @brief same as GetLaserScanData, but blocks up to wait_ms for the next frame
+   *  instead of returning DATA_WAIT straight away
+   * @param [in]
+   * *@param wait_ms: how long to wait for a frame, in milliseconds
+   * *@param timeout: data timeout, in milliseconds
+  */
+  LidarStatus WaitLaserScanData(Points2D& dst, int64_t wait_ms, int64_t timeout = 1000);
   
   /**
    * @brief get lidar scan frequence
@@ -230,6 +230,19 @@ bool LdLidarDataProcess::GetLaserScanData(Points2D& out) {
   }
 }
 
+bool LdLidarDataProcess::WaitLaserScanData(Points2D& out, int64_t wait_ms) {
+  {
+    std::unique_lock<std::mutex> lk(mutex_lock1_);
+    if (!frame_ready_cv_.wait_for(lk, std::chrono::milliseconds(wait_ms),
+        [this] { return is_frame_ready_; })) {
+      return false;
+    }
+    is_frame_ready_ = false;
+  }
+  out = GetLaserScanData();
+  return true;
+}
+
 double LdLidarDataProcess::GetSpeed(void) { 
   return (speed_ / 360.0);  // unit  is Hz
 }
@@ -270,8 +283,11 @@ void LdLidarDataProcess::ResetFrameReady(void) {
 }
 
 void LdLidarDataProcess::SetFrameReady(void) {
-  std::lock_guard<std::mutex> lg(mutex_lock1_);
-  is_frame_ready_ = true;
+  {
+    std::lock_guard<std::mutex> lg(mutex_lock1_);
+    is_frame_ready_ = true;
+  }
+  frame_ready_cv_.notify_all();
 }
 
 void LdLidarDataProcess::SetLaserScanData(Points2D& src) {
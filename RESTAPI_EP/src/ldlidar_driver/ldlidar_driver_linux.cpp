@@ -285,6 +285,30 @@ LidarStatus LDLidarDriverLinuxInterface::GetLaserScanData(LaserScan& dst, int64_
   }
 }
 
+LidarStatus LDLidarDriverLinuxInterface::WaitLaserScanData(Points2D& dst, int64_t wait_ms, int64_t timeout) {
+  if (!is_start_flag_) {
+    return LidarStatus::STOP;
+  }
+
+  LidarStatus status = comm_pkg_->GetLidarStatus();
+  if (LidarStatus::NORMAL == status) {
+    if (comm_pkg_->WaitLaserScanData(dst, wait_ms)) {
+      last_pubdata_times_ = std::chrono::steady_clock::now(); 
+      return LidarStatus::NORMAL;
+    }
+    
+    if (std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - last_pubdata_times_).count() > timeout) {
+      return LidarStatus::DATA_TIME_OUT;
+    } else {
+      return LidarStatus::DATA_WAIT;
+    }
+  } else {
+    last_pubdata_times_ = std::chrono::steady_clock::now(); 
+    return status;
+  }
+}
+
 bool  LDLidarDriverLinuxInterface::GetLidarScanFreq(double& spin_hz) {
   if (!is_start_flag_) {
     return false;